@@ -0,0 +1,115 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+
+enum class Activation {
+	Sigmoid,
+	ReLU,
+	Tanh,
+	LeakyReLU,
+	//passes the weighted input straight through, used by pooling layers
+	Identity,
+	//normalises over the whole layer, only valid on the output layer
+	Softmax
+};
+
+// Activation policies. Everything is static and inline so the per-node loops below
+// are instantiated once per policy and the compiler sees straight through them.
+struct SigmoidPolicy {
+	template<typename T> static T activate(T x) { return T(1) / (T(1) + std::exp(-x)); }
+	template<typename T> static T derivative(T x) {
+		T fx = activate(x);
+		return fx * (T(1) - fx);
+	}
+};
+
+struct ReLUPolicy {
+	template<typename T> static T activate(T x) { return x > T(0) ? x : T(0); }
+	template<typename T> static T derivative(T x) { return x > T(0) ? T(1) : T(0); }
+};
+
+struct TanhPolicy {
+	template<typename T> static T activate(T x) { return std::tanh(x); }
+	template<typename T> static T derivative(T x) {
+		T fx = std::tanh(x);
+		return T(1) - fx * fx;
+	}
+};
+
+struct LeakyReLUPolicy {
+	static constexpr double SLOPE = 0.01;
+	template<typename T> static T activate(T x) { return x > T(0) ? x : T(SLOPE) * x; }
+	template<typename T> static T derivative(T x) { return x > T(0) ? T(1) : T(SLOPE); }
+};
+
+struct IdentityPolicy {
+	template<typename T> static T activate(T x) { return x; }
+	template<typename T> static T derivative(T) { return T(1); }
+};
+
+template<typename Policy, typename T>
+void activate_values(T* values, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		values[i] = Policy::activate(values[i]);
+	}
+}
+
+//errors[i] *= f'(weighted_inputs[i])
+template<typename Policy, typename T>
+void apply_activation_derivative(const T* weighted_inputs, T* errors, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		errors[i] *= Policy::derivative(weighted_inputs[i]);
+	}
+}
+
+template<typename T>
+void softmax_values(T* values, size_t n)
+{
+	T max = values[0];
+	for (size_t i = 1; i < n; i++) {
+		max = values[i] > max ? values[i] : max;
+	}
+	T sum = T(0);
+	for (size_t i = 0; i < n; i++) {
+		sum += std::exp(values[i] - max);
+	}
+	//exp(x - lse(x)) never overflows and sums to 1
+	T lse = max + std::log(sum);
+	for (size_t i = 0; i < n; i++) {
+		values[i] = std::exp(values[i] - lse);
+	}
+}
+
+// One entry per Activation, each pointing at a template instantiation, so a layer pays one
+// indirect call per pass rather than a branch or virtual call per node.
+template<typename T>
+struct ActivationKernels {
+	const char* name;
+	void (*activate)(T* values, size_t n);
+	//nullptr for activations that aren't elementwise (softmax)
+	void (*apply_derivative)(const T* weighted_inputs, T* errors, size_t n);
+};
+
+template<typename T>
+const ActivationKernels<T>& activation_kernels(Activation activation)
+{
+	static const ActivationKernels<T> table[] = {
+		{ "sigmoid", activate_values<SigmoidPolicy, T>, apply_activation_derivative<SigmoidPolicy, T> },
+		{ "relu", activate_values<ReLUPolicy, T>, apply_activation_derivative<ReLUPolicy, T> },
+		{ "tanh", activate_values<TanhPolicy, T>, apply_activation_derivative<TanhPolicy, T> },
+		{ "leaky_relu", activate_values<LeakyReLUPolicy, T>, apply_activation_derivative<LeakyReLUPolicy, T> },
+		{ "identity", activate_values<IdentityPolicy, T>, apply_activation_derivative<IdentityPolicy, T> },
+		{ "softmax", softmax_values<T>, nullptr },
+	};
+	return table[(size_t)activation];
+}
+
+inline const char* activation_name(Activation activation)
+{
+	return activation_kernels<double>(activation).name;
+}
+
+//every elementwise activation, used to build the matching gpu shader variants
+constexpr Activation ELEMENTWISE_ACTIVATIONS[] = { Activation::Sigmoid, Activation::ReLU, Activation::Tanh, Activation::LeakyReLU, Activation::Identity };
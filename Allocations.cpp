@@ -0,0 +1,242 @@
+#include "Allocations.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "Logging.h"
+
+std::atomic<bool> Allocations::_timer_tracking{ false };
+
+namespace {
+
+constexpr int MAX_THREADS = 256;
+
+//constant initialized so operator new can run before any static constructor,
+//a cache line each so threads counting at once don't share one
+struct alignas(64) ThreadSlot {
+	std::atomic<uint64_t> allocations{ 0 };
+	std::atomic<uint64_t> bytes{ 0 };
+};
+ThreadSlot slots[MAX_THREADS];
+std::atomic<int> used_slots{ 0 };
+thread_local ThreadSlot* local_slot = nullptr;
+
+std::atomic<int> active_regions{ 0 };
+std::atomic<bool> abort_in_regions{ false };
+
+ThreadSlot& thread_slot()
+{
+	if (local_slot == nullptr) {
+		local_slot = &slots[std::min(used_slots.fetch_add(1, std::memory_order_relaxed), MAX_THREADS - 1)];
+	}
+	return *local_slot;
+}
+
+#ifdef ENABLE_ALLOCATION_HOOKS
+void count_allocation(std::size_t size)
+{
+	ThreadSlot& slot = thread_slot();
+	//a shared overflow slot can be written by several threads, so these are real adds
+	slot.allocations.fetch_add(1, std::memory_order_relaxed);
+	slot.bytes.fetch_add(size, std::memory_order_relaxed);
+	if (active_regions.load(std::memory_order_relaxed) > 0 && abort_in_regions.load(std::memory_order_relaxed)) {
+		//no formatting library here, it could allocate
+		char message[96];
+		std::snprintf(message, sizeof(message), "allocation of %zu bytes inside a NoAllocRegion\n", size);
+		std::fputs(message, stderr);
+		std::abort();
+	}
+}
+
+void* allocate(std::size_t size)
+{
+	void* ptr = std::malloc(size == 0 ? 1 : size);
+	if (ptr != nullptr) {
+		count_allocation(size);
+	}
+	return ptr;
+}
+
+void* allocate_aligned(std::size_t size, std::align_val_t alignment)
+{
+	std::size_t align = (std::size_t)alignment;
+#ifdef _WIN32
+	void* ptr = _aligned_malloc(size == 0 ? 1 : size, align);
+#else
+	//aligned_alloc wants a multiple of the alignment
+	void* ptr = std::aligned_alloc(align, std::max<std::size_t>((size + align - 1) / align * align, align));
+#endif
+	if (ptr != nullptr) {
+		count_allocation(size);
+	}
+	return ptr;
+}
+
+//gives the installed new_handler a chance to free memory before giving up, as the default operator new does
+template<typename F>
+void* allocate_or_throw(F& allocate_once)
+{
+	void* ptr;
+	while ((ptr = allocate_once()) == nullptr) {
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+	return ptr;
+}
+
+void free_aligned(void* ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	std::free(ptr);
+#endif
+}
+#endif
+
+}
+
+#ifdef ENABLE_ALLOCATION_HOOKS
+void* operator new(std::size_t size)
+{
+	auto allocate_once = [=]() { return allocate(size); };
+	return allocate_or_throw(allocate_once);
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	try {
+		return operator new(size);
+	}
+	catch (const std::bad_alloc&) {
+		return nullptr;
+	}
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	auto allocate_once = [=]() { return allocate_aligned(size, alignment); };
+	return allocate_or_throw(allocate_once);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	try {
+		return operator new(size, alignment);
+	}
+	catch (const std::bad_alloc&) {
+		return nullptr;
+	}
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, alignment, tag);
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { free_aligned(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { free_aligned(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { free_aligned(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { free_aligned(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { free_aligned(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { free_aligned(ptr); }
+#endif
+
+bool Allocations::hooked()
+{
+#ifdef ENABLE_ALLOCATION_HOOKS
+	return true;
+#else
+	return false;
+#endif
+}
+
+AllocationCounts Allocations::thread_counts()
+{
+	ThreadSlot& slot = thread_slot();
+	return { slot.allocations.load(std::memory_order_relaxed), slot.bytes.load(std::memory_order_relaxed) };
+}
+
+AllocationCounts Allocations::total()
+{
+	AllocationCounts res;
+	int used = std::min(used_slots.load(std::memory_order_relaxed), MAX_THREADS);
+	for (int i = 0; i < used; i++) {
+		res.allocations += slots[i].allocations.load(std::memory_order_relaxed);
+		res.bytes += slots[i].bytes.load(std::memory_order_relaxed);
+	}
+	return res;
+}
+
+std::vector<ThreadAllocations> Allocations::per_thread()
+{
+	std::vector<ThreadAllocations> res;
+	int used = std::min(used_slots.load(std::memory_order_relaxed), MAX_THREADS);
+	for (int i = 0; i < used; i++) {
+		res.push_back({ i, { slots[i].allocations.load(std::memory_order_relaxed), slots[i].bytes.load(std::memory_order_relaxed) } });
+	}
+	return res;
+}
+
+void Allocations::print_report()
+{
+	auto threads = per_thread();
+	AllocationCounts sum;
+	LOG_DEBUG("Allocations:");
+	for (const auto& thread : threads) {
+		LOG_DEBUG("thread {}: {} allocations, {} bytes", thread.thread, thread.counts.allocations, thread.counts.bytes);
+		sum.allocations += thread.counts.allocations;
+		sum.bytes += thread.counts.bytes;
+	}
+	LOG_DEBUG("total: {} allocations, {} bytes", sum.allocations, sum.bytes);
+}
+
+void Allocations::set_abort_in_regions(bool abort)
+{
+	abort_in_regions.store(abort, std::memory_order_relaxed);
+}
+
+NoAllocRegion::NoAllocRegion()
+{
+	_started_at = Allocations::total();
+	active_regions.fetch_add(1, std::memory_order_relaxed);
+}
+
+NoAllocRegion::~NoAllocRegion()
+{
+	active_regions.fetch_sub(1, std::memory_order_relaxed);
+}
+
+uint64_t NoAllocRegion::allocations() const
+{
+	return (Allocations::total() - _started_at).allocations;
+}
+
+uint64_t NoAllocRegion::bytes() const
+{
+	return (Allocations::total() - _started_at).bytes;
+}
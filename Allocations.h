@@ -0,0 +1,64 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+//replaces the global operator new/delete with counting versions, also set by the
+//ALLOCATION_HOOKS cmake option. Off by default, every count is then 0
+//#define ENABLE_ALLOCATION_HOOKS
+
+struct AllocationCounts {
+	uint64_t allocations = 0;
+	uint64_t bytes = 0;
+
+	AllocationCounts operator-(const AllocationCounts& other) const {
+		return { allocations - other.allocations, bytes - other.bytes };
+	}
+};
+
+struct ThreadAllocations {
+	//in the order threads first allocated, threads past the limit share the last one
+	int thread;
+	AllocationCounts counts;
+};
+
+// Counts every operator new per thread through replaced global allocation functions. Counting
+// is a couple of relaxed adds per allocation and always on when hooked in; attributing the counts to
+// Timer scopes is opt in with set_timer_tracking. Frees are not tracked.
+class Allocations {
+private:
+	static std::atomic<bool> _timer_tracking;
+public:
+	//false unless compiled with ENABLE_ALLOCATION_HOOKS
+	static bool hooked();
+
+	//since the calling thread started
+	static AllocationCounts thread_counts();
+	static AllocationCounts total();
+	static std::vector<ThreadAllocations> per_thread();
+	static void print_report();
+
+	//adds the allocations each Timer scope made on its own thread to the usage report
+	static void set_timer_tracking(bool enabled) { _timer_tracking.store(enabled, std::memory_order_relaxed); }
+	static bool timer_tracking() { return _timer_tracking.load(std::memory_order_relaxed); }
+
+	//prints and aborts on the first allocation in any NoAllocRegion instead of only counting,
+	//run under a debugger to get the stack of the offending allocation
+	static void set_abort_in_regions(bool abort);
+};
+
+// Counts allocations by every thread in the process while it is alive. Wrap a warmed up
+// training step or inference call in one and expect allocations() to be 0; background threads
+// that allocate at the same time (logging, metrics) are counted too, so keep them quiet.
+class NoAllocRegion {
+private:
+	AllocationCounts _started_at;
+public:
+	NoAllocRegion();
+	~NoAllocRegion();
+	NoAllocRegion(const NoAllocRegion&) = delete;
+	NoAllocRegion& operator=(const NoAllocRegion&) = delete;
+
+	uint64_t allocations() const;
+	uint64_t bytes() const;
+};
@@ -0,0 +1,245 @@
+#include "Backend.h"
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <fmt/core.h>
+#include "CPUTrainer.h"
+#include "Logging.h"
+#include "util.h"
+
+const char* to_string(BackendKind kind)
+{
+	switch (kind) {
+	case BackendKind::CPU:
+		return "cpu";
+	case BackendKind::Vulkan:
+		return "vulkan";
+	}
+	return "unknown";
+}
+
+static std::string cpu_description()
+{
+	return fmt::format("cpu, {} threads", ThreadPool::default_threads());
+}
+
+class CPUBackend : public Backend {
+private:
+	Network& _network;
+	CPUTrainer _trainer;
+public:
+	CPUBackend(Network& network) : _network(network), _trainer(network) {
+		if (network.is_fully_connected()) {
+			_trainer.set_execution_plan(true);
+		}
+	}
+
+	BackendKind kind() const override { return BackendKind::CPU; }
+	std::string description() const override { return cpu_description(); }
+	void train_epoch(double learn_rate) override { _trainer.train_epoch(learn_rate); }
+	double accuracy(const std::vector<DataPoint>& data) override { return _trainer.accuracy(data); }
+	void predict(const std::vector<double>& input, std::vector<double>& output) override { _network.calculate(input, output); }
+	void sync_weights() override {}
+	const TrainingMetrics& metrics() const override { return _trainer.metrics(); }
+};
+
+std::unique_ptr<Backend> create_backend(Network& network, BackendKind kind, int device_index)
+{
+	if (kind == BackendKind::Vulkan) {
+		return create_vulkan_backend(network, device_index);
+	}
+	return std::make_unique<CPUBackend>(network);
+}
+
+namespace {
+
+// Swaps a small training set into the network and puts its data and weights back when done
+class BenchmarkScope {
+private:
+	Network& _network;
+	std::vector<DataPoint> _training_data;
+	std::vector<DataPoint> _test_data;
+	std::vector<Layer> _layers;
+public:
+	BenchmarkScope(Network& network, size_t samples) : _network(network), _layers(network.layers) {
+		std::vector<DataPoint> sample;
+		if (!network.training_data.empty()) {
+			samples = std::min(samples, network.training_data.size());
+			sample.assign(network.training_data.begin(), network.training_data.begin() + samples);
+		}
+		else {
+			//the shape is all the timing depends on
+			std::mt19937 rng(1);
+			std::uniform_real_distribution<double> value(0.0, 1.0);
+			size_t outputs = network.layers.back().size;
+			sample.resize(samples);
+			for (size_t i = 0; i < samples; i++) {
+				sample[i].data.resize(network.layers[0].input_size);
+				for (double& x : sample[i].data) {
+					x = value(rng);
+				}
+				sample[i].label = (uint32_t)(i % outputs);
+				sample[i].set_expected_from_label(outputs);
+			}
+		}
+		std::swap(_training_data, network.training_data);
+		std::swap(_test_data, network.test_data);
+		network.training_data = std::move(sample);
+	}
+	~BenchmarkScope() {
+		_network.training_data = std::move(_training_data);
+		_network.test_data = std::move(_test_data);
+		restore_weights();
+	}
+	void restore_weights() { _network.layers = _layers; }
+};
+
+double time_epoch(Network& network, BackendKind kind, int device_index)
+{
+	std::unique_ptr<Backend> backend = create_backend(network, kind, device_index);
+	//pipeline creation, uploads and first touch of the buffers
+	backend->train_epoch(network.learn_rate);
+	auto started_at = std::chrono::steady_clock::now();
+	backend->train_epoch(network.learn_rate);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started_at).count();
+	return seconds > 0.0 ? network.training_data.size() / seconds : 0.0;
+}
+
+//fnv-1a, stable across runs and standard libraries unlike std::hash
+uint64_t hash_string(const std::string& text)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned char c : text) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+}
+
+std::vector<BackendCandidate> benchmark_backends(Network& network, size_t samples)
+{
+	std::vector<BackendCandidate> candidates;
+	candidates.push_back({ BackendKind::CPU, -1, cpu_description(), 0.0 });
+	std::vector<std::string> devices = vulkan_devices();
+	for (int i = 0; i < (int)devices.size(); i++) {
+		candidates.push_back({ BackendKind::Vulkan, i, devices[i], 0.0 });
+	}
+
+	BenchmarkScope scope(network, std::max<size_t>(samples, 1));
+	for (auto& candidate : candidates) {
+		try {
+			candidate.samples_per_second = time_epoch(network, candidate.kind, candidate.device_index);
+		}
+		catch (const std::exception& e) {
+			//unsupported layers, no timeline semaphores, out of memory
+			LOG_DEBUG("backend {} can't run this network: {}", candidate.description, e.what());
+		}
+		scope.restore_weights();
+		LOG_DEBUG("backend {}: {:.0f} samples/s", candidate.description, candidate.samples_per_second);
+	}
+	return candidates;
+}
+
+std::string default_backend_cache_path()
+{
+	std::string dir = cache_directory();
+	return dir.empty() ? "" : (std::filesystem::path(dir) / "backends.txt").string();
+}
+
+std::string backend_cache_key(const Network& network)
+{
+	std::string description = fmt::format("batch {} loss {} threads {}", network.batch_size, (int)network.loss, std::thread::hardware_concurrency());
+	for (const auto& layer : network.layers) {
+		description += fmt::format(" {}:{}x{}:{}:{}", (int)layer.type, layer.input_size, layer.size, layer.weights.size(), activation_name(layer.activation));
+	}
+	for (const auto& device : vulkan_devices()) {
+		description += " " + device;
+	}
+	return fmt::format("{:016x}", hash_string(description));
+}
+
+//a line per key: key kind device_index samples_per_second description
+std::optional<BackendCandidate> read_cached_backend(const std::string& path, const std::string& key)
+{
+	std::ifstream file(path);
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream fields(line);
+		std::string line_key;
+		std::string kind;
+		BackendCandidate candidate;
+		if (!(fields >> line_key >> kind >> candidate.device_index >> candidate.samples_per_second) || line_key != key) {
+			continue;
+		}
+		if (kind != to_string(BackendKind::CPU) && kind != to_string(BackendKind::Vulkan)) {
+			continue;
+		}
+		candidate.kind = kind == to_string(BackendKind::CPU) ? BackendKind::CPU : BackendKind::Vulkan;
+		std::getline(fields >> std::ws, candidate.description);
+		return candidate;
+	}
+	return std::nullopt;
+}
+
+void write_cached_backend(const std::string& path, const std::string& key, const BackendCandidate& candidate)
+{
+	std::string text;
+	{
+		std::ifstream file(path);
+		std::string line;
+		while (std::getline(file, line)) {
+			if (line.compare(0, key.size() + 1, key + " ") != 0) {
+				text += line + "\n";
+			}
+		}
+	}
+	text += fmt::format("{} {} {} {:.0f} {}\n", key, to_string(candidate.kind), candidate.device_index, candidate.samples_per_second, candidate.description);
+
+	std::error_code error;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+	//hosts starting several trainers at once never read half a file
+	if (!write_file_atomically(path, text.data(), text.size())) {
+		LOG_DEBUG("failed to write {}", path);
+	}
+}
+
+std::unique_ptr<Backend> select_backend(Network& network, const BackendOptions& options)
+{
+	if (options.force) {
+		return create_backend(network, *options.force, options.device_index);
+	}
+
+	std::string key = backend_cache_key(network);
+	if (!options.cache_path.empty()) {
+		if (auto cached = read_cached_backend(options.cache_path, key)) {
+			try {
+				auto backend = create_backend(network, cached->kind, cached->device_index);
+				LOG_DEBUG("using cached backend choice {}", backend->description());
+				return backend;
+			}
+			catch (const std::exception& e) {
+				LOG_DEBUG("cached backend {} failed, benchmarking again: {}", cached->description, e.what());
+			}
+		}
+	}
+
+	std::vector<BackendCandidate> candidates = benchmark_backends(network, options.benchmark_samples);
+	//the cpu always runs, ties go to it since it is first
+	BackendCandidate best = candidates[0];
+	for (const auto& candidate : candidates) {
+		if (candidate.samples_per_second > best.samples_per_second) {
+			best = candidate;
+		}
+	}
+	LOG_DEBUG("picked backend {} at {:.0f} samples/s", best.description, best.samples_per_second);
+	if (!options.cache_path.empty()) {
+		write_cached_backend(options.cache_path, key, best);
+	}
+	return create_backend(network, best.kind, best.device_index);
+}
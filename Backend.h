@@ -0,0 +1,75 @@
+#pragma once
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "Network.h"
+#include "Metrics.h"
+
+enum class BackendKind { CPU, Vulkan };
+const char* to_string(BackendKind kind);
+
+// One network's trainer and inference engine, over CPUTrainer or GPUNetwork, so callers do not
+// care where it runs. The network and its data must outlive the backend. Weights live where the
+// backend trains them, sync_weights brings them back into the network.
+class Backend {
+public:
+	virtual ~Backend() = default;
+	virtual BackendKind kind() const = 0;
+	//"cpu, 8 threads" or the vulkan device
+	virtual std::string description() const = 0;
+
+	//one pass over the network's training data in batches of network.batch_size
+	virtual void train_epoch(double learn_rate) = 0;
+	//fraction of data whose largest output is the expected one
+	virtual double accuracy(const std::vector<DataPoint>& data) = 0;
+	//the output layer's activations for one input
+	virtual void predict(const std::vector<double>& input, std::vector<double>& output) = 0;
+	//a no-op on the cpu, which trains the network in place
+	virtual void sync_weights() = 0;
+	virtual const TrainingMetrics& metrics() const = 0;
+};
+
+//defined in gpu/VulkanBackend.cpp. Trains through the resident dataset, which is uploaded on the
+//first train_epoch
+std::unique_ptr<Backend> create_vulkan_backend(Network& network, int device_index);
+//a description per Context::devices index, empty when there is no vulkan driver
+std::vector<std::string> vulkan_devices();
+
+//device_index picks the vulkan device, -1 for the best kind there is
+std::unique_ptr<Backend> create_backend(Network& network, BackendKind kind, int device_index = -1);
+
+struct BackendCandidate {
+	BackendKind kind = BackendKind::CPU;
+	//into vulkan_devices, -1 for the cpu
+	int device_index = -1;
+	std::string description;
+	//training throughput in the benchmark, 0 when the backend could not run the network
+	double samples_per_second = 0.0;
+};
+
+//the cpu and every vulkan device, each timed on an epoch over the first samples of the network's
+//training data (random ones when it has none) after a warm up epoch. The network's weights are
+//restored afterwards and it must not be used elsewhere meanwhile
+std::vector<BackendCandidate> benchmark_backends(Network& network, size_t samples);
+
+//backends.txt in cache_directory()
+std::string default_backend_cache_path();
+//identifies the network's layer shapes, loss and batch size on this host's cpu and devices
+std::string backend_cache_key(const Network& network);
+std::optional<BackendCandidate> read_cached_backend(const std::string& path, const std::string& key);
+//replaces any earlier line for key
+void write_cached_backend(const std::string& path, const std::string& key, const BackendCandidate& candidate);
+
+struct BackendOptions {
+	//skips the benchmark and the cache
+	std::optional<BackendKind> force;
+	int device_index = -1;
+	size_t benchmark_samples = 1024;
+	//empty to benchmark on every call
+	std::string cache_path = default_backend_cache_path();
+};
+
+// The fastest backend for this network shape and batch size on this host. The benchmark runs
+// once, later calls with the same shape read the choice back from the cache file.
+std::unique_ptr<Backend> select_backend(Network& network, const BackendOptions& options = {});
@@ -4,6 +4,10 @@
 #include <functional>
 #include <numeric>
 #include "Logging.h"
+#include "Tracer.h"
+#include <chrono>
+#include <stdexcept>
+#include <string>
 
 Gradients::Gradients(const std::vector<Layer>& layers)
 {
@@ -46,25 +50,56 @@ void Gradients::add_to_bias(size_t layer, size_t index, double delta)
 
 double CPUTrainer::test_training_accuracy() {
 	Timer t("training_accuracy");
+	PhaseTimer phase(_metrics, TrainingPhase::Evaluation);
+	if (_low_precision) {
+		return (double)_low_precision->count_correct(_thread_pool) / _network.training_data.size();
+	}
+
+	return (double)count_correct(_network.training_data) / _network.training_data.size();
+}
 
+double CPUTrainer::accuracy(const std::vector<DataPoint>& data)
+{
+	Timer t("accuracy");
+	PhaseTimer phase(_metrics, TrainingPhase::Evaluation);
+	return data.empty() ? 0.0 : (double)count_correct(data) / data.size();
+}
+
+int CPUTrainer::count_correct(const std::vector<DataPoint>& data)
+{
 	std::vector<int> correct(_thread_pool.nthreads(), 0);
-	batch_function task = [&](size_t thread_index, size_t start_index, size_t count) {
+	auto task = [&](size_t thread_index, size_t start_index, size_t count) {
+		std::vector<double> output;
 		for (size_t i = start_index; i < start_index + count; i++) {
-			const auto& point = _network.training_data[i];
-			auto output = _network.calculate(point.get_input());
+			const auto& point = data[i];
+			_network.calculate(point.get_input(), output);
 			if (point.is_correct(output)) {
 				correct[thread_index] += 1;
 			}
 		}
 	};
-	_thread_pool.batch_jobs(task, _network.training_data.size());
-	int total_correct = std::accumulate(correct.begin(), correct.end(), 0);
+	_thread_pool.batch_jobs(task, data.size());
+	return std::accumulate(correct.begin(), correct.end(), 0);
+}
 
-	return (double)total_correct / _network.training_data.size();
+void CPUTrainer::check_network() const
+{
+	int nlayers = _network.layers.size();
+	//the loss is -sum(expected * log(output)), which only cancels down to output - expected through a softmax
+	if (_network.loss == Loss::CrossEntropy && _network.layers[nlayers - 1].activation != Activation::Softmax) {
+		throw std::runtime_error("cross entropy needs a softmax output layer");
+	}
+	for (int layer_index = 0; layer_index < nlayers - 1; layer_index++) {
+		Activation activation = _network.layers[layer_index].activation;
+		if (activation_kernels<double>(activation).apply_derivative == nullptr) {
+			throw std::runtime_error(std::string(activation_name(activation)) + " is only supported on the output layer");
+		}
+	}
 }
 
 void CPUTrainer::calculate_deltas(const std::vector<double>& input, const std::vector<double>& expected, LayerTrainingData &layer_data)
 {
+	KernelTimer t("CPUTrainer::calculate_deltas");
 	int nlayers = _network.layers.size();
 	const std::vector<double>& output = layer_data.get_full_output(nlayers - 1);
 
@@ -73,12 +108,30 @@ void CPUTrainer::calculate_deltas(const std::vector<double>& input, const std::v
 	int layer_index = nlayers - 1;
 	auto& out_layer = _network.layers[layer_index];
 	assert(expected.size() == out_layer.size);
-	for (int node_index = 0; node_index < out_layer.size; node_index++) {
-		double o = output[node_index];
-		double cd = cost_derivative(o, expected[node_index]);
-		double ad = sigmoid_derivative(layer_data.get_activation_input(nlayers - 1, node_index));
-		double delta = cd * ad;
-		layer_data.set_delta(nlayers - 1, node_index, delta);
+	if (_network.loss == Loss::CrossEntropy) {
+		assert(out_layer.activation == Activation::Softmax);
+		for (int node_index = 0; node_index < out_layer.size; node_index++) {
+			layer_data.set_delta(nlayers - 1, node_index, output[node_index] - expected[node_index]);
+		}
+	}
+	else if (out_layer.activation == Activation::Softmax) {
+		//mean squared error through the softmax jacobian: o_j * (cd_j - sum_i(cd_i * o_i))
+		double weighted_sum = 0.0;
+		for (int node_index = 0; node_index < out_layer.size; node_index++) {
+			weighted_sum += cost_derivative(output[node_index], expected[node_index]) * output[node_index];
+		}
+		for (int node_index = 0; node_index < out_layer.size; node_index++) {
+			double cd = cost_derivative(output[node_index], expected[node_index]);
+			layer_data.set_delta(nlayers - 1, node_index, output[node_index] * (cd - weighted_sum));
+		}
+	}
+	else {
+		for (int node_index = 0; node_index < out_layer.size; node_index++) {
+			double o = output[node_index];
+			layer_data.set_delta(nlayers - 1, node_index, cost_derivative(o, expected[node_index]));
+		}
+		activation_kernels<double>(out_layer.activation).apply_derivative(
+			layer_data.get_full_activation_inputs(layer_index).data(), layer_data.deltas_data(layer_index), out_layer.size);
 	}
 
 	//hidden layers
@@ -88,23 +141,35 @@ void CPUTrainer::calculate_deltas(const std::vector<double>& input, const std::v
 		int last_layer_index = layer_index + 1;
 		auto& last_layer = _network.layers[last_layer_index];
 
-		for (int node_index = 0; node_index < layer.size; node_index++) {
+		auto apply_derivative = activation_kernels<double>(layer.activation).apply_derivative;
+		assert(apply_derivative != nullptr);
 
-			double sum_of_weighted_errors = 0.0;
-			for (int last_node_index = 0; last_node_index < last_layer.size; last_node_index++) {
-				int weight_index = (last_node_index * last_layer.input_size + node_index);
-				double we = layer_data.get_delta(last_layer_index, last_node_index) * last_layer.weights[weight_index];
-				sum_of_weighted_errors += we;
-			}
-			double new_delta = sum_of_weighted_errors * sigmoid_derivative(layer_data.get_activation_input(layer_index, node_index));
-			layer_data.set_delta(layer_index, node_index, new_delta);
-		}
+		//errors flowing back out of the next layer, whatever its type
+		last_layer.backpropagate(layer_data.get_full_output(layer_index).data(),
+			layer_data.get_full_deltas(last_layer_index).data(), layer_data.deltas_data(layer_index));
+		apply_derivative(layer_data.get_full_activation_inputs(layer_index).data(), layer_data.deltas_data(layer_index), layer.size);
 	}
 }
 
 void CPUTrainer::process_batch(size_t batch_start, size_t batch_len, Gradients* gradients)
 {
-	//Timer t("Network::process_batch");
+	//on the calling thread, an exception thrown inside a pool task would terminate the process
+	check_network();
+	Timer t("CPUTrainer::process_batch");
+	t.add_samples(batch_len);
+	_metrics.add_batch(batch_len, training_flops_per_sample(_network) * batch_len,
+		training_bytes_per_batch(_network, batch_len, _thread_pool.nthreads()));
+	if (_low_precision) {
+		PhaseTimer phase(_metrics, TrainingPhase::ForwardBackward);
+		_low_precision->process_batch(batch_start, batch_len, gradients, _thread_pool);
+		return;
+	}
+	if (_plan) {
+		PhaseTimer phase(_metrics, TrainingPhase::ForwardBackward);
+		_plan->train_batch(batch_start, batch_len, *gradients, _thread_pool);
+		return;
+	}
+
 	if (per_thread_gradients.size() == 0) {
 		//initialize on first entry
 		for (int i = 0; i < _thread_pool.nthreads(); i++) {
@@ -130,8 +195,14 @@ void CPUTrainer::process_batch(size_t batch_start, size_t batch_len, Gradients*
 	}
 
 	int nlayers = _network.layers.size();
-	batch_function task = [&](size_t thread_index, size_t start_index, size_t count) {
+	//thread time, used to split the wall time of the batch between the two phases
+	std::atomic<uint64_t> forward_ns{ 0 };
+	std::atomic<uint64_t> backward_ns{ 0 };
+	auto task = [&](size_t thread_index, size_t start_index, size_t count) {
 		LayerTrainingData& layer_data = per_thread_training_data.at(thread_index);
+		Gradients* thread_gradients = per_thread_gradients.at(thread_index).get();
+		std::chrono::nanoseconds thread_forward{ 0 };
+		std::chrono::nanoseconds thread_backward{ 0 };
 
 		for (int data_index = start_index; data_index < start_index + count; data_index++) {
 
@@ -139,7 +210,10 @@ void CPUTrainer::process_batch(size_t batch_start, size_t batch_len, Gradients*
 			const std::vector<double>& input = data.get_input();
 			const std::vector<double>& expected = data.get_expected();
 
+			auto started_at = std::chrono::steady_clock::now();
 			_network.calculate(input, &layer_data);
+			auto forward_done_at = std::chrono::steady_clock::now();
+			thread_forward += forward_done_at - started_at;
 
 			calculate_deltas(input, expected, layer_data);
 
@@ -147,28 +221,34 @@ void CPUTrainer::process_batch(size_t batch_start, size_t batch_len, Gradients*
 			const std::vector<double>* cur_input = &input;
 			for (size_t layer_index = 0; layer_index < nlayers; layer_index++) {
 				auto& layer = _network.layers[layer_index];
-
-				for (int node_index = 0; node_index < layer.size; node_index++) {
-					for (int input_index = 0; input_index < layer.input_size; input_index++) {
-						int i = node_index * layer.input_size + input_index;
-						double grad = cur_input->at(input_index) * layer_data.get_delta(layer_index, node_index);
-						per_thread_gradients.at(thread_index)->add_to_weight(layer_index, i, grad);
-					}
-					per_thread_gradients.at(thread_index)->add_to_bias(layer_index, node_index, 1 * layer_data.get_delta(layer_index, node_index));
-				}
+				layer.accumulate_gradients(cur_input->data(), layer_data.get_full_deltas(layer_index).data(),
+					thread_gradients->weight_data(layer_index), thread_gradients->bias_data(layer_index));
 				cur_input = &layer_data.get_full_output(layer_index);
 			}
+			thread_backward += std::chrono::steady_clock::now() - forward_done_at;
 		}
+		forward_ns.fetch_add(thread_forward.count(), std::memory_order_relaxed);
+		backward_ns.fetch_add(thread_backward.count(), std::memory_order_relaxed);
 	};
 
+	auto started_at = std::chrono::steady_clock::now();
 	_thread_pool.batch_jobs(task, batch_len);
-	
+	uint64_t wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started_at).count();
+	uint64_t thread_ns = forward_ns + backward_ns;
+	uint64_t wall_forward_ns = thread_ns > 0 ? (uint64_t)((double)wall_ns * forward_ns / thread_ns) : 0;
+	_metrics.add_phase(TrainingPhase::Forward, wall_forward_ns);
+	_metrics.add_phase(TrainingPhase::Backward, wall_ns - wall_forward_ns);
+
+	PhaseTimer phase(_metrics, TrainingPhase::Reduction);
+	reduce_thread_gradients(gradients);
+}
 
-	//add up all the per-thread results
-	
+void CPUTrainer::reduce_thread_gradients(Gradients* gradients)
+{
+	int nlayers = _network.layers.size();
 	for (auto& per_thread : per_thread_gradients) {
 		for (int layer_index = 0; layer_index < nlayers; layer_index++) {
-			batch_function post_process = [&](size_t thread_index, size_t start_index, size_t count) {
+			auto post_process = [&](size_t thread_index, size_t start_index, size_t count) {
 				for (size_t i = start_index; i < start_index + count; i++) {
 					double w = per_thread->get_weight(layer_index, i);
 					gradients->add_to_weight(layer_index, i, w);
@@ -183,39 +263,183 @@ void CPUTrainer::process_batch(size_t batch_start, size_t batch_len, Gradients*
 	}
 }
 
-void CPUTrainer::train()
+void CPUTrainer::set_optimizer(std::unique_ptr<Optimizer> optimizer)
 {
+	_optimizer = std::move(optimizer);
+	_optimizer_initialized = false;
+}
+
+void CPUTrainer::apply_gradients(const Gradients& gradients, size_t batch_size, double learn_rate)
+{
+	PhaseTimer phase(_metrics, TrainingPhase::Update);
+	if (!_optimizer_initialized) {
+		//tensor 2*i is the weights of layer i, 2*i+1 the biases
+		std::vector<ParameterTensor> tensors;
+		for (const auto& layer : _network.layers) {
+			tensors.push_back({ layer.weights.size(), true });
+			tensors.push_back({ layer.biases.size(), false });
+		}
+		_optimizer->init(tensors);
+		_optimizer_initialized = true;
+	}
+
+	_optimizer->begin_step();
+	double grad_scale = 1.0 / batch_size;
+	for (size_t layer_index = 0; layer_index < _network.layers.size(); layer_index++) {
+		auto& layer = _network.layers[layer_index];
+		const double* weight_grads = gradients.weight_data(layer_index);
+		auto update = [&](size_t thread_index, size_t start_index, size_t count) {
+			_optimizer->update(layer_index * 2, start_index, count, layer.weights.data(), weight_grads, grad_scale, learn_rate);
+			if (!_weight_masks.empty()) {
+				const uint8_t* mask = _weight_masks[layer_index].data();
+				for (size_t i = start_index; i < start_index + count; i++) {
+					layer.weights[i] = mask[i] ? layer.weights[i] : 0.0;
+				}
+			}
+		};
+		_thread_pool.batch_jobs(update, layer.weights.size());
+
+		_optimizer->update(layer_index * 2 + 1, 0, layer.biases.size(), layer.biases.data(), gradients.bias_data(layer_index), grad_scale, learn_rate);
+	}
+
+	if (_low_precision) {
+		_low_precision->sync_weights(_thread_pool);
+	}
+}
+
+void CPUTrainer::set_precision(Precision precision)
+{
+	if (precision != Precision::Double && _plan) {
+		throw std::runtime_error("execution plans only run in double precision");
+	}
+	_low_precision = make_low_precision_model(precision, _network, _thread_pool.nthreads());
+}
+
+Precision CPUTrainer::precision() const
+{
+	return _low_precision ? _low_precision->precision() : Precision::Double;
+}
+
+void CPUTrainer::set_execution_plan(bool enabled)
+{
+	if (enabled && _low_precision) {
+		throw std::runtime_error("execution plans only run in double precision");
+	}
+	_plan = enabled ? std::make_unique<ExecutionPlan>(_network, _network.batch_size, _thread_pool.nthreads(), PlanMode::Training) : nullptr;
+}
+
+void CPUTrainer::set_weight_masks(std::vector<std::vector<uint8_t>> masks)
+{
+	if (!masks.empty() && masks.size() != _network.layers.size()) {
+		throw std::runtime_error("need one weight mask per layer");
+	}
+	_weight_masks = std::move(masks);
+}
+
+void CPUTrainer::set_learning_rate_schedule(std::unique_ptr<LearningRateSchedule> schedule)
+{
+	_schedule = std::move(schedule);
+}
+
+void CPUTrainer::set_stop_criteria(const StopCriteria& criteria)
+{
+	_stop_criteria = criteria;
+}
+
+StopReason CPUTrainer::check_accuracy(size_t& evaluations_without_improvement, double& best_accuracy)
+{
+	_training_accuracy = test_training_accuracy();
+	LOG_DEBUG("Training Accuracy: {}", _training_accuracy);
+
+	if (_stop_criteria.target_accuracy > 0.0 && _training_accuracy >= _stop_criteria.target_accuracy) {
+		return StopReason::TargetAccuracy;
+	}
+	if (_training_accuracy >= best_accuracy + _stop_criteria.min_improvement) {
+		best_accuracy = _training_accuracy;
+		evaluations_without_improvement = 0;
+	}
+	else if (_stop_criteria.patience > 0 && ++evaluations_without_improvement >= _stop_criteria.patience) {
+		return StopReason::Plateau;
+	}
+	return StopReason::None;
+}
+
+void CPUTrainer::run_epoch(Gradients& gradients, double base_rate, const LearningRateSchedule& schedule, size_t epoch)
+{
+	TraceScope epoch_trace("epoch", "trainer");
+	//batch_size may have changed since set_execution_plan compiled the plan
+	if (_plan && _plan->max_batch() != (size_t)_network.batch_size) {
+		set_execution_plan(true);
+	}
+	size_t steps_per_epoch = (_network.training_data.size() + _network.batch_size - 1) / _network.batch_size;
+	auto epoch_started_at = std::chrono::steady_clock::now();
+	size_t step = 0;
+	for (size_t batch_index = 0; batch_index < _network.training_data.size(); batch_index += _network.batch_size) {
+		TraceScope batch_trace("batch", "trainer");
+		//reset all the gradients
+		gradients.reset();
+
+		size_t real_batch_size = std::min((size_t)_network.batch_size, _network.training_data.size() - batch_index);
+		process_batch(batch_index, real_batch_size, &gradients);
+
+		//now apply all the gradients
+		double learn_rate = schedule.rate(base_rate, epoch + (double)step / steps_per_epoch);
+		apply_gradients(gradients, real_batch_size, learn_rate);
+		step++;
+	}
+	_metrics.add_epoch();
+
+	double epoch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch_started_at).count();
+	_samples_per_second = epoch_seconds > 0.0 ? _network.training_data.size() / epoch_seconds : 0.0;
+}
+
+void CPUTrainer::train_epoch(double learn_rate)
+{
+	Gradients gradients(_network.layers);
+	run_epoch(gradients, learn_rate, ConstantSchedule(), _epochs);
+	_epochs++;
+}
+
+StopReason CPUTrainer::train()
+{
+	if (!_stop_criteria.bounded()) {
+		throw std::runtime_error("stop criteria have no limit set, training would never stop");
+	}
 	Gradients gradients(_network.layers);
 
-	bool training = true;
+	size_t epoch = 0;
+	size_t evaluations_without_improvement = 0;
+	double best_accuracy = 0.0;
+	size_t validation_interval = std::max<size_t>(_stop_criteria.validation_interval, 1);
+	auto started_at = std::chrono::steady_clock::now();
+
+	StopReason stop = StopReason::None;
 	Timer epoch_timer("Epoch");
-	while (training) {
-		_training_accuracy = test_training_accuracy();
-		LOG_DEBUG("Training Accuracy: {}", _training_accuracy);
+	while (stop == StopReason::None) {
 		epoch_timer.reset();
-		for (int batch_index = 0; batch_index < _network.training_data.size(); batch_index += _network.batch_size) {
-			//reset all the gradients
-			gradients.reset();
+		run_epoch(gradients, _network.learn_rate, *_schedule, epoch);
+		epoch_timer.end();
+		epoch++;
+		LOG_DEBUG("Epoch {}: {:.0f} samples/s ({})", epoch, _samples_per_second, to_string(precision()));
 
-			int real_batch_size = std::min((size_t)_network.batch_size, _network.training_data.size() - batch_index);
-			process_batch(batch_index, real_batch_size, &gradients);
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started_at).count();
+		bool out_of_epochs = _stop_criteria.max_epochs > 0 && epoch >= _stop_criteria.max_epochs;
+		bool out_of_time = _stop_criteria.max_seconds > 0.0 && elapsed >= _stop_criteria.max_seconds;
 
-			//now apply all the gradients
-			for (int layer_index = 0; layer_index < _network.layers.size(); layer_index++) {
-				auto& layer = _network.layers[layer_index];
-				for (int weight_index = 0; weight_index < layer.weights.size(); weight_index++) {
-					double original = layer.weights[weight_index];
-					layer.weights[weight_index] = original - gradients.get_weight(layer_index, weight_index) * _network.learn_rate / real_batch_size;
-				}
-				for (int bias_index = 0; bias_index < layer.biases.size(); bias_index++) {
-					double original = layer.biases[bias_index];
-					layer.biases[bias_index] = original - gradients.get_bias(layer_index, bias_index) * _network.learn_rate / real_batch_size;
-				}
-			}
-			//debug();
+		//always check on the last epoch so the reported accuracy is current
+		if (epoch % validation_interval == 0 || out_of_epochs || out_of_time) {
+			stop = check_accuracy(evaluations_without_improvement, best_accuracy);
+		}
+		if (stop == StopReason::None && out_of_epochs) {
+			stop = StopReason::MaxEpochs;
+		}
+		if (stop == StopReason::None && out_of_time) {
+			stop = StopReason::TimeBudget;
 		}
-		epoch_timer.end();
 		Timer::print_usage_report();
 		//debug();
 	}
-}
\ No newline at end of file
+	_epochs = epoch;
+	LOG_DEBUG("Training stopped after {} epochs: {}", epoch, to_string(stop));
+	return stop;
+}
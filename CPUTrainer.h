@@ -4,6 +4,11 @@
 #include "ThreadPool.h"
 #include "util.h"
 #include "Timer.h"
+#include "Optimizer.h"
+#include "TrainingSchedule.h"
+#include "MixedPrecision.h"
+#include "ExecutionPlan.h"
+#include "Metrics.h"
 #include <memory>
 
 class Gradients {
@@ -20,6 +25,11 @@ public:
 	double get_bias(size_t layer, size_t index);
 	void add_to_weight(size_t layer, size_t index, double delta);
 	void add_to_bias(size_t layer, size_t index, double delta);
+
+	const double* weight_data(size_t layer) const { return weight_gradients[layer].data(); }
+	const double* bias_data(size_t layer) const { return bias_gradients[layer].data(); }
+	double* weight_data(size_t layer) { return weight_gradients[layer].data(); }
+	double* bias_data(size_t layer) { return bias_gradients[layer].data(); }
 };
 
 class CPUTrainer {
@@ -32,15 +42,69 @@ private:
 
 	double _training_accuracy = 0.0;
 
+	std::unique_ptr<Optimizer> _optimizer = std::make_unique<SGD>();
+	bool _optimizer_initialized = false;
+
+	std::unique_ptr<LearningRateSchedule> _schedule = std::make_unique<ConstantSchedule>();
+	StopCriteria _stop_criteria;
+	size_t _epochs = 0;
+
+	//only set when training below double precision
+	std::unique_ptr<LowPrecisionModel> _low_precision;
+	double _samples_per_second = 0.0;
+
+	//per layer, 0 marks a pruned weight that is held at zero after every update
+	std::vector<std::vector<uint8_t>> _weight_masks;
+
+	//only set when process_batch runs through a compiled plan
+	std::unique_ptr<ExecutionPlan> _plan;
+
+	TrainingMetrics _metrics{ "cpu" };
+
+	StopReason check_accuracy(size_t& evaluations_without_improvement, double& best_accuracy);
+	//one pass over the training data, each step at schedule's rate for base_rate at epoch plus the step's fraction
+	void run_epoch(Gradients& gradients, double base_rate, const LearningRateSchedule& schedule, size_t epoch);
+	int count_correct(const std::vector<DataPoint>& data);
+	//throws for a loss or activation the backward pass can't run
+	void check_network() const;
+
 public:
 #ifdef SINGLE_THREADED
 	CPUTrainer(Network& network) : _network(network), _thread_pool(1) {};
 #else
-	CPUTrainer(Network &network) : _thread_pool(std::thread::hardware_concurrency() - 2), _network(network) {};
+	CPUTrainer(Network &network) : _thread_pool(ThreadPool::default_threads()), _network(network) {};
 #endif
+	CPUTrainer(Network& network, int nthreads) : _thread_pool(nthreads), _network(network) {};
 	double test_training_accuracy();
+	//in double precision whatever precision trains
+	double accuracy(const std::vector<DataPoint>& data);
 	void process_batch(size_t batch_start, size_t batch_len, Gradients* gradients);
-	void train();
+	//adds the per-thread gradients left by the last process_batch into gradients
+	void reduce_thread_gradients(Gradients* gradients);
+	StopReason train();
+	//one pass over the training data at learn_rate, without the schedule or stop criteria
+	void train_epoch(double learn_rate);
+	void apply_gradients(const Gradients& gradients, size_t batch_size, double learn_rate);
+
+	void set_optimizer(std::unique_ptr<Optimizer> optimizer);
+	void set_learning_rate_schedule(std::unique_ptr<LearningRateSchedule> schedule);
+	void set_stop_criteria(const StopCriteria& criteria);
+	const StopCriteria& stop_criteria() const { return _stop_criteria; }
+	//throughput and phase times, hand to a MetricsExporter to publish them
+	const TrainingMetrics& metrics() const { return _metrics; }
+	//empty to clear
+	void set_weight_masks(std::vector<std::vector<uint8_t>> masks);
+	void set_precision(Precision precision);
+	Precision precision() const;
+	//compiles the network into a fused training plan for batch_size, dense double precision networks only.
+	//An epoch starting at a different batch_size compiles it again
+	void set_execution_plan(bool enabled);
+	bool uses_execution_plan() const { return _plan != nullptr; }
+
+	double training_accuracy() const { return _training_accuracy; }
+	size_t epochs() const { return _epochs; }
+	//training throughput of the last epoch
+	double samples_per_second() const { return _samples_per_second; }
 
 	void calculate_deltas(const std::vector<double>& input, const std::vector<double>& expected, LayerTrainingData &layer_data);
 };
\ No newline at end of file
@@ -0,0 +1,367 @@
+#include "ExecutionPlan.h"
+#include "CPUTrainer.h"
+#include "Gemm.h"
+#include "Logging.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+struct ForwardEpilogue {
+	const double* biases;
+	//training keeps the weighted inputs in C and writes the activations here, inference activates C in place
+	double* activated;
+	size_t ld;
+	void (*activate)(double* values, size_t n);
+};
+
+void forward_epilogue(const void* context, size_t row, size_t col, double* values, size_t n)
+{
+	auto ctx = (const ForwardEpilogue*)context;
+	for (size_t i = 0; i < n; i++) {
+		values[i] += ctx->biases[col + i];
+	}
+	if (ctx->activate == nullptr) {
+		return;
+	}
+	if (ctx->activated != nullptr) {
+		double* out = ctx->activated + row * ctx->ld + col;
+		std::memcpy(out, values, n * sizeof(double));
+		ctx->activate(out, n);
+	}
+	else {
+		ctx->activate(values, n);
+	}
+}
+
+struct DerivativeEpilogue {
+	const double* weighted_inputs;
+	size_t ld;
+	void (*apply_derivative)(const double* weighted_inputs, double* errors, size_t n);
+};
+
+void derivative_epilogue(const void* context, size_t row, size_t col, double* values, size_t n)
+{
+	auto ctx = (const DerivativeEpilogue*)context;
+	ctx->apply_derivative(ctx->weighted_inputs + row * ctx->ld + col, values, n);
+}
+
+}
+
+ExecutionPlan::ExecutionPlan(const Network& network, size_t max_batch, int nthreads, PlanMode mode) :
+	_network(network), _mode(mode), _max_batch(max_batch), _thread_loss(nthreads, 0.0)
+{
+	if (!network.is_fully_connected()) {
+		throw std::runtime_error("execution plans only support dense layers");
+	}
+	bool training = mode == PlanMode::Training;
+	int nlayers = (int)network.layers.size();
+	const Layer& out_layer = network.layers.back();
+	for (int l = 0; l < nlayers - 1; l++) {
+		if (network.layers[l].activation == Activation::Softmax) {
+			throw std::runtime_error("softmax is only supported on the output layer");
+		}
+	}
+	if (training && network.loss == Loss::CrossEntropy && out_layer.activation != Activation::Softmax) {
+		throw std::runtime_error("cross entropy needs a softmax output layer");
+	}
+
+	Step gather{ StepKind::Gather };
+	gather.output = add_tensor("input", -1, network.layers[0].input_size);
+	if (training) {
+		gather.expected = add_tensor("expected", nlayers - 1, out_layer.size);
+	}
+	_steps.push_back(gather);
+
+	std::vector<int> weighted(nlayers, -1);
+	std::vector<int> activated(nlayers, -1);
+	int input = gather.output;
+	for (int l = 0; l < nlayers; l++) {
+		Step step{ StepKind::Forward, l };
+		step.input = input;
+		step.output = add_tensor("activations", l, network.layers[l].size);
+		if (training) {
+			step.weighted = add_tensor("weighted", l, network.layers[l].size);
+		}
+		_steps.push_back(step);
+		weighted[l] = step.weighted;
+		activated[l] = step.output;
+		input = step.output;
+	}
+	_output_tensor = activated.back();
+
+	if (!training) {
+		if (out_layer.activation == Activation::Softmax) {
+			Step softmax{ StepKind::Softmax, nlayers - 1 };
+			softmax.output = _output_tensor;
+			_steps.push_back(softmax);
+		}
+	}
+	else {
+		Step loss{ StepKind::Loss, nlayers - 1 };
+		loss.weighted = weighted.back();
+		loss.output = _output_tensor;
+		loss.expected = gather.expected;
+		loss.delta = add_tensor("deltas", nlayers - 1, out_layer.size);
+		_steps.push_back(loss);
+
+		int delta = loss.delta;
+		for (int l = nlayers - 1; l >= 0; l--) {
+			Step gradients{ StepKind::Gradients, l };
+			gradients.input = l == 0 ? gather.output : activated[l - 1];
+			gradients.delta = delta;
+			_steps.push_back(gradients);
+			if (l > 0) {
+				Step backward{ StepKind::Backward, l };
+				backward.delta = delta;
+				backward.weighted = weighted[l - 1];
+				backward.output = add_tensor("deltas", l - 1, network.layers[l - 1].size);
+				_steps.push_back(backward);
+				delta = backward.output;
+			}
+		}
+	}
+
+	plan_buffers();
+	for (size_t i = 0; i < _steps.size(); i++) {
+		_jobs.push_back([this, i](size_t thread_index, size_t start, size_t count) {
+			run_step(i, thread_index, start, count);
+		});
+	}
+	LOG_DEBUG("Compiled execution plan:\n{}", describe());
+}
+
+int ExecutionPlan::add_tensor(const char* name, int layer, size_t cols)
+{
+	_tensors.push_back({ name, layer, cols });
+	return (int)_tensors.size() - 1;
+}
+
+void ExecutionPlan::plan_buffers()
+{
+	for (int s = 0; s < (int)_steps.size(); s++) {
+		const Step& step = _steps[s];
+		for (int id : { step.input, step.output, step.weighted, step.expected, step.delta }) {
+			if (id < 0) {
+				continue;
+			}
+			Tensor& t = _tensors[id];
+			t.first_step = t.first_step < 0 ? s : std::min(t.first_step, s);
+			t.last_step = std::max(t.last_step, s);
+		}
+	}
+	//the result has to outlive the run
+	_tensors[_output_tensor].last_step = (int)_steps.size();
+
+	//first fit: each tensor goes in the lowest gap left by tensors whose lifetimes overlap it.
+	//a tensor never shares with one used in the same step, so a gemm never reads what it writes
+	size_t arena_size = 0;
+	for (size_t i = 0; i < _tensors.size(); i++) {
+		Tensor& t = _tensors[i];
+		size_t size = t.cols * _max_batch;
+		std::vector<std::pair<size_t, size_t>> taken;
+		for (size_t j = 0; j < i; j++) {
+			const Tensor& other = _tensors[j];
+			if (other.first_step <= t.last_step && t.first_step <= other.last_step) {
+				taken.push_back({ other.offset, other.offset + other.cols * _max_batch });
+			}
+		}
+		std::sort(taken.begin(), taken.end());
+		size_t offset = 0;
+		for (const auto& range : taken) {
+			if (offset + size <= range.first) {
+				break;
+			}
+			offset = std::max(offset, range.second);
+		}
+		t.offset = offset;
+		arena_size = std::max(arena_size, offset + size);
+	}
+	_arena.assign(arena_size, 0.0);
+}
+
+size_t ExecutionPlan::unplanned_size() const
+{
+	size_t total = 0;
+	for (const auto& t : _tensors) {
+		total += t.cols * _max_batch;
+	}
+	return total;
+}
+
+std::string ExecutionPlan::describe() const
+{
+	static const char* names[] = { "gather", "forward", "softmax", "loss", "backward", "gradients" };
+	std::string res;
+	for (const auto& step : _steps) {
+		res += names[(size_t)step.kind];
+		if (step.layer >= 0) {
+			res += " layer " + std::to_string(step.layer);
+		}
+		res += "\n";
+	}
+	for (const auto& t : _tensors) {
+		res += std::string(t.name) + "[" + std::to_string(t.layer) + "] steps " + std::to_string(t.first_step) + "-" +
+			std::to_string(t.last_step) + " @" + std::to_string(t.offset) + "\n";
+	}
+	res += "arena " + std::to_string(arena_size()) + " doubles, " + std::to_string(unplanned_size()) + " unplanned";
+	return res;
+}
+
+void ExecutionPlan::run_step(size_t step_index, size_t thread_index, size_t start, size_t count)
+{
+	const Step& step = _steps[step_index];
+	const Layer* layer = step.layer >= 0 ? &_network.layers[step.layer] : nullptr;
+
+	switch (step.kind) {
+	case StepKind::Gather: {
+		size_t input_size = _tensors[step.output].cols;
+		double* inputs = tensor(step.output);
+		if (_inputs != nullptr) {
+			std::memcpy(inputs + start * input_size, _inputs + start * input_size, count * input_size * sizeof(double));
+			break;
+		}
+		size_t output_size = _tensors[step.expected].cols;
+		double* expected = tensor(step.expected);
+		for (size_t r = start; r < start + count; r++) {
+			const DataPoint& point = _network.training_data[_start + r];
+			std::memcpy(inputs + r * input_size, point.get_input().data(), input_size * sizeof(double));
+			std::memcpy(expected + r * output_size, point.get_expected().data(), output_size * sizeof(double));
+		}
+		break;
+	}
+	case StepKind::Forward: {
+		size_t n = layer->size;
+		size_t in = layer->input_size;
+		bool training = step.weighted >= 0;
+		double* c = (training ? tensor(step.weighted) : tensor(step.output)) + start * n;
+		//the output layer's softmax runs in its own pass (or the loss), so that epilogue just adds the bias
+		ForwardEpilogue ctx{ layer->biases.data(), training ? tensor(step.output) + start * n : nullptr, n,
+			layer->activation == Activation::Softmax ? nullptr : activation_kernels<double>(layer->activation).activate };
+		gemm(count, n, in, MatrixView::row_major(tensor(step.input) + start * in, in), MatrixView::transposed(layer->weights.data(), in),
+			c, n, false, { forward_epilogue, &ctx });
+		break;
+	}
+	case StepKind::Softmax: {
+		size_t n = layer->size;
+		double* out = tensor(step.output);
+		for (size_t r = start; r < start + count; r++) {
+			softmax_values(out + r * n, n);
+		}
+		break;
+	}
+	case StepKind::Loss: {
+		size_t n = layer->size;
+		const auto& kernels = activation_kernels<double>(layer->activation);
+		bool cross_entropy = _network.loss == Loss::CrossEntropy;
+		double loss = 0.0;
+		for (size_t r = start; r < start + count; r++) {
+			const double* z = tensor(step.weighted) + r * n;
+			double* o = tensor(step.output) + r * n;
+			const double* y = tensor(step.expected) + r * n;
+			double* d = tensor(step.delta) + r * n;
+			std::memcpy(o, z, n * sizeof(double));
+			kernels.activate(o, n);
+
+			double weighted_sum = 0.0;
+			for (size_t i = 0; i < n; i++) {
+				double diff = o[i] - y[i];
+				d[i] = diff;
+				if (cross_entropy) {
+					loss -= y[i] * std::log(std::max(o[i], 1e-300));
+				}
+				else {
+					loss += 0.5 * diff * diff;
+					weighted_sum += diff * o[i];
+				}
+			}
+			if (cross_entropy) {
+				//softmax with cross entropy cancels down to output - expected
+			}
+			else if (layer->activation == Activation::Softmax) {
+				for (size_t i = 0; i < n; i++) {
+					d[i] = o[i] * (d[i] - weighted_sum);
+				}
+			}
+			else {
+				kernels.apply_derivative(z, d, n);
+			}
+		}
+		_thread_loss[thread_index] += loss;
+		break;
+	}
+	case StepKind::Backward: {
+		size_t n = layer->size;
+		size_t in = layer->input_size;
+		const Layer& previous = _network.layers[step.layer - 1];
+		DerivativeEpilogue ctx{ tensor(step.weighted) + start * in, in, activation_kernels<double>(previous.activation).apply_derivative };
+		gemm(count, in, n, MatrixView::row_major(tensor(step.delta) + start * n, n), MatrixView::row_major(layer->weights.data(), in),
+			tensor(step.output) + start * in, in, false, { derivative_epilogue, &ctx });
+		break;
+	}
+	case StepKind::Gradients: {
+		//start and count are nodes here, each thread owns whole rows of the weight gradients
+		size_t n = layer->size;
+		size_t in = layer->input_size;
+		const double* deltas = tensor(step.delta);
+		gemm(count, in, _count, MatrixView::transposed(deltas + start, n), MatrixView::row_major(tensor(step.input), in),
+			_gradients->weight_data(step.layer) + start * in, in);
+		double* bias_gradients = _gradients->bias_data(step.layer);
+		for (size_t node = start; node < start + count; node++) {
+			double sum = 0.0;
+			for (size_t r = 0; r < _count; r++) {
+				sum += deltas[r * n + node];
+			}
+			bias_gradients[node] += sum;
+		}
+		break;
+	}
+	}
+}
+
+void ExecutionPlan::run(ThreadPool& pool)
+{
+	if (_count > _max_batch) {
+		throw std::runtime_error("batch is larger than the plan was compiled for");
+	}
+	for (size_t i = 0; i < _steps.size(); i++) {
+		size_t len = _steps[i].kind == StepKind::Gradients ? _network.layers[_steps[i].layer].size : _count;
+		pool.batch_jobs(_jobs[i], len);
+	}
+}
+
+const double* ExecutionPlan::forward(const double* inputs, size_t count, ThreadPool& pool)
+{
+	if (_mode != PlanMode::Inference) {
+		throw std::runtime_error("forward needs an inference plan");
+	}
+	_inputs = inputs;
+	_count = count;
+	run(pool);
+	_inputs = nullptr;
+	return tensor(_output_tensor);
+}
+
+double ExecutionPlan::train_batch(size_t start, size_t count, Gradients& gradients, ThreadPool& pool)
+{
+	if (_mode != PlanMode::Training) {
+		throw std::runtime_error("train_batch needs a training plan");
+	}
+	if (_thread_loss.size() < (size_t)pool.nthreads()) {
+		throw std::runtime_error("plan was compiled for fewer threads");
+	}
+	std::fill(_thread_loss.begin(), _thread_loss.end(), 0.0);
+	_start = start;
+	_count = count;
+	_gradients = &gradients;
+	run(pool);
+	_gradients = nullptr;
+
+	double loss = 0.0;
+	for (auto l : _thread_loss) {
+		loss += l;
+	}
+	return loss;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "Network.h"
+#include "ThreadPool.h"
+
+class Gradients;
+
+enum class PlanMode {
+	//forward only, activations overwrite each other as soon as they are dead
+	Inference,
+	//keeps what backprop needs and adds the loss, backward and gradient steps
+	Training
+};
+
+// A dense Network compiled ahead of time into a flat list of steps over preplanned buffers.
+// Each layer is one GEMM over the whole batch with the bias add and activation done in the GEMM
+// epilogue, the output activation, loss and output deltas are one fused pass, and hidden deltas
+// fold the activation derivative into the backward GEMM's epilogue. Every intermediate lives in
+// one arena with offsets assigned at compile time from tensor lifetimes, so running a batch
+// makes no decisions and allocates nothing.
+class ExecutionPlan {
+private:
+	enum class StepKind {
+		//copies the batch into the input (and expected) tensors
+		Gather,
+		Forward,
+		//inference only, softmax of the output rows
+		Softmax,
+		//training only, output activation + loss + output deltas
+		Loss,
+		//deltas of the previous layer
+		Backward,
+		//weight and bias gradients, split across threads by node instead of by sample
+		Gradients
+	};
+
+	struct Step {
+		StepKind kind;
+		int layer = -1;
+		int input = -1;
+		int output = -1;
+		int weighted = -1;
+		int expected = -1;
+		int delta = -1;
+	};
+
+	struct Tensor {
+		const char* name;
+		int layer;
+		size_t cols;
+		int first_step = -1;
+		int last_step = -1;
+		size_t offset = 0;
+	};
+
+	const Network& _network;
+	PlanMode _mode;
+	size_t _max_batch;
+	std::vector<Step> _steps;
+	std::vector<Tensor> _tensors;
+	std::vector<double> _arena;
+	//one job per step, built once so running doesn't construct std::functions
+	std::vector<batch_function> _jobs;
+	std::vector<double> _thread_loss;
+	int _output_tensor = -1;
+
+	//arguments of the current run, read by the jobs
+	size_t _count = 0;
+	size_t _start = 0;
+	const double* _inputs = nullptr;
+	Gradients* _gradients = nullptr;
+
+	int add_tensor(const char* name, int layer, size_t cols);
+	void plan_buffers();
+	double* tensor(int id) { return id < 0 ? nullptr : &_arena[_tensors[id].offset]; }
+	void run_step(size_t step_index, size_t thread_index, size_t start, size_t count);
+	void run(ThreadPool& pool);
+
+public:
+	ExecutionPlan(const Network& network, size_t max_batch, int nthreads, PlanMode mode);
+
+	//inputs are count x input size, returns count x output size which stays valid until the next run
+	const double* forward(const double* inputs, size_t count, ThreadPool& pool);
+	//adds the summed gradients of training_data[start, start + count) and returns the summed loss
+	double train_batch(size_t start, size_t count, Gradients& gradients, ThreadPool& pool);
+
+	size_t max_batch() const { return _max_batch; }
+	PlanMode mode() const { return _mode; }
+	//doubles in the arena against the total if every tensor had its own buffer
+	size_t arena_size() const { return _arena.size(); }
+	size_t unplanned_size() const;
+	std::string describe() const;
+};
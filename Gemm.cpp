@@ -0,0 +1,79 @@
+#include "Gemm.h"
+#include <algorithm>
+#include <vector>
+
+namespace {
+//block sizes chosen so a packed A block plus a packed B panel stay in L2
+constexpr size_t MC = 64;
+constexpr size_t KC = 256;
+constexpr size_t NC = 512;
+}
+
+void gemm(size_t M, size_t N, size_t K, MatrixView A, MatrixView B, double* C, size_t ldc,
+	bool accumulate, GemmEpilogue epilogue)
+{
+	if (K == 0) {
+		for (size_t i = 0; i < M; i++) {
+			if (!accumulate) {
+				std::fill(C + i * ldc, C + i * ldc + N, 0.0);
+			}
+			if (epilogue.apply != nullptr) {
+				epilogue.apply(epilogue.context, i, 0, C + i * ldc, N);
+			}
+		}
+		return;
+	}
+
+	//packing makes the inner loop unit stride whatever the views look like
+	thread_local std::vector<double> packed_a;
+	thread_local std::vector<double> packed_b;
+	packed_a.resize(MC * KC);
+	packed_b.resize(KC * NC);
+
+	for (size_t j0 = 0; j0 < N; j0 += NC) {
+		size_t nc = std::min(NC, N - j0);
+		for (size_t k0 = 0; k0 < K; k0 += KC) {
+			size_t kc = std::min(KC, K - k0);
+			bool first_block = k0 == 0;
+			bool last_block = k0 + kc == K;
+
+			for (size_t k = 0; k < kc; k++) {
+				const double* src = B.data + (k0 + k) * B.row_stride + j0 * B.col_stride;
+				double* dst = &packed_b[k * nc];
+				for (size_t j = 0; j < nc; j++) {
+					dst[j] = src[j * B.col_stride];
+				}
+			}
+
+			for (size_t i0 = 0; i0 < M; i0 += MC) {
+				size_t mc = std::min(MC, M - i0);
+				for (size_t i = 0; i < mc; i++) {
+					const double* src = A.data + (i0 + i) * A.row_stride + k0 * A.col_stride;
+					double* dst = &packed_a[i * kc];
+					for (size_t k = 0; k < kc; k++) {
+						dst[k] = src[k * A.col_stride];
+					}
+				}
+
+				for (size_t i = 0; i < mc; i++) {
+					double* c_row = C + (i0 + i) * ldc + j0;
+					const double* a_row = &packed_a[i * kc];
+					if (first_block && !accumulate) {
+						std::fill(c_row, c_row + nc, 0.0);
+					}
+					for (size_t k = 0; k < kc; k++) {
+						double a = a_row[k];
+						const double* b_row = &packed_b[k * nc];
+						for (size_t j = 0; j < nc; j++) {
+							c_row[j] += a * b_row[j];
+						}
+					}
+					//the row segment is final after the last k block, finish it while it's hot
+					if (last_block && epilogue.apply != nullptr) {
+						epilogue.apply(epilogue.context, i0 + i, j0, c_row, nc);
+					}
+				}
+			}
+		}
+	}
+}
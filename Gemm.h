@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+
+// Strided read-only view of a matrix, element (r, c) is data[r * row_stride + c * col_stride].
+// A transposed view of a row major matrix is just the strides swapped.
+struct MatrixView {
+	const double* data;
+	size_t row_stride;
+	size_t col_stride;
+
+	static MatrixView row_major(const double* data, size_t cols) { return { data, cols, 1 }; }
+	static MatrixView transposed(const double* data, size_t cols) { return { data, 1, cols }; }
+};
+
+// Called once for every finished row segment of C, before it leaves cache. row and col are relative to C.
+struct GemmEpilogue {
+	void (*apply)(const void* context, size_t row, size_t col, double* values, size_t n) = nullptr;
+	const void* context = nullptr;
+};
+
+//C[M x N] += A[M x K] * B[K x N], C is row major with leading dimension ldc. With accumulate false C is overwritten
+void gemm(size_t M, size_t N, size_t K, MatrixView A, MatrixView B, double* C, size_t ldc,
+	bool accumulate = true, GemmEpilogue epilogue = {});
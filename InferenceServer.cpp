@@ -0,0 +1,421 @@
+#include "InferenceServer.h"
+#include <algorithm>
+#include <assert.h>
+#include <stdexcept>
+#include "Logging.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+namespace {
+
+//anything bigger than this is treated as a broken client rather than a real sample
+constexpr uint32_t MAX_INPUT_COUNT = 1 << 24;
+
+#ifndef _WIN32
+bool read_exact(int fd, void* dest, size_t len)
+{
+	char* ptr = (char*)dest;
+	while (len > 0) {
+		ssize_t n = ::recv(fd, ptr, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool write_exact(int fd, const void* src, size_t len)
+{
+	const char* ptr = (const char*)src;
+	while (len > 0) {
+		ssize_t n = ::send(fd, ptr, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return true;
+}
+
+sockaddr_un make_address(const std::string& path)
+{
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("socket path too long: " + path);
+	}
+	std::copy(path.begin(), path.end(), addr.sun_path);
+	return addr;
+}
+#endif
+
+}
+
+//queued requests keep their connection alive, so the fd is only closed once the last response
+//has been sent and can't be reused for another client while a request is in flight
+struct InferenceServer::Connection {
+	int fd = -1;
+	std::mutex write_mutex;
+	std::thread reader;
+	std::atomic<bool> closed = false;
+
+	~Connection() {
+#ifndef _WIN32
+		if (fd >= 0) {
+			::close(fd);
+		}
+#endif
+	}
+
+	bool send_response(uint32_t label, const std::vector<float>& scores) {
+#ifndef _WIN32
+		std::unique_lock lock(write_mutex);
+		uint32_t header[2] = { label, (uint32_t)scores.size() };
+		return write_exact(fd, header, sizeof(header))
+			&& write_exact(fd, scores.data(), scores.size() * sizeof(float));
+#else
+		return false;
+#endif
+	}
+};
+
+InferenceServer::InferenceServer(const Network& network, const InferenceServerOptions& options, int nthreads) :
+	_network(network), _options(options), _thread_pool(nthreads)
+{
+	assert(_options.max_batch_size > 0);
+}
+
+InferenceServer::~InferenceServer()
+{
+	stop();
+}
+
+void InferenceServer::start()
+{
+#ifdef _WIN32
+	throw std::runtime_error("InferenceServer needs unix domain sockets");
+#else
+	_listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (_listen_fd < 0) {
+		throw std::runtime_error("failed to create socket");
+	}
+	sockaddr_un addr = make_address(_options.socket_path);
+	::unlink(_options.socket_path.c_str());
+	if (::bind(_listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(_listen_fd, 64) != 0) {
+		::close(_listen_fd);
+		_listen_fd = -1;
+		throw std::runtime_error("failed to listen on " + _options.socket_path);
+	}
+
+	_started_at = std::chrono::steady_clock::now();
+	_running = true;
+	_batch_thread = std::thread(&InferenceServer::batch_loop, this);
+	_accept_thread = std::thread(&InferenceServer::accept_loop, this);
+	LOG_DEBUG("InferenceServer: listening on {} (max batch {}, max delay {}us)",
+		_options.socket_path, _options.max_batch_size, _options.max_queue_delay.count());
+#endif
+}
+
+void InferenceServer::stop()
+{
+#ifndef _WIN32
+	if (!_running.exchange(false)) {
+		return;
+	}
+
+	//wakes up accept() so the accept thread can see _running
+	::shutdown(_listen_fd, SHUT_RDWR);
+	_accept_thread.join();
+	::close(_listen_fd);
+	_listen_fd = -1;
+	::unlink(_options.socket_path.c_str());
+
+	{
+		std::unique_lock lock(_connections_mutex);
+		for (auto& connection : _connections) {
+			::shutdown(connection->fd, SHUT_RDWR);
+		}
+		for (auto& connection : _connections) {
+			connection->reader.join();
+		}
+		_connections.clear();
+	}
+
+	_queue_signal.notify_all();
+	_batch_thread.join();
+	_queue.clear();
+#endif
+}
+
+void InferenceServer::accept_loop()
+{
+#ifndef _WIN32
+	while (_running) {
+		int fd = ::accept(_listen_fd, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		auto connection = std::make_shared<Connection>();
+		connection->fd = fd;
+
+		std::unique_lock lock(_connections_mutex);
+		//reap connections whose clients have gone away
+		for (auto it = _connections.begin(); it != _connections.end();) {
+			if ((*it)->closed) {
+				(*it)->reader.join();
+				it = _connections.erase(it);
+			}
+			else {
+				it++;
+			}
+		}
+		connection->reader = std::thread(&InferenceServer::read_loop, this, connection);
+		_connections.push_back(connection);
+	}
+#endif
+}
+
+void InferenceServer::read_loop(std::shared_ptr<Connection> connection)
+{
+#ifndef _WIN32
+	const uint32_t input_size = _network.layers[0].input_size;
+	std::vector<float> raw;
+	while (_running) {
+		uint32_t count = 0;
+		if (!read_exact(connection->fd, &count, sizeof(count)) || count > MAX_INPUT_COUNT) {
+			break;
+		}
+		raw.resize(count);
+		if (!read_exact(connection->fd, raw.data(), count * sizeof(float))) {
+			break;
+		}
+		if (count != input_size) {
+			LOG_DEBUG("InferenceServer: expected {} inputs, got {}", input_size, count);
+			connection->send_response(INVALID_LABEL, {});
+			continue;
+		}
+
+		Request request{ connection, std::vector<double>(raw.begin(), raw.end()), std::chrono::steady_clock::now() };
+		std::unique_lock lock(_queue_mutex);
+		_queue.push_back(std::move(request));
+		//the batcher only cares about the first request (starts the deadline) and a full batch
+		bool wake = _queue.size() == 1 || _queue.size() >= _options.max_batch_size;
+		lock.unlock();
+		if (wake) {
+			_queue_signal.notify_all();
+		}
+	}
+	connection->closed = true;
+#endif
+}
+
+void InferenceServer::batch_loop()
+{
+	std::vector<Request> batch;
+	batch.reserve(_options.max_batch_size);
+	while (true) {
+		std::unique_lock lock(_queue_mutex);
+		_queue_signal.wait(lock, [&] { return !_queue.empty() || !_running; });
+		if (!_running) {
+			break;
+		}
+
+		//hold the batch open until it fills up or the oldest request has waited long enough
+		auto deadline = _queue.front().enqueued_at + _options.max_queue_delay;
+		_queue_signal.wait_until(lock, deadline, [&] { return _queue.size() >= _options.max_batch_size || !_running; });
+		if (!_running) {
+			break;
+		}
+
+		size_t count = std::min(_queue.size(), _options.max_batch_size);
+		for (size_t i = 0; i < count; i++) {
+			batch.push_back(std::move(_queue.front()));
+			_queue.pop_front();
+		}
+		lock.unlock();
+
+		run_batch(batch);
+		batch.clear();
+	}
+}
+
+void InferenceServer::run_batch(std::vector<Request>& batch)
+{
+	const size_t input_size = _network.layers[0].input_size;
+	const size_t output_size = _network.layers.back().size;
+
+	std::vector<double> inputs(batch.size() * input_size);
+	for (size_t i = 0; i < batch.size(); i++) {
+		std::copy(batch[i].input.begin(), batch[i].input.end(), inputs.begin() + i * input_size);
+	}
+
+	std::vector<double> outputs(batch.size() * output_size);
+	auto task = [&](size_t thread_index, size_t start_index, size_t count) {
+		if (count == 0) {
+			return;
+		}
+		auto res = _network.calculate_batch(&inputs[start_index * input_size], count);
+		std::copy(res.begin(), res.end(), outputs.begin() + start_index * output_size);
+	};
+	_thread_pool.batch_jobs(task, batch.size());
+
+	//counted before any response goes out, a client that got its answer sees it in stats()
+	_requests += batch.size();
+	_batches += 1;
+	std::vector<float> scores(output_size);
+	for (size_t i = 0; i < batch.size(); i++) {
+		const double* out = &outputs[i * output_size];
+		std::copy(out, out + output_size, scores.begin());
+		uint32_t label = (uint32_t)(std::max_element(out, out + output_size) - out);
+		batch[i].connection->send_response(label, scores);
+
+		auto latency = std::chrono::steady_clock::now() - batch[i].enqueued_at;
+		record_latency(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+	}
+}
+
+void InferenceServer::record_latency(uint64_t latency_us)
+{
+	_total_latency_us += latency_us;
+	uint64_t current_max = _max_latency_us;
+	while (latency_us > current_max && !_max_latency_us.compare_exchange_weak(current_max, latency_us)) {}
+
+	int bucket = 0;
+	while (bucket < LATENCY_BUCKETS - 1 && (latency_us >> (bucket + 1)) != 0) {
+		bucket++;
+	}
+	_latency_histogram[bucket]++;
+}
+
+InferenceStats InferenceServer::stats() const
+{
+	InferenceStats res;
+	res.requests = _requests;
+	res.batches = _batches;
+	if (res.batches > 0) {
+		res.mean_batch_size = (double)res.requests / res.batches;
+	}
+	if (res.requests > 0) {
+		res.mean_latency_us = (double)_total_latency_us / res.requests;
+	}
+	res.max_latency_us = (double)_max_latency_us;
+
+	//percentiles are reported as the upper edge of the bucket they land in
+	uint64_t seen = 0;
+	uint64_t total = 0;
+	for (const auto& bucket : _latency_histogram) {
+		total += bucket;
+	}
+	for (int i = 0; i < LATENCY_BUCKETS && total > 0; i++) {
+		seen += _latency_histogram[i];
+		double upper = (double)(2ull << i);
+		if (res.p50_latency_us == 0.0 && seen * 100 >= total * 50) {
+			res.p50_latency_us = upper;
+		}
+		if (seen * 100 >= total * 99) {
+			res.p99_latency_us = upper;
+			break;
+		}
+	}
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - _started_at).count();
+	if (elapsed > 0.0) {
+		res.requests_per_second = res.requests / elapsed;
+	}
+	return res;
+}
+
+void InferenceServer::print_stats() const
+{
+	auto s = stats();
+	LOG_DEBUG("InferenceServer: {} requests in {} batches (mean batch {:.1f})", s.requests, s.batches, s.mean_batch_size);
+	LOG_DEBUG("  latency us: mean={:.1f} p50<={} p99<={} max={}", s.mean_latency_us, s.p50_latency_us, s.p99_latency_us, s.max_latency_us);
+	LOG_DEBUG("  throughput: {:.1f} requests/s", s.requests_per_second);
+}
+
+InferenceClient::~InferenceClient()
+{
+	close();
+}
+
+void InferenceClient::connect(const std::string& socket_path)
+{
+#ifdef _WIN32
+	throw std::runtime_error("InferenceClient needs unix domain sockets");
+#else
+	close();
+	_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un addr = make_address(socket_path);
+	if (_fd < 0 || ::connect(_fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+		close();
+		throw std::runtime_error("failed to connect to " + socket_path);
+	}
+#endif
+}
+
+void InferenceClient::close()
+{
+#ifndef _WIN32
+	if (_fd >= 0) {
+		::close(_fd);
+		_fd = -1;
+	}
+#endif
+}
+
+uint32_t InferenceClient::infer(const std::vector<double>& input, std::vector<float>* scores)
+{
+	send(input);
+	return receive(scores);
+}
+
+void InferenceClient::send(const std::vector<double>& input)
+{
+#ifdef _WIN32
+	throw std::runtime_error("InferenceClient needs unix domain sockets");
+#else
+	std::vector<float> raw(input.begin(), input.end());
+	uint32_t count = (uint32_t)raw.size();
+	if (!write_exact(_fd, &count, sizeof(count)) || !write_exact(_fd, raw.data(), raw.size() * sizeof(float))) {
+		throw std::runtime_error("failed to send inference request");
+	}
+#endif
+}
+
+uint32_t InferenceClient::receive(std::vector<float>* scores)
+{
+#ifdef _WIN32
+	throw std::runtime_error("InferenceClient needs unix domain sockets");
+#else
+	uint32_t header[2];
+	if (!read_exact(_fd, header, sizeof(header)) || header[1] > MAX_INPUT_COUNT) {
+		throw std::runtime_error("failed to read inference response");
+	}
+	std::vector<float> received(header[1]);
+	if (!read_exact(_fd, received.data(), received.size() * sizeof(float))) {
+		throw std::runtime_error("failed to read inference response");
+	}
+	if (scores != nullptr) {
+		*scores = std::move(received);
+	}
+	return header[0];
+#endif
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Network.h"
+#include "ThreadPool.h"
+
+// Wire format, host byte order over a unix domain socket. A connection can send any number of requests:
+//   request:  uint32 input_count, float input[input_count]
+//   response: uint32 label, uint32 score_count, float scores[score_count]
+// A response with label == INVALID_LABEL and no scores is sent for malformed requests.
+
+struct InferenceServerOptions {
+	std::string socket_path = "/tmp/ml-inference.sock";
+	size_t max_batch_size = 64;
+	std::chrono::microseconds max_queue_delay{ 500 };
+};
+
+struct InferenceStats {
+	uint64_t requests = 0;
+	uint64_t batches = 0;
+	double mean_batch_size = 0.0;
+	double mean_latency_us = 0.0;
+	double p50_latency_us = 0.0;
+	double p99_latency_us = 0.0;
+	double max_latency_us = 0.0;
+	double requests_per_second = 0.0;
+};
+
+class InferenceServer {
+private:
+	struct Connection;
+	struct Request {
+		std::shared_ptr<Connection> connection;
+		std::vector<double> input;
+		std::chrono::steady_clock::time_point enqueued_at;
+	};
+
+	//latency histogram buckets are powers of two in microseconds
+	static constexpr int LATENCY_BUCKETS = 32;
+
+	const Network& _network;
+	InferenceServerOptions _options;
+	ThreadPool _thread_pool;
+
+	int _listen_fd = -1;
+	std::atomic<bool> _running = false;
+	std::thread _accept_thread;
+	std::thread _batch_thread;
+
+	std::mutex _connections_mutex;
+	std::vector<std::shared_ptr<Connection>> _connections;
+
+	std::mutex _queue_mutex;
+	std::condition_variable _queue_signal;
+	std::deque<Request> _queue;
+
+	std::chrono::steady_clock::time_point _started_at;
+	std::atomic<uint64_t> _requests = 0;
+	std::atomic<uint64_t> _batches = 0;
+	std::atomic<uint64_t> _total_latency_us = 0;
+	std::atomic<uint64_t> _max_latency_us = 0;
+	std::atomic<uint64_t> _latency_histogram[LATENCY_BUCKETS] = {};
+
+	void accept_loop();
+	void read_loop(std::shared_ptr<Connection> connection);
+	void batch_loop();
+	void run_batch(std::vector<Request>& batch);
+	void record_latency(uint64_t latency_us);
+
+public:
+	static constexpr uint32_t INVALID_LABEL = 0xffffffff;
+
+	InferenceServer() = delete;
+	InferenceServer(const Network& network, const InferenceServerOptions& options, int nthreads);
+	~InferenceServer();
+
+	void start();
+	void stop();
+
+	InferenceStats stats() const;
+	void print_stats() const;
+};
+
+// Blocking client for the wire format above, mostly for tests and tools
+class InferenceClient {
+private:
+	int _fd = -1;
+public:
+	InferenceClient() = default;
+	~InferenceClient();
+
+	void connect(const std::string& socket_path);
+	void close();
+	uint32_t infer(const std::vector<double>& input, std::vector<float>* scores);
+	//infer in two halves, responses come back in the order the requests were sent
+	void send(const std::vector<double>& input);
+	uint32_t receive(std::vector<float>* scores);
+};
@@ -1,4 +1,138 @@
 #include "Logging.h"
+#include <memory>
 
-StdoutLogger Logs::debug("DEBUG");
-StdoutLogger Logs::trace("TRACE");
\ No newline at end of file
+std::atomic<LogLevel> Logs::_level{ LogLevel::Trace };
+
+namespace {
+
+const char* level_prefix(LogLevel level)
+{
+	switch (level) {
+	case LogLevel::Trace:
+		return "[TRACE] ";
+	case LogLevel::Debug:
+		return "[DEBUG] ";
+	default:
+		return "";
+	}
+}
+
+}
+
+AsyncLogger::AsyncLogger() :
+	_ring(new Record[LOG_RING_SIZE])
+{
+	//a slot is free for position p once its sequence reaches p
+	for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+		_ring[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	_thread = std::thread(&AsyncLogger::run, this);
+}
+
+AsyncLogger::~AsyncLogger()
+{
+	_stop.store(true);
+	wake_consumer();
+	_thread.join();
+	delete[] _ring;
+}
+
+AsyncLogger& AsyncLogger::instance()
+{
+	static AsyncLogger logger;
+	return logger;
+}
+
+AsyncLogger::Record& AsyncLogger::claim()
+{
+	size_t pos = _tail.load(std::memory_order_relaxed);
+	while (true) {
+		Record& record = _ring[pos % LOG_RING_SIZE];
+		size_t sequence = record.sequence.load(std::memory_order_acquire);
+		if (sequence == pos) {
+			if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				return record;
+			}
+		}
+		else if (sequence < pos) {
+			//full, the writer is a whole ring behind
+			wake_consumer();
+			std::this_thread::yield();
+			pos = _tail.load(std::memory_order_relaxed);
+		}
+		else {
+			pos = _tail.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+void AsyncLogger::publish(Record& record)
+{
+	size_t pos = record.sequence.load(std::memory_order_relaxed);
+	//seq_cst so it cannot pass the check of _consumer_waiting
+	record.sequence.store(pos + 1);
+	wake_consumer();
+}
+
+void AsyncLogger::wake_consumer()
+{
+	//either this sees the consumer waiting or the consumer sees the record before it sleeps
+	if (_consumer_waiting.load()) {
+		_wake.fetch_add(1);
+		_wake.notify_one();
+	}
+}
+
+void AsyncLogger::run()
+{
+	std::string out;
+	while (true) {
+		Record& record = _ring[_head % LOG_RING_SIZE];
+		if (record.sequence.load(std::memory_order_acquire) == _head + 1) {
+			out += level_prefix(record.level);
+			record.format(record, out);
+			out += '\n';
+			record.sequence.store(_head + LOG_RING_SIZE, std::memory_order_release);
+			_head++;
+			if (out.size() < 64 * 1024) {
+				continue;
+			}
+		}
+		if (!out.empty()) {
+			_output.load()->write(out.data(), out.size());
+			out.clear();
+			continue;
+		}
+
+		//nothing left, make it visible before sleeping
+		_output.load()->flush();
+		_written.store(_head);
+		_written.notify_all();
+		if (_stop.load()) {
+			break;
+		}
+		uint32_t wake = _wake.load();
+		_consumer_waiting.store(true);
+		if (record.sequence.load() != _head + 1 && !_stop.load()) {
+			_wake.wait(wake);
+		}
+		_consumer_waiting.store(false);
+	}
+}
+
+void AsyncLogger::flush()
+{
+	size_t target = _tail.load();
+	size_t written = _written.load();
+	while (written < target) {
+		wake_consumer();
+		_written.wait(written);
+		written = _written.load();
+	}
+}
+
+void AsyncLogger::set_output(std::ostream& output)
+{
+	flush();
+	_output.store(&output);
+}
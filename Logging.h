@@ -1,30 +1,154 @@
 #pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstring>
 #include <iostream>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <fmt/core.h>
 
-class StdoutLogger {
+enum class LogLevel { Trace, Debug, Off };
+
+//levels below this are compiled out, LOG_TRACE needs ENABLE_TRACE as well
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL 0
+#endif
+
+constexpr size_t LOG_RING_SIZE = 4096;
+//arguments bigger than this are formatted on the calling thread instead
+constexpr size_t LOG_ARGS_BYTES = 224;
+
+// Log lines are queued without formatting: the caller copies the format string pointer and its
+// arguments into a slot of a fixed lock-free ring and returns. A background thread formats and
+// writes them to stdout in batches, flushing when it runs out of work. The format string must be
+// a literal. String arguments may not outlive the call, so their characters are copied into the
+// slot behind the other arguments and formatted from there. Lines whose arguments do not fit are
+// formatted on the calling thread instead. A full ring makes callers wait rather than dropping lines.
+class AsyncLogger {
 private:
-	std::string _prefix;
+	struct Record {
+		std::atomic<size_t> sequence;
+		//formats the stored arguments into out and destroys them
+		void (*format)(Record& record, std::string& out);
+		LogLevel level;
+		const char* format_string;
+		alignas(std::max_align_t) unsigned char args[LOG_ARGS_BYTES];
+	};
+
+	template<class T>
+	static constexpr bool is_string_v = std::is_convertible_v<const std::decay_t<T>&, std::string_view>;
+	template<class T>
+	using stored_t = std::conditional_t<is_string_v<T>, std::string_view, std::decay_t<T>>;
+
+	template<class T>
+	static size_t text_bytes(const T& value) {
+		if constexpr (is_string_v<T>) {
+			return std::string_view(value).size();
+		}
+		else {
+			return 0;
+		}
+	}
+
+	//strings become views of their copy at text, which is advanced past it
+	template<class T>
+	static stored_t<T> store(T&& value, char*& text) {
+		if constexpr (is_string_v<T>) {
+			std::string_view view(value);
+			std::memcpy(text, view.data(), view.size());
+			text += view.size();
+			return std::string_view(text - view.size(), view.size());
+		}
+		else {
+			return std::forward<T>(value);
+		}
+	}
+
+	template<class Tuple>
+	static void format_record(Record& record, std::string& out) {
+		Tuple& args = *std::launder(reinterpret_cast<Tuple*>(record.args));
+		std::apply([&](auto&... values) {
+			fmt::vformat_to(std::back_inserter(out), record.format_string, fmt::make_format_args(values...));
+		}, args);
+		args.~Tuple();
+	}
+
+	Record* _ring;
+	alignas(64) std::atomic<size_t> _tail{ 0 };
+	alignas(64) size_t _head = 0;
+	std::atomic<size_t> _written{ 0 };
+	std::atomic<bool> _consumer_waiting{ false };
+	std::atomic<uint32_t> _wake{ 0 };
+	std::atomic<bool> _stop{ false };
+	std::atomic<std::ostream*> _output{ &std::cout };
+	std::thread _thread;
+
+	Record& claim();
+	void publish(Record& record);
+	void wake_consumer();
+	void run();
+	AsyncLogger();
 public:
-	StdoutLogger(const std::string &prefix) : _prefix(prefix) {}
-	template<class... Types> void print(const std::string &str, Types... args) {
-		std::string formatted = fmt::vformat(str, fmt::make_format_args(args...));
-		std::cout << "[" << _prefix << "] " << formatted << std::endl;
+	~AsyncLogger();
+	static AsyncLogger& instance();
+
+	template<class... Types>
+	void push(LogLevel level, const char* format_string, Types&&... args) {
+		using Tuple = std::tuple<stored_t<Types>...>;
+		Record& record = claim();
+		record.level = level;
+		if constexpr (sizeof(Tuple) <= LOG_ARGS_BYTES && alignof(Tuple) <= alignof(std::max_align_t)) {
+			if (sizeof(Tuple) + (text_bytes(args) + ... + (size_t)0) <= LOG_ARGS_BYTES) {
+				char* text = reinterpret_cast<char*>(record.args) + sizeof(Tuple);
+				record.format_string = format_string;
+				new (record.args) Tuple(store(std::forward<Types>(args), text)...);
+				record.format = &format_record<Tuple>;
+				publish(record);
+				return;
+			}
+		}
+		using Formatted = std::tuple<std::string>;
+		record.format_string = "{}";
+		new (record.args) Formatted(fmt::vformat(format_string, fmt::make_format_args(args...)));
+		record.format = &format_record<Formatted>;
+		publish(record);
 	}
+	//blocks until every line pushed before the call has been written
+	void flush();
+	//flushes then sends later lines to output, which must outlive the logger or the next call
+	void set_output(std::ostream& output);
 };
 
 class Logs {
+private:
+	static std::atomic<LogLevel> _level;
 public:
-	static StdoutLogger debug;
-	static StdoutLogger trace;
+	static void set_level(LogLevel level) { _level.store(level, std::memory_order_relaxed); }
+	static LogLevel level() { return _level.load(std::memory_order_relaxed); }
+	static bool enabled(LogLevel level) { return level >= _level.load(std::memory_order_relaxed); }
+	static void flush() { AsyncLogger::instance().flush(); }
+	static void set_output(std::ostream& output) { AsyncLogger::instance().set_output(output); }
 };
 
 //#define ENABLE_TRACE
 
-#define LOG_DEBUG(...) Logs::debug.print(__VA_ARGS__);
+//arguments are only evaluated when the level is enabled
+//a single statement, call sites end it with ;
+#define LOG_AT(level, ...) do { if (Logs::enabled(level)) { AsyncLogger::instance().push(level, __VA_ARGS__); } } while (0)
+
+#if LOG_COMPILED_LEVEL <= 1
+#define LOG_DEBUG(...) LOG_AT(LogLevel::Debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
 
-#ifdef ENABLE_TRACE
-#define LOG_TRACE(...) Logs::trace.print(__VA_ARGS__);
+#if defined(ENABLE_TRACE) && LOG_COMPILED_LEVEL <= 0
+#define LOG_TRACE(...) LOG_AT(LogLevel::Trace, __VA_ARGS__)
 #else
-#define LOG_TRACE(...) 
+#define LOG_TRACE(...) do {} while (0)
 #endif
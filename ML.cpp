@@ -7,18 +7,53 @@
 
 #include "CPUTrainer.h"
 #include "matplotlibcpp.h"
+#include <optional>
 #include <thread>
 
 #include "gpu/GPUNetwork.h"
+#include "Quantization.h"
+#include "Pruning.h"
+#include "Tracer.h"
+#include "PerfCounters.h"
+#include "Metrics.h"
+#include "InferenceServer.h"
+#include "Backend.h"
 
 namespace plt = matplotlibcpp;
 bool training = false;
+//0 leaves out the http endpoint and only writes training.prom
+int metrics_port = 9464;
 
 void train_task(Network& n) {
 	std::cout << "TRAINING" << std::endl;
 	//n.train();
 	CPUTrainer trainer(n);
+	StopCriteria criteria;
+	criteria.target_accuracy = 0.98;
+	criteria.patience = 5;
+	trainer.set_stop_criteria(criteria);
+	if (n.is_fully_connected()) {
+		trainer.set_execution_plan(true);
+	}
+	//scraped by prometheus, or picked up by the node_exporter textfile collector
+	MetricsExporterOptions metrics_options;
+	metrics_options.file_path = "training.prom";
+	metrics_options.http_port = metrics_port;
+	std::optional<MetricsExporter> exporter(std::in_place, metrics_options);
+	exporter->add(trainer.metrics());
+	try {
+		exporter->start();
+	}
+	catch (const std::runtime_error& e) {
+		//a taken port is no reason to lose the run, the file still gets written
+		std::cout << e.what() << ", continuing without the http endpoint" << std::endl;
+		metrics_options.http_port = 0;
+		exporter.emplace(metrics_options);
+		exporter->add(trainer.metrics());
+		exporter->start();
+	}
 	trainer.train();
+	exporter->stop();
 	std::cout << "DONE" << std::endl;
 	training = false;
 }
@@ -26,6 +61,7 @@ void train_task(Network& n) {
 void mnist() 
 {
 	MNISTNetwork n;
+	//MNISTConvNetwork n;
 	n.batch_size = 32;
 	n.learn_rate = 0.05;
 	n.build();
@@ -60,7 +96,60 @@ void test() {
 	n.learn_rate = 0.5;
 	n.build();
 	n.load_data();
-	CPUTrainer(n).train();
+	Tracer::start();
+	//adds IPC and cache misses to the usage report where the host allows it
+	PerfCounters::start();
+	CPUTrainer trainer(n);
+	StopCriteria criteria;
+	criteria.max_epochs = 10;
+	trainer.set_stop_criteria(criteria);
+	trainer.train();
+	PerfCounters::stop();
+	Tracer::stop();
+	//open in ui.perfetto.dev or chrome://tracing
+	Tracer::write("trace.json");
+}
+
+void quantize() {
+	MNISTNetwork n;
+	n.build();
+	n.load_data();
+
+	Quantizer quantizer;
+	QuantizedNetwork q = quantizer.quantize(n);
+	quantizer.evaluate(n, q, n.training_data);
+}
+
+void prune() {
+	MNISTNetwork n;
+	n.build();
+	n.load_data();
+	CPUTrainer trainer(n);
+	//dense baseline first, the pruner fine-tunes from there
+	StopCriteria criteria;
+	criteria.target_accuracy = 0.98;
+	criteria.max_epochs = 20;
+	trainer.set_stop_criteria(criteria);
+	trainer.train();
+
+	Pruner pruner;
+	pruner.options.sparse_below_density = pruner.find_crossover(n.layers[0].input_size, n.layers[0].size).crossover_density;
+	pruner.prune_iteratively(n, trainer);
+	SparseNetwork sparse = pruner.export_sparse(n);
+	std::cout << "Sparse weight bytes: " << sparse.weight_bytes() << std::endl;
+}
+
+void serve() {
+	MNISTNetwork n;
+	n.build();
+
+	InferenceServerOptions options;
+	InferenceServer server(n, options, ThreadPool::default_threads());
+	server.start();
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::seconds(10));
+		server.print_stats();
+	}
 }
 
 void gputest() {
@@ -121,11 +210,54 @@ void gputest() {
 	//std::cin.get();
 }
 
+void gpu_train() {
+	MNISTNetwork n;
+	n.batch_size = 32;
+	n.build();
+	n.load_data();
+
+	GPUNetwork g;
+	g.init(n);
+	g.setup_batch_training_pipeline(n, n.batch_size);
+	//mnist pixels are k/255 so they go up as uint8, after this an epoch only uploads its order
+	g.upload_dataset(n.training_data, n.test_data);
+	for (int epoch = 0; epoch < 5; epoch++) {
+		GPUBatchResult result = g.train_resident_epoch(n.batch_size, n.learn_rate);
+		GPUBatchResult test = g.evaluate_resident(n.batch_size);
+		std::cout << "epoch " << epoch << " loss " << result.loss << " training accuracy " << (double)result.correct / n.training_data.size()
+			<< " test accuracy " << (double)test.correct / n.test_data.size() << std::endl;
+	}
+	g.read_weights(n);
+	g.destroy();
+}
+
+//the same on gpu and cpu only hosts, the first run benchmarks and later ones read the choice back
+void auto_train() {
+	MNISTNetwork n;
+	n.batch_size = 32;
+	n.build();
+	n.load_data();
+
+	auto backend = select_backend(n);
+	std::cout << "training on " << backend->description() << std::endl;
+	for (int epoch = 0; epoch < 5; epoch++) {
+		backend->train_epoch(n.learn_rate);
+		std::cout << "epoch " << epoch << " test accuracy " << backend->accuracy(n.test_data) << std::endl;
+	}
+	backend->sync_weights();
+}
+
 int main()
 {
 	gputest();
+	//picks vulkan or the cpu for this host, see select_backend
+	//auto_train();
+	//gpu_train();
 	//mnist();
 	//test();
+	//quantize();
+	//prune();
+	//serve();
 	return 0;
 }
 
@@ -0,0 +1,345 @@
+#include "Metrics.h"
+#include <stdexcept>
+#include <fmt/core.h>
+#include "Logging.h"
+#include "Network.h"
+#include "util.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+const char* to_string(TrainingPhase phase)
+{
+	switch (phase) {
+	case TrainingPhase::Forward:
+		return "forward";
+	case TrainingPhase::Backward:
+		return "backward";
+	case TrainingPhase::ForwardBackward:
+		return "forward_backward";
+	case TrainingPhase::Reduction:
+		return "reduction";
+	case TrainingPhase::Update:
+		return "update";
+	case TrainingPhase::Evaluation:
+		return "evaluation";
+	case TrainingPhase::Upload:
+		return "upload";
+	case TrainingPhase::Compute:
+		return "compute";
+	case TrainingPhase::Readback:
+		return "readback";
+	default:
+		return "unknown";
+	}
+}
+
+namespace {
+
+//each weight is used once per output position
+uint64_t layer_flops(const Layer& layer)
+{
+	uint64_t positions = layer.type == LayerType::Convolution ? (uint64_t)layer.output_shape.height * layer.output_shape.width : 1;
+	return 2 * (uint64_t)layer.weights.size() * positions;
+}
+
+}
+
+uint64_t forward_flops_per_sample(const Network& network)
+{
+	uint64_t flops = 0;
+	for (const auto& layer : network.layers) {
+		flops += layer_flops(layer);
+	}
+	return flops;
+}
+
+uint64_t training_flops_per_sample(const Network& network)
+{
+	uint64_t flops = 0;
+	for (size_t i = 0; i < network.layers.size(); i++) {
+		uint64_t forward = layer_flops(network.layers[i]);
+		//forward and weight gradients, plus input deltas past the first layer
+		flops += (i == 0 ? 2 : 3) * forward;
+	}
+	return flops;
+}
+
+uint64_t parameter_count(const Network& network)
+{
+	uint64_t count = 0;
+	for (const auto& layer : network.layers) {
+		count += layer.weights.size() + layer.biases.size();
+	}
+	return count;
+}
+
+uint64_t training_bytes_per_batch(const Network& network, size_t batch_len, size_t nthreads)
+{
+	uint64_t parameters = parameter_count(network) * sizeof(double);
+	uint64_t inputs = (uint64_t)network.layers.front().input_size * sizeof(double);
+	//per sample: the input, parameters read forward and backward, gradients read and written
+	uint64_t bytes = batch_len * (inputs + 4 * parameters);
+	//reduction reads every thread's gradients into the total, the update reads both and writes
+	return bytes + 3 * nthreads * parameters + 3 * parameters;
+}
+
+uint64_t peak_rss_bytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return counters.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return (uint64_t)usage.ru_maxrss;
+#else
+	//kilobytes on linux
+	return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+void TrainingMetrics::add_batch(uint64_t samples, uint64_t flops, uint64_t bytes)
+{
+	_samples.fetch_add(samples, std::memory_order_relaxed);
+	_batches.fetch_add(1, std::memory_order_relaxed);
+	_flops.fetch_add(flops, std::memory_order_relaxed);
+	_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+MetricsSnapshot TrainingMetrics::snapshot() const
+{
+	MetricsSnapshot res;
+	res.samples = _samples.load(std::memory_order_relaxed);
+	res.batches = _batches.load(std::memory_order_relaxed);
+	res.epochs = _epochs.load(std::memory_order_relaxed);
+	res.flops = _flops.load(std::memory_order_relaxed);
+	res.bytes = _bytes.load(std::memory_order_relaxed);
+	for (int i = 0; i < (int)TrainingPhase::Count; i++) {
+		res.phase_ns[i] = _phase_ns[i].load(std::memory_order_relaxed);
+	}
+	return res;
+}
+
+MetricsExporter::~MetricsExporter()
+{
+	stop();
+}
+
+void MetricsExporter::add(const TrainingMetrics& metrics)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_sources.push_back({ &metrics, metrics.snapshot() });
+}
+
+std::string MetricsExporter::render()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	auto now = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(now - _last_tick).count();
+	_last_tick = now;
+
+	std::vector<MetricsSnapshot> current;
+	for (const auto& source : _sources) {
+		current.push_back(source.metrics->snapshot());
+	}
+
+	std::string out;
+	auto header = [&](const char* name, const char* type, const char* help) {
+		out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+	};
+	auto each_source = [&](const char* name, auto value) {
+		for (size_t i = 0; i < _sources.size(); i++) {
+			out += fmt::format("{}{{backend=\"{}\"}} {}\n", name, _sources[i].metrics->backend(), value(current[i], _sources[i].last));
+		}
+	};
+	auto rate = [&](uint64_t now_value, uint64_t last_value) {
+		return seconds > 0.0 ? (now_value - last_value) / seconds : 0.0;
+	};
+
+	header("ml_training_samples_total", "counter", "Training samples processed.");
+	each_source("ml_training_samples_total", [](const MetricsSnapshot& s, const MetricsSnapshot&) { return s.samples; });
+	header("ml_training_batches_total", "counter", "Mini-batches processed.");
+	each_source("ml_training_batches_total", [](const MetricsSnapshot& s, const MetricsSnapshot&) { return s.batches; });
+	header("ml_training_epochs_total", "counter", "Epochs completed.");
+	each_source("ml_training_epochs_total", [](const MetricsSnapshot& s, const MetricsSnapshot&) { return s.epochs; });
+	header("ml_training_flops_total", "counter", "Floating point operations from the layer shapes.");
+	each_source("ml_training_flops_total", [](const MetricsSnapshot& s, const MetricsSnapshot&) { return s.flops; });
+	header("ml_training_bytes_total", "counter", "Estimated bytes touched by the kernels.");
+	each_source("ml_training_bytes_total", [](const MetricsSnapshot& s, const MetricsSnapshot&) { return s.bytes; });
+
+	header("ml_training_phase_seconds_total", "counter", "Wall time per training phase.");
+	for (size_t i = 0; i < _sources.size(); i++) {
+		for (int phase = 0; phase < (int)TrainingPhase::Count; phase++) {
+			if (current[i].phase_ns[phase] > 0) {
+				out += fmt::format("ml_training_phase_seconds_total{{backend=\"{}\",phase=\"{}\"}} {:.6f}\n",
+					_sources[i].metrics->backend(), to_string((TrainingPhase)phase), current[i].phase_ns[phase] / 1e9);
+			}
+		}
+	}
+
+	header("ml_training_samples_per_second", "gauge", "Training samples per second over the last interval.");
+	each_source("ml_training_samples_per_second", [&](const MetricsSnapshot& s, const MetricsSnapshot& last) { return rate(s.samples, last.samples); });
+	header("ml_training_gflops", "gauge", "Achieved GFLOP/s over the last interval.");
+	each_source("ml_training_gflops", [&](const MetricsSnapshot& s, const MetricsSnapshot& last) { return rate(s.flops, last.flops) / 1e9; });
+	header("ml_training_bytes_per_second", "gauge", "Estimated bytes touched per second over the last interval.");
+	each_source("ml_training_bytes_per_second", [&](const MetricsSnapshot& s, const MetricsSnapshot& last) { return rate(s.bytes, last.bytes); });
+
+	header("ml_process_peak_rss_bytes", "gauge", "Peak resident set size of the process.");
+	out += fmt::format("ml_process_peak_rss_bytes {}\n", peak_rss_bytes());
+
+	for (size_t i = 0; i < _sources.size(); i++) {
+		_sources[i].last = current[i];
+	}
+	_text = out;
+	return out;
+}
+
+void MetricsExporter::write_file(const std::string& text)
+{
+	//a scraper never sees a half written file
+	if (!write_file_atomically(_options.file_path, text.data(), text.size())) {
+		LOG_DEBUG("MetricsExporter: failed to write {}", _options.file_path);
+	}
+}
+
+void MetricsExporter::start()
+{
+	if (_running) {
+		return;
+	}
+	_last_tick = std::chrono::steady_clock::now();
+	if (_options.http_port != 0) {
+#ifdef _WIN32
+		throw std::runtime_error("MetricsExporter http endpoint needs posix sockets");
+#else
+		_listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+		if (_listen_fd < 0) {
+			throw std::runtime_error("failed to create socket");
+		}
+		int reuse = 1;
+		::setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((uint16_t)_options.http_port);
+		if (::inet_pton(AF_INET, _options.bind_address.c_str(), &addr.sin_addr) != 1
+			|| ::bind(_listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(_listen_fd, 16) != 0) {
+			::close(_listen_fd);
+			_listen_fd = -1;
+			throw std::runtime_error(fmt::format("failed to listen on {}:{}", _options.bind_address, _options.http_port));
+		}
+#endif
+	}
+
+	_running = true;
+	render();
+	_tick_thread = std::thread(&MetricsExporter::tick_loop, this);
+	if (_listen_fd >= 0) {
+		_http_thread = std::thread(&MetricsExporter::http_loop, this);
+	}
+	LOG_DEBUG("MetricsExporter: publishing every {}ms{}{}", _options.interval.count(),
+		_options.file_path.empty() ? "" : " to " + _options.file_path,
+		_options.http_port != 0 ? fmt::format(" on http://{}:{}/metrics", _options.bind_address, _options.http_port) : "");
+}
+
+void MetricsExporter::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_running) {
+			return;
+		}
+		_running = false;
+	}
+	_signal.notify_all();
+	_tick_thread.join();
+#ifndef _WIN32
+	if (_listen_fd >= 0) {
+		//wakes up accept() so the http thread can see _running
+		::shutdown(_listen_fd, SHUT_RDWR);
+		_http_thread.join();
+		::close(_listen_fd);
+		_listen_fd = -1;
+	}
+#endif
+}
+
+void MetricsExporter::tick_loop()
+{
+	while (true) {
+		bool running;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_signal.wait_for(lock, _options.interval, [&] { return !_running; });
+			running = _running;
+		}
+		std::string text = render();
+		if (!_options.file_path.empty()) {
+			write_file(text);
+		}
+		if (!running) {
+			break;
+		}
+	}
+}
+
+void MetricsExporter::http_loop()
+{
+#ifndef _WIN32
+	while (true) {
+		int fd = ::accept(_listen_fd, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		//a client that connects and never sends would otherwise hold up stop() in the join
+		timeval timeout = {};
+		timeout.tv_sec = (time_t)(_options.client_timeout.count() / 1000);
+		timeout.tv_usec = (suseconds_t)(_options.client_timeout.count() % 1000) * 1000;
+		::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		//only the request line matters, anything else the client sent is ignored
+		char request[1024];
+		ssize_t len = ::recv(fd, request, sizeof(request) - 1, 0);
+		std::string line = len > 0 ? std::string(request, len) : "";
+		std::string body;
+		const char* status = "404 Not Found";
+		if (line.rfind("GET /metrics", 0) == 0 || line.rfind("GET / ", 0) == 0) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			body = _text;
+			status = "200 OK";
+		}
+		std::string response = fmt::format("HTTP/1.1 {}\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}",
+			status, body.size(), body);
+		size_t sent = 0;
+		while (sent < response.size()) {
+			ssize_t n = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0) {
+				break;
+			}
+			sent += n;
+		}
+		::close(fd);
+	}
+#endif
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Network;
+
+enum class TrainingPhase {
+	Forward,
+	Backward,
+	//forward and backward when they run as one kernel (execution plans, low precision)
+	ForwardBackward,
+	Reduction,
+	Update,
+	Evaluation,
+	//GPUNetwork
+	Upload,
+	Compute,
+	Readback,
+	Count
+};
+const char* to_string(TrainingPhase phase);
+
+//multiply-adds count as 2, pooling and activations are ignored
+uint64_t forward_flops_per_sample(const Network& network);
+//forward, deltas for every layer but the first, and the weight gradients
+uint64_t training_flops_per_sample(const Network& network);
+uint64_t parameter_count(const Network& network);
+//what the CPU kernels touch for one batch in double precision, see TrainingMetrics
+uint64_t training_bytes_per_batch(const Network& network, size_t batch_len, size_t nthreads);
+//0 where the platform has no way to ask
+uint64_t peak_rss_bytes();
+
+struct MetricsSnapshot {
+	uint64_t samples = 0;
+	uint64_t batches = 0;
+	uint64_t epochs = 0;
+	uint64_t flops = 0;
+	uint64_t bytes = 0;
+	uint64_t phase_ns[(int)TrainingPhase::Count] = {};
+};
+
+// Running totals for one trainer, updated a few times per batch so they are always on. The
+// byte counts are an estimate of what the kernels touch from the layer shapes, with no cache
+// model, useful for comparing runs rather than as a DRAM figure.
+class TrainingMetrics {
+private:
+	std::string _backend;
+	std::atomic<uint64_t> _samples{ 0 };
+	std::atomic<uint64_t> _batches{ 0 };
+	std::atomic<uint64_t> _epochs{ 0 };
+	std::atomic<uint64_t> _flops{ 0 };
+	std::atomic<uint64_t> _bytes{ 0 };
+	std::atomic<uint64_t> _phase_ns[(int)TrainingPhase::Count] = {};
+public:
+	TrainingMetrics(const std::string& backend) : _backend(backend) {}
+	const std::string& backend() const { return _backend; }
+
+	void add_batch(uint64_t samples, uint64_t flops, uint64_t bytes);
+	void add_epoch() { _epochs.fetch_add(1, std::memory_order_relaxed); }
+	void add_phase(TrainingPhase phase, uint64_t ns) { _phase_ns[(int)phase].fetch_add(ns, std::memory_order_relaxed); }
+	MetricsSnapshot snapshot() const;
+};
+
+//adds its lifetime to a phase
+class PhaseTimer {
+private:
+	TrainingMetrics& _metrics;
+	TrainingPhase _phase;
+	std::chrono::steady_clock::time_point _started_at;
+public:
+	PhaseTimer(TrainingMetrics& metrics, TrainingPhase phase) :
+		_metrics(metrics), _phase(phase), _started_at(std::chrono::steady_clock::now()) {}
+	~PhaseTimer() {
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _started_at).count();
+		_metrics.add_phase(_phase, (uint64_t)ns);
+	}
+};
+
+struct MetricsExporterOptions {
+	//written through a temporary and a rename, the node_exporter textfile collector layout
+	std::string file_path;
+	//serves GET /metrics on bind_address when non zero
+	int http_port = 0;
+	std::string bind_address = "127.0.0.1";
+	//how long a scrape may take to send its request or read the response, stop() waits at most this long for one
+	std::chrono::milliseconds client_timeout{ 1000 };
+	//how often the file is rewritten and the served text and rates are refreshed
+	std::chrono::milliseconds interval{ 5000 };
+};
+
+// Publishes TrainingMetrics in the Prometheus text format. Totals are counters so rate() works
+// in queries, and the samples/s, GFLOP/s and bytes/s gauges are over the last interval.
+class MetricsExporter {
+private:
+	struct Source {
+		const TrainingMetrics* metrics;
+		MetricsSnapshot last;
+	};
+
+	MetricsExporterOptions _options;
+	std::vector<Source> _sources;
+	std::chrono::steady_clock::time_point _last_tick;
+
+	std::mutex _mutex;
+	std::condition_variable _signal;
+	bool _running = false;
+	std::string _text;
+	std::thread _tick_thread;
+
+	int _listen_fd = -1;
+	std::thread _http_thread;
+
+	void tick_loop();
+	void http_loop();
+	void write_file(const std::string& text);
+public:
+	MetricsExporter(const MetricsExporterOptions& options) : _options(options) {}
+	~MetricsExporter();
+
+	//metrics must outlive the exporter, add everything before start
+	void add(const TrainingMetrics& metrics);
+	void start();
+	//publishes once more so the final totals are not lost
+	void stop();
+
+	//advances the rate window, callers other than the exporter thread are for tests
+	std::string render();
+};
@@ -0,0 +1,317 @@
+#include "MixedPrecision.h"
+#include "CPUTrainer.h"
+#include <algorithm>
+#include <assert.h>
+#include <stdexcept>
+#include <string>
+
+const char* to_string(Precision precision)
+{
+	switch (precision) {
+	case Precision::Double: return "double";
+	case Precision::Float32: return "float32";
+	case Precision::BFloat16: return "bfloat16";
+	}
+	return "unknown";
+}
+
+namespace {
+
+template<typename Storage> struct StorageTraits;
+
+template<> struct StorageTraits<float> {
+	using Accum = double;
+	static float store(double value) { return (float)value; }
+	static double load(float value) { return value; }
+};
+
+template<> struct StorageTraits<bfloat16> {
+	using Accum = float;
+	static bfloat16 store(float value) { return bfloat16::from_float(value); }
+	static float load(bfloat16 value) { return value.to_float(); }
+};
+
+template<typename Storage>
+class LowPrecisionModelImpl : public LowPrecisionModel {
+private:
+	using Traits = StorageTraits<Storage>;
+	using Accum = typename Traits::Accum;
+
+	struct ThreadState {
+		std::vector<std::vector<Storage>> weighted_inputs;
+		std::vector<std::vector<Storage>> outputs;
+		std::vector<std::vector<Storage>> deltas;
+		std::vector<Accum> scratch;
+		std::vector<Accum> scratch_inputs;
+		//per thread gradient sums in the accumulation type, so float32 storage sums in double
+		std::vector<std::vector<Accum>> weight_gradients;
+		std::vector<std::vector<Accum>> bias_gradients;
+	};
+
+	const Network& _network;
+	Precision _precision;
+	std::vector<std::vector<Storage>> _weights;
+	std::vector<std::vector<Storage>> _biases;
+	//training inputs converted once so each sample is read at storage width
+	std::vector<Storage> _inputs;
+	std::vector<ThreadState> _threads;
+
+	ThreadState make_state() const {
+		ThreadState state;
+		size_t max_size = 0;
+		for (const auto& layer : _network.layers) {
+			state.weighted_inputs.emplace_back(layer.size);
+			state.outputs.emplace_back(layer.size);
+			state.deltas.emplace_back(layer.size);
+			state.weight_gradients.emplace_back(layer.weights.size(), Accum(0));
+			state.bias_gradients.emplace_back(layer.biases.size(), Accum(0));
+			max_size = std::max(max_size, (size_t)layer.size);
+		}
+		state.scratch.resize(max_size);
+		state.scratch_inputs.resize(max_size);
+		return state;
+	}
+
+	const Storage* sample_input(size_t index) const {
+		return &_inputs[index * _network.layers[0].input_size];
+	}
+
+	void forward(const Storage* input, ThreadState& state) {
+		const Storage* in = input;
+		for (size_t l = 0; l < _network.layers.size(); l++) {
+			const Layer& layer = _network.layers[l];
+			const Storage* weights = _weights[l].data();
+			for (int node = 0; node < layer.size; node++) {
+				const Storage* row = weights + (size_t)node * layer.input_size;
+				Accum acc = Traits::load(_biases[l][node]);
+				for (int i = 0; i < layer.input_size; i++) {
+					acc += Traits::load(row[i]) * Traits::load(in[i]);
+				}
+				state.scratch[node] = acc;
+				state.weighted_inputs[l][node] = Traits::store(acc);
+			}
+			activation_kernels<Accum>(layer.activation).activate(state.scratch.data(), layer.size);
+			for (int node = 0; node < layer.size; node++) {
+				state.outputs[l][node] = Traits::store(state.scratch[node]);
+			}
+			in = state.outputs[l].data();
+		}
+	}
+
+	void backward(const std::vector<double>& expected, ThreadState& state) {
+		size_t last = _network.layers.size() - 1;
+		const Layer& out_layer = _network.layers[last];
+		Accum* errors = state.scratch.data();
+		Accum* z = state.scratch_inputs.data();
+
+		for (int node = 0; node < out_layer.size; node++) {
+			errors[node] = Traits::load(state.outputs[last][node]) - (Accum)expected[node];
+			z[node] = Traits::load(state.weighted_inputs[last][node]);
+		}
+		if (_network.loss == Loss::CrossEntropy) {
+			//output - expected already, softmax with cross entropy cancels down to that
+		}
+		else if (out_layer.activation == Activation::Softmax) {
+			Accum weighted_sum = 0;
+			for (int node = 0; node < out_layer.size; node++) {
+				weighted_sum += errors[node] * Traits::load(state.outputs[last][node]);
+			}
+			for (int node = 0; node < out_layer.size; node++) {
+				errors[node] = Traits::load(state.outputs[last][node]) * (errors[node] - weighted_sum);
+			}
+		}
+		else {
+			activation_kernels<Accum>(out_layer.activation).apply_derivative(z, errors, out_layer.size);
+		}
+		for (int node = 0; node < out_layer.size; node++) {
+			state.deltas[last][node] = Traits::store(errors[node]);
+		}
+
+		for (int l = (int)last - 1; l >= 0; l--) {
+			const Layer& layer = _network.layers[l];
+			const Layer& next = _network.layers[l + 1];
+			const Storage* next_weights = _weights[l + 1].data();
+			for (int node = 0; node < layer.size; node++) {
+				Accum acc = 0;
+				for (int k = 0; k < next.size; k++) {
+					acc += Traits::load(state.deltas[l + 1][k]) * Traits::load(next_weights[(size_t)k * next.input_size + node]);
+				}
+				errors[node] = acc;
+				z[node] = Traits::load(state.weighted_inputs[l][node]);
+			}
+			activation_kernels<Accum>(layer.activation).apply_derivative(z, errors, layer.size);
+			for (int node = 0; node < layer.size; node++) {
+				state.deltas[l][node] = Traits::store(errors[node]);
+			}
+		}
+	}
+
+	void accumulate_gradients(const Storage* input, ThreadState& state) {
+		const Storage* in = input;
+		for (size_t l = 0; l < _network.layers.size(); l++) {
+			const Layer& layer = _network.layers[l];
+			Accum* weight_gradients = state.weight_gradients[l].data();
+			for (int node = 0; node < layer.size; node++) {
+				Accum delta = Traits::load(state.deltas[l][node]);
+				Accum* row = weight_gradients + (size_t)node * layer.input_size;
+				for (int i = 0; i < layer.input_size; i++) {
+					row[i] += delta * Traits::load(in[i]);
+				}
+				state.bias_gradients[l][node] += delta;
+			}
+			in = state.outputs[l].data();
+		}
+	}
+
+	static size_t argmax(const std::vector<Storage>& values) {
+		size_t best = 0;
+		for (size_t i = 1; i < values.size(); i++) {
+			if (Traits::load(values[i]) > Traits::load(values[best])) {
+				best = i;
+			}
+		}
+		return best;
+	}
+
+public:
+	LowPrecisionModelImpl(Precision precision, const Network& network, int nthreads) :
+		_network(network), _precision(precision)
+	{
+		if (!network.is_fully_connected()) {
+			throw std::runtime_error("low precision training only supports dense layers");
+		}
+		if (network.loss == Loss::CrossEntropy && network.layers.back().activation != Activation::Softmax) {
+			throw std::runtime_error("cross entropy needs a softmax output layer");
+		}
+		for (const auto& layer : network.layers) {
+			if (layer.activation == Activation::Softmax && &layer != &network.layers.back()) {
+				throw std::runtime_error("softmax is only supported on the output layer");
+			}
+			_weights.emplace_back();
+			_biases.emplace_back();
+			for (auto w : layer.weights) {
+				_weights.back().push_back(Traits::store((Accum)w));
+			}
+			for (auto b : layer.biases) {
+				_biases.back().push_back(Traits::store((Accum)b));
+			}
+		}
+
+		size_t input_size = network.layers[0].input_size;
+		_inputs.resize(network.training_data.size() * input_size);
+		for (size_t s = 0; s < network.training_data.size(); s++) {
+			const auto& data = network.training_data[s].get_input();
+			for (size_t i = 0; i < input_size; i++) {
+				_inputs[s * input_size + i] = Traits::store((Accum)data[i]);
+			}
+		}
+
+		for (int i = 0; i < nthreads; i++) {
+			_threads.push_back(make_state());
+		}
+	}
+
+	Precision precision() const override { return _precision; }
+	size_t bytes_per_parameter() const override { return sizeof(Storage); }
+
+	void sync_weights(ThreadPool& thread_pool) override {
+		for (size_t l = 0; l < _network.layers.size(); l++) {
+			const Layer& layer = _network.layers[l];
+			Storage* weights = _weights[l].data();
+			auto convert = [&](size_t thread_index, size_t start_index, size_t count) {
+				for (size_t i = start_index; i < start_index + count; i++) {
+					weights[i] = Traits::store((Accum)layer.weights[i]);
+				}
+			};
+			thread_pool.batch_jobs(convert, layer.weights.size());
+			for (size_t i = 0; i < layer.biases.size(); i++) {
+				_biases[l][i] = Traits::store((Accum)layer.biases[i]);
+			}
+		}
+	}
+
+	void process_batch(size_t batch_start, size_t batch_len, Gradients* gradients, ThreadPool& thread_pool) override {
+		assert(_threads.size() == (size_t)thread_pool.nthreads());
+		auto task = [&](size_t thread_index, size_t start_index, size_t count) {
+			ThreadState& state = _threads[thread_index];
+			for (size_t i = start_index; i < start_index + count; i++) {
+				size_t sample = batch_start + i;
+				forward(sample_input(sample), state);
+				backward(_network.training_data[sample].get_expected(), state);
+				accumulate_gradients(sample_input(sample), state);
+			}
+		};
+		thread_pool.batch_jobs(task, batch_len);
+
+		//reduce the per-thread sums into the double gradients, zeroing them on the way
+		for (size_t l = 0; l < _network.layers.size(); l++) {
+			double* weight_gradients = gradients->weight_data(l);
+			auto reduce = [&](size_t thread_index, size_t start_index, size_t count) {
+				for (size_t i = start_index; i < start_index + count; i++) {
+					double sum = 0.0;
+					for (auto& state : _threads) {
+						sum += state.weight_gradients[l][i];
+						state.weight_gradients[l][i] = 0;
+					}
+					weight_gradients[i] += sum;
+				}
+			};
+			thread_pool.batch_jobs(reduce, _network.layers[l].weights.size());
+
+			double* bias_gradients = gradients->bias_data(l);
+			for (size_t i = 0; i < _network.layers[l].biases.size(); i++) {
+				for (auto& state : _threads) {
+					bias_gradients[i] += state.bias_gradients[l][i];
+					state.bias_gradients[l][i] = 0;
+				}
+			}
+		}
+	}
+
+	size_t count_correct(ThreadPool& thread_pool) override {
+		std::vector<size_t> correct(thread_pool.nthreads(), 0);
+		auto task = [&](size_t thread_index, size_t start_index, size_t count) {
+			ThreadState& state = _threads[thread_index];
+			for (size_t i = start_index; i < start_index + count; i++) {
+				forward(sample_input(i), state);
+				if (argmax(state.outputs.back()) == _network.training_data[i].label) {
+					correct[thread_index]++;
+				}
+			}
+		};
+		thread_pool.batch_jobs(task, _network.training_data.size());
+		size_t total = 0;
+		for (auto c : correct) {
+			total += c;
+		}
+		return total;
+	}
+
+	std::vector<double> calculate(const std::vector<double>& input) override {
+		ThreadState state = make_state();
+		std::vector<Storage> converted(input.size());
+		for (size_t i = 0; i < input.size(); i++) {
+			converted[i] = Traits::store((Accum)input[i]);
+		}
+		forward(converted.data(), state);
+		std::vector<double> res;
+		for (auto v : state.outputs.back()) {
+			res.push_back(Traits::load(v));
+		}
+		return res;
+	}
+};
+
+}
+
+std::unique_ptr<LowPrecisionModel> make_low_precision_model(Precision precision, const Network& network, int nthreads)
+{
+	switch (precision) {
+	case Precision::Float32:
+		return std::make_unique<LowPrecisionModelImpl<float>>(precision, network, nthreads);
+	case Precision::BFloat16:
+		return std::make_unique<LowPrecisionModelImpl<bfloat16>>(precision, network, nthreads);
+	default:
+		return nullptr;
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "Network.h"
+#include "ThreadPool.h"
+
+class Gradients;
+
+enum class Precision {
+	//the original path, everything in double
+	Double,
+	Float32,
+	//bfloat16 stored as uint16
+	BFloat16
+};
+
+const char* to_string(Precision precision);
+
+struct bfloat16 {
+	uint16_t bits = 0;
+
+	static bfloat16 from_float(float value) {
+		uint32_t u;
+		std::memcpy(&u, &value, sizeof(u));
+		bfloat16 res;
+		if ((u & 0x7fffffff) > 0x7f800000) {
+			//keep nans quiet instead of rounding them into infinity
+			res.bits = (uint16_t)((u >> 16) | 0x40);
+		}
+		else {
+			//round to nearest even
+			res.bits = (uint16_t)((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+		}
+		return res;
+	}
+
+	float to_float() const {
+		uint32_t u = (uint32_t)bits << 16;
+		float value;
+		std::memcpy(&value, &u, sizeof(value));
+		return value;
+	}
+};
+
+// Low precision working copy of a network for training. Weights, activations and deltas are
+// held in the storage type while dot products and gradient sums accumulate in a wider type
+// (double for float32 storage, float for bfloat16). Updates still go to Layer::weights, which
+// acts as the master copy and is converted back with sync_weights after every step.
+class LowPrecisionModel {
+public:
+	virtual ~LowPrecisionModel() = default;
+
+	virtual Precision precision() const = 0;
+	virtual size_t bytes_per_parameter() const = 0;
+
+	virtual void sync_weights(ThreadPool& thread_pool) = 0;
+	//adds the summed gradients of the batch into gradients, same as CPUTrainer::process_batch
+	virtual void process_batch(size_t batch_start, size_t batch_len, Gradients* gradients, ThreadPool& thread_pool) = 0;
+	virtual size_t count_correct(ThreadPool& thread_pool) = 0;
+	virtual std::vector<double> calculate(const std::vector<double>& input) = 0;
+};
+
+std::unique_ptr<LowPrecisionModel> make_low_precision_model(Precision precision, const Network& network, int nthreads);
@@ -12,6 +12,8 @@
 #include "util.h"
 #include "Timer.h"
 #include "Logging.h"
+#include "Gemm.h"
+#include <stdexcept>
 
 double Layer::calculate_node(int node_index, const std::vector<double>& inputs) {
 	assert(node_index < size);
@@ -25,22 +27,252 @@ double Layer::calculate_node(int node_index, const std::vector<double>& inputs)
 }
 
 std::vector<double>Layer::calculate(const std::vector<double>& inputs, LayerTrainingData *training_data) {
-	//Timer t("Layer::Calculate");
+	KernelTimer t("Layer::calculate");
 	std::vector<double> output(size);
-	for (int node = 0; node < size; node++) {
-		double weighted_input = calculate_node(node, inputs);
-		double res = sigmoid(weighted_input);
-		if (training_data != nullptr) {
-			training_data->set_activation_input(index, node, weighted_input);
-			training_data->set_output(index, node, res);
+	calculate_weighted_inputs(inputs.data(), output.data());
+	if (training_data != nullptr) {
+		for (int node = 0; node < size; node++) {
+			training_data->set_activation_input(index, node, output[node]);
+		}
+	}
+	activate(output.data());
+	if (training_data != nullptr) {
+		for (int node = 0; node < size; node++) {
+			training_data->set_output(index, node, output[node]);
 		}
-		output[node] = res;
 	}
 	return output;
 }
 
+void Layer::calculate(const double* inputs, LayerTrainingData& training_data) const
+{
+	KernelTimer t("Layer::calculate");
+	double* activation_inputs = training_data.activation_inputs_data(index);
+	double* output = training_data.output_data(index);
+	calculate_weighted_inputs(inputs, activation_inputs);
+	std::copy(activation_inputs, activation_inputs + size, output);
+	activate(output);
+}
+
+void Layer::activate(double* values) const
+{
+	activation_kernels<double>(activation).activate(values, size);
+}
+
+void Layer::calculate_batch(const double* inputs, size_t count, double* output) const
+{
+	if (type != LayerType::Dense) {
+		for (size_t b = 0; b < count; b++) {
+			calculate_weighted_inputs(inputs + b * input_size, output + b * size);
+			activate(output + b * size);
+		}
+		return;
+	}
+
+	//node outer so each weight row is read once for the whole batch
+	for (int node = 0; node < size; node++) {
+		const double* row = &weights[node * input_size];
+		for (size_t b = 0; b < count; b++) {
+			const double* in = inputs + b * input_size;
+			double weighted_input = biases[node];
+			for (int i = 0; i < input_size; i++) {
+				weighted_input += in[i] * row[i];
+			}
+			output[b * size + node] = weighted_input;
+		}
+	}
+	for (size_t b = 0; b < count; b++) {
+		activate(output + b * size);
+	}
+}
+
+namespace {
+
+//columns are output pixels, rows are (channel, ky, kx) so the convolution becomes weights x columns
+void im2col(const double* input, const Shape3& in, const Shape3& out, int kernel, int stride, double* columns)
+{
+	size_t pixels = (size_t)out.height * out.width;
+	for (int c = 0; c < in.channels; c++) {
+		for (int ky = 0; ky < kernel; ky++) {
+			for (int kx = 0; kx < kernel; kx++) {
+				double* row = columns + ((size_t)(c * kernel + ky) * kernel + kx) * pixels;
+				for (int oy = 0; oy < out.height; oy++) {
+					const double* src = input + ((size_t)c * in.height + oy * stride + ky) * in.width + kx;
+					for (int ox = 0; ox < out.width; ox++) {
+						row[oy * out.width + ox] = src[ox * stride];
+					}
+				}
+			}
+		}
+	}
+}
+
+//inverse of im2col, overlapping windows add up
+void col2im(const double* columns, const Shape3& in, const Shape3& out, int kernel, int stride, double* input)
+{
+	size_t pixels = (size_t)out.height * out.width;
+	for (int c = 0; c < in.channels; c++) {
+		for (int ky = 0; ky < kernel; ky++) {
+			for (int kx = 0; kx < kernel; kx++) {
+				const double* row = columns + ((size_t)(c * kernel + ky) * kernel + kx) * pixels;
+				for (int oy = 0; oy < out.height; oy++) {
+					double* dst = input + ((size_t)c * in.height + oy * stride + ky) * in.width + kx;
+					for (int ox = 0; ox < out.width; ox++) {
+						dst[ox * stride] += row[oy * out.width + ox];
+					}
+				}
+			}
+		}
+	}
+}
+
+//index into the input of the largest value in one pooling window
+size_t max_pool_source(const double* input, const Shape3& in, int c, int oy, int ox, int pool)
+{
+	size_t best = ((size_t)c * in.height + oy * pool) * in.width + ox * pool;
+	for (int y = 0; y < pool; y++) {
+		for (int x = 0; x < pool; x++) {
+			size_t i = ((size_t)c * in.height + oy * pool + y) * in.width + ox * pool + x;
+			if (input[i] > input[best]) {
+				best = i;
+			}
+		}
+	}
+	return best;
+}
+
+//per thread so the batch can run in parallel without reallocating every sample
+thread_local std::vector<double> conv_columns;
+
+}
+
+void Layer::calculate_weighted_inputs(const double* input, double* weighted_inputs) const
+{
+	switch (type) {
+	case LayerType::Dense:
+		for (int node = 0; node < size; node++) {
+			const double* row = &weights[(size_t)node * input_size];
+			double weighted_input = biases[node];
+			for (int i = 0; i < input_size; i++) {
+				weighted_input += input[i] * row[i];
+			}
+			weighted_inputs[node] = weighted_input;
+		}
+		break;
+	case LayerType::Convolution: {
+		size_t pixels = (size_t)output_shape.height * output_shape.width;
+		size_t patch = (size_t)input_shape.channels * kernel_size * kernel_size;
+		conv_columns.resize(patch * pixels);
+		im2col(input, input_shape, output_shape, kernel_size, stride, conv_columns.data());
+		for (int c = 0; c < output_shape.channels; c++) {
+			std::fill(weighted_inputs + c * pixels, weighted_inputs + (c + 1) * pixels, biases[c]);
+		}
+		gemm(output_shape.channels, pixels, patch, MatrixView::row_major(weights.data(), patch),
+			MatrixView::row_major(conv_columns.data(), pixels), weighted_inputs, pixels);
+		break;
+	}
+	case LayerType::MaxPool:
+		for (int c = 0; c < output_shape.channels; c++) {
+			for (int oy = 0; oy < output_shape.height; oy++) {
+				for (int ox = 0; ox < output_shape.width; ox++) {
+					size_t source = max_pool_source(input, input_shape, c, oy, ox, kernel_size);
+					weighted_inputs[((size_t)c * output_shape.height + oy) * output_shape.width + ox] = input[source];
+				}
+			}
+		}
+		break;
+	}
+}
+
+void Layer::backpropagate(const double* input, const double* deltas, double* input_errors) const
+{
+	std::fill(input_errors, input_errors + input_size, 0.0);
+	switch (type) {
+	case LayerType::Dense:
+		//row at a time so the weights are read contiguously
+		for (int node = 0; node < size; node++) {
+			const double* row = &weights[(size_t)node * input_size];
+			double delta = deltas[node];
+			for (int i = 0; i < input_size; i++) {
+				input_errors[i] += delta * row[i];
+			}
+		}
+		break;
+	case LayerType::Convolution: {
+		size_t pixels = (size_t)output_shape.height * output_shape.width;
+		size_t patch = (size_t)input_shape.channels * kernel_size * kernel_size;
+		//column errors = weights^T x deltas, then scatter back onto the image
+		conv_columns.assign(patch * pixels, 0.0);
+		gemm(patch, pixels, output_shape.channels, MatrixView::transposed(weights.data(), patch),
+			MatrixView::row_major(deltas, pixels), conv_columns.data(), pixels);
+		col2im(conv_columns.data(), input_shape, output_shape, kernel_size, stride, input_errors);
+		break;
+	}
+	case LayerType::MaxPool:
+		for (int c = 0; c < output_shape.channels; c++) {
+			for (int oy = 0; oy < output_shape.height; oy++) {
+				for (int ox = 0; ox < output_shape.width; ox++) {
+					size_t source = max_pool_source(input, input_shape, c, oy, ox, kernel_size);
+					input_errors[source] += deltas[((size_t)c * output_shape.height + oy) * output_shape.width + ox];
+				}
+			}
+		}
+		break;
+	}
+}
+
+void Layer::accumulate_gradients(const double* input, const double* deltas, double* weight_gradients, double* bias_gradients) const
+{
+	switch (type) {
+	case LayerType::Dense:
+		for (int node = 0; node < size; node++) {
+			double delta = deltas[node];
+			double* row = weight_gradients + (size_t)node * input_size;
+			for (int i = 0; i < input_size; i++) {
+				row[i] += input[i] * delta;
+			}
+			bias_gradients[node] += delta;
+		}
+		break;
+	case LayerType::Convolution: {
+		size_t pixels = (size_t)output_shape.height * output_shape.width;
+		size_t patch = (size_t)input_shape.channels * kernel_size * kernel_size;
+		//weight gradients = deltas x columns^T
+		conv_columns.resize(patch * pixels);
+		im2col(input, input_shape, output_shape, kernel_size, stride, conv_columns.data());
+		gemm(output_shape.channels, patch, pixels, MatrixView::row_major(deltas, pixels),
+			MatrixView::transposed(conv_columns.data(), pixels), weight_gradients, patch);
+		for (int c = 0; c < output_shape.channels; c++) {
+			const double* channel = deltas + c * pixels;
+			bias_gradients[c] += std::accumulate(channel, channel + pixels, 0.0);
+		}
+		break;
+	}
+	case LayerType::MaxPool:
+		break;
+	}
+}
+
 void Layer::init() 
 {
+	if (type == LayerType::MaxPool) {
+		weights.clear();
+		biases.clear();
+		return;
+	}
+	if (type == LayerType::Convolution) {
+		int fan_in = input_shape.channels * kernel_size * kernel_size;
+		weights.resize((size_t)output_shape.channels * fan_in);
+		biases.resize(output_shape.channels);
+		for (auto& w : weights) {
+			w = random01() / sqrt(fan_in);
+		}
+		for (auto& b : biases) {
+			b = random01() / sqrt(fan_in);
+		}
+		return;
+	}
+
 	weights.resize(input_size * size);
 	biases.resize(size);
 
@@ -52,6 +284,37 @@ void Layer::init()
 	}
 }
 
+void Layer::init_convolution(Shape3 input, int out_channels, int kernel, int conv_stride)
+{
+	if (kernel <= 0 || conv_stride <= 0 || kernel > input.height || kernel > input.width) {
+		throw std::runtime_error("convolution kernel doesn't fit the input");
+	}
+	type = LayerType::Convolution;
+	input_shape = input;
+	kernel_size = kernel;
+	stride = conv_stride;
+	output_shape = { out_channels, (input.height - kernel) / conv_stride + 1, (input.width - kernel) / conv_stride + 1 };
+	input_size = input_shape.size();
+	size = output_shape.size();
+	init();
+}
+
+void Layer::init_max_pool(Shape3 input, int pool_size)
+{
+	if (pool_size <= 0 || input.height % pool_size != 0 || input.width % pool_size != 0) {
+		throw std::runtime_error("max pool size must divide the input");
+	}
+	type = LayerType::MaxPool;
+	activation = Activation::Identity;
+	input_shape = input;
+	kernel_size = pool_size;
+	stride = pool_size;
+	output_shape = { input.channels, input.height / pool_size, input.width / pool_size };
+	input_size = input_shape.size();
+	size = output_shape.size();
+	init();
+}
+
 LayerTrainingData::LayerTrainingData(const std::vector<Layer>& layers) {
 	activation_inputs.resize(layers.size());
 	deltas.resize(layers.size());
@@ -133,23 +396,68 @@ void Network::test()
 
 std::vector<double> Network::calculate(const std::vector<double>& input)
 {
-	std::vector<double> res = layers[0].calculate(input, nullptr);
-	for (size_t i = 1; i < layers.size(); i++) {
-		res = layers[i].calculate(res, nullptr);
-	}
+	std::vector<double> res;
+	calculate(input, res);
 	return res;
 }
 
 
 void Network::calculate(const std::vector<double>& input, LayerTrainingData *layer_training_data)
 {
-	layers[0].calculate(input, layer_training_data);
+	layers[0].calculate(input.data(), *layer_training_data);
 	for (size_t i = 1; i < layers.size(); i++) {
-		layers[i].calculate(layer_training_data->get_full_output(i - 1), layer_training_data);
+		layers[i].calculate(layer_training_data->get_full_output(i - 1).data(), *layer_training_data);
 	}
 	
 }
 
+void Network::calculate(const std::vector<double>& input, std::vector<double>& output) const
+{
+	//ping-pong between two buffers that only grow
+	thread_local std::vector<double> scratch[2];
+	const double* in = input.data();
+	for (size_t i = 0; i < layers.size(); i++) {
+		const Layer& layer = layers[i];
+		std::vector<double>& out = i + 1 == layers.size() ? output : scratch[i % 2];
+		out.resize(layer.size);
+		KernelTimer t("Layer::calculate");
+		layer.calculate_weighted_inputs(in, out.data());
+		layer.activate(out.data());
+		in = out.data();
+	}
+}
+
+std::vector<double> Network::calculate_batch(const double* inputs, size_t count) const
+{
+	std::vector<double> res(count * layers[0].size);
+	layers[0].calculate_batch(inputs, count, res.data());
+	std::vector<double> next;
+	for (size_t i = 1; i < layers.size(); i++) {
+		next.resize(count * layers[i].size);
+		layers[i].calculate_batch(res.data(), count, next.data());
+		std::swap(res, next);
+	}
+	return res;
+}
+
+double Network::cost(const std::vector<double>& output, const std::vector<double>& expected) const
+{
+	if (loss == Loss::CrossEntropy) {
+		assert(output.size() == expected.size());
+		double error = 0.0;
+		for (size_t i = 0; i < output.size(); i++) {
+			error -= expected[i] * log(std::max(output[i], 1e-300));
+		}
+		return error;
+	}
+	return ::cost(output, expected);
+}
+
+bool Network::is_fully_connected() const
+{
+	return std::all_of(layers.begin(), layers.end(), [](const Layer& layer) { return layer.type == LayerType::Dense; });
+}
+
 double Network::get_accuracy()
 {
 	return 0.0;// _training_accuracy;
@@ -5,6 +5,7 @@
 #include "DataPoint.h"
 #include <mutex>
 #include "ThreadPool.h"
+#include "Activation.h"
 
 //#define SINGLE_THREADED
 class Layer;
@@ -30,20 +31,69 @@ public:
 	const std::vector<double>& get_full_output(size_t layer) const;
 	const std::vector<double>& get_full_activation_inputs(size_t layer) const;
 	const std::vector<double>& get_full_deltas(size_t layer) const;
+	double* deltas_data(size_t layer) { return deltas[layer].data(); }
+	double* activation_inputs_data(size_t layer) { return activation_inputs[layer].data(); }
+	double* output_data(size_t layer) { return output[layer].data(); }
 
 };
 
+enum class Loss {
+	MeanSquaredError,
+	CrossEntropy
+};
+
+enum class LayerType {
+	Dense,
+	//valid (unpadded) convolution, weights are out channels x (in channels * kernel * kernel), one bias per out channel
+	Convolution,
+	//max over non-overlapping kernel x kernel windows per channel, no weights
+	MaxPool
+};
+
+//channel major image shape, index is (channel * height + y) * width + x
+struct Shape3 {
+	int channels = 1;
+	int height = 1;
+	int width = 1;
+
+	int size() const { return channels * height * width; }
+};
+
 class Layer {
 public:
 	int input_size;
 	int size;
 	int index;
+	Activation activation = Activation::Sigmoid;
 	std::vector<double> weights;
 	std::vector<double> biases;
 
+	LayerType type = LayerType::Dense;
+	//only used by convolution and pooling layers
+	Shape3 input_shape;
+	Shape3 output_shape;
+	int kernel_size = 0;
+	int stride = 1;
+
 	void init();
+	//set the geometry then init(), input_size and size follow from the shapes
+	void init_convolution(Shape3 input, int out_channels, int kernel, int conv_stride = 1);
+	void init_max_pool(Shape3 input, int pool_size);
+
 	double calculate_node(int node_index, const std::vector<double>& inputs);
 	std::vector<double> calculate(const std::vector<double>& inputs, LayerTrainingData* training_data);
+	//writes the activation inputs and outputs straight into training_data, no allocation
+	void calculate(const double* inputs, LayerTrainingData& training_data) const;
+	void calculate_batch(const double* inputs, size_t count, double* output) const;
+	//one sample's pre-activation values for any layer type
+	void calculate_weighted_inputs(const double* input, double* weighted_inputs) const;
+	//applies the activation in place to one sample's weighted inputs
+	void activate(double* values) const;
+
+	//input_errors = dCost/dInput given this layer's deltas, overwritten. Input is needed to route pooling errors
+	void backpropagate(const double* input, const double* deltas, double* input_errors) const;
+	//adds one sample's weight and bias gradients
+	void accumulate_gradients(const double* input, const double* deltas, double* weight_gradients, double* bias_gradients) const;
 };
 
 class Network {
@@ -59,6 +109,7 @@ public:
 
 	int batch_size = 128;
 	double learn_rate = 0.05;
+	Loss loss = Loss::MeanSquaredError;
 
 	virtual void build() = 0;
 	virtual void load_data() = 0;
@@ -66,6 +117,13 @@ public:
 	void test();
 	std::vector<double> calculate(const std::vector<double>& input);
 	void calculate(const std::vector<double>& input, LayerTrainingData* layer_training_data);
+	//reuses output's capacity and per-thread scratch, so steady state inference does not allocate
+	void calculate(const std::vector<double>& input, std::vector<double>& output) const;
+	//inputs and result are row major, count x input_size and count x output size
+	std::vector<double> calculate_batch(const double* inputs, size_t count) const;
+	double cost(const std::vector<double>& output, const std::vector<double>& expected) const;
+	//true when every layer is dense, the gpu, quantized and low precision paths need this
+	bool is_fully_connected() const;
 	//std::vector<double> &get_result();
 	double get_accuracy();
 
@@ -0,0 +1,106 @@
+#include "Optimizer.h"
+#include <cmath>
+#include <assert.h>
+
+#ifdef _MSC_VER
+#define RESTRICT __restrict
+#else
+#define RESTRICT __restrict__
+#endif
+
+std::vector<std::vector<double>> Optimizer::make_state() const
+{
+	std::vector<std::vector<double>> state(_tensors.size());
+	for (size_t i = 0; i < _tensors.size(); i++) {
+		state[i].resize(_tensors[i].size, 0.0);
+	}
+	return state;
+}
+
+void Optimizer::init(const std::vector<ParameterTensor>& tensors)
+{
+	_tensors = tensors;
+	_step = 0;
+}
+
+void Optimizer::begin_step()
+{
+	_step++;
+}
+
+void SGD::update(size_t /*tensor*/, size_t start, size_t count, double* params, const double* grads, double grad_scale, double learn_rate)
+{
+	double* RESTRICT p = params + start;
+	const double* RESTRICT g = grads + start;
+	const double rate = learn_rate * grad_scale;
+	for (size_t i = 0; i < count; i++) {
+		p[i] -= rate * g[i];
+	}
+}
+
+void Momentum::init(const std::vector<ParameterTensor>& tensors)
+{
+	Optimizer::init(tensors);
+	_velocity = make_state();
+}
+
+void Momentum::update(size_t tensor, size_t start, size_t count, double* params, const double* grads, double grad_scale, double learn_rate)
+{
+	double* RESTRICT p = params + start;
+	const double* RESTRICT g = grads + start;
+	double* RESTRICT v = _velocity[tensor].data() + start;
+	const double mu = _momentum;
+	if (_nesterov) {
+		for (size_t i = 0; i < count; i++) {
+			double grad = g[i] * grad_scale;
+			double vel = mu * v[i] + grad;
+			v[i] = vel;
+			p[i] -= learn_rate * (grad + mu * vel);
+		}
+	}
+	else {
+		for (size_t i = 0; i < count; i++) {
+			double vel = mu * v[i] + g[i] * grad_scale;
+			v[i] = vel;
+			p[i] -= learn_rate * vel;
+		}
+	}
+}
+
+void Adam::init(const std::vector<ParameterTensor>& tensors)
+{
+	Optimizer::init(tensors);
+	_m = make_state();
+	_v = make_state();
+}
+
+void Adam::begin_step()
+{
+	Optimizer::begin_step();
+	//bias corrections only depend on the step, so fold them into two scalars here
+	_m_correction = 1.0 / (1.0 - std::pow(_beta1, (double)_step));
+	_v_correction = 1.0 / (1.0 - std::pow(_beta2, (double)_step));
+}
+
+void Adam::update(size_t tensor, size_t start, size_t count, double* params, const double* grads, double grad_scale, double learn_rate)
+{
+	assert(_step > 0);
+	double* RESTRICT p = params + start;
+	const double* RESTRICT g = grads + start;
+	double* RESTRICT m = _m[tensor].data() + start;
+	double* RESTRICT v = _v[tensor].data() + start;
+	const double b1 = _beta1;
+	const double b2 = _beta2;
+	const double mc = _m_correction;
+	const double vc = _v_correction;
+	const double eps = _epsilon;
+	const double decay = _tensors[tensor].decay ? _weight_decay : 0.0;
+	for (size_t i = 0; i < count; i++) {
+		double grad = g[i] * grad_scale;
+		double mi = b1 * m[i] + (1.0 - b1) * grad;
+		double vi = b2 * v[i] + (1.0 - b2) * grad * grad;
+		m[i] = mi;
+		v[i] = vi;
+		p[i] -= learn_rate * (mi * mc / (std::sqrt(vi * vc) + eps) + decay * p[i]);
+	}
+}
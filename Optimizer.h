@@ -0,0 +1,81 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <memory>
+
+//a flat parameter array the optimizer updates, weights or biases of one layer
+struct ParameterTensor {
+	size_t size;
+	bool decay;
+};
+
+class Optimizer {
+protected:
+	std::vector<ParameterTensor> _tensors;
+	size_t _step = 0;
+
+	//contiguous per-tensor state arrays, same length as the tensor
+	std::vector<std::vector<double>> make_state() const;
+
+public:
+	virtual ~Optimizer() = default;
+
+	//called once before the first step with the shape of every tensor
+	virtual void init(const std::vector<ParameterTensor>& tensors);
+	//called once per batch before any update() for that batch
+	virtual void begin_step();
+
+	// Fused kernel: reads each gradient once and writes the parameter and any optimizer state in the same pass.
+	// Updates params[start, start + count) of tensor, grads are the raw sums over the batch and are multiplied by grad_scale.
+	// Disjoint ranges may be updated from different threads.
+	virtual void update(size_t tensor, size_t start, size_t count, double* params, const double* grads, double grad_scale, double learn_rate) = 0;
+
+	size_t step() const { return _step; }
+};
+
+class SGD : public Optimizer {
+public:
+	void update(size_t tensor, size_t start, size_t count, double* params, const double* grads, double grad_scale, double learn_rate) override;
+};
+
+class Momentum : public Optimizer {
+private:
+	std::vector<std::vector<double>> _velocity;
+	double _momentum;
+	bool _nesterov;
+public:
+	Momentum(double momentum = 0.9, bool nesterov = false) : _momentum(momentum), _nesterov(nesterov) {}
+	void init(const std::vector<ParameterTensor>& tensors) override;
+	void update(size_t tensor, size_t start, size_t count, double* params, const double* grads, double grad_scale, double learn_rate) override;
+};
+
+class Nesterov : public Momentum {
+public:
+	Nesterov(double momentum = 0.9) : Momentum(momentum, true) {}
+};
+
+class Adam : public Optimizer {
+private:
+	std::vector<std::vector<double>> _m;
+	std::vector<std::vector<double>> _v;
+	double _beta1;
+	double _beta2;
+	double _epsilon;
+	//decoupled (AdamW) weight decay, only applied to tensors with decay set
+	double _weight_decay;
+
+	double _m_correction = 1.0;
+	double _v_correction = 1.0;
+public:
+	Adam(double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-8, double weight_decay = 0.0) :
+		_beta1(beta1), _beta2(beta2), _epsilon(epsilon), _weight_decay(weight_decay) {}
+	void init(const std::vector<ParameterTensor>& tensors) override;
+	void begin_step() override;
+	void update(size_t tensor, size_t start, size_t count, double* params, const double* grads, double grad_scale, double learn_rate) override;
+};
+
+class AdamW : public Adam {
+public:
+	AdamW(double weight_decay = 0.01, double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-8) :
+		Adam(beta1, beta2, epsilon, weight_decay) {}
+};
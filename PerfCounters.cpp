@@ -0,0 +1,186 @@
+#include "PerfCounters.h"
+#include "Logging.h"
+
+std::atomic<bool> PerfCounters::_enabled{ false };
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+struct CounterConfig {
+	uint32_t type;
+	uint64_t config;
+	uint64_t PerfSample::* field;
+};
+
+constexpr CounterConfig COUNTERS[] = {
+	//cycles leads the group so the rest are scheduled with it
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, &PerfSample::cycles },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, &PerfSample::instructions },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, &PerfSample::llc_references },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, &PerfSample::llc_misses },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, &PerfSample::branch_misses },
+};
+constexpr size_t NCOUNTERS = sizeof(COUNTERS) / sizeof(COUNTERS[0]);
+
+int open_counter(const CounterConfig& counter, int group_fd)
+{
+	perf_event_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = counter.type;
+	attr.config = counter.config;
+	attr.disabled = group_fd == -1 ? 1 : 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+struct ThreadCounters {
+	bool opened = false;
+	int leader = -1;
+	int fds[NCOUNTERS];
+	uint64_t ids[NCOUNTERS];
+
+	ThreadCounters() {
+		for (size_t i = 0; i < NCOUNTERS; i++) {
+			fds[i] = -1;
+			ids[i] = 0;
+		}
+	}
+	~ThreadCounters() {
+		close_all();
+	}
+
+	//the next read opens them again
+	void close_all() {
+		for (int& fd : fds) {
+			if (fd != -1) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		leader = -1;
+		opened = false;
+	}
+
+	//one attempt per thread, the leader failing means nothing is available
+	void open() {
+		opened = true;
+		leader = open_counter(COUNTERS[0], -1);
+		if (leader == -1) {
+			return;
+		}
+		fds[0] = leader;
+		for (size_t i = 1; i < NCOUNTERS; i++) {
+			fds[i] = open_counter(COUNTERS[i], leader);
+		}
+		for (size_t i = 0; i < NCOUNTERS; i++) {
+			if (fds[i] != -1 && ioctl(fds[i], PERF_EVENT_IOC_ID, &ids[i]) == -1) {
+				close(fds[i]);
+				fds[i] = -1;
+			}
+		}
+		ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	bool read(PerfSample& sample) {
+		if (!opened) {
+			open();
+		}
+		if (leader == -1) {
+			return false;
+		}
+		//nr, the group's time enabled and running, then a value and id per open counter
+		uint64_t buffer[3 + 2 * NCOUNTERS];
+		if (::read(leader, buffer, sizeof(buffer)) <= 0) {
+			return false;
+		}
+		uint64_t time_enabled = buffer[1];
+		uint64_t time_running = buffer[2];
+		//the group is scheduled as one, so one ratio covers every counter in it
+		double scale = time_running > 0 && time_running < time_enabled ? (double)time_enabled / time_running : 1.0;
+		sample = {};
+		for (uint64_t i = 0; i < buffer[0] && i < NCOUNTERS; i++) {
+			uint64_t value = buffer[3 + 2 * i];
+			uint64_t id = buffer[4 + 2 * i];
+			for (size_t c = 0; c < NCOUNTERS; c++) {
+				if (fds[c] != -1 && ids[c] == id) {
+					sample.*(COUNTERS[c].field) = (uint64_t)(value * scale);
+				}
+			}
+		}
+		return true;
+	}
+};
+
+ThreadCounters& thread_counters()
+{
+	thread_local ThreadCounters counters;
+	return counters;
+}
+
+thread_local PerfSample delegated;
+
+}
+
+bool PerfCounters::start()
+{
+	PerfSample sample;
+	if (!thread_counters().read(sample)) {
+		LOG_DEBUG("perf counters unavailable: {} (check kernel.perf_event_paranoid)", std::strerror(errno));
+		return false;
+	}
+	_enabled.store(true, std::memory_order_release);
+	return true;
+}
+
+bool PerfCounters::read(PerfSample& sample)
+{
+	if (!enabled() || !thread_counters().read(sample)) {
+		return false;
+	}
+	sample += delegated;
+	return true;
+}
+
+void PerfCounters::add_delegated(const PerfSample& sample)
+{
+	delegated += sample;
+}
+
+void PerfCounters::stop()
+{
+	_enabled.store(false, std::memory_order_release);
+	//only the owning thread touches its counters, the others may still be mid read
+	thread_counters().close_all();
+}
+#else
+bool PerfCounters::start()
+{
+	LOG_DEBUG("perf counters are only supported on linux");
+	return false;
+}
+
+bool PerfCounters::read(PerfSample& sample)
+{
+	return false;
+}
+
+void PerfCounters::add_delegated(const PerfSample& sample)
+{
+}
+
+void PerfCounters::stop()
+{
+	_enabled.store(false, std::memory_order_release);
+}
+#endif
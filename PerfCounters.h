@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+//bytes pulled in per last level cache miss, for turning misses into a bandwidth estimate
+constexpr uint64_t CACHE_LINE_BYTES = 64;
+
+struct PerfSample {
+	uint64_t cycles = 0;
+	uint64_t instructions = 0;
+	uint64_t llc_references = 0;
+	uint64_t llc_misses = 0;
+	uint64_t branch_misses = 0;
+
+	PerfSample& operator+=(const PerfSample& other) {
+		cycles += other.cycles;
+		instructions += other.instructions;
+		llc_references += other.llc_references;
+		llc_misses += other.llc_misses;
+		branch_misses += other.branch_misses;
+		return *this;
+	}
+	//saturates at 0, readings scaled for multiplexing can step back slightly between reads
+	PerfSample operator-(const PerfSample& other) const {
+		return { minus(cycles, other.cycles), minus(instructions, other.instructions), minus(llc_references, other.llc_references),
+			minus(llc_misses, other.llc_misses), minus(branch_misses, other.branch_misses) };
+	}
+	double ipc() const { return cycles > 0 ? (double)instructions / cycles : 0.0; }
+	//a proxy for DRAM traffic, ignores prefetches and write backs
+	uint64_t memory_bytes() const { return llc_misses * CACHE_LINE_BYTES; }
+
+private:
+	static uint64_t minus(uint64_t a, uint64_t b) { return a > b ? a - b : 0; }
+};
+
+// Hardware counters through perf_event_open, counting user space on the calling thread plus the
+// ThreadPool tasks it has waited on, so a Timer around batch_jobs sees the workers' counts.
+// Each thread opens its own counter group the first time it reads while enabled, and keeps it
+// open for the next start() until the thread exits, stop() only closes the caller's. When the
+// PMU has more events than counters the kernel multiplexes them and readings are scaled up
+// from the fraction of time each was running. Needs kernel.perf_event_paranoid <= 2 and a
+// PMU, so VMs and containers often have none; start() then returns false and every read is a
+// no-op. Linux only.
+class PerfCounters {
+private:
+	static std::atomic<bool> _enabled;
+public:
+	//opens counters on the calling thread to check they work, false if not
+	static bool start();
+	//closes the calling thread's counters, other threads close theirs when they exit
+	static void stop();
+	static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+
+	//running totals for the calling thread, false when disabled or unavailable here.
+	//Counters the PMU does not support stay at 0.
+	static bool read(PerfSample& sample);
+	//adds counts made on the calling thread's behalf to its later reads, ThreadPool hands
+	//each caller of batch_jobs what its tasks counted
+	static void add_delegated(const PerfSample& sample);
+};
@@ -0,0 +1,308 @@
+#include "Pruning.h"
+#include "CPUTrainer.h"
+#include "Logging.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+namespace {
+
+//zeroes weights in place and clears their mask entries, mask must start as all ones
+void prune_layer(Layer& layer, double sparsity, SparsityPattern pattern, int block_size, std::vector<uint8_t>& mask)
+{
+	auto& weights = layer.weights;
+	switch (pattern) {
+	case SparsityPattern::Unstructured: {
+		size_t prune_count = (size_t)(sparsity * weights.size());
+		std::vector<uint32_t> order(weights.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::nth_element(order.begin(), order.begin() + prune_count, order.end(),
+			[&](uint32_t a, uint32_t b) { return std::abs(weights[a]) < std::abs(weights[b]); });
+		for (size_t i = 0; i < prune_count; i++) {
+			mask[order[i]] = 0;
+		}
+		break;
+	}
+	case SparsityPattern::TwoFour:
+		if (layer.input_size % 4 != 0) {
+			throw std::runtime_error("2:4 sparsity needs an input size divisible by 4");
+		}
+		for (size_t group = 0; group < weights.size(); group += 4) {
+			uint32_t order[4] = { 0, 1, 2, 3 };
+			std::sort(order, order + 4, [&](uint32_t a, uint32_t b) { return std::abs(weights[group + a]) < std::abs(weights[group + b]); });
+			mask[group + order[0]] = 0;
+			mask[group + order[1]] = 0;
+		}
+		break;
+	case SparsityPattern::Block: {
+		if (layer.input_size % block_size != 0 || layer.size % block_size != 0) {
+			throw std::runtime_error("block sparsity needs layer dimensions divisible by the block size");
+		}
+		size_t block_cols = layer.input_size / block_size;
+		size_t nblocks = (layer.size / block_size) * block_cols;
+		std::vector<double> magnitude(nblocks, 0.0);
+		for (int node = 0; node < layer.size; node++) {
+			for (int i = 0; i < layer.input_size; i++) {
+				magnitude[(node / block_size) * block_cols + i / block_size] += std::abs(weights[(size_t)node * layer.input_size + i]);
+			}
+		}
+		size_t prune_count = (size_t)(sparsity * nblocks);
+		std::vector<uint32_t> order(nblocks);
+		std::iota(order.begin(), order.end(), 0);
+		std::nth_element(order.begin(), order.begin() + prune_count, order.end(),
+			[&](uint32_t a, uint32_t b) { return magnitude[a] < magnitude[b]; });
+		for (size_t b = 0; b < prune_count; b++) {
+			size_t row0 = (order[b] / block_cols) * block_size;
+			size_t col0 = (order[b] % block_cols) * block_size;
+			for (int r = 0; r < block_size; r++) {
+				for (int c = 0; c < block_size; c++) {
+					mask[(row0 + r) * layer.input_size + col0 + c] = 0;
+				}
+			}
+		}
+		break;
+	}
+	}
+
+	for (size_t i = 0; i < weights.size(); i++) {
+		if (!mask[i]) {
+			weights[i] = 0.0;
+		}
+	}
+}
+
+SparseLayer to_sparse(const Layer& layer, SparseStorage storage, int block_size)
+{
+	SparseLayer res;
+	res.input_size = layer.input_size;
+	res.size = layer.size;
+	res.index = layer.index;
+	res.activation = layer.activation;
+	res.storage = storage;
+	res.biases = layer.biases;
+
+	switch (storage) {
+	case SparseStorage::Dense:
+		res.values = layer.weights;
+		break;
+	case SparseStorage::CSR:
+		res.row_offsets.push_back(0);
+		for (int node = 0; node < layer.size; node++) {
+			for (int i = 0; i < layer.input_size; i++) {
+				double w = layer.weights[(size_t)node * layer.input_size + i];
+				if (w != 0.0) {
+					res.columns.push_back(i);
+					res.values.push_back(w);
+				}
+			}
+			res.row_offsets.push_back((uint32_t)res.values.size());
+		}
+		break;
+	case SparseStorage::BlockCSR:
+		if (layer.input_size % block_size != 0 || layer.size % block_size != 0) {
+			throw std::runtime_error("block sparse storage needs layer dimensions divisible by the block size");
+		}
+		res.block_size = block_size;
+		res.row_offsets.push_back(0);
+		for (int row0 = 0; row0 < layer.size; row0 += block_size) {
+			for (int col0 = 0; col0 < layer.input_size; col0 += block_size) {
+				bool any = false;
+				for (int r = 0; r < block_size && !any; r++) {
+					for (int c = 0; c < block_size && !any; c++) {
+						any = layer.weights[(size_t)(row0 + r) * layer.input_size + col0 + c] != 0.0;
+					}
+				}
+				if (!any) {
+					continue;
+				}
+				res.columns.push_back(col0);
+				for (int r = 0; r < block_size; r++) {
+					for (int c = 0; c < block_size; c++) {
+						res.values.push_back(layer.weights[(size_t)(row0 + r) * layer.input_size + col0 + c]);
+					}
+				}
+			}
+			res.row_offsets.push_back((uint32_t)res.columns.size());
+		}
+		break;
+	}
+	return res;
+}
+
+bool is_prunable(const Network& network, size_t l, const PruningOptions& options)
+{
+	return network.layers[l].type == LayerType::Dense && (options.prune_output_layer || l + 1 < network.layers.size());
+}
+
+}
+
+void SparseLayer::calculate_weighted_inputs(const double* input, double* output) const
+{
+	switch (storage) {
+	case SparseStorage::Dense:
+		for (int node = 0; node < size; node++) {
+			const double* row = &values[(size_t)node * input_size];
+			double acc = biases[node];
+			for (int i = 0; i < input_size; i++) {
+				acc += row[i] * input[i];
+			}
+			output[node] = acc;
+		}
+		break;
+	case SparseStorage::CSR:
+		for (int node = 0; node < size; node++) {
+			double acc = biases[node];
+			for (uint32_t k = row_offsets[node]; k < row_offsets[node + 1]; k++) {
+				acc += values[k] * input[columns[k]];
+			}
+			output[node] = acc;
+		}
+		break;
+	case SparseStorage::BlockCSR: {
+		size_t block_values = (size_t)block_size * block_size;
+		for (int row0 = 0, block_row = 0; row0 < size; row0 += block_size, block_row++) {
+			std::copy(biases.begin() + row0, biases.begin() + row0 + block_size, output + row0);
+			for (uint32_t k = row_offsets[block_row]; k < row_offsets[block_row + 1]; k++) {
+				const double* block = &values[k * block_values];
+				const double* in = input + columns[k];
+				for (int r = 0; r < block_size; r++) {
+					double acc = 0.0;
+					for (int c = 0; c < block_size; c++) {
+						acc += block[r * block_size + c] * in[c];
+					}
+					output[row0 + r] += acc;
+				}
+			}
+		}
+		break;
+	}
+	}
+}
+
+std::vector<double> SparseNetwork::calculate(const std::vector<double>& input) const
+{
+	std::vector<double> activations = input;
+	std::vector<double> output;
+	for (const auto& layer : layers) {
+		output.resize(layer.size);
+		layer.calculate_weighted_inputs(activations.data(), output.data());
+		activation_kernels<double>(layer.activation).activate(output.data(), layer.size);
+		std::swap(activations, output);
+	}
+	return activations;
+}
+
+size_t SparseNetwork::weight_bytes() const
+{
+	size_t total = 0;
+	for (const auto& layer : layers) {
+		total += layer.values.size() * sizeof(double);
+		total += layer.columns.size() * sizeof(uint32_t);
+		total += layer.row_offsets.size() * sizeof(uint32_t);
+		total += layer.biases.size() * sizeof(double);
+	}
+	return total;
+}
+
+std::vector<std::vector<uint8_t>> Pruner::prune(Network& network, double sparsity) const
+{
+	std::vector<std::vector<uint8_t>> masks;
+	for (size_t l = 0; l < network.layers.size(); l++) {
+		Layer& layer = network.layers[l];
+		masks.emplace_back(layer.weights.size(), 1);
+		if (is_prunable(network, l, options)) {
+			prune_layer(layer, sparsity, options.pattern, options.block_size, masks.back());
+		}
+	}
+	return masks;
+}
+
+void Pruner::prune_iteratively(Network& network, CPUTrainer& trainer) const
+{
+	StopCriteria saved = trainer.stop_criteria();
+	StopCriteria finetune;
+	finetune.max_epochs = options.finetune_epochs;
+	trainer.set_stop_criteria(finetune);
+
+	size_t iterations = std::max<size_t>(options.iterations, 1);
+	for (size_t i = 0; i < iterations; i++) {
+		//cubic schedule, prunes hard while there is plenty of redundancy and gently near the target
+		double progress = (double)(i + 1) / iterations;
+		double sparsity = options.target_sparsity * (1.0 - std::pow(1.0 - progress, 3.0));
+		trainer.set_weight_masks(prune(network, sparsity));
+		trainer.train();
+		LOG_DEBUG("Pruning step {}: sparsity {:.2f}, training accuracy {}",
+			i + 1, options.pattern == SparsityPattern::TwoFour ? 0.5 : sparsity, trainer.training_accuracy());
+	}
+	//the masks stay on the trainer so further training keeps the sparsity
+	trainer.set_stop_criteria(saved);
+}
+
+SparseNetwork Pruner::export_sparse(const Network& network) const
+{
+	SparseNetwork res;
+	for (const auto& layer : network.layers) {
+		if (layer.type != LayerType::Dense) {
+			throw std::runtime_error("sparse export only supports dense layers");
+		}
+		size_t nonzeros = std::count_if(layer.weights.begin(), layer.weights.end(), [](double w) { return w != 0.0; });
+		double density = layer.weights.empty() ? 1.0 : (double)nonzeros / layer.weights.size();
+
+		SparseStorage storage = options.pattern == SparsityPattern::Block ? SparseStorage::BlockCSR : SparseStorage::CSR;
+		if (density > options.sparse_below_density) {
+			storage = SparseStorage::Dense;
+		}
+		res.layers.push_back(to_sparse(layer, storage, options.block_size));
+		LOG_DEBUG("Sparse layer {}: density {:.3f}, {} values stored", layer.index, density, res.layers.back().stored_values());
+	}
+	return res;
+}
+
+SparsityCrossover Pruner::find_crossover(int input_size, int size) const
+{
+	//2:4 can only reach 50%, scan its storage format (CSR) with unstructured pruning instead
+	SparsityPattern pattern = options.pattern == SparsityPattern::TwoFour ? SparsityPattern::Unstructured : options.pattern;
+	SparseStorage storage = pattern == SparsityPattern::Block ? SparseStorage::BlockCSR : SparseStorage::CSR;
+
+	Layer dense;
+	dense.input_size = input_size;
+	dense.size = size;
+	dense.init();
+	std::vector<double> input(input_size);
+	for (int i = 0; i < input_size; i++) {
+		input[i] = std::sin((double)i);
+	}
+	std::vector<double> output(size);
+	size_t repetitions = std::max<size_t>(20, 20000000 / ((size_t)input_size * size));
+
+	auto time_ns = [&](auto&& forward) {
+		forward();
+		auto started_at = std::chrono::steady_clock::now();
+		for (size_t r = 0; r < repetitions; r++) {
+			forward();
+		}
+		auto elapsed = std::chrono::steady_clock::now() - started_at;
+		return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / repetitions;
+	};
+	double dense_ns = time_ns([&]() { dense.calculate_weighted_inputs(input.data(), output.data()); });
+
+	SparsityCrossover res;
+	LOG_DEBUG("Sparse vs dense {}x{} ({}):", input_size, size, storage == SparseStorage::CSR ? "csr" : "block csr");
+	for (double density : { 0.9, 0.7, 0.5, 0.4, 0.3, 0.2, 0.15, 0.1, 0.05 }) {
+		Layer pruned = dense;
+		std::vector<uint8_t> mask(pruned.weights.size(), 1);
+		prune_layer(pruned, 1.0 - density, pattern, options.block_size, mask);
+		SparseLayer sparse = to_sparse(pruned, storage, options.block_size);
+		double sparse_ns = time_ns([&]() { sparse.calculate_weighted_inputs(input.data(), output.data()); });
+
+		res.samples.push_back({ density, dense_ns, sparse_ns });
+		if (sparse_ns < dense_ns) {
+			res.crossover_density = std::max(res.crossover_density, density);
+		}
+		LOG_DEBUG("  density {:.2f}: dense {:.0f}ns sparse {:.0f}ns", density, dense_ns, sparse_ns);
+	}
+	LOG_DEBUG("  sparse wins below density {:.2f}", res.crossover_density);
+	return res;
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "Network.h"
+
+class CPUTrainer;
+
+enum class SparsityPattern {
+	//smallest weights anywhere in the layer
+	Unstructured,
+	//2 of every 4 consecutive weights in a row, always 50%
+	TwoFour,
+	//whole block_size x block_size tiles, ranked by their summed magnitude
+	Block
+};
+
+enum class SparseStorage {
+	Dense,
+	CSR,
+	//block compressed rows, each stored block is a dense block_size x block_size tile
+	BlockCSR
+};
+
+class SparseLayer {
+public:
+	int input_size;
+	int size;
+	int index;
+	Activation activation = Activation::Sigmoid;
+	SparseStorage storage = SparseStorage::CSR;
+	int block_size = 1;
+
+	//size + 1 offsets into columns for CSR, size / block_size + 1 for BlockCSR
+	std::vector<uint32_t> row_offsets;
+	//input index of each value, or of the first column of each block
+	std::vector<uint32_t> columns;
+	//nonzeros, whole blocks row major, or the full matrix for Dense
+	std::vector<double> values;
+	std::vector<double> biases;
+
+	void calculate_weighted_inputs(const double* input, double* output) const;
+	size_t stored_values() const { return values.size(); }
+};
+
+class SparseNetwork {
+public:
+	std::vector<SparseLayer> layers;
+
+	std::vector<double> calculate(const std::vector<double>& input) const;
+	size_t weight_bytes() const;
+};
+
+struct PruningOptions {
+	SparsityPattern pattern = SparsityPattern::Unstructured;
+	//final fraction of zero weights in each pruned layer, fixed at 0.5 for TwoFour
+	double target_sparsity = 0.8;
+	int block_size = 4;
+	//prune steps for prune_iteratively, following a cubic schedule up to target_sparsity
+	size_t iterations = 4;
+	size_t finetune_epochs = 1;
+	//the output layer is small and usually the most sensitive
+	bool prune_output_layer = false;
+	//layers denser than this export with dense storage, see find_crossover
+	double sparse_below_density = 0.3;
+};
+
+struct SparsityCrossover {
+	struct Sample {
+		double density;
+		double dense_ns;
+		double sparse_ns;
+	};
+	std::vector<Sample> samples;
+	//highest measured density at which the sparse kernel was faster, 0 if it never was
+	double crossover_density = 0.0;
+};
+
+class Pruner {
+public:
+	PruningOptions options;
+
+	//zeroes the smallest weights of every prunable layer, returns the masks with 1 for kept weights
+	std::vector<std::vector<uint8_t>> prune(Network& network, double sparsity) const;
+	//alternates pruning and fine tuning with trainer, whose masks keep pruned weights at zero
+	void prune_iteratively(Network& network, CPUTrainer& trainer) const;
+	SparseNetwork export_sparse(const Network& network) const;
+	//times dense against sparse forward passes of one input_size x size layer at falling densities
+	SparsityCrossover find_crossover(int input_size, int size) const;
+};
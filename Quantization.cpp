@@ -0,0 +1,295 @@
+#include "Quantization.h"
+#include <algorithm>
+#include <cmath>
+#include <assert.h>
+#include <stdexcept>
+#include "util.h"
+#include "Logging.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define QUANTIZATION_X86
+#endif
+
+#if defined(QUANTIZATION_X86) && defined(__GNUC__)
+#define TARGET(x) __attribute__((target(x)))
+#else
+#define TARGET(x)
+#endif
+
+namespace {
+
+constexpr int ROW_ALIGNMENT = 32;
+
+using dot_function = int32_t(*)(const uint8_t* a, const int8_t* b, int n);
+
+int32_t dot_u8s8_scalar(const uint8_t* a, const int8_t* b, int n)
+{
+	int32_t acc = 0;
+	for (int i = 0; i < n; i++) {
+		acc += (int32_t)a[i] * (int32_t)b[i];
+	}
+	return acc;
+}
+
+#if defined(QUANTIZATION_X86) && (defined(__GNUC__) || defined(__AVX2__))
+TARGET("avx2") inline int32_t hsum_epi32(__m256i v)
+{
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(sum);
+}
+
+//widen to 16 bits and use madd so the u8*s8 pairs can't saturate like maddubs does
+TARGET("avx2") int32_t dot_u8s8_avx2(const uint8_t* a, const int8_t* b, int n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	for (int i = 0; i < n; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		__m256i a_lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(va));
+		__m256i a_hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1));
+		__m256i b_lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(vb));
+		__m256i b_hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(vb, 1));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a_lo, b_lo));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a_hi, b_hi));
+	}
+	return hsum_epi32(acc);
+}
+#endif
+
+#if defined(QUANTIZATION_X86) && defined(__GNUC__)
+TARGET("avxvnni,avx2") int32_t dot_u8s8_avxvnni(const uint8_t* a, const int8_t* b, int n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	for (int i = 0; i < n; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		acc = _mm256_dpbusd_avx_epi32(acc, va, vb);
+	}
+	return hsum_epi32(acc);
+}
+
+TARGET("avx512vnni,avx512vl,avx2") int32_t dot_u8s8_avx512vnni(const uint8_t* a, const int8_t* b, int n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	for (int i = 0; i < n; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		acc = _mm256_dpbusd_epi32(acc, va, vb);
+	}
+	return hsum_epi32(acc);
+}
+#endif
+
+struct DotKernel {
+	dot_function func;
+	const char* name;
+};
+
+DotKernel select_kernel()
+{
+#if defined(QUANTIZATION_X86) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl")) {
+		return { dot_u8s8_avx512vnni, "avx512-vnni" };
+	}
+	if (__builtin_cpu_supports("avxvnni")) {
+		return { dot_u8s8_avxvnni, "avx-vnni" };
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return { dot_u8s8_avx2, "avx2" };
+	}
+#elif defined(QUANTIZATION_X86) && defined(__AVX2__)
+	return { dot_u8s8_avx2, "avx2" };
+#endif
+	return { dot_u8s8_scalar, "scalar" };
+}
+
+const DotKernel& kernel()
+{
+	static DotKernel k = select_kernel();
+	return k;
+}
+
+int round_up(int value, int multiple)
+{
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+struct Range {
+	float min = 0.0f;
+	float max = 0.0f;
+
+	void add(double v) {
+		min = std::min(min, (float)v);
+		max = std::max(max, (float)v);
+	}
+};
+
+}
+
+const char* quantized_kernel_name()
+{
+	return kernel().name;
+}
+
+void QuantizedLayer::quantize_input(const float* input, uint8_t* output) const
+{
+	float inv_scale = 1.0f / input_scale;
+	for (int i = 0; i < input_size; i++) {
+		int32_t q = (int32_t)std::lround(input[i] * inv_scale) + input_zero_point;
+		output[i] = (uint8_t)std::clamp(q, 0, 255);
+	}
+	std::fill(output + input_size, output + padded_input_size, (uint8_t)input_zero_point);
+}
+
+void QuantizedLayer::calculate(const uint8_t* input, float* output) const
+{
+	dot_function dot = kernel().func;
+	for (int node = 0; node < size; node++) {
+		const int8_t* row = &weights[(size_t)node * padded_input_size];
+		int32_t acc = dot(input, row, padded_input_size);
+		acc -= input_zero_point * row_sums[node];
+		float weighted_input = (float)acc * (input_scale * weight_scales[node]) + biases[node];
+		output[node] = weighted_input;
+	}
+	activation_kernels<float>(activation).activate(output, size);
+}
+
+std::vector<double> QuantizedNetwork::calculate(const std::vector<double>& input) const
+{
+	assert(!layers.empty());
+	std::vector<float> activations(input.begin(), input.end());
+	std::vector<uint8_t> quantized;
+	std::vector<float> output;
+	for (const auto& layer : layers) {
+		quantized.resize(layer.padded_input_size);
+		output.resize(layer.size);
+		layer.quantize_input(activations.data(), quantized.data());
+		layer.calculate(quantized.data(), output.data());
+		std::swap(activations, output);
+	}
+	return std::vector<double>(activations.begin(), activations.end());
+}
+
+size_t QuantizedNetwork::weight_bytes() const
+{
+	size_t total = 0;
+	for (const auto& layer : layers) {
+		total += layer.weights.size() * sizeof(int8_t);
+		total += layer.weight_scales.size() * sizeof(float);
+		total += layer.row_sums.size() * sizeof(int32_t);
+		total += layer.biases.size() * sizeof(float);
+	}
+	return total;
+}
+
+QuantizedNetwork Quantizer::quantize(Network& network) const
+{
+	if (!network.is_fully_connected()) {
+		throw std::runtime_error("quantization only supports dense layers");
+	}
+	size_t nlayers = network.layers.size();
+
+	//calibrate the input range of every layer on a strided sample of the training data
+	std::vector<Range> ranges(nlayers);
+	size_t nsamples = std::min(calibration_samples, network.training_data.size());
+	if (nsamples > 0) {
+		size_t stride = network.training_data.size() / nsamples;
+		LayerTrainingData layer_data(network.layers);
+		for (size_t s = 0; s < nsamples; s++) {
+			const auto& input = network.training_data[s * stride].get_input();
+			network.calculate(input, &layer_data);
+			for (auto v : input) {
+				ranges[0].add(v);
+			}
+			for (size_t l = 1; l < nlayers; l++) {
+				for (auto v : layer_data.get_full_output(l - 1)) {
+					ranges[l].add(v);
+				}
+			}
+		}
+	}
+
+	QuantizedNetwork result;
+	result.layers.resize(nlayers);
+	for (size_t l = 0; l < nlayers; l++) {
+		const Layer& layer = network.layers[l];
+		QuantizedLayer& q = result.layers[l];
+		q.input_size = layer.input_size;
+		q.size = layer.size;
+		q.index = layer.index;
+		q.activation = layer.activation;
+		q.padded_input_size = round_up(layer.input_size, ROW_ALIGNMENT);
+
+		//range always contains 0 so the zero point is exact
+		float range = ranges[l].max - ranges[l].min;
+		q.input_scale = range > 0.0f ? range / 255.0f : 1.0f;
+		q.input_zero_point = std::clamp((int32_t)std::lround(-ranges[l].min / q.input_scale), 0, 255);
+
+		std::vector<float> max_abs(layer.size, 0.0f);
+		for (int node = 0; node < layer.size; node++) {
+			for (int i = 0; i < layer.input_size; i++) {
+				max_abs[node] = std::max(max_abs[node], (float)std::abs(layer.weights[node * layer.input_size + i]));
+			}
+		}
+		if (granularity == QuantizationGranularity::PerLayer) {
+			float layer_max = *std::max_element(max_abs.begin(), max_abs.end());
+			std::fill(max_abs.begin(), max_abs.end(), layer_max);
+		}
+
+		q.weights.assign((size_t)layer.size * q.padded_input_size, 0);
+		q.weight_scales.resize(layer.size);
+		q.row_sums.resize(layer.size);
+		q.biases.resize(layer.size);
+		for (int node = 0; node < layer.size; node++) {
+			float scale = max_abs[node] > 0.0f ? max_abs[node] / 127.0f : 1.0f;
+			int32_t row_sum = 0;
+			for (int i = 0; i < layer.input_size; i++) {
+				int32_t w = (int32_t)std::lround(layer.weights[node * layer.input_size + i] / scale);
+				w = std::clamp(w, -127, 127);
+				q.weights[(size_t)node * q.padded_input_size + i] = (int8_t)w;
+				row_sum += w;
+			}
+			q.weight_scales[node] = scale;
+			q.row_sums[node] = row_sum;
+			q.biases[node] = (float)layer.biases[node];
+		}
+		LOG_DEBUG("Quantized layer {}: input scale={} zero point={}", l, q.input_scale, q.input_zero_point);
+	}
+	return result;
+}
+
+QuantizationReport Quantizer::evaluate(Network& network, const QuantizedNetwork& quantized, const std::vector<DataPoint>& data) const
+{
+	QuantizationReport report;
+	size_t float_correct = 0;
+	size_t quantized_correct = 0;
+	for (const auto& point : data) {
+		if (point.is_correct(network.calculate(point.get_input()))) {
+			float_correct++;
+		}
+		if (point.is_correct(quantized.calculate(point.get_input()))) {
+			quantized_correct++;
+		}
+	}
+	report.samples = data.size();
+	if (report.samples > 0) {
+		report.float_accuracy = (double)float_correct / report.samples;
+		report.quantized_accuracy = (double)quantized_correct / report.samples;
+	}
+	report.accuracy_delta = report.quantized_accuracy - report.float_accuracy;
+	for (const auto& layer : network.layers) {
+		report.float_weight_bytes += (layer.weights.size() + layer.biases.size()) * sizeof(double);
+	}
+	report.quantized_weight_bytes = quantized.weight_bytes();
+
+	LOG_DEBUG("Quantization ({} kernel) on {} samples", quantized_kernel_name(), report.samples);
+	LOG_DEBUG("  float accuracy: {}", report.float_accuracy);
+	LOG_DEBUG("  int8 accuracy: {}", report.quantized_accuracy);
+	LOG_DEBUG("  accuracy delta: {}", report.accuracy_delta);
+	LOG_DEBUG("  weight bytes: {} -> {}", report.float_weight_bytes, report.quantized_weight_bytes);
+	return report;
+}
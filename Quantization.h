@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "Network.h"
+
+enum class QuantizationGranularity {
+	PerLayer,
+	PerChannel
+};
+
+class QuantizedLayer {
+public:
+	int input_size;
+	int size;
+	int index;
+	Activation activation = Activation::Sigmoid;
+	//rows are padded to a multiple of 32 bytes for the simd kernels, padding weights are 0
+	int padded_input_size;
+
+	//symmetric int8 weights, one scale per output node (all equal for per-layer)
+	std::vector<int8_t> weights;
+	std::vector<float> weight_scales;
+	//sum of each weight row, used to remove the input zero point from the int32 accumulator
+	std::vector<int32_t> row_sums;
+	std::vector<float> biases;
+
+	//asymmetric uint8 activations coming into this layer
+	float input_scale = 1.0f;
+	int32_t input_zero_point = 0;
+
+	void quantize_input(const float* input, uint8_t* output) const;
+	void calculate(const uint8_t* input, float* output) const;
+};
+
+class QuantizedNetwork {
+public:
+	std::vector<QuantizedLayer> layers;
+
+	std::vector<double> calculate(const std::vector<double>& input) const;
+	size_t weight_bytes() const;
+};
+
+struct QuantizationReport {
+	size_t samples = 0;
+	double float_accuracy = 0.0;
+	double quantized_accuracy = 0.0;
+	double accuracy_delta = 0.0;
+	size_t float_weight_bytes = 0;
+	size_t quantized_weight_bytes = 0;
+};
+
+class Quantizer {
+public:
+	QuantizationGranularity granularity = QuantizationGranularity::PerChannel;
+	//number of training_data samples used to calibrate the activation ranges
+	size_t calibration_samples = 1000;
+
+	QuantizedNetwork quantize(Network& network) const;
+	QuantizationReport evaluate(Network& network, const QuantizedNetwork& quantized, const std::vector<DataPoint>& data) const;
+};
+
+//name of the integer dot product kernel picked for this cpu
+const char* quantized_kernel_name();
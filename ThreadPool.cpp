@@ -3,12 +3,22 @@
 #include <assert.h>
 #include <iostream>
 #include "Logging.h"
+#include "Tracer.h"
 
 void Task::wait_for_complete() {
 	std::unique_lock lock(is_complete_mutex);
 	is_complete_cv.wait(lock, [&] {return _is_complete;});
 }
 
+void Task::reset(batch_function_ref func, size_t index, size_t len) {
+	task = func;
+	data_index = index;
+	data_len = len;
+	counted = false;
+	_thread_index = -1;
+	_is_complete = false;
+}
+
 void Task::mark_complete() {
 	std::unique_lock lock(is_complete_mutex);
 	_is_complete = true;
@@ -44,6 +54,7 @@ ThreadPool::~ThreadPool()
 void ThreadPool::SchedulerLoop(int thread_index)
 {
 	auto& this_worker = _workers.at(thread_index);
+	Tracer::set_thread_name(fmt::format("worker {}", thread_index));
 	while (true) {
 		Task* job = nullptr;
 		{
@@ -57,7 +68,7 @@ void ThreadPool::SchedulerLoop(int thread_index)
 				continue;
 			}
 			job = this_worker.scheduled.front();
-			this_worker.scheduled.pop();
+			this_worker.scheduled.erase(this_worker.scheduled.begin());
 			
 		}
 	
@@ -68,7 +79,17 @@ void ThreadPool::SchedulerLoop(int thread_index)
 		else {
 			LOG_TRACE("starting job {}, {} on thread {}", job->data_index, job->data_len, thread_index);
 			job->set_thread_index(thread_index);
-			job->task(thread_index, job->data_index, job->data_len);
+			{
+				TraceScope trace("task", "threadpool");
+				PerfSample counters_before;
+				bool counted = PerfCounters::read(counters_before);
+				job->task(thread_index, job->data_index, job->data_len);
+				PerfSample counters_after;
+				job->counted = counted && PerfCounters::read(counters_after);
+				if (job->counted) {
+					job->counters = counters_after - counters_before;
+				}
+			}
 			job->mark_complete();
 			LOG_TRACE("job complete on thread {}", thread_index);
 		}
@@ -81,32 +102,43 @@ void ThreadPool::schedule(Task *task, int on_thread)
 
 	auto& worker = _workers.at(on_thread);
 	std::unique_lock my_lock(worker.scheduled_mutex);
-	worker.scheduled.push(task);
+	worker.scheduled.push_back(task);
 	my_lock.unlock();
 	worker.scheduled_signal.notify_all();
 }
 
 
-void ThreadPool::batch_jobs(batch_function& func, size_t data_len)
+void ThreadPool::batch_jobs(batch_function_ref func, size_t data_len)
 {
 	size_t batch_size = data_len /_nthreads + 1;
 	size_t data_index = 0;
-	std::vector<std::unique_ptr<Task>> tasks;
+	//the caller blocks until its tasks complete, so they can be reused by its next batch
+	thread_local std::vector<std::unique_ptr<Task>> task_cache;
+	while (task_cache.size() < _nthreads) {
+		task_cache.push_back(std::make_unique<Task>(func, 0, 0));
+	}
 
 	for (int i = 0; i < _nthreads; i++) {
 
 		size_t len = std::min(batch_size, data_len - data_index);
-		auto task = std::make_unique<Task>(func, data_index, len);
-		schedule(task.get(), i);
+		Task* task = task_cache[i].get();
+		task->reset(func, data_index, len);
+		schedule(task, i);
 
-		tasks.push_back(std::move(task));
 		LOG_TRACE("submitted job {} {}", data_index, len);
 		data_index += len;
 	}
 	assert(data_index == data_len);
-	for (auto &task : tasks) {
+	PerfSample delegated;
+	for (int i = 0; i < _nthreads; i++) {
+		Task* task = task_cache[i].get();
 		LOG_TRACE("waiting on i={}", task->get_thread_index());
 		task->wait_for_complete();
 		LOG_TRACE("i={} complete", task->get_thread_index());
+		if (task->counted) {
+			delegated += task->counters;
+		}
 	}
+	//the caller was blocked in here, so a Timer around this call counts the workers instead
+	PerfCounters::add_delegated(delegated);
 }
@@ -1,9 +1,10 @@
 #pragma once
 #include "util.h"
+#include "PerfCounters.h"
 #include <thread>
-#include <queue>
 #include <mutex>
 #include <condition_variable>
+#include <algorithm>
 
 class Task {
 private:
@@ -11,16 +12,21 @@ private:
 	bool _is_complete = false;
 public:
 	int requested_thread_index = -1;
-	batch_function& task;
+	batch_function_ref task;
 	size_t data_index;
 	size_t data_len;
+	//what the worker's counters moved by while it ran the task, when PerfCounters was enabled
+	bool counted = false;
+	PerfSample counters;
 
 	std::condition_variable is_complete_cv;
 	std::mutex is_complete_mutex;
 
 	Task() = delete;
-	Task(batch_function& func, size_t index, size_t len) :
+	Task(batch_function_ref func, size_t index, size_t len) :
 		task(func), data_index(index), data_len(len) {}
+	//reuses the task for another job once it has completed
+	void reset(batch_function_ref func, size_t index, size_t len);
 
 	bool is_complete() { return _is_complete; }
 	void mark_complete();
@@ -34,7 +40,8 @@ struct Worker {
 	std::thread thread;
 	std::mutex scheduled_mutex;
 	std::condition_variable scheduled_signal;
-	std::queue<Task*> scheduled;
+	//a vector rather than a queue, it only ever holds a few tasks and never gives its memory back
+	std::vector<Task*> scheduled;
 	bool terminate = false;
 };
 
@@ -52,8 +59,12 @@ public:
 	~ThreadPool();
 
 	int nthreads() { return _nthreads; }
+	//leaves two cores for the main and ui threads, but always at least one worker
+	static int default_threads() { return std::max(1, (int)std::thread::hardware_concurrency() - 2); }
 
 	void schedule(Task *task, int on_thread);
-	void batch_jobs(batch_function& task, size_t data_len);
+	//does not allocate once the calling thread has run a batch on a pool this size.
+	//The tasks' hardware counts are added to the calling thread's, see PerfCounters
+	void batch_jobs(batch_function_ref task, size_t data_len);
 
 };
\ No newline at end of file
@@ -1,10 +1,171 @@
 #include "Timer.h"
-#include <iostream>
+#ifndef DISABLE_TIMERS
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include "Logging.h"
+#include "Tracer.h"
 
-std::unordered_map<std::string, double> Timer::total_times;
+namespace {
 
-Timer::Timer(const std::string& name) :
+//8 buckets per power of two, exact below 8ns
+constexpr int SUB_BUCKET_BITS = 3;
+constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+constexpr int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+constexpr size_t MAX_SCOPES = 64;
+
+size_t bucket_index(uint64_t ns)
+{
+	if (ns < SUB_BUCKETS) {
+		return ns;
+	}
+	int exponent = 63 - std::countl_zero(ns);
+	uint64_t sub = (ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+	return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+uint64_t bucket_lower_bound(size_t index)
+{
+	if (index < SUB_BUCKETS) {
+		return index;
+	}
+	int exponent = (int)(index / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+	return (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << (exponent - SUB_BUCKET_BITS);
+}
+
+// Only the owning thread writes a slot so updates are plain relaxed load/store pairs, the
+// atomics are there so a concurrent report reads whole values.
+struct ScopeSlot {
+	std::atomic<const char*> name{ nullptr };
+	std::atomic<uint64_t> calls{ 0 };
+	std::atomic<uint64_t> total_ns{ 0 };
+	std::atomic<uint64_t> max_ns{ 0 };
+	std::atomic<uint64_t> samples{ 0 };
+	std::atomic<uint64_t> counted_calls{ 0 };
+	std::atomic<uint64_t> counted_samples{ 0 };
+	std::atomic<uint64_t> cycles{ 0 };
+	std::atomic<uint64_t> instructions{ 0 };
+	std::atomic<uint64_t> llc_references{ 0 };
+	std::atomic<uint64_t> llc_misses{ 0 };
+	std::atomic<uint64_t> branch_misses{ 0 };
+	std::atomic<uint64_t> allocations{ 0 };
+	std::atomic<uint64_t> allocated_bytes{ 0 };
+	std::atomic<uint32_t> histogram[BUCKETS] = {};
+};
+
+struct ThreadTimes {
+	ScopeSlot slots[MAX_SCOPES];
+	std::atomic<size_t> used{ 0 };
+};
+
+template<typename T>
+void add_relaxed(std::atomic<T>& value, T amount)
+{
+	value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+//buffers are owned here rather than by the thread so they survive pool threads exiting
+std::mutex& registry_mutex()
+{
+	static std::mutex mutex;
+	return mutex;
+}
+
+std::vector<std::unique_ptr<ThreadTimes>>& registry()
+{
+	static std::vector<std::unique_ptr<ThreadTimes>> threads;
+	return threads;
+}
+
+ThreadTimes& local_times()
+{
+	thread_local ThreadTimes* times = nullptr;
+	if (times == nullptr) {
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		registry().push_back(std::make_unique<ThreadTimes>());
+		times = registry().back().get();
+	}
+	return *times;
+}
+
+ScopeSlot& find_slot(const char* name)
+{
+	ThreadTimes& times = local_times();
+	size_t used = times.used.load(std::memory_order_relaxed);
+	ScopeSlot* slot = nullptr;
+	for (size_t i = 0; i < used; i++) {
+		if (times.slots[i].name.load(std::memory_order_relaxed) == name) {
+			slot = &times.slots[i];
+			break;
+		}
+	}
+	if (slot == nullptr) {
+		//a full buffer lumps everything new into the last slot
+		slot = &times.slots[std::min(used, MAX_SCOPES - 1)];
+		if (used < MAX_SCOPES) {
+			slot->name.store(used == MAX_SCOPES - 1 ? "(other)" : name, std::memory_order_relaxed);
+			times.used.store(used + 1, std::memory_order_release);
+		}
+	}
+	return *slot;
+}
+
+//weight is how many calls this one stands for
+void record_call(ScopeSlot* slot, uint64_t ns, uint32_t weight)
+{
+	add_relaxed<uint64_t>(slot->calls, weight);
+	add_relaxed<uint64_t>(slot->total_ns, ns * weight);
+	if (ns > slot->max_ns.load(std::memory_order_relaxed)) {
+		slot->max_ns.store(ns, std::memory_order_relaxed);
+	}
+	add_relaxed<uint32_t>(slot->histogram[bucket_index(ns)], weight);
+}
+
+void record(const char* name, uint64_t ns, uint64_t samples, const PerfSample* counters, const AllocationCounts& allocations)
+{
+	ScopeSlot* slot = &find_slot(name);
+	record_call(slot, ns, 1);
+	add_relaxed<uint64_t>(slot->samples, samples);
+	add_relaxed<uint64_t>(slot->allocations, allocations.allocations);
+	add_relaxed<uint64_t>(slot->allocated_bytes, allocations.bytes);
+	if (counters != nullptr) {
+		add_relaxed<uint64_t>(slot->counted_calls, 1);
+		add_relaxed<uint64_t>(slot->counted_samples, samples);
+		add_relaxed<uint64_t>(slot->cycles, counters->cycles);
+		add_relaxed<uint64_t>(slot->instructions, counters->instructions);
+		add_relaxed<uint64_t>(slot->llc_references, counters->llc_references);
+		add_relaxed<uint64_t>(slot->llc_misses, counters->llc_misses);
+		add_relaxed<uint64_t>(slot->branch_misses, counters->branch_misses);
+	}
+}
+
+uint64_t percentile(const std::vector<uint64_t>& histogram, uint64_t calls, double fraction, uint64_t max_ns)
+{
+	uint64_t target = (uint64_t)(fraction * calls);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < histogram.size(); i++) {
+		seen += histogram[i];
+		if (seen > target) {
+			//upper edge of the bucket, never past the largest sample
+			return std::min(bucket_lower_bound(i + 1), max_ns);
+		}
+	}
+	return max_ns;
+}
+
+}
+
+void KernelTimer::record(const char* name, uint64_t ns)
+{
+	ScopeSlot* slot = &find_slot(name);
+	record_call(slot, ns, KERNEL_TIMER_PERIOD);
+	add_relaxed<uint64_t>(slot->samples, KERNEL_TIMER_PERIOD);
+}
+
+Timer::Timer(const char* name) :
 	_name(name)
 {
 	reset();
@@ -17,29 +178,138 @@ Timer::~Timer()
 
 void Timer::reset()
 {
+	if (_traced && !_has_finalized && Tracer::generation() == _trace_generation) {
+		Tracer::end(_name, "timer");
+	}
 	_has_finalized = false;
-	_started_at = std::chrono::high_resolution_clock::now();
+	_samples = 0;
+	_traced = Tracer::enabled();
+	_trace_generation = Tracer::generation();
+	if (_traced) {
+		Tracer::begin(_name, "timer");
+	}
+	_tracking_allocations = Allocations::timer_tracking();
+	if (_tracking_allocations) {
+		_allocations_at = Allocations::thread_counts();
+	}
+	//the read is a syscall, keep it outside the timed span
+	_counted = PerfCounters::read(_counters_at);
+	_started_at = std::chrono::steady_clock::now();
 }
 
 void Timer::end()
 {
 	if (!_has_finalized) {
 		_has_finalized = true;
-		auto end = std::chrono::high_resolution_clock::now();
-		auto duration = duration_cast<std::chrono::milliseconds>(end - _started_at);
-		//std::cout << "Duration: " << _name << " = " << duration << "\n";
+		auto end = std::chrono::steady_clock::now();
+		PerfSample counters_now;
+		bool counted = _counted && PerfCounters::read(counters_now);
+		PerfSample counters = counters_now - _counters_at;
+		AllocationCounts allocations;
+		if (_tracking_allocations) {
+			allocations = Allocations::thread_counts() - _allocations_at;
+		}
+		record(_name, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - _started_at).count(),
+			_samples > 0 ? _samples : 1, counted ? &counters : nullptr, allocations);
+		if (_traced && Tracer::generation() == _trace_generation) {
+			Tracer::end(_name, "timer");
+		}
+	}
+}
 
-		if (Timer::total_times.find(_name) == Timer::total_times.end()) {
-			Timer::total_times.insert({ _name, 0.0 });
+std::vector<TimerStats> Timer::usage_report()
+{
+	struct Merged {
+		TimerStats stats;
+		std::vector<uint64_t> histogram;
+	};
+	std::vector<Merged> merged;
+
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	for (const auto& times : registry()) {
+		size_t used = times->used.load(std::memory_order_acquire);
+		for (size_t i = 0; i < used; i++) {
+			const ScopeSlot& slot = times->slots[i];
+			const char* name = slot.name.load(std::memory_order_relaxed);
+			//the same literal can have a different address in each translation unit
+			auto it = std::find_if(merged.begin(), merged.end(), [&](const Merged& m) { return m.stats.name == name; });
+			if (it == merged.end()) {
+				merged.push_back({ TimerStats(), std::vector<uint64_t>(BUCKETS, 0) });
+				it = merged.end() - 1;
+				it->stats.name = name;
+			}
+			it->stats.calls += slot.calls.load(std::memory_order_relaxed);
+			it->stats.total_ns += slot.total_ns.load(std::memory_order_relaxed);
+			it->stats.max_ns = std::max(it->stats.max_ns, slot.max_ns.load(std::memory_order_relaxed));
+			it->stats.samples += slot.samples.load(std::memory_order_relaxed);
+			it->stats.counted_calls += slot.counted_calls.load(std::memory_order_relaxed);
+			it->stats.counted_samples += slot.counted_samples.load(std::memory_order_relaxed);
+			it->stats.allocations += slot.allocations.load(std::memory_order_relaxed);
+			it->stats.allocated_bytes += slot.allocated_bytes.load(std::memory_order_relaxed);
+			it->stats.counters += { slot.cycles.load(std::memory_order_relaxed), slot.instructions.load(std::memory_order_relaxed),
+				slot.llc_references.load(std::memory_order_relaxed), slot.llc_misses.load(std::memory_order_relaxed),
+				slot.branch_misses.load(std::memory_order_relaxed) };
+			for (size_t b = 0; b < BUCKETS; b++) {
+				it->histogram[b] += slot.histogram[b].load(std::memory_order_relaxed);
+			}
 		}
-		Timer::total_times[_name] += (double)duration.count();		
 	}
+
+	std::vector<TimerStats> res;
+	for (auto& m : merged) {
+		m.stats.p50_ns = percentile(m.histogram, m.stats.calls, 0.5, m.stats.max_ns);
+		m.stats.p99_ns = percentile(m.histogram, m.stats.calls, 0.99, m.stats.max_ns);
+		res.push_back(m.stats);
+	}
+	std::sort(res.begin(), res.end(), [](const TimerStats& a, const TimerStats& b) { return a.total_ns > b.total_ns; });
+	return res;
 }
 
 void Timer::print_usage_report()
 {
-	LOG_DEBUG("Usages:")
-	for (auto& item : total_times) {
-		LOG_DEBUG("{}: {}ms", item.first, item.second);
+	LOG_DEBUG("Usages:");
+	for (const auto& stats : usage_report()) {
+		LOG_DEBUG("{}: {:.3f}ms over {} calls, p50 {}ns p99 {}ns max {}ns",
+			stats.name, stats.total_ns / 1e6, stats.calls, stats.p50_ns, stats.p99_ns, stats.max_ns);
+		if (stats.allocations > 0) {
+			LOG_DEBUG("    {} allocations ({:.1f} per call), {} bytes", stats.allocations, (double)stats.allocations / stats.calls, stats.allocated_bytes);
+		}
+		if (stats.counted_calls > 0) {
+			//bandwidth is only meaningful when every call was counted
+			double seconds = stats.total_ns / 1e9;
+			LOG_DEBUG("    IPC {:.2f}, {:.1f} LLC misses/sample ({:.1f}% of refs), {:.1f} branch misses/sample, ~{:.2f} GB/s from memory",
+				stats.counters.ipc(), stats.misses_per_sample(),
+				stats.counters.llc_references > 0 ? 100.0 * stats.counters.llc_misses / stats.counters.llc_references : 0.0,
+				stats.branch_misses_per_sample(),
+				stats.counted_calls == stats.calls && seconds > 0.0 ? stats.counters.memory_bytes() / seconds / 1e9 : 0.0);
+		}
+	}
+}
+
+void Timer::clear()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	for (auto& times : registry()) {
+		for (auto& slot : times->slots) {
+			slot.name.store(nullptr, std::memory_order_relaxed);
+			slot.calls.store(0, std::memory_order_relaxed);
+			slot.total_ns.store(0, std::memory_order_relaxed);
+			slot.max_ns.store(0, std::memory_order_relaxed);
+			slot.samples.store(0, std::memory_order_relaxed);
+			slot.counted_calls.store(0, std::memory_order_relaxed);
+			slot.counted_samples.store(0, std::memory_order_relaxed);
+			slot.cycles.store(0, std::memory_order_relaxed);
+			slot.instructions.store(0, std::memory_order_relaxed);
+			slot.llc_references.store(0, std::memory_order_relaxed);
+			slot.llc_misses.store(0, std::memory_order_relaxed);
+			slot.branch_misses.store(0, std::memory_order_relaxed);
+			slot.allocations.store(0, std::memory_order_relaxed);
+			slot.allocated_bytes.store(0, std::memory_order_relaxed);
+			for (auto& bucket : slot.histogram) {
+				bucket.store(0, std::memory_order_relaxed);
+			}
+		}
+		times->used.store(0, std::memory_order_release);
 	}
-}
\ No newline at end of file
+}
+#endif
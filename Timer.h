@@ -1,20 +1,114 @@
 #pragma once
 
 #include <chrono>
-#include <unordered_map>
+#include <cstdint>
 #include <string>
+#include <vector>
+#include "PerfCounters.h"
+#include "Allocations.h"
 
+//compiles every Timer down to nothing, also set by the DISABLE_TIMERS cmake option
+//#define DISABLE_TIMERS
+
+struct TimerStats {
+	std::string name;
+	uint64_t calls = 0;
+	uint64_t total_ns = 0;
+	//from a log-linear histogram, within 1/8 of the true value
+	uint64_t p50_ns = 0;
+	uint64_t p99_ns = 0;
+	uint64_t max_ns = 0;
+	//work items the calls covered, see Timer::add_samples
+	uint64_t samples = 0;
+	//hardware counter totals over the calls that ran while PerfCounters was enabled
+	uint64_t counted_calls = 0;
+	//samples of just those calls, so the per sample figures divide like by like
+	uint64_t counted_samples = 0;
+	PerfSample counters;
+	//made on the scope's own thread while Allocations::timer_tracking() was on
+	uint64_t allocations = 0;
+	uint64_t allocated_bytes = 0;
+
+	double misses_per_sample() const { return counted_samples > 0 ? (double)counters.llc_misses / counted_samples : 0.0; }
+	double branch_misses_per_sample() const { return counted_samples > 0 ? (double)counters.branch_misses / counted_samples : 0.0; }
+};
+
+//prime, so scopes that take turns in a fixed pattern are all sampled by KernelTimer
+constexpr uint32_t KERNEL_TIMER_PERIOD = 61;
+
+#ifndef DISABLE_TIMERS
+// Scoped timer that is safe to use on ThreadPool workers. Each thread records into its own
+// preallocated buffer without locking and the buffers are merged by name when a report is
+// asked for. name must outlive the program, in practice a string literal.
 class Timer {
 private:
-	std::chrono::time_point<std::chrono::high_resolution_clock> _started_at;
+	std::chrono::steady_clock::time_point _started_at;
 	bool _has_finalized = false;
-	std::string _name;
-	static std::unordered_map<std::string, double> total_times;
+	//set when the scope began while the Tracer was on, the end event is only written to the same trace
+	bool _traced = false;
+	uint32_t _trace_generation = 0;
+	bool _counted = false;
+	uint64_t _samples = 0;
+	PerfSample _counters_at;
+	bool _tracking_allocations = false;
+	AllocationCounts _allocations_at;
+	const char* _name;
 public:
-	Timer(const std::string &name);
+	Timer(const char* name);
 	~Timer();
 	void reset();
 	void end();
-	
+	//how many samples (or other work items) this scope handles, 1 if never called
+	void add_samples(uint64_t count) { _samples += count; }
+
+	static std::vector<TimerStats> usage_report();
 	static void print_usage_report();
+	//forgets everything recorded, only call while no timer is running
+	static void clear();
+};
+
+// Timer for scopes inside the per-sample kernels. Only one call in KERNEL_TIMER_PERIOD on each
+// thread reads the clock, the others cost a thread local decrement. A timed call stands in for
+// the whole period in the report, so calls and totals are estimates, and it skips the Tracer,
+// perf counters and allocation tracking that a Timer pays for. Reported with the Timers.
+class KernelTimer {
+private:
+	inline static thread_local uint32_t _countdown = 1;
+	const char* _name;
+	bool _timed;
+	std::chrono::steady_clock::time_point _started_at;
+
+	static void record(const char* name, uint64_t ns);
+public:
+	KernelTimer(const char* name) : _name(name), _timed(--_countdown == 0) {
+		if (_timed) {
+			_countdown = KERNEL_TIMER_PERIOD;
+			_started_at = std::chrono::steady_clock::now();
+		}
+	}
+	~KernelTimer() {
+		if (_timed) {
+			record(_name, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _started_at).count());
+		}
+	}
+	KernelTimer(const KernelTimer&) = delete;
+	KernelTimer& operator=(const KernelTimer&) = delete;
+};
+#else
+class Timer {
+public:
+	Timer(const char*) {}
+	void reset() {}
+	void end() {}
+	void add_samples(uint64_t) {}
+
+	static std::vector<TimerStats> usage_report() { return {}; }
+	static void print_usage_report() {}
+	static void clear() {}
+};
+
+class KernelTimer {
+public:
+	KernelTimer(const char*) {}
 };
+#endif
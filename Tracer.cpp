@@ -0,0 +1,183 @@
+#include "Tracer.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <fmt/core.h>
+
+std::atomic<bool> Tracer::_enabled{ false };
+std::atomic<uint32_t> Tracer::_generation{ 0 };
+
+namespace {
+
+struct TraceEvent {
+	const char* name;
+	const char* category;
+	uint64_t ts_ns;
+	char phase;
+};
+
+//written only by its thread, read by write() once tracing has stopped
+struct ThreadTrace {
+	int tid;
+	std::string name;
+	//never replaced, a scope left open across stop() may still be writing to it
+	std::unique_ptr<TraceEvent[]> events;
+	size_t allocated = 0;
+	//at most allocated, lowered by start() for smaller traces
+	std::atomic<size_t> capacity{ 0 };
+	std::atomic<size_t> count{ 0 };
+	std::atomic<size_t> dropped{ 0 };
+};
+
+struct TraceState {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ThreadTrace>> threads;
+	size_t events_per_thread = 1 << 16;
+	std::chrono::steady_clock::time_point started_at = std::chrono::steady_clock::now();
+};
+
+TraceState& state()
+{
+	static TraceState s;
+	return s;
+}
+
+thread_local ThreadTrace* local_trace = nullptr;
+thread_local std::string local_thread_name;
+
+ThreadTrace& thread_trace()
+{
+	if (local_trace == nullptr) {
+		TraceState& s = state();
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto trace = std::make_unique<ThreadTrace>();
+		trace->tid = (int)s.threads.size() + 1;
+		trace->name = local_thread_name.empty() ? fmt::format("thread {}", trace->tid) : local_thread_name;
+		trace->events = std::make_unique<TraceEvent[]>(s.events_per_thread);
+		trace->allocated = s.events_per_thread;
+		trace->capacity.store(s.events_per_thread, std::memory_order_relaxed);
+		local_trace = trace.get();
+		s.threads.push_back(std::move(trace));
+	}
+	return *local_trace;
+}
+
+void record(const char* name, const char* category, char phase)
+{
+	ThreadTrace& trace = thread_trace();
+	size_t count = trace.count.load(std::memory_order_relaxed);
+	if (count >= trace.capacity.load(std::memory_order_relaxed)) {
+		trace.dropped.store(trace.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+	auto now = std::chrono::steady_clock::now() - state().started_at;
+	trace.events[count] = { name, category, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(), phase };
+	trace.count.store(count + 1, std::memory_order_release);
+}
+
+std::string escape(const std::string& value)
+{
+	std::string res;
+	for (char c : value) {
+		if (c == '"' || c == '\\') {
+			res += '\\';
+		}
+		res += c;
+	}
+	return res;
+}
+
+}
+
+void Tracer::start(size_t events_per_thread)
+{
+	TraceState& s = state();
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		s.events_per_thread = events_per_thread;
+		for (auto& trace : s.threads) {
+			trace->capacity.store(std::min(events_per_thread, trace->allocated), std::memory_order_relaxed);
+			trace->count.store(0, std::memory_order_relaxed);
+			trace->dropped.store(0, std::memory_order_relaxed);
+		}
+		s.started_at = std::chrono::steady_clock::now();
+	}
+	//scopes still open from the last trace stop recording into this one
+	_generation.fetch_add(1, std::memory_order_release);
+	//allocate the caller's buffer now rather than inside the first traced scope
+	thread_trace();
+	_enabled.store(true, std::memory_order_release);
+}
+
+void Tracer::stop()
+{
+	_enabled.store(false, std::memory_order_release);
+	_generation.fetch_add(1, std::memory_order_release);
+}
+
+void Tracer::begin(const char* name, const char* category)
+{
+	record(name, category, 'B');
+}
+
+void Tracer::end(const char* name, const char* category)
+{
+	record(name, category, 'E');
+}
+
+void Tracer::instant(const char* name, const char* category)
+{
+	if (enabled()) {
+		record(name, category, 'i');
+	}
+}
+
+void Tracer::set_thread_name(const std::string& name)
+{
+	local_thread_name = name;
+	if (local_trace != nullptr) {
+		std::lock_guard<std::mutex> lock(state().mutex);
+		local_trace->name = name;
+	}
+}
+
+void Tracer::write(const std::string& path)
+{
+	std::ofstream file(path);
+	if (file.fail()) {
+		throw std::runtime_error("failed to open trace file " + path);
+	}
+
+	TraceState& s = state();
+	std::lock_guard<std::mutex> lock(s.mutex);
+	file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	bool first = true;
+	for (const auto& trace : s.threads) {
+		file << (first ? "" : ",\n") << fmt::format(
+			"{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":\"{}\"}}}}", trace->tid, escape(trace->name));
+		first = false;
+		size_t count = trace->count.load(std::memory_order_acquire);
+		for (size_t i = 0; i < count; i++) {
+			const TraceEvent& e = trace->events[i];
+			//ts is in microseconds, keep the nanoseconds as decimals
+			file << fmt::format(",\n{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"{}\",\"ts\":{}.{:03},\"pid\":1,\"tid\":{}{}}}",
+				escape(e.name), escape(e.category), e.phase, e.ts_ns / 1000, e.ts_ns % 1000, trace->tid, e.phase == 'i' ? ",\"s\":\"t\"" : "");
+		}
+	}
+	file << "\n]}\n";
+}
+
+size_t Tracer::dropped_events()
+{
+	TraceState& s = state();
+	std::lock_guard<std::mutex> lock(s.mutex);
+	size_t dropped = 0;
+	for (const auto& trace : s.threads) {
+		dropped += trace->dropped.load(std::memory_order_relaxed);
+	}
+	return dropped;
+}
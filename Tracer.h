@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Timeline of begin/end events for chrome://tracing or ui.perfetto.dev. Every thread records
+// into its own buffer, allocated once at full size on its first event and kept for the life of
+// the thread, so recording takes no locks and never grows. Off until start(), while off each
+// hook is a single relaxed load.
+class Tracer {
+private:
+	static std::atomic<bool> _enabled;
+	static std::atomic<uint32_t> _generation;
+public:
+	//drops anything recorded before. A thread that already has a buffer keeps it, so
+	//events_per_thread can lower its limit but not raise it past the first allocation
+	static void start(size_t events_per_thread = 1 << 16);
+	static void stop();
+	static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+	//changes on every start and stop, a scope only ends in the trace it began in
+	static uint32_t generation() { return _generation.load(std::memory_order_acquire); }
+
+	//name and category must outlive the tracer, in practice string literals
+	static void begin(const char* name, const char* category);
+	static void end(const char* name, const char* category);
+	static void instant(const char* name, const char* category);
+	//labels the calling thread in the trace
+	static void set_thread_name(const std::string& name);
+
+	//writes the Chrome trace event json, call after stop
+	static void write(const std::string& path);
+	//events lost to full buffers since start
+	static size_t dropped_events();
+};
+
+class TraceScope {
+private:
+	const char* _name;
+	const char* _category;
+	bool _active;
+	uint32_t _generation;
+public:
+	TraceScope(const char* name, const char* category) :
+		_name(name), _category(category), _active(Tracer::enabled()), _generation(Tracer::generation()) {
+		if (_active) {
+			Tracer::begin(_name, _category);
+		}
+	}
+	~TraceScope() {
+		if (_active && Tracer::generation() == _generation) {
+			Tracer::end(_name, _category);
+		}
+	}
+};
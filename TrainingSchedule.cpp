@@ -0,0 +1,67 @@
+#include "TrainingSchedule.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+constexpr double PI = 3.14159265358979323846;
+
+double cosine_anneal(double from, double to, double t)
+{
+	t = std::clamp(t, 0.0, 1.0);
+	return to + (from - to) * 0.5 * (1.0 + std::cos(PI * t));
+}
+}
+
+double StepSchedule::rate(double base_rate, double epoch) const
+{
+	size_t steps = (size_t)epoch / std::max<size_t>(_step_epochs, 1);
+	return base_rate * std::pow(_gamma, (double)steps);
+}
+
+CosineSchedule::CosineSchedule(size_t total_epochs, double min_rate) :
+	_total_epochs((double)total_epochs), _min_rate(min_rate)
+{
+	if (total_epochs == 0) {
+		throw std::runtime_error("CosineSchedule needs at least one epoch");
+	}
+}
+
+double CosineSchedule::rate(double base_rate, double epoch) const
+{
+	return cosine_anneal(base_rate, _min_rate, epoch / _total_epochs);
+}
+
+OneCycleSchedule::OneCycleSchedule(size_t total_epochs, double max_factor, double warmup_fraction, double final_factor) :
+	_total_epochs((double)total_epochs), _max_factor(max_factor), _warmup_fraction(warmup_fraction), _final_factor(final_factor)
+{
+	if (total_epochs == 0) {
+		throw std::runtime_error("OneCycleSchedule needs at least one epoch");
+	}
+	//both phases divide by their length
+	if (!(warmup_fraction > 0.0 && warmup_fraction < 1.0)) {
+		throw std::runtime_error("OneCycleSchedule warmup_fraction has to be between 0 and 1");
+	}
+}
+
+double OneCycleSchedule::rate(double base_rate, double epoch) const
+{
+	double t = std::clamp(epoch / _total_epochs, 0.0, 1.0);
+	double max_rate = base_rate * _max_factor;
+	if (t < _warmup_fraction) {
+		return base_rate + (max_rate - base_rate) * (t / _warmup_fraction);
+	}
+	return cosine_anneal(max_rate, base_rate * _final_factor, (t - _warmup_fraction) / (1.0 - _warmup_fraction));
+}
+
+const char* to_string(StopReason reason)
+{
+	switch (reason) {
+	case StopReason::None: return "none";
+	case StopReason::TargetAccuracy: return "target accuracy";
+	case StopReason::Plateau: return "plateau";
+	case StopReason::MaxEpochs: return "max epochs";
+	case StopReason::TimeBudget: return "time budget";
+	}
+	return "unknown";
+}
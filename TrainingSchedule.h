@@ -0,0 +1,75 @@
+#pragma once
+#include <cstddef>
+
+class LearningRateSchedule {
+public:
+	virtual ~LearningRateSchedule() = default;
+	//epoch is fractional, e.g. 2.5 is halfway through the third epoch
+	virtual double rate(double base_rate, double epoch) const = 0;
+};
+
+class ConstantSchedule : public LearningRateSchedule {
+public:
+	double rate(double base_rate, double /*epoch*/) const override { return base_rate; }
+};
+
+//multiplies the rate by gamma every step_epochs epochs
+class StepSchedule : public LearningRateSchedule {
+private:
+	size_t _step_epochs;
+	double _gamma;
+public:
+	StepSchedule(size_t step_epochs, double gamma = 0.1) : _step_epochs(step_epochs), _gamma(gamma) {}
+	double rate(double base_rate, double epoch) const override;
+};
+
+//cosine decay from base_rate to min_rate over total_epochs, which has to be at least 1
+class CosineSchedule : public LearningRateSchedule {
+private:
+	double _total_epochs;
+	double _min_rate;
+public:
+	CosineSchedule(size_t total_epochs, double min_rate = 0.0);
+	double rate(double base_rate, double epoch) const override;
+};
+
+//linear warmup to base_rate * max_factor, then cosine annealing down to base_rate * final_factor.
+//total_epochs has to be at least 1 and warmup_fraction strictly between 0 and 1
+class OneCycleSchedule : public LearningRateSchedule {
+private:
+	double _total_epochs;
+	double _max_factor;
+	double _warmup_fraction;
+	double _final_factor;
+public:
+	OneCycleSchedule(size_t total_epochs, double max_factor = 10.0, double warmup_fraction = 0.3, double final_factor = 0.01);
+	double rate(double base_rate, double epoch) const override;
+};
+
+//any criterion left at 0 is disabled, CPUTrainer::train needs at least one that can end it
+struct StopCriteria {
+	//an early exit only, a network that never reaches it would train forever
+	double target_accuracy = 0.0;
+	//evaluations without at least min_improvement in accuracy before giving up
+	size_t patience = 0;
+	double min_improvement = 0.001;
+	size_t max_epochs = 0;
+	double max_seconds = 0.0;
+	//run the accuracy check every n epochs
+	size_t validation_interval = 1;
+
+	//false when nothing set is guaranteed to stop training
+	bool bounded() const {
+		return (patience > 0 && min_improvement > 0.0) || max_epochs > 0 || max_seconds > 0.0;
+	}
+};
+
+enum class StopReason {
+	None,
+	TargetAccuracy,
+	Plateau,
+	MaxEpochs,
+	TimeBudget
+};
+
+const char* to_string(StopReason reason);
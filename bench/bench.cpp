@@ -0,0 +1,225 @@
+#include <benchmark/benchmark.h>
+
+#include "../networks/mnist.h"
+#include "../gpu/GPUNetwork.h"
+#include "../CPUTrainer.h"
+#include "../ThreadPool.h"
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+
+// Run with --benchmark_out=bench.json --benchmark_out_format=json (or build the bench_json
+// target) to keep results for comparing releases. Everything runs on synthetic data.
+
+namespace {
+
+//784 -> hidden -> 10 like MNISTNetwork, filled with deterministic fake samples
+class BenchNetwork : public Network {
+public:
+	int hidden_size;
+	size_t samples;
+
+	BenchNetwork(int hidden, size_t nsamples) : hidden_size(hidden), samples(nsamples) {
+		build();
+		load_data();
+	}
+
+	void build() override {
+		layers.resize(2);
+		layers[0].input_size = 28 * 28;
+		layers[0].size = hidden_size;
+		layers[0].init();
+		layers[1].input_size = hidden_size;
+		layers[1].size = 10;
+		layers[1].activation = Activation::Softmax;
+		layers[1].init();
+		loss = Loss::CrossEntropy;
+		for (int i = 0; i < layers.size(); i++) {
+			layers[i].index = i;
+		}
+	}
+
+	void load_data() override {
+		training_data.resize(samples, {});
+		for (size_t s = 0; s < samples; s++) {
+			DataPoint& point = training_data[s];
+			for (int i = 0; i < layers[0].input_size; i++) {
+				point.data.push_back(0.5 + 0.5 * std::sin((double)(s * 7919 + i)));
+			}
+			point.label = s % 10;
+			point.set_expected_from_label(10);
+		}
+	}
+};
+
+void write_big_endian(std::ofstream& file, uint32_t value)
+{
+	uint8_t bytes[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+	file.write((const char*)bytes, 4);
+}
+
+//writes idx files in the MNIST layout and returns the directory, with a trailing slash
+std::string write_synthetic_mnist(size_t count)
+{
+	auto dir = std::filesystem::temp_directory_path() / ("ml_bench_mnist_" + std::to_string(count));
+	std::filesystem::create_directories(dir);
+
+	std::ofstream labels(dir / "train-labels.idx1-ubyte", std::ios::binary);
+	write_big_endian(labels, 0x801);
+	write_big_endian(labels, (uint32_t)count);
+	std::ofstream images(dir / "train-images.idx3-ubyte", std::ios::binary);
+	write_big_endian(images, 0x803);
+	write_big_endian(images, (uint32_t)count);
+	write_big_endian(images, 28);
+	write_big_endian(images, 28);
+	std::vector<char> pixels(28 * 28);
+	for (size_t i = 0; i < count; i++) {
+		labels.put((char)(i % 10));
+		for (size_t p = 0; p < pixels.size(); p++) {
+			pixels[p] = (char)((i * 31 + p * 7) & 0xff);
+		}
+		images.write(pixels.data(), pixels.size());
+	}
+	return dir.string() + "/";
+}
+
+void set_flops(benchmark::State& state, double flops_per_iteration)
+{
+	state.counters["FLOPS"] = benchmark::Counter(flops_per_iteration, benchmark::Counter::kIsIterationInvariantRate);
+}
+
+}
+
+static void BM_LayerCalculate(benchmark::State& state)
+{
+	Layer layer;
+	layer.input_size = (int)state.range(0);
+	layer.size = (int)state.range(1);
+	layer.index = 0;
+	layer.init();
+	std::vector<double> input(layer.input_size, 0.5);
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(layer.calculate(input, nullptr));
+	}
+	set_flops(state, 2.0 * layer.input_size * layer.size);
+}
+BENCHMARK(BM_LayerCalculate)->Args({ 784, 300 })->Args({ 300, 10 })->Args({ 784, 1024 })->Args({ 1024, 1024 });
+
+static void BM_CalculateDeltas(benchmark::State& state)
+{
+	BenchNetwork n((int)state.range(0), 1);
+	CPUTrainer trainer(n, 1);
+	LayerTrainingData layer_data(n.layers);
+	const auto& point = n.training_data[0];
+	n.calculate(point.get_input(), &layer_data);
+	for (auto _ : state) {
+		trainer.calculate_deltas(point.get_input(), point.get_expected(), layer_data);
+		benchmark::ClobberMemory();
+	}
+}
+BENCHMARK(BM_CalculateDeltas)->Arg(100)->Arg(300)->Arg(1024);
+
+//args: hidden size, batch size, threads, execution plan
+static void BM_ProcessBatch(benchmark::State& state)
+{
+	BenchNetwork n((int)state.range(0), (size_t)state.range(1));
+	n.batch_size = (int)state.range(1);
+	CPUTrainer trainer(n, (int)state.range(2));
+	if (state.range(3)) {
+		trainer.set_execution_plan(true);
+	}
+	Gradients gradients(n.layers);
+	for (auto _ : state) {
+		gradients.reset();
+		trainer.process_batch(0, n.batch_size, &gradients);
+	}
+	state.SetItemsProcessed(state.iterations() * n.batch_size);
+	//forward, backward and weight gradients, ~3 multiply-adds per weight per sample
+	set_flops(state, 6.0 * (n.layers[0].weights.size() + n.layers[1].weights.size()) * n.batch_size);
+}
+BENCHMARK(BM_ProcessBatch)->ArgsProduct({ { 300, 1024 }, { 32, 128 }, { 1, 2, 4, 8 }, { 0, 1 } })->UseRealTime();
+
+//args: hidden size, threads
+static void BM_GradientReduction(benchmark::State& state)
+{
+	BenchNetwork n((int)state.range(0), 1);
+	CPUTrainer trainer(n, (int)state.range(1));
+	Gradients gradients(n.layers);
+	//sets up the per-thread gradients
+	trainer.process_batch(0, 1, &gradients);
+	for (auto _ : state) {
+		trainer.reduce_thread_gradients(&gradients);
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(1) * (n.layers[0].weights.size() + n.layers[1].weights.size()) * sizeof(double));
+}
+BENCHMARK(BM_GradientReduction)->ArgsProduct({ { 300, 1024 }, { 1, 2, 4, 8 } })->UseRealTime();
+
+//args: threads, items. The task does nothing so this is pure dispatch and wakeup cost
+static void BM_BatchJobs(benchmark::State& state)
+{
+	ThreadPool pool((int)state.range(0));
+	batch_function task = [](size_t thread_index, size_t start, size_t count) {
+		benchmark::DoNotOptimize(count);
+	};
+	for (auto _ : state) {
+		pool.batch_jobs(task, (size_t)state.range(1));
+	}
+}
+BENCHMARK(BM_BatchJobs)->ArgsProduct({ { 1, 2, 4, 8 }, { 1, 1024 } })->UseRealTime();
+
+static void BM_MNISTLoadData(benchmark::State& state)
+{
+	std::string root = write_synthetic_mnist((size_t)state.range(0));
+	for (auto _ : state) {
+		MNISTNetwork n;
+		n.data_root = root;
+		n.load_data();
+		benchmark::DoNotOptimize(n.training_data.data());
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	std::filesystem::remove_all(root);
+}
+BENCHMARK(BM_MNISTLoadData)->Arg(1000)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+//args: hidden size. Runs on whatever device Context picks, lavapipe on a machine without a gpu
+static void BM_GPUCalculate(benchmark::State& state)
+{
+	BenchNetwork n((int)state.range(0), 1);
+	GPUNetwork g;
+	try {
+		g.init(n);
+	}
+	catch (const std::exception& e) {
+		state.SkipWithError(e.what());
+		return;
+	}
+	g.setup_calculate_only_pipeline(n);
+	std::vector<float> output, activations, deltas;
+	for (auto _ : state) {
+		g.calculate({ &n.training_data[0].data, &n.training_data[0].expected, &output, &activations, &deltas });
+	}
+	g.destroy();
+}
+BENCHMARK(BM_GPUCalculate)->Arg(300)->Arg(1024)->UseRealTime();
+
+static void BM_GPUTrainingStep(benchmark::State& state)
+{
+	BenchNetwork n((int)state.range(0), 1);
+	GPUNetwork g;
+	try {
+		g.init(n);
+	}
+	catch (const std::exception& e) {
+		state.SkipWithError(e.what());
+		return;
+	}
+	g.setup_calculate_and_gradients_pipeline(n);
+	std::vector<float> output, activations, deltas;
+	for (auto _ : state) {
+		g.training_step({ &n.training_data[0].data, &n.training_data[0].expected, &output, &activations, &deltas });
+	}
+	g.destroy();
+}
+BENCHMARK(BM_GPUTrainingStep)->Arg(300)->Arg(1024)->UseRealTime();
+
+BENCHMARK_MAIN();
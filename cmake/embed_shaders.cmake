@@ -0,0 +1,27 @@
+# Run with cmake -P. Writes OUTPUT, a source file holding every SPIR-V binary listed in
+# SHADER_LIST as a uint32_t array plus the EMBEDDED_SHADERS table declared in HEADER.
+file(READ "${SHADER_LIST}" shaders)
+set(arrays "")
+set(table "")
+set(index 0)
+foreach(shader ${shaders})
+  get_filename_component(name "${shader}" NAME_WE)
+  file(READ "${shader}" hex HEX)
+  # glslc writes the words in host byte order, which is little endian everywhere we build
+  string(REGEX REPLACE "([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])" "0x\\4\\3\\2\\1," words "${hex}")
+  string(LENGTH "${hex}" length)
+  math(EXPR size "${length} / 2")
+  string(APPEND arrays "static const uint32_t shader_${index}[] = {${words}};\n")
+  string(APPEND table "\t{ \"${name}\", shader_${index}, ${size} },\n")
+  math(EXPR index "${index} + 1")
+endforeach()
+
+file(WRITE "${OUTPUT}.tmp"
+  "// Generated from gpu/assets by cmake/embed_shaders.cmake, do not edit\n"
+  "#include \"${HEADER}\"\n\n"
+  "${arrays}\n"
+  "const EmbeddedShader EMBEDDED_SHADERS[] = {\n${table}};\n"
+  "const size_t EMBEDDED_SHADER_COUNT = ${index};\n")
+# only touch the output when a shader changed so ML is not rebuilt for nothing
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different "${OUTPUT}.tmp" "${OUTPUT}")
+file(REMOVE "${OUTPUT}.tmp")
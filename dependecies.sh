@@ -2,4 +2,5 @@
 vcpkg install nlohmann-json:x64-linux
 vcpkg install GTest:x64-linux
 vcpkg install matplotlib-cpp:x64-linux
-vcpkg install fmt:x64-linux
\ No newline at end of file
+vcpkg install fmt:x64-linux
+vcpkg install benchmark:x64-linux
\ No newline at end of file
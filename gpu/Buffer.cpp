@@ -1,9 +1,17 @@
 #include "Buffer.h"
+#include "../Tracer.h"
 
-Buffer Buffer::create(Context& context, vk::BufferUsageFlags usageFlags, vk::MemoryPropertyFlags memoryPropertyFlags, vk::DeviceSize size)
+Buffer Buffer::create(Context& context, vk::BufferUsageFlags usageFlags, vk::MemoryPropertyFlags memoryPropertyFlags, vk::DeviceSize size, bool shared_with_transfer)
 {
 	// Create the buffer handle	
 	vk::BufferCreateInfo bufferCreateInfo({}, size, usageFlags, vk::SharingMode::eExclusive);
+	//concurrent sharing saves ownership transfers between the compute and transfer families
+	std::vector<uint32_t> families = context.queue_families();
+	if (shared_with_transfer && families.size() > 1) {
+		bufferCreateInfo.sharingMode = vk::SharingMode::eConcurrent;
+		bufferCreateInfo.queueFamilyIndexCount = (uint32_t)families.size();
+		bufferCreateInfo.pQueueFamilyIndices = families.data();
+	}
 	vk::Buffer buffer = context.device.createBuffer(bufferCreateInfo);
 
 	if (buffer == (vk::Buffer)nullptr) {
@@ -37,29 +45,45 @@ Buffer Buffer::create(Context& context, vk::BufferUsageFlags usageFlags, vk::Mem
 	res.buffer = buffer;
 	res.memory = memory;
 	res.size = size;
+
+	//mapping once instead of per transfer, freeing the memory unmaps it
+	if (memoryPropertyFlags & vk::MemoryPropertyFlagBits::eHostVisible) {
+		res.mapped = context.device.mapMemory(memory, 0, VK_WHOLE_SIZE);
+	}
 	
 	return res;
 }
 
 void Buffer::store(void* data, vk::DeviceSize data_len, bool flush) {
 	if (data != nullptr) {
-		void* mapped = context->device.mapMemory(memory, 0, size);
 		memcpy(mapped, data, data_len);
 		if (flush) {
-			vk::MappedMemoryRange mappedRange(memory, 0, VK_WHOLE_SIZE);
-			context->device.flushMappedMemoryRanges(1, &mappedRange);
+			this->flush();
 		}
-		context->device.unmapMemory(memory);
 	}
 }
 
 void Buffer::read_back(void* dest, vk::DeviceSize data_len) {
-	void* mapped = context->device.mapMemory(memory, 0, data_len);
+	invalidate();
+	memcpy(dest, mapped, data_len);
+}
+
+void Buffer::flush() {
+	vk::MappedMemoryRange mappedRange(memory, 0, VK_WHOLE_SIZE);
+	context->device.flushMappedMemoryRanges(1, &mappedRange);
+}
+
+void Buffer::invalidate() {
 	vk::MappedMemoryRange mappedRange(memory, 0, VK_WHOLE_SIZE);
 	context->device.invalidateMappedMemoryRanges(1, &mappedRange);
+}
 
-	memcpy(dest, mapped, data_len);
-	context->device.unmapMemory(memory);
+void Buffer::destroy() {
+	context->device.destroyBuffer(buffer);
+	context->device.freeMemory(memory);
+	buffer = nullptr;
+	memory = nullptr;
+	mapped = nullptr;
 }
 
 void HostDeviceBufferPair::init(Context* ctx, vk::DeviceSize size)
@@ -98,6 +122,7 @@ void HostDeviceBufferPair::store(void* data, vk::DeviceSize len)
 	vk::Fence lfence = context->device.createFence(fenceInfo);
 
 	// Submit to the queue
+	TraceScope trace("copy submit", "gpu");
 	context->queue.submit(1, &submitInfo, lfence);
 	context->device.waitForFences(1, &lfence, VK_TRUE, UINT64_MAX);
 
@@ -105,6 +130,33 @@ void HostDeviceBufferPair::store(void* data, vk::DeviceSize len)
 	context->device.freeCommandBuffers(context->command_pool, 1, &copyCmd);
 }
 
+void HostDeviceBufferPair::load(void* dest, vk::DeviceSize len)
+{
+	vk::CommandBufferAllocateInfo cmdBufAllocateInfo(context->command_pool, vk::CommandBufferLevel::ePrimary, 1);
+	vk::CommandBuffer copyCmd = context->device.allocateCommandBuffers(cmdBufAllocateInfo)[0];
+	vk::CommandBufferBeginInfo cmdBufInfo;
+	copyCmd.begin(cmdBufInfo);
+
+	vk::BufferCopy copyRegion(0, 0, len);
+	copyCmd.copyBuffer(device.buffer, host.buffer, 1, &copyRegion);
+	transfer_out_barrier(copyCmd);
+	copyCmd.end();
+
+	vk::SubmitInfo submitInfo(0, nullptr, nullptr, 1, &copyCmd);
+	vk::FenceCreateInfo fenceInfo;
+	vk::Fence lfence = context->device.createFence(fenceInfo);
+
+	{
+		TraceScope trace("copy submit", "gpu");
+		context->queue.submit(1, &submitInfo, lfence);
+		context->device.waitForFences(1, &lfence, VK_TRUE, UINT64_MAX);
+	}
+
+	context->device.destroyFence(lfence);
+	context->device.freeCommandBuffers(context->command_pool, 1, &copyCmd);
+	host.read_back(dest, len);
+}
+
 void HostDeviceBufferPair::transfer_in_barrier(vk::CommandBuffer& command_buffer)
 {
 	vk::BufferMemoryBarrier barrier(
@@ -124,6 +176,25 @@ void HostDeviceBufferPair::transfer_in_barrier(vk::CommandBuffer& command_buffer
 		0, nullptr);
 }
 
+void HostDeviceBufferPair::copy_in_barrier(vk::CommandBuffer& command_buffer)
+{
+	vk::BufferMemoryBarrier barrier(
+		vk::AccessFlagBits::eTransferWrite,
+		vk::AccessFlagBits::eShaderRead,
+		VK_QUEUE_FAMILY_IGNORED,
+		VK_QUEUE_FAMILY_IGNORED,
+		device.buffer,
+		0, VK_WHOLE_SIZE);
+
+	command_buffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eTransfer,
+		vk::PipelineStageFlagBits::eComputeShader,
+		vk::DependencyFlags(0),
+		0, nullptr,
+		1, &barrier,
+		0, nullptr);
+}
+
 void HostDeviceBufferPair::transfer_out_barrier(vk::CommandBuffer& command_buffer)
 {
 	vk::BufferMemoryBarrier barrier(
@@ -210,10 +281,8 @@ HostDeviceBufferPair::HostDeviceBufferPair(Context* ctx, vk::DeviceSize size) :
 
 void HostDeviceBufferPair::destroy()
 {
-	context->device.destroyBuffer(device.buffer);
-	context->device.freeMemory(device.memory);
-	context->device.destroyBuffer(host.buffer);
-	context->device.freeMemory(host.memory);
+	device.destroy();
+	host.destroy();
 }
 
 
@@ -8,13 +8,20 @@ public:
 	vk::Buffer buffer = nullptr;
 	vk::DeviceMemory memory = nullptr;
 	vk::DeviceSize size = 0;
+	//host visible buffers stay mapped from create until destroy
+	void* mapped = nullptr;
 
 	Buffer() = default;
 	Buffer(Context *ctx) : context(ctx) {};
 
-	static Buffer create(Context& context, vk::BufferUsageFlags usageFlags, vk::MemoryPropertyFlags memoryPropertyFlags, vk::DeviceSize buffer_size);
+	//shared_with_transfer makes the buffer usable from the transfer queue's family as well
+	static Buffer create(Context& context, vk::BufferUsageFlags usageFlags, vk::MemoryPropertyFlags memoryPropertyFlags, vk::DeviceSize buffer_size, bool shared_with_transfer = false);
 	void store(void* data, vk::DeviceSize data_len, bool flush=false);
 	void read_back(void* dest, vk::DeviceSize len);
+	//for writing or reading through mapped directly, both no-ops on coherent memory
+	void flush();
+	void invalidate();
+	void destroy();
 };
 
 
@@ -29,8 +36,12 @@ public:
 	HostDeviceBufferPair(Context* ctx, vk::DeviceSize size);
 	void init(Context* ctx, vk::DeviceSize size);
 	void store(void* data, vk::DeviceSize len);
+	//copies the device buffer back through the host one, waits for the copy
+	void load(void* dest, vk::DeviceSize len);
 
 	void transfer_in_barrier(vk::CommandBuffer& command_buffer);
+	//a transfer command wrote the device buffer and shaders read it next
+	void copy_in_barrier(vk::CommandBuffer& command_buffer);
 	void shader_write_barrier(vk::CommandBuffer& command_buffer);
 	void compute_write_read_barrier(vk::CommandBuffer& command_buffer);
 	void compute_write_readwrite_barrier(vk::CommandBuffer& command_buffer);
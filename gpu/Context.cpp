@@ -1,5 +1,9 @@
 #include "Context.h"
 #include "../Logging.h"
+#include "../util.h"
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 
 #define DEBUG (!NDEBUG)
 //#define DEBUG 1
@@ -18,7 +22,105 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL debugMessageCallback(
 	return VK_FALSE;
 }
 
-void Context::open() 
+static std::filesystem::path pipeline_cache_directory()
+{
+	if (const char* dir = std::getenv("ML_PIPELINE_CACHE_DIR")) {
+		return dir;
+	}
+	return cache_directory();
+}
+
+//drivers are meant to ignore data from another device or driver version, not all of them do
+static bool pipeline_cache_matches(const std::vector<char>& data, const vk::PhysicalDeviceProperties& properties)
+{
+	//VkPipelineCacheHeaderVersionOne: size, version, vendor, device, then the uuid
+	uint32_t header[4];
+	if (data.size() < sizeof(header) + VK_UUID_SIZE) {
+		return false;
+	}
+	std::memcpy(header, data.data(), sizeof(header));
+	return header[0] >= sizeof(header) + VK_UUID_SIZE &&
+		header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+		header[2] == properties.vendorID &&
+		header[3] == properties.deviceID &&
+		std::memcmp(data.data() + sizeof(header), properties.pipelineCacheUUID.data(), VK_UUID_SIZE) == 0;
+}
+
+void Context::load_pipeline_cache(const vk::PhysicalDeviceProperties& properties)
+{
+	pipeline_cache_path.clear();
+	std::filesystem::path dir = pipeline_cache_directory();
+	if (!dir.empty()) {
+		std::string uuid;
+		for (uint8_t byte : properties.pipelineCacheUUID) {
+			uuid += fmt::format("{:02x}", byte);
+		}
+		pipeline_cache_path = (dir / fmt::format("pipelines_{:04x}_{:04x}_{}.bin", properties.vendorID, properties.deviceID, uuid)).string();
+	}
+
+	std::vector<char> data;
+	std::error_code error;
+	if (!pipeline_cache_path.empty() && std::filesystem::exists(pipeline_cache_path, error)) {
+		data = read_file(pipeline_cache_path);
+		if (!pipeline_cache_matches(data, properties)) {
+			LOG_DEBUG("ignoring pipeline cache {}, it is from another device or driver", pipeline_cache_path);
+			data.clear();
+		}
+	}
+	vk::PipelineCacheCreateInfo pipelineCacheCreateInfo({}, data.size(), data.data());
+	pipeline_cache = device.createPipelineCache(pipelineCacheCreateInfo);
+	LOG_DEBUG("  pipeline cache={} loaded {} bytes", pipeline_cache_path, data.size());
+}
+
+void Context::save_pipeline_cache()
+{
+	if (pipeline_cache_path.empty()) {
+		return;
+	}
+	std::vector<uint8_t> data = device.getPipelineCacheData(pipeline_cache);
+	std::error_code error;
+	std::filesystem::create_directories(std::filesystem::path(pipeline_cache_path).parent_path(), error);
+
+	//another process opening the device never reads half a cache
+	if (!write_file_atomically(pipeline_cache_path, reinterpret_cast<const char*>(data.data()), data.size())) {
+		LOG_DEBUG("failed to write {}", pipeline_cache_path);
+	}
+}
+
+//higher is picked first when open is not given a device
+static int device_rank(vk::PhysicalDeviceType type)
+{
+	switch (type) {
+	case vk::PhysicalDeviceType::eDiscreteGpu:
+		return 4;
+	case vk::PhysicalDeviceType::eIntegratedGpu:
+		return 3;
+	case vk::PhysicalDeviceType::eVirtualGpu:
+		return 2;
+	case vk::PhysicalDeviceType::eCpu:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+std::vector<DeviceInfo> Context::devices()
+{
+	//a bare instance, no layers or extensions are needed to list devices
+	vk::ApplicationInfo appInfo("Compute", 0, "Example", 0, VK_API_VERSION_1_2);
+	vk::InstanceCreateInfo instanceCreateInfo({}, &appInfo);
+	vk::Instance list_instance = vk::createInstance(instanceCreateInfo);
+	std::vector<DeviceInfo> res;
+	auto physical_devices = list_instance.enumeratePhysicalDevices();
+	for (uint32_t i = 0; i < (uint32_t)physical_devices.size(); i++) {
+		vk::PhysicalDeviceProperties properties = physical_devices[i].getProperties();
+		res.push_back({ i, std::string(properties.deviceName.data()), properties.deviceType });
+	}
+	list_instance.destroy();
+	return res;
+}
+
+void Context::open(int device_index) 
 {
 	const char* app_name = "Vulkan headless example";
 	vk::ApplicationInfo appInfo("Compute", 0, "Example", 0, VK_API_VERSION_1_2);
@@ -79,35 +181,79 @@ void Context::open()
 	}
 #endif
 
-	// Pick a discrete physical device if we can
+	// Pick the requested device, or the best kind there is
 	std::vector<vk::PhysicalDevice> physical_devices = instance.enumeratePhysicalDevices();
-	physical_device = physical_devices[0];
+	if (physical_devices.empty()) {
+		throw std::runtime_error("no vulkan devices, install a driver or a software one like lavapipe");
+	}
+	if (device_index >= (int)physical_devices.size()) {
+		throw std::runtime_error("no vulkan device " + std::to_string(device_index));
+	}
+	physical_device = physical_devices[device_index < 0 ? 0 : device_index];
 	for (const auto &dev : physical_devices) {
 		vk::PhysicalDeviceProperties properties = dev.getProperties();
 		LOG_DEBUG("GPU: {}", properties.deviceName);
 		LOG_DEBUG("  type={}", vk::to_string(properties.deviceType));
-		if( properties.deviceType == vk::PhysicalDeviceType::eDiscreteGpu) {
+		if (device_index < 0 && device_rank(properties.deviceType) > device_rank(physical_device.getProperties().deviceType)) {
 			physical_device = dev;
 		}
 	}
 	vk::PhysicalDeviceProperties deviceProperties = physical_device.getProperties();
+	device_name = deviceProperties.deviceName.data();
+	device_type = deviceProperties.deviceType;
 	LOG_DEBUG("using {}", deviceProperties.deviceName);
 
-	// Request a single compute queue
+	const auto& limits = deviceProperties.limits;
+	max_workgroup_invocations = limits.maxComputeWorkGroupInvocations;
+	for (int i = 0; i < 3; i++) {
+		max_workgroup_size[i] = limits.maxComputeWorkGroupSize[i];
+	}
+	max_shared_memory_size = limits.maxComputeSharedMemorySize;
+	//subgroup properties are core from 1.1
+	if (deviceProperties.apiVersion >= VK_API_VERSION_1_1) {
+		auto properties = physical_device.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceSubgroupProperties>();
+		const auto& subgroup = properties.get<vk::PhysicalDeviceSubgroupProperties>();
+		subgroup_size = subgroup.subgroupSize;
+		subgroup_arithmetic = (subgroup.supportedStages & vk::ShaderStageFlagBits::eCompute) &&
+			(subgroup.supportedOperations & vk::SubgroupFeatureFlagBits::eArithmetic);
+	}
+	LOG_DEBUG("  workgroup invocations={} subgroup size={} subgroup arithmetic={}", max_workgroup_invocations, subgroup_size, subgroup_arithmetic);
+
+	// Request a compute queue, and a transfer queue when the device has a family just for copies
 	const float defaultQueuePriority(0.0f);
 
 	std::vector<vk::QueueFamilyProperties> queueFamilyProperties = physical_device.getQueueFamilyProperties();
-	vk::DeviceQueueCreateInfo queueCreateInfo({}, 0, 1, &defaultQueuePriority);
 	for (uint32_t i = 0; i < static_cast<uint32_t>(queueFamilyProperties.size()); i++) {
 		if (queueFamilyProperties[i].queueFlags & vk::QueueFlagBits::eCompute) {
 			queueFamilyIndex = i;
-			queueCreateInfo.queueFamilyIndex = i;
 			break;
 		}
 	}
+	transfer_queue_family_index = queueFamilyIndex;
+	for (uint32_t i = 0; i < static_cast<uint32_t>(queueFamilyProperties.size()); i++) {
+		auto flags = queueFamilyProperties[i].queueFlags;
+		if ((flags & vk::QueueFlagBits::eTransfer) && !(flags & (vk::QueueFlagBits::eCompute | vk::QueueFlagBits::eGraphics))) {
+			transfer_queue_family_index = i;
+			break;
+		}
+	}
+	std::vector<vk::DeviceQueueCreateInfo> queueCreateInfos = { vk::DeviceQueueCreateInfo({}, queueFamilyIndex, 1, &defaultQueuePriority) };
+	if (transfer_queue_family_index != queueFamilyIndex) {
+		queueCreateInfos.push_back(vk::DeviceQueueCreateInfo({}, transfer_queue_family_index, 1, &defaultQueuePriority));
+	}
+	LOG_DEBUG("  compute queue family={} transfer queue family={}", queueFamilyIndex, transfer_queue_family_index);
 
 	// Create logical device
-	vk::DeviceCreateInfo deviceCreateInfo({}, 1, &queueCreateInfo);
+	vk::DeviceCreateInfo deviceCreateInfo({}, (uint32_t)queueCreateInfos.size(), queueCreateInfos.data());
+
+	//timeline semaphores are core, and required, from 1.2 but still have to be enabled
+	vk::PhysicalDeviceTimelineSemaphoreFeatures timelineFeatures;
+	if (deviceProperties.apiVersion >= VK_API_VERSION_1_2) {
+		auto features = physical_device.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceTimelineSemaphoreFeatures>();
+		timeline_semaphores = features.get<vk::PhysicalDeviceTimelineSemaphoreFeatures>().timelineSemaphore;
+		timelineFeatures.timelineSemaphore = timeline_semaphores;
+		deviceCreateInfo.pNext = &timelineFeatures;
+	}
 
 	std::vector<const char*> deviceExtensions = {};
 	deviceCreateInfo.enabledExtensionCount = (uint32_t)deviceExtensions.size();
@@ -120,14 +266,37 @@ void Context::open()
 
 	// Get a compute queue
 	queue = device.getQueue(queueFamilyIndex, 0);
+	transfer_queue = device.getQueue(transfer_queue_family_index, 0);
 
 	// Compute command pool
 	vk::CommandPoolCreateInfo cmdPoolInfo(vk::CommandPoolCreateFlagBits::eResetCommandBuffer, queueFamilyIndex);
 	command_pool = device.createCommandPool(cmdPoolInfo);
+	if (transfer_queue_family_index != queueFamilyIndex) {
+		vk::CommandPoolCreateInfo transferPoolInfo(vk::CommandPoolCreateFlagBits::eResetCommandBuffer, transfer_queue_family_index);
+		transfer_command_pool = device.createCommandPool(transferPoolInfo);
+	}
+	else {
+		transfer_command_pool = command_pool;
+	}
+
+	load_pipeline_cache(deviceProperties);
+}
+
+std::vector<uint32_t> Context::queue_families() const
+{
+	if (transfer_queue_family_index == queueFamilyIndex) {
+		return { queueFamilyIndex };
+	}
+	return { queueFamilyIndex, transfer_queue_family_index };
 }
 
 void Context::close()
 {
+	save_pipeline_cache();
+	device.destroyPipelineCache(pipeline_cache);
+	if (transfer_command_pool != command_pool) {
+		device.destroyCommandPool(transfer_command_pool);
+	}
 	device.destroyCommandPool(command_pool);
 	device.destroy();
 #if DEBUG
@@ -1,11 +1,24 @@
 #pragma once
 #include <vulkan/vulkan.hpp>
+#include <string>
+
+//what Context::devices reports, index is what open takes
+struct DeviceInfo {
+	uint32_t index;
+	std::string name;
+	vk::PhysicalDeviceType type;
+};
 
 class Context {
+private:
+	void load_pipeline_cache(const vk::PhysicalDeviceProperties& properties);
+	void save_pipeline_cache();
 public:
 	vk::Instance instance;
 	vk::Device device;
 	vk::PhysicalDevice physical_device;
+	std::string device_name;
+	vk::PhysicalDeviceType device_type = vk::PhysicalDeviceType::eOther;
 
 	vk::DebugReportCallbackEXT debugReportCallback{};
 
@@ -13,6 +26,35 @@ public:
 	vk::Queue queue;
 	vk::CommandPool command_pool;
 
-	void open();
+	//a copy only queue when the device has one, otherwise the compute queue again
+	uint32_t transfer_queue_family_index;
+	vk::Queue transfer_queue;
+	vk::CommandPool transfer_command_pool;
+
+	//read from the device in open, shaders size their workgroups from these
+	uint32_t max_workgroup_invocations = 0;
+	uint32_t max_workgroup_size[3] = {};
+	uint32_t max_shared_memory_size = 0;
+	uint32_t subgroup_size = 1;
+	//subgroupAdd and friends in compute shaders
+	bool subgroup_arithmetic = false;
+	bool timeline_semaphores = false;
+
+	//shared by every Compute. Loaded in open from a file per device, keyed by vendor, device and
+	//pipelineCacheUUID so a driver update starts over, and written back in close. The directory
+	//is ML_PIPELINE_CACHE_DIR, or neural-net in the user's cache directory; set the variable
+	//to an empty string to keep nothing on disk
+	vk::PipelineCache pipeline_cache;
+	//empty when nothing is kept on disk
+	std::string pipeline_cache_path;
+
+	//every device the loader reports, software ones like lavapipe included. Throws when there is
+	//no vulkan loader or driver at all
+	static std::vector<DeviceInfo> devices();
+	//device_index into devices(), or -1 for the best kind there is: discrete, integrated,
+	//virtual, then software
+	void open(int device_index = -1);
 	void close();
+	//the distinct families of the compute and transfer queues
+	std::vector<uint32_t> queue_families() const;
 };
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include "Dataset.h"
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+const char* to_string(DatasetFormat format)
+{
+	switch (format) {
+	case DatasetFormat::Float32:
+		return "float32";
+	case DatasetFormat::Float16:
+		return "float16";
+	case DatasetFormat::UInt8:
+		return "uint8";
+	case DatasetFormat::Auto:
+		return "auto";
+	}
+	return "unknown";
+}
+
+uint16_t float_to_half(float value)
+{
+	uint32_t u;
+	std::memcpy(&u, &value, sizeof(u));
+	uint32_t sign = (u >> 16) & 0x8000;
+	uint32_t float_exponent = (u >> 23) & 0xff;
+	uint32_t mantissa = u & 0x7fffff;
+	if (float_exponent == 0xff) {
+		//infinity stays infinity, nans stay quiet nans
+		return (uint16_t)(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));
+	}
+
+	int32_t exponent = (int32_t)float_exponent - 127 + 15;
+	if (exponent >= 31) {
+		return (uint16_t)(sign | 0x7c00);
+	}
+	if (exponent <= 0) {
+		//subnormal half, or zero below half the smallest one
+		if (exponent < -10) {
+			return (uint16_t)sign;
+		}
+		mantissa |= 0x800000;
+		uint32_t shift = (uint32_t)(14 - exponent);
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1))) {
+			half++;
+		}
+		return (uint16_t)(sign | half);
+	}
+
+	uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	//a carry out of the mantissa rounds up into the exponent, which is what we want
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+		half++;
+	}
+	return (uint16_t)half;
+}
+
+float half_to_float(uint16_t bits)
+{
+	uint32_t sign = (uint32_t)(bits & 0x8000) << 16;
+	uint32_t exponent = (bits >> 10) & 0x1f;
+	uint32_t mantissa = bits & 0x3ff;
+	uint32_t u;
+	if (exponent == 0x1f) {
+		u = sign | 0x7f800000 | (mantissa << 13);
+	}
+	else if (exponent != 0) {
+		u = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	}
+	else {
+		//zero or subnormal, exact in float
+		float value = std::ldexp((float)mantissa, -24);
+		return sign ? -value : value;
+	}
+	float value;
+	std::memcpy(&value, &u, sizeof(value));
+	return value;
+}
+
+static uint32_t values_per_word(DatasetFormat format)
+{
+	switch (format) {
+	case DatasetFormat::Float16:
+		return 2;
+	case DatasetFormat::UInt8:
+		return 4;
+	default:
+		return 1;
+	}
+}
+
+static const std::vector<double>& field_of(const DataPoint& point, DatasetField field)
+{
+	return field == DatasetField::Inputs ? point.get_input() : point.get_expected();
+}
+
+float PackedRows::value(size_t row, size_t element) const
+{
+	uint32_t word = words[row * row_words + element / values_per_word(format)];
+	switch (format) {
+	case DatasetFormat::Float16:
+		return half_to_float((uint16_t)(element % 2 == 0 ? word & 0xffff : word >> 16));
+	case DatasetFormat::UInt8:
+		return (float)((word >> (8 * (element % 4))) & 0xff) / 255.0f;
+	default: {
+		float value;
+		std::memcpy(&value, &word, sizeof(value));
+		return value;
+	}
+	}
+}
+
+DatasetFormat choose_format(const std::vector<DataPoint>& training, const std::vector<DataPoint>& test, DatasetField field)
+{
+	bool uint8_lossless = true;
+	bool half_lossless = true;
+	for (const auto* set : { &training, &test }) {
+		for (const auto& point : *set) {
+			for (double value : field_of(point, field)) {
+				double scaled = value * 255.0;
+				if (value < 0.0 || value > 1.0 || std::abs(scaled - std::round(scaled)) > 1e-6) {
+					uint8_lossless = false;
+				}
+				//exact against the float32 the device would otherwise be given
+				if (half_to_float(float_to_half((float)value)) != (float)value) {
+					half_lossless = false;
+				}
+			}
+		}
+	}
+	if (uint8_lossless) {
+		return DatasetFormat::UInt8;
+	}
+	return half_lossless ? DatasetFormat::Float16 : DatasetFormat::Float32;
+}
+
+PackedRows pack_rows(const std::vector<DataPoint>& training, const std::vector<DataPoint>& test, DatasetField field, uint32_t row_size, DatasetFormat format)
+{
+	PackedRows res;
+	res.format = format == DatasetFormat::Auto ? choose_format(training, test, field) : format;
+	res.row_size = row_size;
+	uint32_t per_word = values_per_word(res.format);
+	res.row_words = (row_size + per_word - 1) / per_word;
+	res.words.assign((training.size() + test.size()) * res.row_words, 0);
+
+	size_t row = 0;
+	for (const auto* set : { &training, &test }) {
+		for (const auto& point : *set) {
+			const auto& values = field_of(point, field);
+			if (values.size() != row_size) {
+				throw std::runtime_error("data points do not match the network shape");
+			}
+			uint32_t* words = res.words.data() + row * res.row_words;
+			for (uint32_t i = 0; i < row_size; i++) {
+				float value = (float)values[i];
+				switch (res.format) {
+				case DatasetFormat::Float16:
+					words[i / 2] |= (uint32_t)float_to_half(value) << (16 * (i % 2));
+					break;
+				case DatasetFormat::UInt8: {
+					double scaled = std::round(std::min(std::max(values[i], 0.0), 1.0) * 255.0);
+					words[i / 4] |= (uint32_t)scaled << (8 * (i % 4));
+					break;
+				}
+				default:
+					std::memcpy(&words[i], &value, sizeof(value));
+					break;
+				}
+			}
+			row++;
+		}
+	}
+	return res;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "../DataPoint.h"
+
+//the values are the FORMAT_ constants in dataset.glsl
+enum class DatasetFormat {
+	Float32 = 0,
+	//two per word, read with unpackHalf2x16. Rounds anything fp16 can't hold, so only when asked for
+	Float16 = 1,
+	//four per word as value * 255, lossless for data like mnist pixels
+	UInt8 = 2,
+	//the smallest format that holds every value exactly: uint8, then fp16, then float32
+	Auto = 3
+};
+const char* to_string(DatasetFormat format);
+
+//round to nearest even, out of range values become infinity
+uint16_t float_to_half(float value);
+float half_to_float(uint16_t bits);
+
+enum class DatasetField { Inputs, Expected };
+
+// One field of every data point packed into uint32 words for a device buffer, each row
+// starting on a new word so a shader finds row r at r * row_words.
+struct PackedRows {
+	DatasetFormat format = DatasetFormat::Float32;
+	uint32_t row_size = 0;
+	uint32_t row_words = 0;
+	std::vector<uint32_t> words;
+
+	//decodes like dataset.glsl
+	float value(size_t row, size_t element) const;
+};
+
+DatasetFormat choose_format(const std::vector<DataPoint>& training, const std::vector<DataPoint>& test, DatasetField field);
+//training rows then test rows, throws when a point's field is not row_size long
+PackedRows pack_rows(const std::vector<DataPoint>& training, const std::vector<DataPoint>& test, DatasetField field, uint32_t row_size, DatasetFormat format);
@@ -1,13 +1,80 @@
 #include "GPUNetwork.h"
 #include "compute.h"
 #include "../Logging.h"
+#include "../Tracer.h"
+#include <algorithm>
+#include <cstring>
+#include <numeric>
 
-void GPUNetwork::init(Network& network) {
-	_context.open();
+//the shared arrays in compute.glsl and batch_forward.glsl are sized for these
+constexpr uint32_t MAX_GEMV_WORKGROUP_SIZE = 256;
+constexpr uint32_t MAX_GEMM_TILE = 16;
+
+//largest power of two the device allows, but no wider than the layer's input needs
+static uint32_t gemv_workgroup_size(const Context& context, uint32_t input_size)
+{
+	uint32_t limit = std::min({ MAX_GEMV_WORKGROUP_SIZE, context.max_workgroup_invocations, context.max_workgroup_size[0] });
+	uint32_t size = 1;
+	while (size * 2 <= limit && size < input_size) {
+		size *= 2;
+	}
+	return size;
+}
+
+//16x16 on anything that allows 256 invocations, every device allows at least 8x8
+static uint32_t gemm_tile_size(const Context& context)
+{
+	uint32_t tile = MAX_GEMM_TILE;
+	while (tile > 1 && (tile * tile > context.max_workgroup_invocations || tile > context.max_workgroup_size[0] || tile > context.max_workgroup_size[1])) {
+		tile /= 2;
+	}
+	return tile;
+}
+
+//pass_name built for layer's shape, see shared.glsl for the constants. extra are passed from
+//constant_id 4 on
+static LayerPass layer_pass(Compute& compute, const std::string& pass_name, const Layer& layer, uint32_t workgroup_x, uint32_t workgroup_y, const std::vector<uint32_t>& extra = {})
+{
+	std::vector<uint32_t> constants = { workgroup_x, workgroup_y, (uint32_t)layer.input_size, (uint32_t)layer.size };
+	constants.insert(constants.end(), extra.begin(), extra.end());
+	LayerPass res;
+	res.pass = &compute.specialized_pass(pass_name, constants);
+	res.workgroup_x = workgroup_x;
+	res.workgroup_y = workgroup_y;
+	return res;
+}
+
+//a pass with an invocation per value of an x by y dispatch. The workgroup is a couple of
+//subgroups, 64 invocations on most devices, split into powers of two with x first; neither side
+//is wider than it needs, so a small layer fills the group with more samples instead of idling
+static LayerPass elementwise_pass(Compute& compute, const Context& context, const std::string& pass_name, const Layer& layer, uint32_t x, uint32_t y, const std::vector<uint32_t>& extra = {})
+{
+	uint32_t invocations = std::min(std::max<uint32_t>(64, context.subgroup_size), context.max_workgroup_invocations);
+	uint32_t workgroup_x = 1;
+	while (workgroup_x * 2 <= std::min(invocations, context.max_workgroup_size[0]) && workgroup_x < x) {
+		workgroup_x *= 2;
+	}
+	uint32_t workgroup_y = 1;
+	while (workgroup_x * workgroup_y * 2 <= invocations && workgroup_y * 2 <= context.max_workgroup_size[1] && workgroup_y < y) {
+		workgroup_y *= 2;
+	}
+	return layer_pass(compute, pass_name, layer, workgroup_x, workgroup_y, extra);
+}
+
+void GPUNetwork::init(Network& network, int device_index) {
+	if (network.layers.back().activation == Activation::Softmax && network.loss != Loss::CrossEntropy) {
+		throw std::runtime_error("GPUNetwork only supports softmax outputs with cross entropy loss");
+	}
+	if (network.loss == Loss::CrossEntropy && network.layers.back().activation != Activation::Softmax) {
+		throw std::runtime_error("cross entropy needs a softmax output layer");
+	}
+	if (!network.is_fully_connected()) {
+		throw std::runtime_error("GPUNetwork only supports dense layers");
+	}
+	_context.open(device_index);
 
 	std::vector<float_t> weights;
 	std::vector<uint32_t> layer_weight_sizes;
-	uint32_t max_layer_size = 0;
 	_network_size = 0;
 
 	for (const auto layer : network.layers) {
@@ -20,16 +87,20 @@ void GPUNetwork::init(Network& network) {
 		}
 
 		layer_weight_sizes.push_back(layer.weights.size() + layer.biases.size());
-		if (layer.size > max_layer_size) {
-			max_layer_size = layer.size;
-		}
 		_network_size += layer.size;
 	}
 
 	_output_size = network.layers[network.layers.size() - 1].size;
+	_weights_size = (uint32_t)weights.size();
+	//a subtract and a multiply by the derivative per output delta
+	_step_flops = forward_flops_per_sample(network) + 2 * (uint64_t)_output_size;
+	_batch_flops_per_sample = training_flops_per_sample(network);
+	_update_flops = 3 * (uint64_t)_weights_size;
+	_parameter_count = parameter_count(network);
 	uint32_t input_size = network.layers[0].input_size;
+	_input_size = input_size;
 
-	_input_buffer = HostDeviceBufferPair(&_context, std::max(max_layer_size + 1, input_size + 1) * sizeof(float_t));
+	_input_buffer = HostDeviceBufferPair(&_context, input_size * sizeof(float_t));
 	_output_buffer = HostDeviceBufferPair(&_context, _network_size * sizeof(float_t));
 	_data_buffer = HostDeviceBufferPair(&_context, weights.size() * sizeof(float_t));
 	_activated_buffer = HostDeviceBufferPair(&_context, _network_size * sizeof(float_t));
@@ -52,9 +123,26 @@ void GPUNetwork::init(Network& network) {
 			throw std::runtime_error("buffer was null");
 		}
 	}
-	std::vector<std::string> pipelines = { "compute", "activate", "reset", "clear", "deltas"};
-
+	_gemv_pass = _context.subgroup_arithmetic ? "compute_subgroup" : "compute";
+	_gemm_tile = gemm_tile_size(_context);
+	//every single sample pass is a layer pass
+	std::vector<std::string> pipelines;
 	_compute = std::make_unique<Compute>(_context, buffers, pipelines);
+
+	//a pipeline per layer shape, built here so recording never waits on the driver
+	_layer_passes.clear();
+	for (size_t layer_index = 0; layer_index < network.layers.size(); layer_index++) {
+		auto& layer = network.layers[layer_index];
+		LayerPasses passes;
+		passes.gemv = layer_pass(*_compute, _gemv_pass, layer, gemv_workgroup_size(_context, layer.input_size), 1);
+		std::string activate_pass = layer.activation == Activation::Softmax ? "softmax" : std::string("activate_") + activation_name(layer.activation);
+		passes.activate = elementwise_pass(*_compute, _context, activate_pass, layer, layer.size, 1);
+		if (layer_index + 1 == network.layers.size()) {
+			std::string deltas_pass = network.loss == Loss::CrossEntropy ? "deltas_cross_entropy" : std::string("deltas_") + activation_name(layer.activation);
+			passes.deltas = elementwise_pass(*_compute, _context, deltas_pass, layer, layer.size, 1);
+		}
+		_layer_passes.push_back(passes);
+	}
 }
 
 void GPUNetwork::setup_calculate_only_pipeline(const Network& network)
@@ -90,17 +178,6 @@ void GPUNetwork::init_commands(vk::CommandBuffer& command_buffer, const Network&
 	// Barrier to ensure that input buffer transfer is finished before compute shader reads from it
 	_input_buffer.transfer_in_barrier(command_buffer);
 	_data_buffer.transfer_in_barrier(command_buffer);
-
-	auto& descriptor_set = _compute->descriptor_set;
-	PushConstants constants{ 0, 0, 0 };
-	constants.layer_weights_offset = 0;
-	constants.layer_output_offset = 0;
-
-	//clear out buffer to all zeroes since it uses an atomic add instead of assigning
-	constants.layer_size = _network_size;
-	_compute->pass("clear").bind_and_dispatch(command_buffer, descriptor_set, _network_size, 1, 1, constants);
-	_output_buffer.compute_write_readwrite_barrier(command_buffer);
-
 }
 
 void GPUNetwork::end_commands(vk::CommandBuffer& command_buffer)
@@ -128,38 +205,27 @@ void GPUNetwork::readback_commands(vk::CommandBuffer &command_buffer, const Netw
 void GPUNetwork::calculate_commands(vk::CommandBuffer& command_buffer, const Network &network)
 {
 	auto& descriptor_set = _compute->descriptor_set;
-	PushConstants constants{ 0, 0, 0 };
-	constants.layer_weights_offset = 0;
-	constants.layer_output_offset = 0;
-
-	//clear out buffer to all zeroes since it uses an atomic add instead of assigning
-	constants.layer_size = _network_size;
-	_compute->pass("clear").bind_and_dispatch(command_buffer, descriptor_set, _network_size, 1, 1, constants);
-	_output_buffer.compute_write_readwrite_barrier(command_buffer);
+	PushConstants constants{};
+	constants.batch_size = 1;
+	constants.network_size = _network_size;
 
 	for (uint32_t layer_index = 0; layer_index < network.layers.size(); layer_index++)
 	{
 		auto& layer = network.layers[layer_index];
 
-		constants.input_size = layer.input_size + 1; //+1 for bias
+		constants.input_size = layer.input_size;
 		constants.layer_size = layer.size;
 
-		// collect weighted inputs
-		// y +1 is bias
-		_compute->pass("compute").bind_and_dispatch(command_buffer, descriptor_set, layer.size, layer.input_size + 1, 1, constants);
+		// collect weighted inputs, a workgroup per node
+		// layers after the first read the activations of the one before in place
+		auto& passes = _layer_passes[layer_index];
+		passes.gemv.pass->bind_and_dispatch(command_buffer, descriptor_set, layer.size, 1, 1, constants);
 
 		//barrier on write to output_buffer before it can be read
 		_output_buffer.compute_write_read_barrier(command_buffer);
 
 		//calculate activations
-		_compute->pass("activate").bind_and_dispatch(command_buffer, descriptor_set, layer.size, 1, 1, constants);
-
-		//barrier on write to activations_buffer before it can be read
-		_activated_buffer.compute_write_read_barrier(command_buffer);
-
-		//reset output buffer and copy activated to new input
-		//+1 on x inserts bias in shader. TODO: better way to do this
-		_compute->pass("reset").bind_and_dispatch(command_buffer, descriptor_set, layer.size + 1, 1, 1, constants);
+		passes.activate.dispatch(command_buffer, descriptor_set, layer.size, 1, constants);
 
 		//barrier on write to activations_buffer before it can be read
 		_activated_buffer.compute_write_read_barrier(command_buffer);
@@ -173,34 +239,745 @@ void GPUNetwork::gradient_commands(vk::CommandBuffer& command_buffer, const Netw
 {
 	_expected_buffer.transfer_in_barrier(command_buffer);
 	auto& descriptor_set = _compute->descriptor_set;
-	PushConstants constants{ 0, 0, 0 };
-	constants.layer_weights_offset = 0;
+	PushConstants constants{};
+	constants.batch_size = 1;
+	constants.network_size = _network_size;
 	constants.layer_output_offset = _network_size;
 
 	//output layer
 	const Layer& layer = network.layers[network.layers.size() - 1];
 	constants.layer_output_offset -= layer.size;
 	constants.layer_size = layer.size;
-	_compute->pass("deltas").bind_and_dispatch(command_buffer, descriptor_set, layer.size, 1, 1, constants);
+	_layer_passes.back().deltas.dispatch(command_buffer, descriptor_set, layer.size, 1, constants);
 	_deltas_buffer.compute_write_read_barrier(command_buffer);
 
 }
 
+void GPUNetwork::setup_batch_training_pipeline(const Network& network, uint32_t max_batch_size)
+{
+	if (max_batch_size == 0) {
+		throw std::runtime_error("batch size must be at least 1");
+	}
+	for (size_t layer_index = 0; layer_index + 1 < network.layers.size(); layer_index++) {
+		if (network.layers[layer_index].activation == Activation::Softmax) {
+			throw std::runtime_error("GPUNetwork only supports softmax on the output layer");
+		}
+	}
+	if (!_context.timeline_semaphores) {
+		throw std::runtime_error("batched training needs a vulkan 1.2 device with timeline semaphores");
+	}
+	destroy_batch_buffers();
+	_batch_network = &network;
+	_max_batch_size = max_batch_size;
+
+	_batch_input_buffer = HostDeviceBufferPair(&_context, max_batch_size * _input_size * sizeof(float_t));
+	_batch_output_buffer = HostDeviceBufferPair(&_context, max_batch_size * _network_size * sizeof(float_t));
+	_batch_activated_buffer = HostDeviceBufferPair(&_context, max_batch_size * _network_size * sizeof(float_t));
+	_batch_deltas_buffer = HostDeviceBufferPair(&_context, max_batch_size * _network_size * sizeof(float_t));
+	_batch_expected_buffer = HostDeviceBufferPair(&_context, max_batch_size * _output_size * sizeof(float_t));
+	_gradient_buffer = HostDeviceBufferPair(&_context, _weights_size * sizeof(float_t));
+	_stats_buffer = HostDeviceBufferPair(&_context, (2 + 2 * max_batch_size) * sizeof(float_t));
+
+	//binding order matches batch.glsl
+	std::vector<HostDeviceBufferPair*> buffers = {
+		&_batch_input_buffer,
+		&_batch_output_buffer,
+		&_data_buffer,
+		&_batch_activated_buffer,
+		&_batch_deltas_buffer,
+		&_batch_expected_buffer,
+		&_gradient_buffer,
+		&_stats_buffer
+	};
+	//dataset.glsl, bound only once upload_dataset has run
+	bool resident = _resident_training_size + _resident_test_size > 0;
+	if (resident) {
+		buffers.push_back(&_dataset_inputs);
+		buffers.push_back(&_dataset_expected);
+		buffers.push_back(&_index_buffer);
+		buffers.push_back(&_batch_base_buffer);
+	}
+
+	//the passes over the whole network, the rest are layer passes
+	std::unordered_map<std::string, std::vector<uint32_t>> specializations;
+	std::vector<std::string> pipelines = { "batch_update", "batch_reduce" };
+	if (resident) {
+		pipelines.push_back("batch_gather");
+		specializations["batch_gather"] = { (uint32_t)_dataset_input_format, (uint32_t)_dataset_expected_format };
+	}
+
+	_batch_compute = std::make_unique<Compute>(_context, buffers, pipelines, specializations);
+
+	//sized for max_batch_size, smaller batches dispatch fewer workgroups
+	size_t nlayers = network.layers.size();
+	bool cross_entropy = network.loss == Loss::CrossEntropy;
+	_batch_layer_passes.clear();
+	for (size_t layer_index = 0; layer_index < nlayers; layer_index++) {
+		auto& layer = network.layers[layer_index];
+		bool softmax = layer.activation == Activation::Softmax;
+		BatchLayerPasses passes;
+		std::string forward_pass = std::string("batch_forward_") + activation_name(softmax ? Activation::Identity : layer.activation);
+		passes.forward = layer_pass(*_batch_compute, forward_pass, layer, _gemm_tile, _gemm_tile);
+		if (layer_index + 1 == nlayers) {
+			if (softmax) {
+				passes.softmax = elementwise_pass(*_batch_compute, _context, "batch_softmax", layer, layer.size, max_batch_size);
+			}
+			std::string deltas_pass = cross_entropy ? "batch_deltas_cross_entropy" : std::string("batch_deltas_") + activation_name(layer.activation);
+			passes.deltas = elementwise_pass(*_batch_compute, _context, deltas_pass, layer, layer.size, max_batch_size);
+			passes.loss = elementwise_pass(*_batch_compute, _context, cross_entropy ? "batch_loss_cross_entropy" : "batch_loss", layer, max_batch_size, 1);
+		}
+		if (layer_index > 0) {
+			std::string backprop_pass = std::string("batch_backprop_") + activation_name(network.layers[layer_index - 1].activation);
+			passes.backprop = elementwise_pass(*_batch_compute, _context, backprop_pass, layer, layer.input_size, max_batch_size);
+		}
+		passes.gradients = elementwise_pass(*_batch_compute, _context, "batch_gradients", layer, layer.size, layer.input_size + 1);
+		_batch_layer_passes.push_back(passes);
+	}
+
+	vk::SemaphoreTypeCreateInfo timelineInfo(vk::SemaphoreType::eTimeline, 0);
+	vk::SemaphoreCreateInfo semaphoreInfo;
+	semaphoreInfo.pNext = &timelineInfo;
+	_upload_timeline = _context.device.createSemaphore(semaphoreInfo);
+	_compute_timeline = _context.device.createSemaphore(semaphoreInfo);
+	_batches_queued = 0;
+	_batches_completed = 0;
+
+	vk::DeviceSize upload_size = max_batch_size * (_input_size + _output_size) * sizeof(float_t);
+	vk::CommandBufferAllocateInfo computeAllocateInfo(_context.command_pool, vk::CommandBufferLevel::ePrimary, FRAMES_IN_FLIGHT);
+	vk::CommandBufferAllocateInfo transferAllocateInfo(_context.transfer_command_pool, vk::CommandBufferLevel::ePrimary, FRAMES_IN_FLIGHT);
+	auto compute_commands = _context.device.allocateCommandBuffers(computeAllocateInfo);
+	auto transfer_commands = _context.device.allocateCommandBuffers(transferAllocateInfo);
+	for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; i++) {
+		BatchFrame& frame = _frames[i];
+		frame = BatchFrame();
+		frame.upload_staging = Buffer::create(_context, vk::BufferUsageFlagBits::eTransferSrc, vk::MemoryPropertyFlagBits::eHostVisible, upload_size);
+		frame.upload = Buffer::create(_context, 
+			vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eTransferDst, 
+			vk::MemoryPropertyFlagBits::eDeviceLocal, upload_size, true);
+		frame.stats_readback = Buffer::create(_context, vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eHostVisible, 2 * sizeof(float_t));
+		frame.compute_commands = compute_commands[i];
+		frame.transfer_commands = transfer_commands[i];
+	}
+}
+
+void GPUNetwork::batch_training_commands(vk::CommandBuffer& command_buffer, const Network& network, uint32_t batch_size, float learn_rate, bool training, Buffer& stats_readback)
+{
+	//the last batch's update has to land before this one reads the weights
+	_data_buffer.compute_write_read_barrier(command_buffer);
+
+	auto& descriptor_set = _batch_compute->descriptor_set;
+	size_t nlayers = network.layers.size();
+	std::vector<PushConstants> layer_constants(nlayers);
+	PushConstants constants{};
+	constants.batch_size = batch_size;
+	constants.network_size = _network_size;
+	constants.learn_rate = learn_rate;
+	for (size_t layer_index = 0; layer_index < nlayers; layer_index++) {
+		auto& layer = network.layers[layer_index];
+		constants.input_size = layer.input_size;
+		constants.layer_size = layer.size;
+		layer_constants[layer_index] = constants;
+		constants.layer_weights_offset += (layer.weights.size() + layer.biases.size());
+		constants.layer_output_offset += layer.size;
+	}
+
+	//forward, a tiled dispatch per layer covers every sample
+	for (size_t layer_index = 0; layer_index < nlayers; layer_index++) {
+		auto& layer = network.layers[layer_index];
+		auto& passes = _batch_layer_passes[layer_index];
+		passes.forward.dispatch(command_buffer, descriptor_set, layer.size, batch_size, layer_constants[layer_index]);
+		_batch_output_buffer.compute_write_read_barrier(command_buffer);
+		if (layer.activation == Activation::Softmax) {
+			_batch_activated_buffer.compute_write_readwrite_barrier(command_buffer);
+			passes.softmax.dispatch(command_buffer, descriptor_set, layer.size, batch_size, layer_constants[layer_index]);
+		}
+		_batch_activated_buffer.compute_write_read_barrier(command_buffer);
+	}
+
+	//the loss and correct count of each sample while the outputs are at hand
+	const Layer& out_layer = network.layers[nlayers - 1];
+	auto& out_passes = _batch_layer_passes[nlayers - 1];
+	out_passes.loss.dispatch(command_buffer, descriptor_set, batch_size, 1, layer_constants[nlayers - 1]);
+	PushConstants update_constants = constants;
+	update_constants.layer_weights_offset = 0;
+	update_constants.layer_size = _weights_size;
+
+	//evaluation stops at the loss
+	if (training) {
+		out_passes.deltas.dispatch(command_buffer, descriptor_set, out_layer.size, batch_size, layer_constants[nlayers - 1]);
+		_batch_deltas_buffer.compute_write_read_barrier(command_buffer);
+
+		//hidden deltas, each dispatched with the constants of the layer after it
+		for (size_t layer_index = nlayers - 1; layer_index > 0; layer_index--) {
+			auto& layer = network.layers[layer_index - 1];
+			_batch_layer_passes[layer_index].backprop.dispatch(command_buffer, descriptor_set, layer.size, batch_size, layer_constants[layer_index]);
+			_batch_deltas_buffer.compute_write_read_barrier(command_buffer);
+		}
+
+		//weight gradients summed over the batch, y + 1 is the bias
+		for (size_t layer_index = 0; layer_index < nlayers; layer_index++) {
+			auto& layer = network.layers[layer_index];
+			_batch_layer_passes[layer_index].gradients.dispatch(command_buffer, descriptor_set, layer.size, layer.input_size + 1, layer_constants[layer_index]);
+		}
+		_gradient_buffer.compute_write_read_barrier(command_buffer);
+
+		//update every weight at once, the barrier above also keeps it behind the passes reading them
+		_batch_compute->pass("batch_update").bind_and_dispatch(command_buffer, descriptor_set, (_weights_size + 63) / 64, 1, 1, update_constants);
+	}
+
+	_stats_buffer.compute_write_readwrite_barrier(command_buffer);
+	_batch_compute->pass("batch_reduce").bind_and_dispatch(command_buffer, descriptor_set, 1, 1, 1, update_constants);
+
+	// Only the batch loss and correct count go back to the host, into the frame's own buffer
+	_stats_buffer.shader_write_barrier(command_buffer);
+	vk::BufferCopy copyRegion(0, 0, 2 * sizeof(float_t));
+	command_buffer.copyBuffer(_stats_buffer.device.buffer, stats_readback.buffer, 1, &copyRegion);
+	vk::BufferMemoryBarrier barrier(
+		vk::AccessFlagBits::eTransferWrite,
+		vk::AccessFlagBits::eHostRead,
+		VK_QUEUE_FAMILY_IGNORED,
+		VK_QUEUE_FAMILY_IGNORED,
+		stats_readback.buffer,
+		0, VK_WHOLE_SIZE);
+	command_buffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eTransfer,
+		vk::PipelineStageFlagBits::eHost,
+		vk::DependencyFlags(0),
+		0, nullptr,
+		1, &barrier,
+		0, nullptr);
+}
+
+void GPUNetwork::record_frame_commands(BatchFrame& frame, uint32_t batch_size, float learn_rate, bool resident, bool training)
+{
+	vk::CommandBufferBeginInfo cmdBufInfo;
+	auto& command_buffer = frame.compute_commands;
+
+	if (!resident) {
+		vk::DeviceSize input_bytes = batch_size * _input_size * sizeof(float_t);
+		vk::DeviceSize expected_offset = _max_batch_size * _input_size * sizeof(float_t);
+		vk::DeviceSize expected_bytes = batch_size * _output_size * sizeof(float_t);
+
+		//transfer queue, host staging to the frame's device buffer
+		frame.transfer_commands.begin(&cmdBufInfo);
+		vk::BufferCopy uploadRegions[2] = {
+			vk::BufferCopy(0, 0, input_bytes),
+			vk::BufferCopy(expected_offset, expected_offset, expected_bytes)
+		};
+		frame.transfer_commands.copyBuffer(frame.upload_staging.buffer, frame.upload.buffer, 2, uploadRegions);
+		frame.transfer_commands.end();
+
+		//compute queue, a device local copy into the batch buffers then the training passes
+		command_buffer.begin(&cmdBufInfo);
+		//the batch before may still be reading the batch buffers in its shaders
+		command_buffer.pipelineBarrier(
+			vk::PipelineStageFlagBits::eComputeShader,
+			vk::PipelineStageFlagBits::eTransfer,
+			vk::DependencyFlags(0),
+			0, nullptr,
+			0, nullptr,
+			0, nullptr);
+		vk::BufferCopy inputRegion(0, 0, input_bytes);
+		command_buffer.copyBuffer(frame.upload.buffer, _batch_input_buffer.device.buffer, 1, &inputRegion);
+		vk::BufferCopy expectedRegion(expected_offset, 0, expected_bytes);
+		command_buffer.copyBuffer(frame.upload.buffer, _batch_expected_buffer.device.buffer, 1, &expectedRegion);
+		_batch_input_buffer.copy_in_barrier(command_buffer);
+		_batch_expected_buffer.copy_in_barrier(command_buffer);
+	}
+	else {
+		//the resident dataset is gathered on the compute queue, the only copy is the batch base
+		//queue_resident_batch writes to the start of upload_staging
+		command_buffer.begin(&cmdBufInfo);
+		//the batch before may still be reading the base and the rows this gather overwrites
+		command_buffer.pipelineBarrier(
+			vk::PipelineStageFlagBits::eComputeShader,
+			vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eComputeShader,
+			vk::DependencyFlags(0),
+			0, nullptr,
+			0, nullptr,
+			0, nullptr);
+		vk::BufferCopy baseRegion(0, 0, sizeof(uint32_t));
+		command_buffer.copyBuffer(frame.upload_staging.buffer, _batch_base_buffer.device.buffer, 1, &baseRegion);
+		_batch_base_buffer.copy_in_barrier(command_buffer);
+		//the index buffer is rewritten by a copy between epochs
+		_index_buffer.copy_in_barrier(command_buffer);
+		PushConstants constants{};
+		constants.input_size = _input_size;
+		constants.layer_size = _output_size;
+		constants.batch_size = batch_size;
+		constants.network_size = _network_size;
+		uint32_t row_size = std::max(_input_size, _output_size);
+		_batch_compute->pass("batch_gather").bind_and_dispatch(command_buffer, _batch_compute->descriptor_set, (row_size + 63) / 64, batch_size, 1, constants);
+		_batch_input_buffer.compute_write_read_barrier(command_buffer);
+		_batch_expected_buffer.compute_write_read_barrier(command_buffer);
+	}
+	batch_training_commands(command_buffer, *_batch_network, batch_size, learn_rate, training, frame.stats_readback);
+	command_buffer.end();
+
+	frame.recorded_batch_size = batch_size;
+	frame.recorded_learn_rate = learn_rate;
+	frame.recorded_resident = resident;
+	frame.recorded_training = training;
+}
+
+BatchFrame& GPUNetwork::next_frame(uint32_t batch_size, float learn_rate, bool resident, bool training)
+{
+	if (_batch_compute == nullptr) {
+		throw std::runtime_error("setup_batch_training_pipeline has to be called before queueing batches");
+	}
+	if (batch_size == 0 || batch_size > _max_batch_size) {
+		throw std::runtime_error("batch does not fit the batch buffers");
+	}
+	if (batches_in_flight() == FRAMES_IN_FLIGHT) {
+		throw std::runtime_error("every frame is in flight, call next_result first");
+	}
+
+	//results are collected in order, so the last batch on this frame has been waited for. A frame
+	//is only recorded again when the batch shape changes, not for every batch of an epoch
+	BatchFrame& frame = _frames[_batches_queued % FRAMES_IN_FLIGHT];
+	if (batch_size != frame.recorded_batch_size || learn_rate != frame.recorded_learn_rate ||
+		resident != frame.recorded_resident || training != frame.recorded_training) {
+		record_frame_commands(frame, batch_size, learn_rate, resident, training);
+	}
+	frame.batch_size = batch_size;
+	frame.training = training;
+	frame.timeline_value = _batches_queued + 1;
+	return frame;
+}
+
+void GPUNetwork::queue_batch(const std::vector<DataPoint>& data, size_t start, size_t count, double learn_rate, bool training)
+{
+	if (start + count > data.size()) {
+		throw std::runtime_error("batch does not fit the batch buffers");
+	}
+	BatchFrame& frame = next_frame((uint32_t)count, (float)learn_rate, false, training);
+	{
+		PhaseTimer phase(_metrics, TrainingPhase::Upload);
+		//converted straight into the mapped staging memory
+		float_t* inputs = static_cast<float_t*>(frame.upload_staging.mapped);
+		float_t* expected = inputs + _max_batch_size * _input_size;
+		for (size_t i = start; i < start + count; i++) {
+			const DataPoint& point = data[i];
+			if (point.get_input().size() != _input_size || point.get_expected().size() != _output_size) {
+				throw std::runtime_error("data points do not match the network shape");
+			}
+			for (double value : point.get_input()) {
+				*inputs++ = static_cast<float_t>(value);
+			}
+			for (double value : point.get_expected()) {
+				*expected++ = static_cast<float_t>(value);
+			}
+		}
+		frame.upload_staging.flush();
+	}
+
+	uint64_t timeline_value = frame.timeline_value;
+	vk::TimelineSemaphoreSubmitInfo uploadTimeline(0, nullptr, 1, &timeline_value);
+	vk::SubmitInfo uploadSubmitInfo(0, nullptr, nullptr, 1, &frame.transfer_commands, 1, &_upload_timeline);
+	uploadSubmitInfo.pNext = &uploadTimeline;
+
+	//the compute only waits for its own upload, the batch before it is ordered by the queue
+	const vk::PipelineStageFlags waitStageMask = vk::PipelineStageFlagBits::eTransfer;
+	vk::TimelineSemaphoreSubmitInfo computeTimeline(1, &timeline_value, 1, &timeline_value);
+	vk::SubmitInfo computeSubmitInfo(1, &_upload_timeline, &waitStageMask, 1, &frame.compute_commands, 1, &_compute_timeline);
+	computeSubmitInfo.pNext = &computeTimeline;
+
+	TraceScope trace("batch submit", "gpu");
+	_context.transfer_queue.submit(1, &uploadSubmitInfo, nullptr);
+	_context.queue.submit(1, &computeSubmitInfo, nullptr);
+	_batches_queued++;
+}
+
+void GPUNetwork::queue_resident_batch(uint32_t index_offset, uint32_t count, double learn_rate, bool training)
+{
+	BatchFrame& frame = next_frame(count, (float)learn_rate, true, training);
+	//the frame's last batch is done with its staging buffer, the recorded copy picks this up
+	*static_cast<uint32_t*>(frame.upload_staging.mapped) = index_offset;
+	frame.upload_staging.flush();
+
+	//no upload to wait for, the upload timeline is left where it is
+	uint64_t timeline_value = frame.timeline_value;
+	vk::TimelineSemaphoreSubmitInfo computeTimeline(0, nullptr, 1, &timeline_value);
+	vk::SubmitInfo computeSubmitInfo(0, nullptr, nullptr, 1, &frame.compute_commands, 1, &_compute_timeline);
+	computeSubmitInfo.pNext = &computeTimeline;
+
+	TraceScope trace("batch submit", "gpu");
+	_context.queue.submit(1, &computeSubmitInfo, nullptr);
+	_batches_queued++;
+}
+
+GPUBatchResult GPUNetwork::next_result()
+{
+	if (batches_in_flight() == 0) {
+		throw std::runtime_error("no batches in flight");
+	}
+	BatchFrame& frame = _frames[_batches_completed % FRAMES_IN_FLIGHT];
+	{
+		//the time spent blocked on the gpu
+		PhaseTimer phase(_metrics, TrainingPhase::Compute);
+		TraceScope trace("batch wait", "gpu");
+		vk::SemaphoreWaitInfo waitInfo({}, 1, &_compute_timeline, &frame.timeline_value);
+		if (_context.device.waitSemaphores(&waitInfo, UINT64_MAX) != vk::Result::eSuccess) {
+			throw std::runtime_error("waiting for a batch failed");
+		}
+	}
+
+	PhaseTimer phase(_metrics, TrainingPhase::Readback);
+	frame.stats_readback.invalidate();
+	const float_t* stats = static_cast<const float_t*>(frame.stats_readback.mapped);
+	uint32_t count = frame.batch_size;
+
+	//uploads, the weights read forward, backward and by the update and written by it, the
+	//gradients written and read, and the three batch rows each written once and read about twice
+	if (frame.training) {
+		uint64_t bytes = ((uint64_t)count * (_input_size + _output_size) * 2 + 2 + 6 * (uint64_t)_weights_size + 9 * (uint64_t)count * _network_size) * sizeof(float_t);
+		_metrics.add_batch(count, _batch_flops_per_sample * count + _update_flops, bytes);
+	}
+	_batches_completed++;
+
+	GPUBatchResult result;
+	result.loss = stats[0] / count;
+	result.correct = (uint32_t)(stats[1] + 0.5f);
+	return result;
+}
+
+GPUBatchResult GPUNetwork::train_batch(const std::vector<DataPoint>& data, size_t start, size_t count, double learn_rate)
+{
+	if (batches_in_flight() > 0) {
+		throw std::runtime_error("train_batch can't be mixed with queued batches");
+	}
+	queue_batch(data, start, count, learn_rate);
+	return next_result();
+}
+
+GPUBatchResult GPUNetwork::run_batches(size_t count, uint32_t batch_size, function_ref<void(size_t start, size_t len)> queue)
+{
+	double loss = 0.0;
+	uint32_t correct = 0;
+	auto collect = [&]() {
+		uint32_t len = _frames[_batches_completed % FRAMES_IN_FLIGHT].batch_size;
+		GPUBatchResult result = next_result();
+		loss += result.loss * len;
+		correct += result.correct;
+	};
+
+	for (size_t start = 0; start < count; start += batch_size) {
+		if (batches_in_flight() == FRAMES_IN_FLIGHT) {
+			collect();
+		}
+		queue(start, std::min<size_t>(batch_size, count - start));
+	}
+	while (batches_in_flight() > 0) {
+		collect();
+	}
+
+	GPUBatchResult result;
+	result.loss = count == 0 ? 0.0 : loss / count;
+	result.correct = correct;
+	return result;
+}
+
+GPUBatchResult GPUNetwork::train_epoch(const std::vector<DataPoint>& data, uint32_t batch_size, double learn_rate)
+{
+	auto queue = [&](size_t start, size_t len) {
+		queue_batch(data, start, len, learn_rate);
+	};
+	GPUBatchResult result = run_batches(data.size(), batch_size, queue);
+	_metrics.add_epoch();
+	return result;
+}
+
+GPUBatchResult GPUNetwork::evaluate(const std::vector<DataPoint>& data, uint32_t batch_size)
+{
+	auto queue = [&](size_t start, size_t len) {
+		queue_batch(data, start, len, 0.0, false);
+	};
+	return run_batches(data.size(), batch_size, queue);
+}
+
+void GPUNetwork::upload_dataset(const std::vector<DataPoint>& training, const std::vector<DataPoint>& test, DatasetFormat format)
+{
+	if (batches_in_flight() > 0) {
+		throw std::runtime_error("upload_dataset can't be called with batches in flight");
+	}
+	if (training.empty() && test.empty()) {
+		throw std::runtime_error("no data to upload");
+	}
+	PackedRows inputs = pack_rows(training, test, DatasetField::Inputs, _input_size, format);
+	PackedRows expected = pack_rows(training, test, DatasetField::Expected, _output_size, format);
+
+	//the descriptor set has to be rebuilt to point at the new buffers
+	bool rebuild = _batch_compute != nullptr;
+	destroy_batch_buffers();
+	destroy_dataset();
+
+	PhaseTimer phase(_metrics, TrainingPhase::Upload);
+	_dataset_inputs = HostDeviceBufferPair(&_context, inputs.words.size() * sizeof(uint32_t));
+	_dataset_inputs.store(inputs.words.data(), inputs.words.size() * sizeof(uint32_t));
+	_dataset_expected = HostDeviceBufferPair(&_context, expected.words.size() * sizeof(uint32_t));
+	_dataset_expected.store(expected.words.data(), expected.words.size() * sizeof(uint32_t));
+	//the staging halves are only needed for this one copy
+	_dataset_inputs.host.destroy();
+	_dataset_expected.host.destroy();
+	_dataset_input_format = inputs.format;
+	_dataset_expected_format = expected.format;
+	_resident_training_size = (uint32_t)training.size();
+	_resident_test_size = (uint32_t)test.size();
+
+	//identity order, the test rows keep it and train_resident_epoch reshuffles the training rows
+	std::vector<uint32_t> indices(training.size() + test.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	_index_buffer = HostDeviceBufferPair(&_context, indices.size() * sizeof(uint32_t));
+	_index_buffer.store(indices.data(), indices.size() * sizeof(uint32_t));
+	_batch_base_buffer = HostDeviceBufferPair(&_context, sizeof(uint32_t));
+	_epoch_order.assign(indices.begin(), indices.begin() + training.size());
+
+	LOG_DEBUG("dataset on the device: {} training and {} test samples, {} inputs, {} expected, {} bytes", 
+		training.size(), test.size(), to_string(inputs.format), to_string(expected.format),
+		(inputs.words.size() + expected.words.size() + indices.size()) * sizeof(uint32_t));
+	if (rebuild) {
+		setup_batch_training_pipeline(*_batch_network, _max_batch_size);
+	}
+}
+
+GPUBatchResult GPUNetwork::train_resident_epoch(uint32_t batch_size, double learn_rate)
+{
+	if (_resident_training_size == 0) {
+		throw std::runtime_error("upload_dataset has to be called with training data first");
+	}
+	if (batches_in_flight() > 0) {
+		throw std::runtime_error("train_resident_epoch can't be mixed with queued batches");
+	}
+	{
+		//4 bytes a sample, the only host to device copy of the epoch
+		PhaseTimer phase(_metrics, TrainingPhase::Upload);
+		std::shuffle(_epoch_order.begin(), _epoch_order.end(), _shuffle_rng);
+		_index_buffer.store(_epoch_order.data(), _epoch_order.size() * sizeof(uint32_t));
+	}
+
+	auto queue = [&](size_t start, size_t len) {
+		queue_resident_batch((uint32_t)start, (uint32_t)len, learn_rate, true);
+	};
+	GPUBatchResult result = run_batches(_resident_training_size, batch_size, queue);
+	_metrics.add_epoch();
+	return result;
+}
+
+GPUBatchResult GPUNetwork::evaluate_resident(uint32_t batch_size)
+{
+	if (_resident_test_size == 0) {
+		throw std::runtime_error("upload_dataset has to be called with test data first");
+	}
+	if (batches_in_flight() > 0) {
+		throw std::runtime_error("evaluate_resident can't be mixed with queued batches");
+	}
+	auto queue = [&](size_t start, size_t len) {
+		queue_resident_batch(_resident_training_size + (uint32_t)start, (uint32_t)len, 0.0, false);
+	};
+	return run_batches(_resident_test_size, batch_size, queue);
+}
+
+void GPUNetwork::setup_inference_pipeline(const Network& network, uint32_t max_batch_size, uint32_t top_k)
+{
+	if (max_batch_size == 0) {
+		throw std::runtime_error("batch size must be at least 1");
+	}
+	if (top_k == 0 || top_k > MAX_TOP_K || top_k > _output_size) {
+		throw std::runtime_error("top_k has to be between 1 and the output size, at most " + std::to_string(MAX_TOP_K));
+	}
+	for (size_t layer_index = 0; layer_index + 1 < network.layers.size(); layer_index++) {
+		if (network.layers[layer_index].activation == Activation::Softmax) {
+			throw std::runtime_error("GPUNetwork only supports softmax on the output layer");
+		}
+	}
+	destroy_inference_buffers();
+	_inference_network = &network;
+	_max_inference_batch_size = max_batch_size;
+	_top_k = top_k;
+
+	_inference_input_buffer = HostDeviceBufferPair(&_context, max_batch_size * _input_size * sizeof(float_t));
+	_inference_output_buffer = HostDeviceBufferPair(&_context, max_batch_size * _network_size * sizeof(float_t));
+	_inference_activated_buffer = HostDeviceBufferPair(&_context, max_batch_size * _network_size * sizeof(float_t));
+	//a label and a score per kept output
+	_inference_results_buffer = HostDeviceBufferPair(&_context, max_batch_size * top_k * 2 * sizeof(uint32_t));
+
+	//batch.glsl's bindings, the forward passes never touch the deltas, expected or gradients
+	std::vector<HostDeviceBufferPair*> buffers = {
+		&_inference_input_buffer,
+		&_inference_output_buffer,
+		&_data_buffer,
+		&_inference_activated_buffer,
+		nullptr,
+		nullptr,
+		&_inference_results_buffer
+	};
+	std::vector<std::string> pipelines;
+	_inference_compute = std::make_unique<Compute>(_context, buffers, pipelines);
+
+	for (auto& layer : network.layers) {
+		bool softmax = layer.activation == Activation::Softmax;
+		std::string forward_pass = std::string("batch_forward_") + activation_name(softmax ? Activation::Identity : layer.activation);
+		_inference_forward.push_back(layer_pass(*_inference_compute, forward_pass, layer, _gemm_tile, _gemm_tile));
+	}
+	const Layer& out_layer = network.layers.back();
+	if (out_layer.activation == Activation::Softmax) {
+		_inference_softmax = elementwise_pass(*_inference_compute, _context, "batch_softmax", out_layer, out_layer.size, max_batch_size);
+	}
+	_inference_top_k = elementwise_pass(*_inference_compute, _context, "batch_top_k", out_layer, max_batch_size, 1, { top_k });
+}
+
+void GPUNetwork::inference_commands(vk::CommandBuffer& command_buffer, const Network& network, uint32_t batch_size)
+{
+	vk::CommandBufferBeginInfo cmdBufInfo;
+	command_buffer.begin(&cmdBufInfo);
+	//training batches update the weights from the shaders
+	_data_buffer.compute_write_read_barrier(command_buffer);
+
+	//the host writes the inputs into the mapped staging half before each submit
+	vk::BufferCopy inputRegion(0, 0, batch_size * _input_size * sizeof(float_t));
+	command_buffer.copyBuffer(_inference_input_buffer.host.buffer, _inference_input_buffer.device.buffer, 1, &inputRegion);
+	_inference_input_buffer.copy_in_barrier(command_buffer);
+
+	auto& descriptor_set = _inference_compute->descriptor_set;
+	PushConstants constants{};
+	constants.batch_size = batch_size;
+	constants.network_size = _network_size;
+	for (size_t layer_index = 0; layer_index < network.layers.size(); layer_index++) {
+		auto& layer = network.layers[layer_index];
+		constants.input_size = layer.input_size;
+		constants.layer_size = layer.size;
+		_inference_forward[layer_index].dispatch(command_buffer, descriptor_set, layer.size, batch_size, constants);
+		_inference_output_buffer.compute_write_read_barrier(command_buffer);
+		if (layer.activation == Activation::Softmax) {
+			_inference_activated_buffer.compute_write_readwrite_barrier(command_buffer);
+			_inference_softmax.dispatch(command_buffer, descriptor_set, layer.size, batch_size, constants);
+		}
+		_inference_activated_buffer.compute_write_read_barrier(command_buffer);
+		if (layer_index + 1 < network.layers.size()) {
+			constants.layer_weights_offset += (layer.weights.size() + layer.biases.size());
+			constants.layer_output_offset += layer.size;
+		}
+	}
+	_inference_top_k.dispatch(command_buffer, descriptor_set, batch_size, 1, constants);
+
+	// Only the top k of each sample comes back
+	_inference_results_buffer.shader_write_barrier(command_buffer);
+	vk::BufferCopy resultsRegion(0, 0, batch_size * _top_k * 2 * sizeof(uint32_t));
+	command_buffer.copyBuffer(_inference_results_buffer.device.buffer, _inference_results_buffer.host.buffer, 1, &resultsRegion);
+	_inference_results_buffer.transfer_out_barrier(command_buffer);
+	command_buffer.end();
+	_inference_recorded_batch_size = batch_size;
+}
+
+void GPUNetwork::run_inference(size_t count, function_ref<const double*(size_t)> row, GPUPrediction* predictions)
+{
+	if (_inference_compute == nullptr) {
+		throw std::runtime_error("setup_inference_pipeline has to be called before inference");
+	}
+	if (batches_in_flight() > 0) {
+		throw std::runtime_error("inference can't be mixed with queued batches");
+	}
+	PhaseTimer phase(_metrics, TrainingPhase::Evaluation);
+	TraceScope trace("inference", "gpu");
+	float_t* staging = static_cast<float_t*>(_inference_input_buffer.host.mapped);
+	const uint32_t* results = static_cast<const uint32_t*>(_inference_results_buffer.host.mapped);
+	for (size_t start = 0; start < count; start += _max_inference_batch_size) {
+		uint32_t batch_size = (uint32_t)std::min<size_t>(_max_inference_batch_size, count - start);
+		for (uint32_t i = 0; i < batch_size; i++) {
+			const double* input = row(start + i);
+			for (uint32_t j = 0; j < _input_size; j++) {
+				staging[i * _input_size + j] = (float_t)input[j];
+			}
+		}
+		_inference_input_buffer.host.flush();
+
+		if (_inference_recorded_batch_size != batch_size) {
+			inference_commands(_inference_compute->command_buffer, *_inference_network, batch_size);
+		}
+		_inference_compute->run();
+
+		_inference_results_buffer.host.invalidate();
+		for (uint32_t i = 0; i < batch_size * _top_k; i++) {
+			GPUPrediction& prediction = predictions[start * _top_k + i];
+			prediction.label = results[i * 2];
+			std::memcpy(&prediction.score, &results[i * 2 + 1], sizeof(float));
+		}
+	}
+}
+
+void GPUNetwork::infer(const double* inputs, size_t count, GPUPrediction* predictions)
+{
+	auto row = [&](size_t i) { return inputs + i * _input_size; };
+	run_inference(count, row, predictions);
+}
+
+void GPUNetwork::infer(const std::vector<DataPoint>& data, std::vector<GPUPrediction>& predictions)
+{
+	//checked up front, run_inference only sees a pointer per row
+	for (const auto& point : data) {
+		if (point.get_input().size() != _input_size) {
+			throw std::runtime_error("data points do not match the network shape");
+		}
+	}
+	predictions.resize(data.size() * _top_k);
+	auto row = [&](size_t i) { return data[i].get_input().data(); };
+	run_inference(data.size(), row, predictions.data());
+}
+
+uint32_t GPUNetwork::count_correct(const std::vector<DataPoint>& data)
+{
+	infer(data, _predictions);
+	uint32_t correct = 0;
+	for (size_t i = 0; i < data.size(); i++) {
+		if (_predictions[i * _top_k].label == data[i].label) {
+			correct++;
+		}
+	}
+	return correct;
+}
+
+void GPUNetwork::read_weights(Network& network)
+{
+	std::vector<float_t> weights(_weights_size);
+	_data_buffer.load(weights.data(), weights.size() * sizeof(float_t));
+
+	//undo the flattening in init
+	size_t index = 0;
+	for (auto& layer : network.layers) {
+		for (int node_index = 0; node_index < layer.size; node_index++) {
+			for (int input_index = 0; input_index < layer.input_size; input_index++) {
+				layer.weights[node_index * layer.input_size + input_index] = weights[index++];
+			}
+			layer.biases[node_index] = weights[index++];
+		}
+	}
+}
+
 void GPUNetwork::training_step(const Buffers &buffers)
 {
-	std::vector<float_t> inputs;
-	double_vector_to_float(*buffers.input, inputs);
-	//bias
-	inputs.push_back(1.0);
-	_input_buffer.store(inputs.data(), inputs.size() * sizeof(float_t));
-	
-	std::vector<float_t> expected;
-	double_vector_to_float(*buffers.expected, expected);
-	_expected_buffer.store(expected.data(), expected.size() * sizeof(float_t));
+	std::vector<float_t>& inputs = _staged_input;
+	std::vector<float_t>& expected = _staged_expected;
+	{
+		PhaseTimer phase(_metrics, TrainingPhase::Upload);
+		inputs.clear();
+		double_vector_to_float(*buffers.input, inputs);
+		_input_buffer.store(inputs.data(), inputs.size() * sizeof(float_t));
 
-	_compute->run();
+		expected.clear();
+		double_vector_to_float(*buffers.expected, expected);
+		_expected_buffer.store(expected.data(), expected.size() * sizeof(float_t));
+	}
+
+	{
+		PhaseTimer phase(_metrics, TrainingPhase::Compute);
+		_compute->run();
+	}
 
 	// Copy to output
+	PhaseTimer phase(_metrics, TrainingPhase::Readback);
+	//uploads, three readbacks and the weights read by the forward pass
+	uint64_t bytes = (inputs.size() + expected.size() + 3 * _network_size + _parameter_count) * sizeof(float_t);
+	_metrics.add_batch(1, _step_flops, bytes);
 	buffers.output->resize(_network_size);
 	buffers.activated->resize(_network_size);
 	buffers.deltas->resize(_network_size);
@@ -212,10 +989,10 @@ void GPUNetwork::training_step(const Buffers &buffers)
 }
 
 void GPUNetwork::calculate(const Buffers &buffers) {
-	std::vector<float_t> inputs;
+	PhaseTimer phase(_metrics, TrainingPhase::Evaluation);
+	std::vector<float_t>& inputs = _staged_input;
+	inputs.clear();
 	double_vector_to_float(*buffers.input, inputs);
-	//bias
-	inputs.push_back(1.0);
 	_input_buffer.store(inputs.data(), inputs.size() * sizeof(float_t));
 
 	_compute->run();
@@ -229,7 +1006,70 @@ void GPUNetwork::calculate(const Buffers &buffers) {
 	_context.queue.waitIdle();
 }
 
+void GPUNetwork::destroy_batch_buffers()
+{
+	if (_batch_compute == nullptr) {
+		return;
+	}
+	//queued batches still use the frames
+	_context.device.waitIdle();
+	for (auto& frame : _frames) {
+		frame.upload_staging.destroy();
+		frame.upload.destroy();
+		frame.stats_readback.destroy();
+		_context.device.freeCommandBuffers(_context.command_pool, 1, &frame.compute_commands);
+		_context.device.freeCommandBuffers(_context.transfer_command_pool, 1, &frame.transfer_commands);
+	}
+	_context.device.destroySemaphore(_upload_timeline);
+	_context.device.destroySemaphore(_compute_timeline);
+	_batches_queued = 0;
+	_batches_completed = 0;
+
+	_batch_layer_passes.clear();
+	_batch_compute.reset();
+	_batch_input_buffer.destroy();
+	_batch_output_buffer.destroy();
+	_batch_activated_buffer.destroy();
+	_batch_deltas_buffer.destroy();
+	_batch_expected_buffer.destroy();
+	_gradient_buffer.destroy();
+	_stats_buffer.destroy();
+}
+
+void GPUNetwork::destroy_inference_buffers()
+{
+	if (_inference_compute == nullptr) {
+		return;
+	}
+	_inference_forward.clear();
+	_inference_softmax = LayerPass();
+	_inference_top_k = LayerPass();
+	_inference_compute.reset();
+	_inference_input_buffer.destroy();
+	_inference_output_buffer.destroy();
+	_inference_activated_buffer.destroy();
+	_inference_results_buffer.destroy();
+	_inference_recorded_batch_size = 0;
+}
+
+void GPUNetwork::destroy_dataset()
+{
+	if (_resident_training_size + _resident_test_size == 0) {
+		return;
+	}
+	_dataset_inputs.destroy();
+	_dataset_expected.destroy();
+	_index_buffer.destroy();
+	_batch_base_buffer.destroy();
+	_epoch_order.clear();
+	_resident_training_size = 0;
+	_resident_test_size = 0;
+}
+
 void GPUNetwork::destroy() {
+	destroy_batch_buffers();
+	destroy_dataset();
+	destroy_inference_buffers();
 
 	_input_buffer.destroy();
 	_output_buffer.destroy();
@@ -238,6 +1078,7 @@ void GPUNetwork::destroy() {
 	_deltas_buffer.destroy();
 	_expected_buffer.destroy();
 
+	_layer_passes.clear();
 	_compute.reset();
 	_context.close();
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
 #pragma once
 #include "../Network.h"
 #include "compute.h"
+#include "../Metrics.h"
+#include "Dataset.h"
 #include <cstdint>
+#include <random>
 
 #ifdef __linux__
 	typedef float float_t;
@@ -15,6 +18,71 @@ struct Buffers {
 	std::vector<float> *deltas;
 };
 
+//batches that can be queued before the oldest result has to be collected
+constexpr uint32_t FRAMES_IN_FLIGHT = 3;
+
+//one slot of the batch ring, reused every FRAMES_IN_FLIGHT batches
+struct BatchFrame {
+	//host visible and mapped, inputs for max_batch_size samples then their expected outputs
+	Buffer upload_staging;
+	//device copy of upload_staging, written on the transfer queue
+	Buffer upload;
+	//the batch loss and correct count, mapped
+	Buffer stats_readback;
+	vk::CommandBuffer transfer_commands;
+	vk::CommandBuffer compute_commands;
+	//what the command buffers were recorded for, push constants are baked in
+	uint32_t recorded_batch_size = 0;
+	float recorded_learn_rate = 0.0f;
+	//gathers from the resident dataset, the batch base is copied in from upload_staging
+	bool recorded_resident = false;
+	//evaluation batches skip the backward passes and the update
+	bool recorded_training = true;
+	//of the batch using the frame, its compute is done once the compute timeline reaches it
+	uint32_t batch_size = 0;
+	bool training = true;
+	uint64_t timeline_value = 0;
+};
+
+//the single sample passes of a layer, specialized for its shape
+struct LayerPasses {
+	//a workgroup per node
+	LayerPass gemv;
+	//activate_<name>, or softmax
+	LayerPass activate;
+	//output layer only
+	LayerPass deltas;
+};
+
+//the batch passes of a layer, specialized for its shape and the largest batch
+struct BatchLayerPasses {
+	LayerPass forward;
+	//output layer only, softmax for softmax outputs
+	LayerPass softmax;
+	LayerPass deltas;
+	LayerPass loss;
+	//layers after the first, writes the deltas of the layer before
+	LayerPass backprop;
+	LayerPass gradients;
+};
+
+//the most top_k setup_inference_pipeline keeps per sample, batch_top_k.glsl is sized for it
+constexpr uint32_t MAX_TOP_K = 16;
+
+//one of the top_k outputs kept per sample by the inference pipeline
+struct GPUPrediction {
+	uint32_t label = 0;
+	//the output layer's activation
+	float score = 0.0f;
+};
+
+struct GPUBatchResult {
+	//mean over the batch
+	double loss = 0.0;
+	//samples whose largest output matched the largest expected value
+	uint32_t correct = 0;
+};
+
 class GPUNetwork {
 private:
 	std::vector<float> weights;
@@ -28,9 +96,83 @@ private:
 
 	std::unique_ptr<Compute> _compute;
 	Context _context;
+	//compute, or compute_subgroup where the device has subgroup arithmetic
+	std::string _gemv_pass;
+	//side of the square workgroup batch_forward runs with
+	uint32_t _gemm_tile = 1;
+	//by layer index, the pipelines are owned by _compute and _batch_compute
+	std::vector<LayerPasses> _layer_passes;
+	std::vector<BatchLayerPasses> _batch_layer_passes;
 
+	//batched training, a row per sample, shares _data_buffer with the single sample passes
+	HostDeviceBufferPair _batch_input_buffer;
+	HostDeviceBufferPair _batch_output_buffer;
+	HostDeviceBufferPair _batch_activated_buffer;
+	HostDeviceBufferPair _batch_deltas_buffer;
+	HostDeviceBufferPair _batch_expected_buffer;
+	HostDeviceBufferPair _gradient_buffer;
+	HostDeviceBufferPair _stats_buffer;
+	std::unique_ptr<Compute> _batch_compute;
+	const Network* _batch_network = nullptr;
+	uint32_t _max_batch_size = 0;
+
+	//batch k uses frame k % FRAMES_IN_FLIGHT, its upload signals k on the upload timeline and
+	//its compute waits for that and signals k on the compute timeline
+	BatchFrame _frames[FRAMES_IN_FLIGHT];
+	vk::Semaphore _upload_timeline;
+	vk::Semaphore _compute_timeline;
+	uint64_t _batches_queued = 0;
+	uint64_t _batches_completed = 0;
+
+	//the dataset kept on the device by upload_dataset, only the shuffled training order is
+	//uploaded per epoch
+	HostDeviceBufferPair _dataset_inputs;
+	HostDeviceBufferPair _dataset_expected;
+	HostDeviceBufferPair _index_buffer;
+	//where the batch being gathered starts in the index buffer, see dataset.glsl
+	HostDeviceBufferPair _batch_base_buffer;
+	DatasetFormat _dataset_input_format = DatasetFormat::Float32;
+	DatasetFormat _dataset_expected_format = DatasetFormat::Float32;
+	uint32_t _resident_training_size = 0;
+	uint32_t _resident_test_size = 0;
+	std::vector<uint32_t> _epoch_order;
+	std::mt19937 _shuffle_rng;
+
+	//batched inference, forward passes and a top k per sample in one submit per batch. Binding 6
+	//is the top k results, the training buffers are left out
+	HostDeviceBufferPair _inference_input_buffer;
+	HostDeviceBufferPair _inference_output_buffer;
+	HostDeviceBufferPair _inference_activated_buffer;
+	HostDeviceBufferPair _inference_results_buffer;
+	std::unique_ptr<Compute> _inference_compute;
+	const Network* _inference_network = nullptr;
+	std::vector<LayerPass> _inference_forward;
+	LayerPass _inference_softmax;
+	LayerPass _inference_top_k;
+	uint32_t _max_inference_batch_size = 0;
+	uint32_t _top_k = 0;
+	//the command buffer is recorded again when the batch size changes
+	uint32_t _inference_recorded_batch_size = 0;
+	//reused by count_correct
+	std::vector<GPUPrediction> _predictions;
+
+	uint32_t _input_size;
 	uint32_t _output_size;
 	uint32_t _network_size;
+	uint32_t _weights_size;
+
+	//float copies of the inputs, kept so a step does not allocate once they have grown
+	std::vector<float_t> _staged_input;
+	std::vector<float_t> _staged_expected;
+
+	TrainingMetrics _metrics{ "gpu" };
+	//training_step runs the forward pass and the output layer's deltas, no hidden deltas, gradients or update
+	uint64_t _step_flops = 0;
+	//the batch pipeline's forward, deltas and weight gradients for each sample
+	uint64_t _batch_flops_per_sample = 0;
+	//batch_update, a multiply, divide and subtract per weight and bias once per batch
+	uint64_t _update_flops = 0;
+	uint64_t _parameter_count = 0;
 
 	
 	
@@ -41,10 +183,22 @@ private:
 	void calculate_commands(vk::CommandBuffer& command_buffer, const Network& network);
 	void readback_commands(vk::CommandBuffer& command_buffer, const Network& network);
 	void gradient_commands(vk::CommandBuffer& command_buffer, const Network& network);
-	
+	void batch_training_commands(vk::CommandBuffer& command_buffer, const Network& network, uint32_t batch_size, float learn_rate, bool training, Buffer& stats_readback);
+	void record_frame_commands(BatchFrame& frame, uint32_t batch_size, float learn_rate, bool resident, bool training);
+	BatchFrame& next_frame(uint32_t batch_size, float learn_rate, bool resident, bool training);
+	void queue_resident_batch(uint32_t index_offset, uint32_t count, double learn_rate, bool training);
+	//queues batches [0, count) through queue with the ring kept full, the result is over all of them
+	GPUBatchResult run_batches(size_t count, uint32_t batch_size, function_ref<void(size_t start, size_t len)> queue);
+	void destroy_batch_buffers();
+	void destroy_dataset();
+	void inference_commands(vk::CommandBuffer& command_buffer, const Network& network, uint32_t batch_size);
+	//one submit for samples [0, count), row(i) gives the inputs of sample i
+	void run_inference(size_t count, function_ref<const double*(size_t)> row, GPUPrediction* predictions);
+	void destroy_inference_buffers();
 
 public:
-	void init(Network& network);
+	//device_index is passed to Context::open, -1 picks the best device there is
+	void init(Network& network, int device_index = -1);
 	void destroy();
 	void setup_calculate_only_pipeline(const Network& network);
 	void setup_calculate_and_gradients_pipeline(const Network& network);
@@ -52,4 +206,56 @@ public:
 
 	void calculate(const Buffers &buffers);
 	void training_step(const Buffers &buffers);
+
+	//allocates the batched buffers, network must outlive the GPUNetwork
+	void setup_batch_training_pipeline(const Network& network, uint32_t max_batch_size);
+	//forward, backward and an sgd update for data[start, start + count) in one submit,
+	//only the loss and the correct count come back to the host. Returns without waiting,
+	//up to FRAMES_IN_FLIGHT batches can be queued before next_result has to be called.
+	//Without training only the forward pass and the loss run
+	void queue_batch(const std::vector<DataPoint>& data, size_t start, size_t count, double learn_rate, bool training = true);
+	//waits for the oldest queued batch
+	GPUBatchResult next_result();
+	size_t batches_in_flight() const { return (size_t)(_batches_queued - _batches_completed); }
+	//queue_batch then next_result, nothing else may be in flight
+	GPUBatchResult train_batch(const std::vector<DataPoint>& data, size_t start, size_t count, double learn_rate);
+	//every batch of data in order with the ring kept full, so uploads and readbacks overlap
+	//compute. The result is over the whole epoch
+	GPUBatchResult train_epoch(const std::vector<DataPoint>& data, uint32_t batch_size, double learn_rate);
+	//loss and correct count over data through the batch pipeline, the weights are not changed
+	GPUBatchResult evaluate(const std::vector<DataPoint>& data, uint32_t batch_size);
+
+	//copies both sets into device local buffers once, as uint8 or fp16 where that is exact
+	//(see DatasetFormat::Auto), lossy fp16 has to be asked for. Rebuilds the batch pipeline if it
+	//was already set up
+	void upload_dataset(const std::vector<DataPoint>& training, const std::vector<DataPoint>& test, DatasetFormat format = DatasetFormat::Auto);
+	//an epoch over the uploaded training set in a new shuffled order, the order is the only upload
+	GPUBatchResult train_resident_epoch(uint32_t batch_size, double learn_rate);
+	//loss and correct count over the uploaded test set, the weights are not changed
+	GPUBatchResult evaluate_resident(uint32_t batch_size);
+	//the order of the next train_resident_epoch calls
+	void seed_shuffle(uint32_t seed) { _shuffle_rng.seed(seed); }
+	//the order the last train_resident_epoch used
+	const std::vector<uint32_t>& epoch_order() const { return _epoch_order; }
+	//buffers for scoring up to max_batch_size samples per submit. The top_k largest outputs of each
+	//sample are picked on the device and only they are read back. Separate from the training
+	//pipelines, network must outlive the GPUNetwork
+	void setup_inference_pipeline(const Network& network, uint32_t max_batch_size, uint32_t top_k = 1);
+	//inputs holds count samples of the network's input size back to back, scored in submits of up
+	//to max_batch_size. Sample i's predictions are predictions[i * top_k, (i + 1) * top_k), best first
+	void infer(const double* inputs, size_t count, GPUPrediction* predictions);
+	//throws before scoring anything when a point's input is not the network's input size
+	void infer(const std::vector<DataPoint>& data, std::vector<GPUPrediction>& predictions);
+	//samples whose best prediction is their label, DataPoint::is_correct without the outputs.
+	//The batch pipelines have no labels on the device and count the argmax of expected instead,
+	//the same thing for one-hot expected outputs made by DataPoint::set_expected_from_label
+	uint32_t count_correct(const std::vector<DataPoint>& data);
+	uint32_t top_k() const { return _top_k; }
+
+	//copies the device weights back into network
+	void read_weights(Network& network);
+
+	const TrainingMetrics& metrics() const { return _metrics; }
+	const std::string& device_name() const { return _context.device_name; }
+	vk::PhysicalDeviceType device_type() const { return _context.device_type; }
 };
\ No newline at end of file
@@ -1,42 +1,34 @@
 #include "Pipeline.h"
-#include "../util.h"
+#include "Shaders.h"
 #include <exception>
 
-vk::ShaderModule load_shader(vk::Device& device, const std::vector<char>& bytes) {
+vk::ShaderModule load_shader(vk::Device& device, const EmbeddedShader& shader) {
 	vk::ShaderModuleCreateInfo create_info{};
-	create_info.codeSize = bytes.size();
-	create_info.pCode = reinterpret_cast<const uint32_t*>(bytes.data());
+	create_info.codeSize = shader.size;
+	create_info.pCode = shader.code;
 
 	vk::ShaderModule shader = device.createShaderModule(create_info);
 	return shader;
 }
 
 
-std::unique_ptr<ComputePass> create_pipeline(Context &context, const std::string& shader_name, vk::PipelineLayout *pipeline_layout, vk::PipelineCache &pipeline_cache)
+std::unique_ptr<ComputePass> create_pipeline(Context &context, const std::string& shader_name, vk::PipelineLayout *pipeline_layout, vk::PipelineCache &pipeline_cache, const std::vector<uint32_t>& specialization_constants)
 {
 	std::unique_ptr<ComputePass> result = std::make_unique<ComputePass>(context, pipeline_layout);
 	result->name = shader_name;
 
 	//specialization
-	//struct SpecializationData {
-	//	uint32_t LAYER_SIZE = 2;
-	//	uint32_t INPUT_SIZE = 3;
-	//} specializationData;
-
-	//std::vector<vk::SpecializationMapEntry> specializationMapEntries{
-	//	vk::SpecializationMapEntry(0, 0, sizeof(uint32_t)),
-	//	vk::SpecializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t))
-	//};
-	//vk::SpecializationInfo specializationinfo(specializationMapEntries.size(), specializationMapEntries.data(), sizeof(SpecializationData), &specializationData);
+	std::vector<vk::SpecializationMapEntry> specializationMapEntries;
+	for (uint32_t i = 0; i < specialization_constants.size(); i++) {
+		specializationMapEntries.push_back(vk::SpecializationMapEntry(i, i * sizeof(uint32_t), sizeof(uint32_t)));
+	}
+	vk::SpecializationInfo specializationInfo(
+		static_cast<uint32_t>(specializationMapEntries.size()), specializationMapEntries.data(), 
+		specialization_constants.size() * sizeof(uint32_t), specialization_constants.data());
 
-#ifdef _WIN32	
-	std::string base_shader_path = "../../../gpu/assets/";
-#else
-	std::string base_shader_path = "../gpu/assets/";
-#endif
-	auto shader_code = read_file(base_shader_path + shader_name + ".spv");
-	result->shader_module = load_shader(context.device, shader_code);
-	vk::PipelineShaderStageCreateInfo shaderStage({}, vk::ShaderStageFlagBits::eCompute, result->shader_module, "main");
+	result->shader_module = load_shader(context.device, embedded_shader(shader_name));
+	vk::PipelineShaderStageCreateInfo shaderStage({}, vk::ShaderStageFlagBits::eCompute, result->shader_module, "main", 
+		specialization_constants.empty() ? nullptr : &specializationInfo);
 	if ((VkShaderModule)shaderStage.module == VK_NULL_HANDLE) {
 		throw std::runtime_error("failed to create shader stage");
 	}
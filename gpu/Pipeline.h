@@ -2,12 +2,18 @@
 
 #include "Context.h"
 #include <memory>
+#include <vector>
 
 struct PushConstants {
 	uint32_t layer_weights_offset;
+	//the layer's real input count, weight rows are input_size + 1 with the bias last
 	uint32_t input_size;
 	uint32_t layer_size;
 	uint32_t layer_output_offset;
+	//1 outside the batch_* shaders
+	uint32_t batch_size;
+	uint32_t network_size;
+	float learn_rate;
 };
 
 class ComputePass {
@@ -33,4 +39,17 @@ public:
 	void destroy();
 };
 
-std::unique_ptr<ComputePass> create_pipeline(Context& context, const std::string& shader_name, vk::PipelineLayout *pipeline_layout, vk::PipelineCache& pipeline_cache);
\ No newline at end of file
+//a pass built for one layer shape, with the workgroup size it was specialized with
+struct LayerPass {
+	ComputePass* pass = nullptr;
+	uint32_t workgroup_x = 1;
+	uint32_t workgroup_y = 1;
+
+	//x by y invocations, rounded up to whole workgroups
+	void dispatch(vk::CommandBuffer& command_buffer, vk::DescriptorSet& descriptor_set, uint32_t x, uint32_t y, PushConstants push_constants) const {
+		pass->bind_and_dispatch(command_buffer, descriptor_set, (x + workgroup_x - 1) / workgroup_x, (y + workgroup_y - 1) / workgroup_y, 1, push_constants);
+	}
+};
+
+//specialization_constants[i] is passed as constant_id i
+std::unique_ptr<ComputePass> create_pipeline(Context& context, const std::string& shader_name, vk::PipelineLayout *pipeline_layout, vk::PipelineCache& pipeline_cache, const std::vector<uint32_t>& specialization_constants = {});
\ No newline at end of file
@@ -0,0 +1,14 @@
+#include "Shaders.h"
+#include <cstring>
+#include <stdexcept>
+
+const EmbeddedShader& embedded_shader(const std::string& name)
+{
+	//a few dozen entries, looked up once per pipeline
+	for (size_t i = 0; i < EMBEDDED_SHADER_COUNT; i++) {
+		if (std::strcmp(EMBEDDED_SHADERS[i].name, name.c_str()) == 0) {
+			return EMBEDDED_SHADERS[i];
+		}
+	}
+	throw std::runtime_error("no embedded shader named " + name);
+}
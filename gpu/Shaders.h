@@ -0,0 +1,20 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// SPIR-V compiled from gpu/assets at build time and linked into ML, so nothing is read from
+// disk at runtime. The variants and their names are the add_shader calls in CMakeLists.txt.
+struct EmbeddedShader {
+	const char* name;
+	const uint32_t* code;
+	//in bytes
+	size_t size;
+};
+
+//generated by cmake/embed_shaders.cmake
+extern const EmbeddedShader EMBEDDED_SHADERS[];
+extern const size_t EMBEDDED_SHADER_COUNT;
+
+//throws for a name the build did not compile
+const EmbeddedShader& embedded_shader(const std::string& name);
@@ -0,0 +1,97 @@
+#include "../Backend.h"
+#include "GPUNetwork.h"
+#include "../Logging.h"
+#include <fmt/core.h>
+
+//samples per submit when scoring data that is not on the device
+constexpr uint32_t INFERENCE_BATCH_SIZE = 4096;
+
+class VulkanBackend : public Backend {
+private:
+	Network& _network;
+	GPUNetwork _gpu;
+	bool _uploaded = false;
+	bool _calculate_ready = false;
+	bool _inference_ready = false;
+
+	//reused by predict
+	std::vector<double> _input;
+	std::vector<double> _expected;
+	std::vector<float> _activated;
+	std::vector<float> _output;
+	std::vector<float> _deltas;
+public:
+	VulkanBackend(Network& network, int device_index) : _network(network) {
+		_gpu.init(network, device_index);
+		try {
+			_gpu.setup_batch_training_pipeline(network, network.batch_size);
+		}
+		catch (...) {
+			_gpu.destroy();
+			throw;
+		}
+	}
+	~VulkanBackend() override { _gpu.destroy(); }
+
+	BackendKind kind() const override { return BackendKind::Vulkan; }
+	std::string description() const override { return fmt::format("vulkan {} ({})", _gpu.device_name(), vk::to_string(_gpu.device_type())); }
+
+	void train_epoch(double learn_rate) override {
+		if (_network.training_data.empty()) {
+			return;
+		}
+		if (!_uploaded) {
+			_gpu.upload_dataset(_network.training_data, _network.test_data);
+			_uploaded = true;
+		}
+		_gpu.train_resident_epoch(_network.batch_size, learn_rate);
+	}
+
+	double accuracy(const std::vector<DataPoint>& data) override {
+		if (data.empty()) {
+			return 0.0;
+		}
+		//always through the inference pipeline, which compares against DataPoint::label like the cpu
+		//does. The resident evaluation compares against the argmax of expected instead
+		if (!_inference_ready) {
+			_gpu.setup_inference_pipeline(_network, INFERENCE_BATCH_SIZE);
+			_inference_ready = true;
+		}
+		return (double)_gpu.count_correct(data) / data.size();
+	}
+
+	void predict(const std::vector<double>& input, std::vector<double>& output) override {
+		if (!_calculate_ready) {
+			_gpu.setup_calculate_only_pipeline(_network);
+			_calculate_ready = true;
+		}
+		_input = input;
+		_gpu.calculate({ &_input, &_expected, &_activated, &_output, &_deltas });
+		//every layer's activations, the output layer's are last
+		size_t outputs = _network.layers.back().size;
+		output.assign(_activated.end() - outputs, _activated.end());
+	}
+
+	void sync_weights() override { _gpu.read_weights(_network); }
+	const TrainingMetrics& metrics() const override { return _gpu.metrics(); }
+};
+
+std::unique_ptr<Backend> create_vulkan_backend(Network& network, int device_index)
+{
+	return std::make_unique<VulkanBackend>(network, device_index);
+}
+
+std::vector<std::string> vulkan_devices()
+{
+	std::vector<std::string> res;
+	try {
+		for (const auto& device : Context::devices()) {
+			res.push_back(fmt::format("vulkan {} ({})", device.name, vk::to_string(device.type)));
+		}
+	}
+	catch (const std::exception& e) {
+		//cpu only hosts have no loader or no driver
+		LOG_DEBUG("no vulkan devices: {}", e.what());
+	}
+	return res;
+}
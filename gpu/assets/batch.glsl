@@ -0,0 +1,12 @@
+// Extra bindings for the batch_* shaders, the sample layout is in shared.glsl. expected_buf
+// holds the output layer's size per sample.
+#include "shared.glsl"
+
+layout(binding = 6) buffer GradientBuffer {
+   float gradient_buf[ ];
+};
+
+//[0] batch loss, [1] correct samples, then a loss/correct pair per sample
+layout(binding = 7) buffer StatsBuffer {
+   float stats_buf[ ];
+};
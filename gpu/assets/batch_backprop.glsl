@@ -0,0 +1,25 @@
+#version 450
+
+#include "batch.glsl"
+
+//the workgroup size is picked per layer shape, see elementwise_pass
+layout (local_size_x_id = 0, local_size_y_id = 1) in;
+
+//hidden layer deltas, dispatched with the push constants of the layer after it so input_size
+//is the hidden layer's size, compiled with the hidden layer's activation
+void main() 
+{
+	uint input_index = gl_GlobalInvocationID.x;
+	uint sample_index = gl_GlobalInvocationID.y;
+	if (input_index >= input_size() || sample_index >= PushConstants.batch_size) 
+		return;
+
+	uint next_offset = sample_offset(sample_index) + PushConstants.layer_output_offset;
+	float sum = 0.0;
+	for (uint node_index = 0; node_index < layer_size(); node_index++) {
+		sum += data_buf[weight_row(node_index) + input_index] * delta_buf[next_offset + node_index];
+	}
+
+	uint index = next_offset - input_size() + input_index;
+	delta_buf[index] = sum * activation_derivative(out_buf[index]);
+}
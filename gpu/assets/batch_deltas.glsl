@@ -0,0 +1,24 @@
+#version 450
+
+#include "batch.glsl"
+
+//the workgroup size is picked per layer shape, see elementwise_pass
+layout (local_size_x_id = 0, local_size_y_id = 1) in;
+
+//output layer deltas, -DCROSS_ENTROPY for softmax outputs with cross entropy loss
+void main() 
+{
+	uint node_index = gl_GlobalInvocationID.x;
+	uint sample_index = gl_GlobalInvocationID.y;
+	if (node_index >= layer_size() || sample_index >= PushConstants.batch_size) 
+		return;
+
+	uint index = sample_offset(sample_index) + PushConstants.layer_output_offset + node_index;
+	float o = activated_buf[index];
+	float expected = expected_buf[sample_index * layer_size() + node_index];
+#if defined(CROSS_ENTROPY)
+	delta_buf[index] = o - expected;
+#else
+	delta_buf[index] = cost_derivative(o, expected) * activation_derivative(out_buf[index]);
+#endif
+}
@@ -0,0 +1,52 @@
+#version 450
+
+#include "batch.glsl"
+
+//a square tile picked from the device limits, see gemm_tile_size
+layout (local_size_x_id = 0, local_size_y_id = 1) in;
+const uint MAX_TILE = 16;
+
+shared float input_tile[MAX_TILE][MAX_TILE];
+//padded by one so reading a column does not hit the same bank on every lane
+shared float weight_tile[MAX_TILE][MAX_TILE + 1];
+
+// Tiled GEMM for a tile of nodes (x) by samples (y) per workgroup. Each step loads a tile of
+// inputs and a tile of weights into shared memory, one value each per invocation, and every
+// invocation then sums its own node and sample from them.
+void main() 
+{
+	uint tile = gl_WorkGroupSize.x;
+	uint tx = gl_LocalInvocationID.x;
+	uint ty = gl_LocalInvocationID.y;
+	uint node_base = gl_WorkGroupID.x * tile;
+	uint node_index = node_base + tx;
+	uint sample_index = gl_WorkGroupID.y * tile + ty;
+	bool sample_in_batch = sample_index < PushConstants.batch_size;
+	uint load_node = node_base + ty;
+	bool load_node_in_layer = load_node < layer_size();
+	uint load_row = weight_row(load_node);
+
+	float sum = 0.0;
+	for (uint k_base = 0; k_base < input_size(); k_base += tile) {
+		//tiles past the edges are padded with zeroes
+		uint k = k_base + tx;
+		bool k_in_layer = k < input_size();
+		input_tile[ty][tx] = sample_in_batch && k_in_layer ? layer_input(sample_index, k) : 0.0;
+		weight_tile[ty][tx] = load_node_in_layer && k_in_layer ? data_buf[load_row + k] : 0.0;
+		memoryBarrierShared();
+		barrier();
+
+		for (uint i = 0; i < tile; i++) {
+			sum += input_tile[ty][i] * weight_tile[tx][i];
+		}
+		barrier();
+	}
+
+	if (node_index >= layer_size() || !sample_in_batch) 
+		return;
+
+	sum += data_buf[weight_row(node_index) + input_size()];
+	uint index = sample_offset(sample_index) + PushConstants.layer_output_offset + node_index;
+	out_buf[index] = sum;
+	activated_buf[index] = activation(sum);
+}
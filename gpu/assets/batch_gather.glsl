@@ -0,0 +1,24 @@
+#version 450
+#include "dataset.glsl"
+
+layout (local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+
+// Unpacks the batch's dataset rows into input_buf and expected_buf, x is the element and y the
+// sample. layer_size is the output layer's size.
+void main() {
+	uint element = gl_GlobalInvocationID.x;
+	uint sample_index = gl_GlobalInvocationID.y;
+	if (sample_index >= PushConstants.batch_size) {
+		return;
+	}
+	uint row = index_buf[batch_base + sample_index];
+
+	if (element < PushConstants.input_size) {
+		uint word = dataset_inputs[row * row_words(PushConstants.input_size, INPUT_FORMAT) + element / values_per_word(INPUT_FORMAT)];
+		input_buf[sample_index * PushConstants.input_size + element] = unpack_value(word, element, INPUT_FORMAT);
+	}
+	if (element < PushConstants.layer_size) {
+		uint word = dataset_expected[row * row_words(PushConstants.layer_size, EXPECTED_FORMAT) + element / values_per_word(EXPECTED_FORMAT)];
+		expected_buf[sample_index * PushConstants.layer_size + element] = unpack_value(word, element, EXPECTED_FORMAT);
+	}
+}
@@ -0,0 +1,23 @@
+#version 450
+
+#include "batch.glsl"
+
+//the workgroup size is picked per layer shape, see elementwise_pass
+layout (local_size_x_id = 0, local_size_y_id = 1) in;
+
+void main() 
+{
+	uint node_index = gl_GlobalInvocationID.x;
+	uint input_index = gl_GlobalInvocationID.y;
+	//y == input_size is the bias
+	if (node_index >= layer_size() || input_index > input_size()) 
+		return;
+
+	//sums the whole batch in one invocation instead of an atomic add per sample
+	float sum = 0.0;
+	for (uint sample_index = 0; sample_index < PushConstants.batch_size; sample_index++) {
+		float x = input_index == input_size() ? 1.0 : layer_input(sample_index, input_index);
+		sum += delta_buf[sample_offset(sample_index) + PushConstants.layer_output_offset + node_index] * x;
+	}
+	gradient_buf[weight_row(node_index) + input_index] = sum;
+}
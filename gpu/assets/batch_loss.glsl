@@ -0,0 +1,38 @@
+#version 450
+
+#include "batch.glsl"
+
+//the workgroup size is picked per layer shape, see elementwise_pass
+layout (local_size_x_id = 0, local_size_y_id = 1) in;
+
+//loss and argmax match per sample for the output layer, -DCROSS_ENTROPY for cross entropy loss
+void main() 
+{
+	uint sample_index = gl_GlobalInvocationID.x;
+	if (sample_index >= PushConstants.batch_size) 
+		return;
+
+	uint offset = sample_offset(sample_index) + PushConstants.layer_output_offset;
+	uint expected_offset = sample_index * layer_size();
+	float loss = 0.0;
+	uint predicted = 0;
+	uint label = 0;
+	for (uint i = 0; i < layer_size(); i++) {
+		float o = activated_buf[offset + i];
+		float expected = expected_buf[expected_offset + i];
+#if defined(CROSS_ENTROPY)
+		loss -= expected * log(max(o, 1e-30));
+#else
+		float diff = o - expected;
+		loss += 0.5 * diff * diff;
+#endif
+		//first maximum wins, like DataPoint::is_correct
+		if (o > activated_buf[offset + predicted]) 
+			predicted = i;
+		if (expected > expected_buf[expected_offset + label]) 
+			label = i;
+	}
+
+	stats_buf[2 + sample_index * 2] = loss;
+	stats_buf[3 + sample_index * 2] = predicted == label ? 1.0 : 0.0;
+}
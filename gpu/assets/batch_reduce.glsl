@@ -0,0 +1,18 @@
+#version 450
+
+#include "batch.glsl"
+
+layout (local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+
+//a single invocation, the batch is small next to the layer passes
+void main() 
+{
+	float loss = 0.0;
+	float correct = 0.0;
+	for (uint sample_index = 0; sample_index < PushConstants.batch_size; sample_index++) {
+		loss += stats_buf[2 + sample_index * 2];
+		correct += stats_buf[3 + sample_index * 2];
+	}
+	stats_buf[0] = loss;
+	stats_buf[1] = correct;
+}
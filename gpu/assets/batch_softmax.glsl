@@ -0,0 +1,28 @@
+#version 450
+
+#include "batch.glsl"
+
+//the workgroup size is picked per layer shape, see elementwise_pass
+layout (local_size_x_id = 0, local_size_y_id = 1) in;
+
+void main() 
+{
+	uint node_index = gl_GlobalInvocationID.x;
+	uint sample_index = gl_GlobalInvocationID.y;
+	if (node_index >= layer_size() || sample_index >= PushConstants.batch_size) 
+		return;
+
+	uint offset = sample_offset(sample_index) + PushConstants.layer_output_offset;
+
+	//same as softmax.glsl, one row per sample
+	float max_input = out_buf[offset];
+	for (uint i = 1; i < layer_size(); i++) {
+		max_input = max(max_input, out_buf[offset + i]);
+	}
+	float sum = 0.0;
+	for (uint i = 0; i < layer_size(); i++) {
+		sum += exp(out_buf[offset + i] - max_input);
+	}
+
+	activated_buf[offset + node_index] = exp(out_buf[offset + node_index] - max_input) / sum;
+}
@@ -0,0 +1,50 @@
+#version 450
+
+#include "shared.glsl"
+
+//binding 6 of the inference pipeline, a label then a score per kept output, best first
+layout(binding = 6) buffer TopKBuffer {
+   uint top_k_buf[ ];
+};
+
+//the workgroup size is picked per layer shape, see elementwise_pass
+layout (local_size_x_id = 0, local_size_y_id = 1) in;
+
+const uint MAX_TOP_K = 16;
+layout (constant_id = 4) const uint TOP_K = 1;
+
+// The TOP_K largest outputs of a sample, x is the sample. An insertion into a short sorted list
+// per output, which is cheap for the output layer sizes this runs on. Equal scores keep the
+// lower label first, like DataPoint::is_correct.
+void main() 
+{
+	uint sample_index = gl_GlobalInvocationID.x;
+	if (sample_index >= PushConstants.batch_size) 
+		return;
+
+	uint offset = sample_offset(sample_index) + PushConstants.layer_output_offset;
+	uint labels[MAX_TOP_K];
+	float scores[MAX_TOP_K];
+	uint kept = 0;
+	for (uint i = 0; i < layer_size(); i++) {
+		float score = activated_buf[offset + i];
+		if (kept == TOP_K && score <= scores[TOP_K - 1]) 
+			continue;
+		//the lower scores move down a slot, once the list is full the last one drops off
+		uint slot = min(kept, TOP_K - 1);
+		while (slot > 0 && score > scores[slot - 1]) {
+			scores[slot] = scores[slot - 1];
+			labels[slot] = labels[slot - 1];
+			slot--;
+		}
+		scores[slot] = score;
+		labels[slot] = i;
+		kept = min(kept + 1, TOP_K);
+	}
+
+	uint result = sample_index * TOP_K * 2;
+	for (uint i = 0; i < TOP_K; i++) {
+		top_k_buf[result + i * 2] = labels[i];
+		top_k_buf[result + i * 2 + 1] = floatBitsToUint(scores[i]);
+	}
+}
@@ -0,0 +1,16 @@
+#version 450
+
+#include "batch.glsl"
+
+//a weight per invocation, the bigger group keeps the dispatch under the group count limit
+layout (local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+
+void main() 
+{
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= PushConstants.layer_size) 
+		return;
+
+	//plain sgd on the mean gradient
+	data_buf[index] -= PushConstants.learn_rate * gradient_buf[index] / float(PushConstants.batch_size);
+}
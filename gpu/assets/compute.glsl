@@ -1,25 +1,58 @@
 #version 450
-#extension GL_EXT_shader_atomic_float : enable
+#if defined(SUBGROUPS)
+#extension GL_KHR_shader_subgroup_arithmetic : enable
+#endif
 
 #include "shared.glsl"
 
-layout (local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+//the workgroup size is a power of two picked from the device limits, see gemv_workgroup_size
+layout (local_size_x_id = 0) in;
+const uint MAX_WORKGROUP_SIZE = 256;
 
-void weighted_add(uint input_index, uint node_index) {
-	uint index = node_index * PushConstants.input_size + input_index;
-	index += PushConstants.layer_weights_offset;
-	float weighted_input = input_buf[input_index] * data_buf[index];
-	atomicAdd(out_buf[node_index + PushConstants.layer_output_offset], weighted_input); 
-}
+shared float partial_sums[MAX_WORKGROUP_SIZE];
 
+// Weighted inputs of one sample, a workgroup per node. The lanes stride over the inputs so
+// neighbouring lanes read neighbouring weights, then the partial sums are reduced in a fixed
+// order, so there are no atomics and the result is the same every run. -DSUBGROUPS reduces
+// within subgroups first and needs a device with subgroup arithmetic.
 void main() 
 {
-	uint node_index = gl_GlobalInvocationID.x;
-	uint input_index = gl_GlobalInvocationID.y;
+	uint node_index = gl_WorkGroupID.x;
+	uint lane = gl_LocalInvocationID.x;
+	uint row = weight_row(node_index);
 
-	if (node_index >= PushConstants.layer_size || input_index >= PushConstants.input_size) 
-		return;	
+	float sum = 0.0;
+	for (uint i = lane; i < input_size(); i += gl_WorkGroupSize.x) {
+		sum += layer_input(0, i) * data_buf[row + i];
+	}
 
-	weighted_add(input_index, node_index);
-	//activated_buf[node_index] = PushConstants.layer_weights_offset;
+#if defined(SUBGROUPS)
+	sum = subgroupAdd(sum);
+	if (subgroupElect()) {
+		partial_sums[gl_SubgroupID] = sum;
+	}
+	memoryBarrierShared();
+	barrier();
+	if (lane == 0) {
+		float total = 0.0;
+		for (uint i = 0; i < gl_NumSubgroups; i++) {
+			total += partial_sums[i];
+		}
+		out_buf[PushConstants.layer_output_offset + node_index] = total + data_buf[row + input_size()];
+	}
+#else
+	partial_sums[lane] = sum;
+	memoryBarrierShared();
+	barrier();
+	for (uint stride = gl_WorkGroupSize.x / 2; stride > 0; stride /= 2) {
+		if (lane < stride) {
+			partial_sums[lane] += partial_sums[lane + stride];
+		}
+		memoryBarrierShared();
+		barrier();
+	}
+	if (lane == 0) {
+		out_buf[PushConstants.layer_output_offset + node_index] = partial_sums[0] + data_buf[row + input_size()];
+	}
+#endif
 }
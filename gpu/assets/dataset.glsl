@@ -0,0 +1,49 @@
+// The device resident dataset, see GPUNetwork::upload_dataset. Rows are packed into uint words,
+// each row starting on a new word, training rows first and then the test rows.
+#include "batch.glsl"
+
+layout(binding = 8) buffer DatasetInputs {
+   uint dataset_inputs[ ];
+};
+
+layout(binding = 9) buffer DatasetExpected {
+   uint dataset_expected[ ];
+};
+
+//dataset rows to gather, the shuffled training order then the test rows in order
+layout(binding = 10) buffer IndexBuffer {
+   uint index_buf[ ];
+};
+
+//first index_buf entry of the batch, copied in from the frame's staging buffer so the recorded
+//commands do not change from batch to batch
+layout(binding = 11) buffer BatchBase {
+   uint batch_base;
+};
+
+//DatasetFormat
+const uint FORMAT_FLOAT32 = 0;
+const uint FORMAT_FLOAT16 = 1;
+const uint FORMAT_UINT8 = 2;
+
+layout (constant_id = 0) const uint INPUT_FORMAT = FORMAT_FLOAT32;
+layout (constant_id = 1) const uint EXPECTED_FORMAT = FORMAT_FLOAT32;
+
+uint values_per_word(uint format) {
+	return format == FORMAT_UINT8 ? 4 : (format == FORMAT_FLOAT16 ? 2 : 1);
+}
+
+uint row_words(uint row_size, uint format) {
+	return (row_size + values_per_word(format) - 1) / values_per_word(format);
+}
+
+float unpack_value(uint word, uint element, uint format) {
+	if (format == FORMAT_FLOAT16) {
+		vec2 pair = unpackHalf2x16(word);
+		return (element & 1) == 0 ? pair.x : pair.y;
+	}
+	if (format == FORMAT_UINT8) {
+		return float((word >> (8 * (element & 3))) & 0xff) / 255.0;
+	}
+	return uintBitsToFloat(word);
+}
@@ -0,0 +1,18 @@
+#version 450
+
+#include "shared.glsl"
+
+//the workgroup size is picked per layer shape, see elementwise_pass
+layout (local_size_x_id = 0, local_size_y_id = 1) in;
+
+void main() 
+{
+	uint node_index = gl_GlobalInvocationID.x;
+
+	if (node_index >= layer_size()) 
+		return;	
+
+	//softmax + cross entropy cancels down to output - expected
+	float o = activated_buf[node_index + PushConstants.layer_output_offset];
+	delta_buf[node_index + PushConstants.layer_output_offset] = o - expected_buf[node_index];
+}
@@ -22,17 +22,53 @@ layout(binding = 5) buffer ExpectedBuffer {
    float expected_buf[ ];
 };
 
-//layout (constant_id = 0) const uint LAYER_SIZE = 300;
+// The layer passes are built per layer shape, see LayerPasses and BatchLayerPasses. Ids 0 and 1
+// are their workgroup size (batch_gather uses them for its formats instead), 2 and 3 the layer's
+// dimensions so loop bounds are compile time constants. 0 is unspecialized and reads the push
+// constants.
+layout (constant_id = 2) const uint SPEC_INPUT_SIZE = 0;
+layout (constant_id = 3) const uint SPEC_LAYER_SIZE = 0;
 
 //push constants block
 layout( push_constant ) uniform constants
 {
 	uint layer_weights_offset;
+	//the layer's real input count, weight rows are input_size + 1 with the bias last
 	uint input_size;
 	uint layer_size;
 	uint layer_output_offset;
+	//1 outside the batch_* shaders
+	uint batch_size;
+	uint network_size;
+	float learn_rate;
 } PushConstants;
 
+uint input_size() {
+	return SPEC_INPUT_SIZE != 0 ? SPEC_INPUT_SIZE : PushConstants.input_size;
+}
+
+uint layer_size() {
+	return SPEC_LAYER_SIZE != 0 ? SPEC_LAYER_SIZE : PushConstants.layer_size;
+}
+
+// input_buf holds the first layer's inputs, input_size per sample and no bias. out_buf,
+// activated_buf and delta_buf hold network_size per sample, one layer after the other.
+uint sample_offset(uint sample_index) {
+	return sample_index * PushConstants.network_size;
+}
+
+uint weight_row(uint node_index) {
+	return PushConstants.layer_weights_offset + node_index * (input_size() + 1);
+}
+
+//the first layer reads the uploaded inputs, the others the activations of the layer before
+float layer_input(uint sample_index, uint input_index) {
+	if (PushConstants.layer_output_offset == 0) {
+		return input_buf[sample_index * input_size() + input_index];
+	}
+	return activated_buf[sample_offset(sample_index) + PushConstants.layer_output_offset - input_size() + input_index];
+}
+
 float sigmoid(float x)
 {
 	return 1.0 / (1.0 + exp(-x));
@@ -45,4 +81,44 @@ float sigmoid_derivative(float x) {
 
 float cost_derivative(float res, float expected) {
 	return res - expected;
-}
\ No newline at end of file
+}
+
+// Activation variants are compiled per shader with -DACTIVATION_<NAME>, sigmoid if none is given
+#if defined(ACTIVATION_RELU)
+float activation(float x) {
+	return max(x, 0.0);
+}
+float activation_derivative(float x) {
+	return x > 0.0 ? 1.0 : 0.0;
+}
+#elif defined(ACTIVATION_TANH)
+float activation(float x) {
+	return tanh(x);
+}
+float activation_derivative(float x) {
+	float fx = tanh(x);
+	return 1.0 - fx * fx;
+}
+#elif defined(ACTIVATION_LEAKY_RELU)
+const float LEAKY_RELU_SLOPE = 0.01;
+float activation(float x) {
+	return x > 0.0 ? x : LEAKY_RELU_SLOPE * x;
+}
+float activation_derivative(float x) {
+	return x > 0.0 ? 1.0 : LEAKY_RELU_SLOPE;
+}
+#elif defined(ACTIVATION_IDENTITY)
+float activation(float x) {
+	return x;
+}
+float activation_derivative(float x) {
+	return 1.0;
+}
+#else
+float activation(float x) {
+	return sigmoid(x);
+}
+float activation_derivative(float x) {
+	return sigmoid_derivative(x);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#version 450
+
+#include "shared.glsl"
+
+//the workgroup size is picked per layer shape, see elementwise_pass
+layout (local_size_x_id = 0, local_size_y_id = 1) in;
+
+void main() 
+{
+	uint node_index = gl_GlobalInvocationID.x;
+	if (node_index >= layer_size()) 
+		return;	
+
+	uint offset = PushConstants.layer_output_offset;
+
+	//softmax is only used on small output layers so each invocation does the whole max/sum itself
+	float max_input = out_buf[offset];
+	for (uint i = 1; i < layer_size(); i++) {
+		max_input = max(max_input, out_buf[offset + i]);
+	}
+	float sum = 0.0;
+	for (uint i = 0; i < layer_size(); i++) {
+		sum += exp(out_buf[offset + i] - max_input);
+	}
+
+	activated_buf[offset + node_index] = exp(out_buf[offset + node_index] - max_input) / sum;
+}
@@ -10,20 +10,23 @@
 #include <chrono>
 
 #include "compute.h"
+#include "../Tracer.h"
 #include "../util.h"
 #include "Pipeline.h"
 
 #define LOG(...) printf(__VA_ARGS__)
 
-Compute::Compute(Context &context, std::vector<HostDeviceBufferPair *> &buffers, std::vector<std::string> &pass_names) :
+Compute::Compute(Context &context, std::vector<HostDeviceBufferPair *> &buffers, std::vector<std::string> &pass_names, 
+	const std::unordered_map<std::string, std::vector<uint32_t>>& specializations) :
 	_context(context)
 {
 	/*
 		Prepare compute pipeline
 	*/
 	{
+		uint32_t bound = static_cast<uint32_t>(std::count_if(buffers.begin(), buffers.end(), [](HostDeviceBufferPair* buffer) { return buffer != nullptr; }));
 		std::vector<vk::DescriptorPoolSize> poolSizes = {
-			vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, 1)
+			vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, bound)
 		};
 
 		vk::DescriptorPoolCreateInfo descriptorPoolInfo({}, 1, static_cast<uint32_t>(poolSizes.size()), poolSizes.data());
@@ -31,6 +34,9 @@ Compute::Compute(Context &context, std::vector<HostDeviceBufferPair *> &buffers,
 		
 		std::vector<vk::DescriptorSetLayoutBinding> setLayoutBindings;
 		for (size_t i = 0; i < buffers.size(); i++) {
+			if (buffers[i] == nullptr) {
+				continue;
+			}
 			setLayoutBindings.push_back(vk::DescriptorSetLayoutBinding(i, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute));
 		}
 		
@@ -49,29 +55,36 @@ Compute::Compute(Context &context, std::vector<HostDeviceBufferPair *> &buffers,
 		std::vector<vk::DescriptorBufferInfo> buffer_descriptors(0);
 		std::vector<vk::WriteDescriptorSet> computeWriteDescriptorSets(0);
 		for (size_t i = 0; i < buffers.size(); i++) {
+			if (buffers[i] == nullptr) {
+				continue;
+			}
 			vk::DescriptorBufferInfo info(buffers[i]->device.buffer, 0, VK_WHOLE_SIZE);
 			buffer_descriptors.push_back(info);
 			vk::WriteDescriptorSet write_set(
 					descriptor_set, i, {}, 1,
-					vk::DescriptorType::eStorageBuffer, {}, &buffer_descriptors[i]);
+					vk::DescriptorType::eStorageBuffer, {}, &buffer_descriptors.back());
 			computeWriteDescriptorSets.push_back(write_set);
 		}
 
 		// TODO: Why is this needed? 
 		// 		 computeWriteDescriptorSets[i].pBufferInfo[0].buffer is nullptr here even though we set it in the loop above
 		//       this also worked fine in MSVC and was only noticed in linux
-		for (size_t i = 0; i < buffers.size(); i++) {
+		for (size_t i = 0; i < computeWriteDescriptorSets.size(); i++) {
 			computeWriteDescriptorSets[i].pBufferInfo = &buffer_descriptors[i];
 		}
 		
 
 		_context.device.updateDescriptorSets(static_cast<uint32_t>(computeWriteDescriptorSets.size()), computeWriteDescriptorSets.data(), 0, nullptr);
 	
-		vk::PipelineCacheCreateInfo pipelineCacheCreateInfo;
-		pipelineCache = _context.device.createPipelineCache(pipelineCacheCreateInfo);
-
+		//the context's cache, persisted across runs
 		for (auto &pass_name : pass_names) {
-			_passes[pass_name] = create_pipeline(_context, pass_name, &pipelineLayout, pipelineCache);
+			auto specialization = specializations.find(pass_name);
+			if (specialization == specializations.end()) {
+				_passes[pass_name] = create_pipeline(_context, pass_name, &pipelineLayout, _context.pipeline_cache);
+			}
+			else {
+				_passes[pass_name] = create_pipeline(_context, pass_name, &pipelineLayout, _context.pipeline_cache, specialization->second);
+			}
 		}
 
 		// Fence for compute CB sync
@@ -91,9 +104,22 @@ ComputePass &Compute::pass(const std::string& name) {
 	return *(_passes[name]);
 }
 
+ComputePass &Compute::specialized_pass(const std::string& name, const std::vector<uint32_t>& constants) {
+	std::string key = name;
+	for (auto constant : constants) {
+		key += "/" + std::to_string(constant);
+	}
+	auto& pass = _specialized_passes[key];
+	if (pass == nullptr) {
+		pass = create_pipeline(_context, name, &pipelineLayout, _context.pipeline_cache, constants);
+	}
+	return *pass;
+}
+
 void Compute::run() {
 
 	// Submit compute work
+	TraceScope trace("compute submit", "gpu");
 	_context.device.resetFences(1, &fence);
 	const vk::PipelineStageFlags waitStageMask = vk::PipelineStageFlagBits::eTransfer;
 	vk::SubmitInfo computeSubmitInfo(0, nullptr, &waitStageMask, 1, &command_buffer, 0, nullptr);
@@ -111,7 +137,9 @@ Compute::~Compute()
 	for (auto& pass : _passes) {
 		pass.second->destroy();
 	}
-	_context.device.destroyPipelineCache(pipelineCache);
+	for (auto& pass : _specialized_passes) {
+		pass.second->destroy();
+	}
 	_context.device.destroyFence(fence);
 	
 	_context.device.destroyShaderModule(shaderModule);
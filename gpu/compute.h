@@ -9,9 +9,6 @@ int go();
 
 class Compute {
 private:
-
-	vk::PipelineCache pipelineCache;
-	
 	vk::Fence fence;
 	vk::DescriptorPool descriptorPool;
 	vk::DescriptorSetLayout descriptorSetLayout;;
@@ -23,16 +20,24 @@ private:
 	Context _context;
 
 	std::unordered_map<std::string, std::unique_ptr<ComputePass>> _passes;
+	//by name and constants, see specialized_pass
+	std::unordered_map<std::string, std::unique_ptr<ComputePass>> _specialized_passes;
 
 public:
 	vk::DescriptorSet descriptor_set;
 	vk::CommandBuffer command_buffer;
 
 	Compute() = delete;
-	Compute(Context& context, std::vector<HostDeviceBufferPair*> &buffers, std::vector<std::string> &pass_names);
+	//buffers[i] is bound as binding i, nullptr entries leave the binding out. specializations
+	//holds the constants of the passes that take any, by pass name
+	Compute(Context& context, std::vector<HostDeviceBufferPair*> &buffers, std::vector<std::string> &pass_names, 
+		const std::unordered_map<std::string, std::vector<uint32_t>>& specializations = {});
 	virtual ~Compute();
 
 	ComputePass &pass(const std::string& name);
+	//name built with these constants, created on the first call and shared by later calls with
+	//the same ones. Layers of the same shape get the same pipeline
+	ComputePass &specialized_pass(const std::string& name, const std::vector<uint32_t>& constants);
 	void run();
 
 };
\ No newline at end of file
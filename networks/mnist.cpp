@@ -14,21 +14,49 @@ void MNISTNetwork::build()
 	Layer *output = &layers[1];
 	output->input_size = hidden->size;
 	output->size = 10;
+	output->activation = Activation::Softmax;
 	output->init();
 
+	loss = Loss::CrossEntropy;
+
 	for (int i = 0; i < layers.size(); i++) {
 		layers[i].index = i;
 	}
 }
 
-void MNISTNetwork::load_data() {
+void MNISTConvNetwork::build()
+{
+	layers.resize(3);
+	Layer* conv = &layers[0];
+	conv->activation = Activation::ReLU;
+	conv->init_convolution({ 1, 28, 28 }, 8, 5);
+
+	Layer* pool = &layers[1];
+	pool->init_max_pool(conv->output_shape, 2);
+
+	Layer* output = &layers[2];
+	output->input_size = pool->size;
+	output->size = 10;
+	output->activation = Activation::Softmax;
+	output->init();
+
+	loss = Loss::CrossEntropy;
+
+	for (int i = 0; i < layers.size(); i++) {
+		layers[i].index = i;
+	}
+}
+
+//one idx label file and its image file, pixels scaled to 0..1
+static void load_idx(const std::string& labels_path, const std::string& images_path, std::vector<DataPoint>& points)
+{
 	std::vector<uint8_t> labels_buffer;
-	read_file(std::string(DATA_ROOT) + "train-labels.idx1-ubyte", labels_buffer);
+	read_file(labels_path, labels_buffer);
 	uint32_t magic = from_big_endian(&labels_buffer[0]);
 	assert(magic == 0x801);
 
 	std::vector<uint8_t> data_buffer;
-	read_file(std::string(DATA_ROOT) + "train-images.idx3-ubyte", data_buffer);
+	read_file(images_path, data_buffer);
 	magic = from_big_endian(&data_buffer[0]);
 	assert(magic == 0x803);
 
@@ -39,12 +67,12 @@ void MNISTNetwork::load_data() {
 	uint32_t rows = from_big_endian(&data_buffer[8]);
 	uint32_t cols = from_big_endian(&data_buffer[12]);
 
-	training_data.resize(data_len, {});
+	points.resize(data_len, {});
 
 	size_t label_pos = 8;
 	size_t data_pos = 16;
 	for (size_t i = 0; i < data_len; i++) {
-		DataPoint& point = training_data[i];
+		DataPoint& point = points[i];
 		point.label = labels_buffer[label_pos++];
 		for (int row = 0; row < rows; row++) {
 			for (int col = 0; col < cols; col++) {
@@ -54,4 +82,10 @@ void MNISTNetwork::load_data() {
 		point.set_expected_from_label(10);
 		//stdf::cout << point.label << std::endl;
 	}
+}
+
+void MNISTNetwork::load_data() {
+	load_idx(data_root + "train-labels.idx1-ubyte", data_root + "train-images.idx3-ubyte", training_data);
+	//the 10k held out images, never trained on
+	load_idx(data_root + "t10k-labels.idx1-ubyte", data_root + "t10k-images.idx3-ubyte", test_data);
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include "../DataPoint.h"
 #include "../Network.h"
+#include <string>
 
 class MNISTNetwork : public Network {
 public:
@@ -11,4 +12,12 @@ public:
 #else
 	static constexpr auto DATA_ROOT = "../data/mnist/";
 #endif
+	//directory holding the idx files, with a trailing slash
+	std::string data_root = DATA_ROOT;
+};
+
+//conv 5x5 x8 -> max pool 2x2 -> dense softmax, roughly 12k weights against 238k for MNISTNetwork
+class MNISTConvNetwork : public MNISTNetwork {
+public:
+	void build() override;
 };
\ No newline at end of file
@@ -1,5 +0,0 @@
-C:\VulkanSDK\1.2.198.1\Bin\glslc -fshader-stage=compute gpu/assets/compute.glsl -o gpu/assets/compute.spv
-C:\VulkanSDK\1.2.198.1\Bin\glslc -fshader-stage=compute gpu/assets/activate.glsl -o gpu/assets/activate.spv
-C:\VulkanSDK\1.2.198.1\Bin\glslc -fshader-stage=compute gpu/assets/reset.glsl -o gpu/assets/reset.spv
-C:\VulkanSDK\1.2.198.1\Bin\glslc -fshader-stage=compute gpu/assets/clear.glsl -o gpu/assets/clear.spv
-C:\VulkanSDK\1.2.198.1\Bin\glslc -fshader-stage=compute gpu/assets/deltas.glsl -o gpu/assets/deltas.spv
\ No newline at end of file
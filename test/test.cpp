@@ -3,6 +3,28 @@
 #include "../networks/test.h"
 #include "../networks/mnist.h"
 #include "../gpu/GPUNetwork.h"
+#include "../gpu/Dataset.h"
+#include "../gpu/Shaders.h"
+#include "../Quantization.h"
+#include "../InferenceServer.h"
+#include "../CPUTrainer.h"
+#include "../Gemm.h"
+#include "../ExecutionPlan.h"
+#include "../Pruning.h"
+#include "../Tracer.h"
+#include "../PerfCounters.h"
+#include "../Logging.h"
+#include "../Metrics.h"
+#include "../Allocations.h"
+#include "../Backend.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 TEST(GPUCompute, TestNetwork) {
 	TestNetwork n;
@@ -63,3 +85,1378 @@ TEST(GPUCompute, MNISTNetwork) {
 	g.destroy();
 }
 
+
+
+TEST(GPUCompute, DeterministicForward) {
+	MNISTNetwork n;
+	n.build();
+	n.load_data();
+	GPUNetwork g;
+	g.init(n);
+	g.setup_calculate_only_pipeline(n);
+
+	//the reductions run in a fixed order, so repeated runs match bit for bit
+	std::vector<float> first;
+	std::vector<float> second;
+	std::vector<float> output;
+	std::vector<float> deltas;
+	g.calculate({ &n.training_data[0].data, &n.training_data[0].expected, &first, &output, &deltas });
+	g.calculate({ &n.training_data[1].data, &n.training_data[1].expected, &second, &output, &deltas });
+	g.calculate({ &n.training_data[0].data, &n.training_data[0].expected, &second, &output, &deltas });
+	ASSERT_EQ(first.size(), second.size());
+	for (size_t i = 0; i < first.size(); i++) {
+		EXPECT_EQ(first[i], second[i]) << "index " << i;
+	}
+
+	g.destroy();
+}
+
+TEST(GPUCompute, BatchTraining) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+	n.training_data.resize(8, n.training_data[0]);
+	for (size_t i = 0; i < n.training_data.size(); i++) {
+		DataPoint& point = n.training_data[i];
+		point.data = { 0.05 + 0.1 * i, 0.1 - 0.02 * i };
+		point.label = i % 2;
+		point.expected = { i % 2 ? 0.01 : 0.99, i % 2 ? 0.99 : 0.01 };
+	}
+
+	GPUNetwork g;
+	g.init(n);
+	g.setup_batch_training_pipeline(n, 8);
+	CPUTrainer trainer(n, 1);
+	TestNetwork trained;
+	trained.build();
+
+	//a full batch then a short one, which records the commands again
+	std::pair<size_t, size_t> batches[] = { { 0, 8 }, { 5, 3 } };
+	for (auto [start, count] : batches) {
+		double expected_loss = 0.0;
+		uint32_t expected_correct = 0;
+		for (size_t i = start; i < start + count; i++) {
+			auto output = n.calculate(n.training_data[i].get_input());
+			expected_loss += n.cost(output, n.training_data[i].get_expected());
+			expected_correct += n.training_data[i].is_correct(output) ? 1 : 0;
+		}
+
+		GPUBatchResult result = g.train_batch(n.training_data, start, count, n.learn_rate);
+		EXPECT_NEAR(result.loss, expected_loss / count, 1e-5);
+		EXPECT_EQ(result.correct, expected_correct);
+
+		Gradients gradients(n.layers);
+		trainer.process_batch(start, count, &gradients);
+		trainer.apply_gradients(gradients, count, n.learn_rate);
+
+		g.read_weights(trained);
+		for (size_t l = 0; l < n.layers.size(); l++) {
+			for (size_t i = 0; i < n.layers[l].weights.size(); i++) {
+				EXPECT_NEAR(trained.layers[l].weights[i], n.layers[l].weights[i], 1e-5) << "layer " << l << " weight " << i;
+			}
+			for (size_t i = 0; i < n.layers[l].biases.size(); i++) {
+				EXPECT_NEAR(trained.layers[l].biases[i], n.layers[l].biases[i], 1e-5) << "layer " << l << " bias " << i;
+			}
+		}
+	}
+
+	g.destroy();
+}
+
+TEST(GPUCompute, PipelinedEpochMatchesSequential) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+	n.training_data.resize(11, n.training_data[0]);
+	for (size_t i = 0; i < n.training_data.size(); i++) {
+		DataPoint& point = n.training_data[i];
+		point.data = { 0.05 + 0.1 * i, 0.1 - 0.02 * i };
+		point.label = i % 2;
+		point.expected = { i % 2 ? 0.01 : 0.99, i % 2 ? 0.99 : 0.01 };
+	}
+
+	//more batches than frames, and a short last one
+	const uint32_t batch_size = 3;
+	GPUNetwork pipelined;
+	pipelined.init(n);
+	pipelined.setup_batch_training_pipeline(n, batch_size);
+	GPUBatchResult epoch = pipelined.train_epoch(n.training_data, batch_size, n.learn_rate);
+	EXPECT_EQ(pipelined.batches_in_flight(), 0u);
+
+	GPUNetwork sequential;
+	sequential.init(n);
+	sequential.setup_batch_training_pipeline(n, batch_size);
+	double loss = 0.0;
+	uint32_t correct = 0;
+	for (size_t start = 0; start < n.training_data.size(); start += batch_size) {
+		size_t count = std::min<size_t>(batch_size, n.training_data.size() - start);
+		GPUBatchResult result = sequential.train_batch(n.training_data, start, count, n.learn_rate);
+		loss += result.loss * count;
+		correct += result.correct;
+	}
+	EXPECT_NEAR(epoch.loss, loss / n.training_data.size(), 1e-6);
+	EXPECT_EQ(epoch.correct, correct);
+
+	//same passes in the same order, so the weights match exactly
+	TestNetwork a;
+	a.build();
+	TestNetwork b;
+	b.build();
+	pipelined.read_weights(a);
+	sequential.read_weights(b);
+	for (size_t l = 0; l < a.layers.size(); l++) {
+		EXPECT_EQ(a.layers[l].weights, b.layers[l].weights);
+		EXPECT_EQ(a.layers[l].biases, b.layers[l].biases);
+	}
+
+	pipelined.destroy();
+	sequential.destroy();
+}
+
+TEST(GPUCompute, ResidentEpochMatchesUploads) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+	n.training_data.resize(10, n.training_data[0]);
+	for (size_t i = 0; i < n.training_data.size(); i++) {
+		DataPoint& point = n.training_data[i];
+		point.data = { 0.05 + 0.1 * i, 0.1 - 0.02 * i };
+		point.label = i % 2;
+		point.expected = { i % 2 ? 0.01 : 0.99, i % 2 ? 0.99 : 0.01 };
+	}
+	std::vector<DataPoint> test_data(n.training_data.begin(), n.training_data.begin() + 4);
+
+	//float32 so the gathered rows are the same floats queue_batch uploads
+	const uint32_t batch_size = 3;
+	GPUNetwork resident;
+	resident.init(n);
+	resident.setup_batch_training_pipeline(n, batch_size);
+	resident.upload_dataset(n.training_data, test_data, DatasetFormat::Float32);
+	resident.seed_shuffle(7);
+	GPUBatchResult epoch = resident.train_resident_epoch(batch_size, n.learn_rate);
+	EXPECT_EQ(resident.batches_in_flight(), 0u);
+
+	//the same order through the upload path
+	std::vector<DataPoint> shuffled;
+	for (uint32_t index : resident.epoch_order()) {
+		shuffled.push_back(n.training_data[index]);
+	}
+	GPUNetwork uploaded;
+	uploaded.init(n);
+	uploaded.setup_batch_training_pipeline(n, batch_size);
+	GPUBatchResult expected = uploaded.train_epoch(shuffled, batch_size, n.learn_rate);
+	EXPECT_NEAR(epoch.loss, expected.loss, 1e-6);
+	EXPECT_EQ(epoch.correct, expected.correct);
+
+	TestNetwork a;
+	a.build();
+	TestNetwork b;
+	b.build();
+	resident.read_weights(a);
+	uploaded.read_weights(b);
+	for (size_t l = 0; l < a.layers.size(); l++) {
+		EXPECT_EQ(a.layers[l].weights, b.layers[l].weights);
+		EXPECT_EQ(a.layers[l].biases, b.layers[l].biases);
+	}
+
+	//evaluation leaves the weights alone, so a second run gives the same loss
+	GPUBatchResult evaluated = resident.evaluate_resident(batch_size);
+	GPUBatchResult again = resident.evaluate_resident(batch_size);
+	EXPECT_EQ(evaluated.loss, again.loss);
+	EXPECT_EQ(evaluated.correct, again.correct);
+
+	//fp16 rows are close enough to train on
+	resident.upload_dataset(n.training_data, test_data, DatasetFormat::Float16);
+	GPUBatchResult half = resident.evaluate_resident(batch_size);
+	EXPECT_NEAR(half.loss, evaluated.loss, 1e-3);
+
+	resident.destroy();
+	uploaded.destroy();
+}
+
+//odd sizes so no workgroup divides a layer, and two hidden layers of the same shape
+class ShapesTestNetwork : public Network {
+public:
+	void build() override {
+		int sizes[] = { 3, 33, 33, 10 };
+		Activation activations[] = { Activation::ReLU, Activation::Tanh, Activation::Softmax };
+		layers.resize(3);
+		for (int i = 0; i < layers.size(); i++) {
+			layers[i].input_size = sizes[i];
+			layers[i].size = sizes[i + 1];
+			layers[i].activation = activations[i];
+			layers[i].init();
+			layers[i].index = i;
+		}
+		loss = Loss::CrossEntropy;
+	}
+	void load_data() override {
+		training_data.resize(19, {});
+		for (int i = 0; i < training_data.size(); i++) {
+			DataPoint& point = training_data[i];
+			point.data = { std::sin(i * 1.3), std::cos(i * 0.7), 0.1 * i };
+			point.label = i % 10;
+			point.set_expected_from_label(10);
+		}
+	}
+};
+
+TEST(GPUCompute, LayerShapesMatchCPU) {
+	ShapesTestNetwork n;
+	n.build();
+	n.load_data();
+
+	GPUNetwork g;
+	g.init(n);
+	g.setup_batch_training_pipeline(n, 19);
+	CPUTrainer trainer(n, 1);
+	ShapesTestNetwork trained;
+	trained.build();
+
+	//the largest batch the passes were built for, then a smaller one
+	std::pair<size_t, size_t> batches[] = { { 0, 19 }, { 2, 5 } };
+	for (auto [start, count] : batches) {
+		double expected_loss = 0.0;
+		for (size_t i = start; i < start + count; i++) {
+			expected_loss += n.cost(n.calculate(n.training_data[i].get_input()), n.training_data[i].get_expected());
+		}
+
+		GPUBatchResult result = g.train_batch(n.training_data, start, count, n.learn_rate);
+		EXPECT_NEAR(result.loss, expected_loss / count, 1e-4);
+
+		Gradients gradients(n.layers);
+		trainer.process_batch(start, count, &gradients);
+		trainer.apply_gradients(gradients, count, n.learn_rate);
+
+		g.read_weights(trained);
+		for (size_t l = 0; l < n.layers.size(); l++) {
+			for (size_t i = 0; i < n.layers[l].weights.size(); i++) {
+				EXPECT_NEAR(trained.layers[l].weights[i], n.layers[l].weights[i], 1e-4) << "layer " << l << " weight " << i;
+			}
+		}
+	}
+
+	g.destroy();
+}
+
+TEST(GPUCompute, BatchedInference) {
+	ShapesTestNetwork n;
+	n.build();
+	n.load_data();
+
+	GPUNetwork g;
+	g.init(n);
+	EXPECT_THROW(g.setup_inference_pipeline(n, 8, 11), std::runtime_error);
+	//19 samples in submits of 8, the last one short
+	g.setup_inference_pipeline(n, 8, 3);
+	std::vector<GPUPrediction> predictions;
+	g.infer(n.training_data, predictions);
+	ASSERT_EQ(predictions.size(), n.training_data.size() * 3);
+
+	uint32_t expected_correct = 0;
+	for (size_t i = 0; i < n.training_data.size(); i++) {
+		auto output = n.calculate(n.training_data[i].get_input());
+		expected_correct += n.training_data[i].is_correct(output) ? 1 : 0;
+		std::vector<uint32_t> order(output.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return output[a] > output[b]; });
+		for (size_t k = 0; k < 3; k++) {
+			EXPECT_EQ(predictions[i * 3 + k].label, order[k]) << "sample " << i << " rank " << k;
+			EXPECT_NEAR(predictions[i * 3 + k].score, output[order[k]], 1e-4);
+		}
+	}
+	EXPECT_EQ(g.count_correct(n.training_data), expected_correct);
+
+	//a short row would be read past its end
+	std::vector<DataPoint> wrong_shape = { n.training_data[0] };
+	wrong_shape[0].data.pop_back();
+	EXPECT_THROW(g.infer(wrong_shape, predictions), std::runtime_error);
+
+	g.destroy();
+}
+
+TEST(GPUCompute, EmbeddedShadersAndPipelineCache) {
+	//every variant the passes ask for is in the library, as SPIR-V
+	const EmbeddedShader& shader = embedded_shader("batch_forward_relu");
+	ASSERT_GE(shader.size, 20u);
+	EXPECT_EQ(shader.code[0], 0x07230203u);
+	EXPECT_THROW(embedded_shader("no_such_shader"), std::runtime_error);
+
+	auto dir = std::filesystem::temp_directory_path() / "ml_pipeline_cache_test";
+	std::filesystem::remove_all(dir);
+#ifdef _WIN32
+	_putenv_s("ML_PIPELINE_CACHE_DIR", dir.string().c_str());
+#else
+	setenv("ML_PIPELINE_CACHE_DIR", dir.string().c_str(), 1);
+#endif
+	TestNetwork n;
+	n.build();
+	GPUNetwork g;
+	g.init(n);
+	g.destroy();
+
+	//written on close, one file for the device
+	std::vector<std::filesystem::path> files;
+	for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+		files.push_back(entry.path());
+	}
+	ASSERT_EQ(files.size(), 1u);
+	EXPECT_GT(std::filesystem::file_size(files[0]), 32u);
+
+	//and picked up by the next context on the same device
+	Context context;
+	context.open();
+	EXPECT_EQ(std::filesystem::path(context.pipeline_cache_path), files[0]);
+	context.close();
+
+#ifdef _WIN32
+	_putenv_s("ML_PIPELINE_CACHE_DIR", "");
+#else
+	unsetenv("ML_PIPELINE_CACHE_DIR");
+#endif
+	std::filesystem::remove_all(dir);
+}
+
+TEST(Dataset, Packing) {
+	EXPECT_EQ(half_to_float(float_to_half(1.0f)), 1.0f);
+	EXPECT_EQ(half_to_float(float_to_half(-2.5f)), -2.5f);
+	//1 + 2^-11 is halfway between two halves and rounds to even
+	EXPECT_EQ(half_to_float(float_to_half(1.00048828125f)), 1.0f);
+	EXPECT_EQ(half_to_float(float_to_half(std::ldexp(1.0f, -24))), std::ldexp(1.0f, -24));
+	EXPECT_TRUE(std::isinf(half_to_float(float_to_half(70000.0f))));
+	EXPECT_NEAR(half_to_float(float_to_half(0.1f)), 0.1f, 1e-4);
+
+	//pixels over 255 are exact as uint8, then fp16 if it is exact, float32 otherwise
+	std::vector<DataPoint> points(3);
+	for (size_t i = 0; i < points.size(); i++) {
+		points[i].data = { i / 255.0, 1.0, 0.0, 200 / 255.0, 17 / 255.0 };
+		points[i].expected = { 1.25 * i, -0.5 };
+	}
+	std::vector<DataPoint> none;
+	EXPECT_EQ(choose_format(points, none, DatasetField::Inputs), DatasetFormat::UInt8);
+	EXPECT_EQ(choose_format(points, none, DatasetField::Expected), DatasetFormat::Float16);
+	//fp16 would round it
+	points[1].expected[0] = 0.01;
+	EXPECT_EQ(choose_format(points, none, DatasetField::Expected), DatasetFormat::Float32);
+	points[1].expected[0] = 1.25;
+	points[2].expected[0] = 1e6;
+	EXPECT_EQ(choose_format(points, none, DatasetField::Expected), DatasetFormat::Float32);
+
+	//5 values take two words a row as uint8, the second row starts on its own word
+	PackedRows inputs = pack_rows({ points[0], points[1] }, { points[2] }, DatasetField::Inputs, 5, DatasetFormat::Auto);
+	EXPECT_EQ(inputs.format, DatasetFormat::UInt8);
+	EXPECT_EQ(inputs.row_words, 2u);
+	EXPECT_EQ(inputs.words.size(), 6u);
+	for (size_t row = 0; row < 3; row++) {
+		for (size_t i = 0; i < 5; i++) {
+			EXPECT_EQ(inputs.value(row, i), (float)points[row].data[i]);
+		}
+	}
+	PackedRows expected = pack_rows(points, none, DatasetField::Expected, 2, DatasetFormat::Float16);
+	EXPECT_EQ(expected.row_words, 1u);
+	EXPECT_EQ(expected.value(1, 0), 1.25f);
+	//forcing fp16 on values out of its range overflows
+	EXPECT_TRUE(std::isinf(expected.value(2, 0)));
+	EXPECT_THROW(pack_rows(points, none, DatasetField::Inputs, 4, DatasetFormat::Auto), std::runtime_error);
+}
+
+TEST(BackendGPU, MatchesCPU) {
+	//forced so the comparison runs whichever the host would pick
+	TestNetwork n;
+	n.build();
+	n.load_data();
+	std::vector<double> cpu_output;
+	std::vector<double> gpu_output;
+	{
+		BackendOptions options;
+		options.force = BackendKind::Vulkan;
+		auto backend = select_backend(n, options);
+		EXPECT_EQ(backend->kind(), BackendKind::Vulkan);
+		backend->predict(n.training_data[0].get_input(), gpu_output);
+	}
+	n.calculate(n.training_data[0].get_input(), cpu_output);
+	ASSERT_EQ(gpu_output.size(), cpu_output.size());
+	for (size_t i = 0; i < cpu_output.size(); i++) {
+		EXPECT_NEAR(gpu_output[i], cpu_output[i], 1e-4);
+	}
+}
+
+TEST(Quantization, TestNetwork) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+
+	Quantizer quantizer;
+	QuantizedNetwork q = quantizer.quantize(n);
+
+	auto expected = n.calculate(n.training_data[0].data);
+	auto output = q.calculate(n.training_data[0].data);
+	ASSERT_EQ(output.size(), expected.size());
+	for (size_t i = 0; i < expected.size(); i++) {
+		EXPECT_NEAR(output[i], expected[i], 0.01);
+	}
+
+	auto report = quantizer.evaluate(n, q, n.training_data);
+	EXPECT_EQ(report.accuracy_delta, 0.0);
+}
+
+TEST(Quantization, MNISTShapes) {
+	MNISTNetwork n;
+	n.build();
+	n.training_data.resize(16);
+	for (size_t s = 0; s < n.training_data.size(); s++) {
+		for (int i = 0; i < n.layers[0].input_size; i++) {
+			n.training_data[s].data.push_back(((s * 31 + i * 7) % 256) / 255.0);
+		}
+	}
+
+	Quantizer quantizer;
+	QuantizedNetwork q = quantizer.quantize(n);
+	EXPECT_LT(q.weight_bytes(), (n.layers[0].weights.size() + n.layers[1].weights.size()) * sizeof(double) / 4);
+
+	for (const auto& point : n.training_data) {
+		auto expected = n.calculate(point.data);
+		auto output = q.calculate(point.data);
+		for (size_t i = 0; i < expected.size(); i++) {
+			EXPECT_NEAR(output[i], expected[i], 0.02);
+		}
+	}
+}
+
+TEST(InferenceServer, TestNetwork) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+
+	InferenceServerOptions options;
+	options.socket_path = "/tmp/ml-inference-test.sock";
+	options.max_batch_size = 4;
+	InferenceServer server(n, options, 2);
+	server.start();
+
+	std::vector<std::thread> clients;
+	for (int c = 0; c < 4; c++) {
+		clients.push_back(std::thread([&]() {
+			InferenceClient client;
+			client.connect(options.socket_path);
+			for (int i = 0; i < 8; i++) {
+				std::vector<float> scores;
+				uint32_t label = client.infer(n.training_data[0].data, &scores);
+				auto expected = n.calculate(n.training_data[0].data);
+				EXPECT_EQ(label, n.training_data[0].label);
+				ASSERT_EQ(scores.size(), expected.size());
+				for (size_t s = 0; s < expected.size(); s++) {
+					EXPECT_NEAR(scores[s], expected[s], 0.0001);
+				}
+			}
+		}));
+	}
+	for (auto& client : clients) {
+		client.join();
+	}
+
+	auto stats = server.stats();
+	EXPECT_EQ(stats.requests, 32);
+	EXPECT_LE(stats.batches, 32);
+	server.stop();
+}
+
+TEST(InferenceServer, ClientLeavesWithRequestQueued) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+
+	InferenceServerOptions options;
+	options.socket_path = "/tmp/ml-inference-test.sock";
+	//long enough for the client to leave and others to connect before its batch runs
+	options.max_queue_delay = std::chrono::milliseconds(200);
+	InferenceServer server(n, options, 1);
+	server.start();
+
+	InferenceClient leaving;
+	leaving.connect(options.socket_path);
+	leaving.send({ 0.9, -0.4 });
+	leaving.close();
+	//the next accept reaps the connection once its reader has seen the disconnect
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	InferenceClient reaper;
+	reaper.connect(options.socket_path);
+	//would get the reaped connection's fd number if it had been closed with the request queued
+	InferenceClient client;
+	client.connect(options.socket_path);
+	std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+	std::vector<float> scores;
+	uint32_t label = client.infer(n.training_data[0].data, &scores);
+	auto expected = n.calculate(n.training_data[0].data);
+	EXPECT_EQ(label, n.training_data[0].label);
+	ASSERT_EQ(scores.size(), expected.size());
+	for (size_t s = 0; s < expected.size(); s++) {
+		EXPECT_NEAR(scores[s], expected[s], 0.0001);
+	}
+	server.stop();
+}
+
+TEST(Optimizer, Kernels) {
+	std::vector<ParameterTensor> tensors = { { 4, true } };
+	std::vector<double> grads = { 1.0, -2.0, 0.5, 0.0 };
+
+	std::vector<double> p(4, 1.0);
+	SGD sgd;
+	sgd.init(tensors);
+	sgd.begin_step();
+	sgd.update(0, 0, 4, p.data(), grads.data(), 0.5, 0.1);
+	EXPECT_DOUBLE_EQ(p[0], 0.95);
+	EXPECT_DOUBLE_EQ(p[1], 1.1);
+
+	//first adam step moves each parameter by ~learn_rate against the gradient sign
+	std::fill(p.begin(), p.end(), 1.0);
+	Adam adam;
+	adam.init(tensors);
+	adam.begin_step();
+	adam.update(0, 0, 2, p.data(), grads.data(), 1.0, 0.01);
+	adam.update(0, 2, 2, p.data(), grads.data(), 1.0, 0.01);
+	EXPECT_NEAR(p[0], 0.99, 1e-6);
+	EXPECT_NEAR(p[1], 1.01, 1e-6);
+	EXPECT_NEAR(p[2], 0.99, 1e-6);
+	EXPECT_DOUBLE_EQ(p[3], 1.0);
+
+	std::fill(p.begin(), p.end(), 1.0);
+	Momentum momentum(0.9);
+	momentum.init(tensors);
+	for (int i = 0; i < 2; i++) {
+		momentum.begin_step();
+		momentum.update(0, 0, 4, p.data(), grads.data(), 1.0, 0.1);
+	}
+	EXPECT_NEAR(p[0], 1.0 - 0.1 - 0.19, 1e-12);
+}
+
+TEST(Optimizer, TrainTestNetwork) {
+	std::vector<std::function<std::unique_ptr<Optimizer>()>> optimizers = {
+		[] { return std::make_unique<SGD>(); },
+		[] { return std::make_unique<Momentum>(); },
+		[] { return std::make_unique<Nesterov>(); },
+		[] { return std::make_unique<Adam>(); },
+		[] { return std::make_unique<AdamW>(); },
+	};
+	for (auto& make : optimizers) {
+		TestNetwork n;
+		n.build();
+		n.load_data();
+		n.learn_rate = 0.05;
+		CPUTrainer trainer(n);
+		trainer.set_optimizer(make());
+
+		const auto& point = n.training_data[0];
+		double before = cost(n.calculate(point.data), point.expected);
+		Gradients gradients(n.layers);
+		for (int step = 0; step < 20; step++) {
+			gradients.reset();
+			trainer.process_batch(0, 1, &gradients);
+			trainer.apply_gradients(gradients, 1, n.learn_rate);
+		}
+		double after = cost(n.calculate(point.data), point.expected);
+		EXPECT_LT(after, before);
+	}
+}
+
+TEST(TrainingSchedule, Schedules) {
+	StepSchedule step(2, 0.5);
+	EXPECT_DOUBLE_EQ(step.rate(1.0, 1.9), 1.0);
+	EXPECT_DOUBLE_EQ(step.rate(1.0, 4.0), 0.25);
+
+	CosineSchedule cosine(10, 0.0);
+	EXPECT_DOUBLE_EQ(cosine.rate(1.0, 0.0), 1.0);
+	EXPECT_NEAR(cosine.rate(1.0, 5.0), 0.5, 1e-12);
+	EXPECT_NEAR(cosine.rate(1.0, 10.0), 0.0, 1e-12);
+
+	OneCycleSchedule one_cycle(10, 10.0, 0.3, 0.01);
+	EXPECT_DOUBLE_EQ(one_cycle.rate(0.1, 0.0), 0.1);
+	EXPECT_NEAR(one_cycle.rate(0.1, 3.0), 1.0, 1e-12);
+	EXPECT_NEAR(one_cycle.rate(0.1, 10.0), 0.001, 1e-12);
+
+	//would divide by zero
+	EXPECT_THROW(CosineSchedule(0), std::runtime_error);
+	EXPECT_THROW(OneCycleSchedule(0), std::runtime_error);
+	EXPECT_THROW(OneCycleSchedule(10, 10.0, 0.0), std::runtime_error);
+	EXPECT_THROW(OneCycleSchedule(10, 10.0, 1.0), std::runtime_error);
+}
+
+TEST(TrainingSchedule, StopCriteria) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+	n.learn_rate = 0.5;
+
+	//the defaults have no limit at all
+	CPUTrainer trainer(n);
+	EXPECT_THROW(trainer.train(), std::runtime_error);
+
+	StopCriteria criteria;
+	criteria.max_epochs = 5;
+	criteria.validation_interval = 2;
+	trainer.set_stop_criteria(criteria);
+	EXPECT_EQ(trainer.train(), StopReason::MaxEpochs);
+	EXPECT_EQ(trainer.epochs(), 5);
+
+	//a target alone may never be reached
+	criteria.max_epochs = 0;
+	criteria.target_accuracy = 1.0;
+	trainer.set_stop_criteria(criteria);
+	EXPECT_THROW(trainer.train(), std::runtime_error);
+
+	criteria.max_epochs = 1000;
+	trainer.set_stop_criteria(criteria);
+	EXPECT_EQ(trainer.train(), StopReason::TargetAccuracy);
+	EXPECT_LT(trainer.epochs(), 1000);
+}
+
+//compares backprop against central differences of the loss
+void expect_gradients_match(Network& n)
+{
+	const auto& point = n.training_data[0];
+	CPUTrainer trainer(n);
+	Gradients gradients(n.layers);
+	trainer.process_batch(0, 1, &gradients);
+
+	const double eps = 1e-6;
+	for (size_t l = 0; l < n.layers.size(); l++) {
+		for (size_t w = 0; w < n.layers[l].weights.size(); w++) {
+			double original = n.layers[l].weights[w];
+			n.layers[l].weights[w] = original + eps;
+			double plus = n.cost(n.calculate(point.data), point.expected);
+			n.layers[l].weights[w] = original - eps;
+			double minus = n.cost(n.calculate(point.data), point.expected);
+			n.layers[l].weights[w] = original;
+			EXPECT_NEAR(gradients.get_weight(l, w), (plus - minus) / (2 * eps), 1e-6);
+		}
+	}
+}
+
+TEST(Softmax, GradientCheck) {
+	for (Loss loss : { Loss::CrossEntropy, Loss::MeanSquaredError }) {
+		TestNetwork n;
+		n.build();
+		n.load_data();
+		n.layers[1].activation = Activation::Softmax;
+		n.loss = loss;
+
+		auto output = n.calculate(n.training_data[0].data);
+		EXPECT_NEAR(output[0] + output[1], 1.0, 1e-12);
+		expect_gradients_match(n);
+	}
+}
+
+TEST(Softmax, CrossEntropyNeedsSoftmax) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+	//-sum(expected * log(output)) has no output - expected shortcut through a sigmoid
+	n.layers[1].activation = Activation::Sigmoid;
+	n.loss = Loss::CrossEntropy;
+	EXPECT_THROW(ExecutionPlan(n, 4, 1, PlanMode::Training), std::runtime_error);
+	EXPECT_THROW(make_low_precision_model(Precision::Float32, n, 1), std::runtime_error);
+	//thrown before the batch reaches the pool workers
+	CPUTrainer trainer(n, 2);
+	EXPECT_THROW(trainer.train_epoch(0.1), std::runtime_error);
+
+	//softmax has no elementwise derivative to pass hidden deltas through
+	n.layers[1].activation = Activation::Softmax;
+	n.layers[0].activation = Activation::Softmax;
+	EXPECT_THROW(trainer.train_epoch(0.1), std::runtime_error);
+}
+
+TEST(Activation, GradientCheck) {
+	for (Activation activation : ELEMENTWISE_ACTIVATIONS) {
+		TestNetwork n;
+		n.build();
+		n.load_data();
+		n.layers[0].activation = activation;
+		n.layers[1].activation = activation;
+		expect_gradients_match(n);
+	}
+}
+
+TEST(MixedPrecision, BFloat16) {
+	EXPECT_EQ(bfloat16::from_float(1.0f).to_float(), 1.0f);
+	EXPECT_EQ(bfloat16::from_float(-2.5f).to_float(), -2.5f);
+	//1 + 2^-8 is exactly halfway between two bfloat16 values and rounds to even
+	EXPECT_EQ(bfloat16::from_float(1.00390625f).to_float(), 1.0f);
+	EXPECT_NEAR(bfloat16::from_float(0.1f).to_float(), 0.1f, 0.001);
+}
+
+TEST(MixedPrecision, MatchesDouble) {
+	for (Precision precision : { Precision::Float32, Precision::BFloat16 }) {
+		TestNetwork reference;
+		reference.build();
+		reference.load_data();
+		reference.learn_rate = 0.5;
+		TestNetwork n;
+		n.build();
+		n.load_data();
+		n.learn_rate = 0.5;
+
+		CPUTrainer reference_trainer(reference);
+		CPUTrainer trainer(n);
+		trainer.set_precision(precision);
+		EXPECT_EQ(trainer.precision(), precision);
+
+		double tolerance = precision == Precision::Float32 ? 1e-6 : 0.02;
+		auto expected = reference.calculate(reference.training_data[0].data);
+		auto output = make_low_precision_model(precision, n, 1)->calculate(n.training_data[0].data);
+		for (size_t i = 0; i < expected.size(); i++) {
+			EXPECT_NEAR(output[i], expected[i], tolerance);
+		}
+
+		Gradients reference_gradients(reference.layers);
+		Gradients gradients(n.layers);
+		for (int step = 0; step < 10; step++) {
+			reference_gradients.reset();
+			gradients.reset();
+			reference_trainer.process_batch(0, 1, &reference_gradients);
+			trainer.process_batch(0, 1, &gradients);
+			reference_trainer.apply_gradients(reference_gradients, 1, reference.learn_rate);
+			trainer.apply_gradients(gradients, 1, n.learn_rate);
+		}
+		for (size_t l = 0; l < n.layers.size(); l++) {
+			for (size_t w = 0; w < n.layers[l].weights.size(); w++) {
+				EXPECT_NEAR(n.layers[l].weights[w], reference.layers[l].weights[w], tolerance);
+			}
+		}
+		EXPECT_EQ(trainer.test_training_accuracy(), 1.0);
+	}
+}
+
+TEST(Gemm, MatchesNaive) {
+	//sizes straddle the block boundaries, B is read through a transposed view
+	const size_t M = 70, N = 530, K = 300;
+	std::vector<double> a(M * K), bt(N * K), c(M * N, 1.0);
+	for (size_t i = 0; i < a.size(); i++) {
+		a[i] = std::sin((double)i);
+	}
+	for (size_t i = 0; i < bt.size(); i++) {
+		bt[i] = std::cos((double)i);
+	}
+	gemm(M, N, K, MatrixView::row_major(a.data(), K), MatrixView::transposed(bt.data(), K), c.data(), N);
+	for (size_t i = 0; i < M; i += 7) {
+		for (size_t j = 0; j < N; j += 13) {
+			double expected = 1.0;
+			for (size_t k = 0; k < K; k++) {
+				expected += a[i * K + k] * bt[j * K + k];
+			}
+			EXPECT_NEAR(c[i * N + j], expected, 1e-9);
+		}
+	}
+}
+
+class ConvTestNetwork : public Network {
+public:
+	bool pool = true;
+	void build() override {
+		Shape3 input = pool ? Shape3{ 1, 6, 6 } : Shape3{ 1, 7, 7 };
+		layers.resize(pool ? 3 : 2);
+		layers[0].activation = Activation::Tanh;
+		layers[0].init_convolution(input, 2, 3, pool ? 1 : 2);
+		if (pool) {
+			layers[1].init_max_pool(layers[0].output_shape, 2);
+		}
+		Layer& output = layers.back();
+		output.input_size = layers[layers.size() - 2].size;
+		output.size = 2;
+		output.activation = Activation::Softmax;
+		output.init();
+		loss = Loss::CrossEntropy;
+		for (int i = 0; i < layers.size(); i++) {
+			layers[i].index = i;
+		}
+	}
+	void load_data() override {
+		training_data.resize(1, {});
+		DataPoint& point = training_data[0];
+		for (int i = 0; i < layers[0].input_size; i++) {
+			point.data.push_back(std::sin(i * 1.7));
+		}
+		point.label = 1;
+		point.set_expected_from_label(2);
+	}
+};
+
+TEST(Convolution, GradientCheck) {
+	for (bool pool : { true, false }) {
+		ConvTestNetwork n;
+		n.pool = pool;
+		n.build();
+		n.load_data();
+		EXPECT_EQ(n.layers[0].weights.size(), 2 * 9);
+		EXPECT_EQ(n.layers[0].size, pool ? 2 * 4 * 4 : 2 * 3 * 3);
+		expect_gradients_match(n);
+
+		//the batched path used by inference matches the single sample one
+		auto expected = n.calculate(n.training_data[0].data);
+		auto batched = n.calculate_batch(n.training_data[0].data.data(), 1);
+		for (size_t i = 0; i < expected.size(); i++) {
+			EXPECT_NEAR(batched[i], expected[i], 1e-12);
+		}
+	}
+}
+
+TEST(ExecutionPlan, MatchesEager) {
+	for (Loss loss : { Loss::CrossEntropy, Loss::MeanSquaredError }) {
+		MNISTNetwork n;
+		n.build();
+		n.loss = loss;
+		n.batch_size = 5;
+		for (int i = 0; i < 7; i++) {
+			DataPoint point;
+			for (int p = 0; p < n.layers[0].input_size; p++) {
+				point.data.push_back(0.5 + 0.5 * std::sin(i * 31.0 + p));
+			}
+			point.label = i % 10;
+			point.set_expected_from_label(10);
+			n.training_data.push_back(point);
+		}
+
+		CPUTrainer eager(n);
+		CPUTrainer planned(n);
+		planned.set_execution_plan(true);
+		EXPECT_TRUE(planned.uses_execution_plan());
+		for (size_t start : { 0, 5 }) {
+			size_t count = std::min<size_t>(5, n.training_data.size() - start);
+			Gradients expected(n.layers);
+			Gradients gradients(n.layers);
+			eager.process_batch(start, count, &expected);
+			planned.process_batch(start, count, &gradients);
+			for (size_t l = 0; l < n.layers.size(); l++) {
+				for (size_t w = 0; w < n.layers[l].weights.size(); w += 97) {
+					EXPECT_NEAR(gradients.get_weight(l, w), expected.get_weight(l, w), 1e-9);
+				}
+				for (size_t b = 0; b < n.layers[l].biases.size(); b++) {
+					EXPECT_NEAR(gradients.get_bias(l, b), expected.get_bias(l, b), 1e-9);
+				}
+			}
+		}
+
+		ThreadPool pool(2);
+		ExecutionPlan inference(n, 4, pool.nthreads(), PlanMode::Inference);
+		//activations ping-pong instead of every layer getting its own buffer
+		EXPECT_LT(inference.arena_size(), inference.unplanned_size());
+		std::vector<double> inputs;
+		for (size_t i = 0; i < 3; i++) {
+			inputs.insert(inputs.end(), n.training_data[i].data.begin(), n.training_data[i].data.end());
+		}
+		const double* output = inference.forward(inputs.data(), 3, pool);
+		for (size_t i = 0; i < 3; i++) {
+			auto expected = n.calculate(n.training_data[i].data);
+			for (size_t o = 0; o < expected.size(); o++) {
+				EXPECT_NEAR(output[i * 10 + o], expected[o], 1e-12);
+			}
+		}
+
+		//compiled for 5, an epoch recompiles it for the batch size it runs at
+		n.batch_size = 7;
+		planned.train_epoch(0.01);
+		EXPECT_TRUE(planned.uses_execution_plan());
+	}
+}
+
+TEST(Pruning, PatternsAndSparseKernels) {
+	for (SparsityPattern pattern : { SparsityPattern::Unstructured, SparsityPattern::TwoFour, SparsityPattern::Block }) {
+		MNISTNetwork n;
+		n.build();
+		Pruner pruner;
+		pruner.options.pattern = pattern;
+		pruner.options.sparse_below_density = 0.6;
+		auto masks = pruner.prune(n, 0.75);
+
+		const Layer& hidden = n.layers[0];
+		size_t zeros = std::count(hidden.weights.begin(), hidden.weights.end(), 0.0);
+		double expected_sparsity = pattern == SparsityPattern::TwoFour ? 0.5 : 0.75;
+		EXPECT_NEAR((double)zeros / hidden.weights.size(), expected_sparsity, 0.01);
+		//output layer is left dense by default
+		EXPECT_EQ(std::count(masks[1].begin(), masks[1].end(), 0), 0);
+		if (pattern == SparsityPattern::TwoFour) {
+			for (size_t g = 0; g < hidden.weights.size(); g += 4) {
+				EXPECT_EQ(std::count(hidden.weights.begin() + g, hidden.weights.begin() + g + 4, 0.0), 2);
+			}
+		}
+
+		SparseNetwork sparse = pruner.export_sparse(n);
+		EXPECT_EQ(sparse.layers[0].storage, pattern == SparsityPattern::Block ? SparseStorage::BlockCSR : SparseStorage::CSR);
+		EXPECT_EQ(sparse.layers[1].storage, SparseStorage::Dense);
+		EXPECT_LT(sparse.weight_bytes(), (hidden.weights.size() + n.layers[1].weights.size()) * sizeof(double));
+
+		std::vector<double> input(hidden.input_size);
+		for (size_t i = 0; i < input.size(); i++) {
+			input[i] = 0.5 + 0.5 * std::sin((double)i);
+		}
+		auto expected = n.calculate(input);
+		auto output = sparse.calculate(input);
+		for (size_t i = 0; i < expected.size(); i++) {
+			EXPECT_NEAR(output[i], expected[i], 1e-12);
+		}
+	}
+}
+
+TEST(Pruning, MasksHoldDuringTraining) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+	n.learn_rate = 0.5;
+	CPUTrainer trainer(n);
+	Pruner pruner;
+	pruner.options.prune_output_layer = true;
+	pruner.options.iterations = 2;
+	pruner.options.target_sparsity = 0.5;
+	pruner.prune_iteratively(n, trainer);
+	for (const auto& layer : n.layers) {
+		EXPECT_EQ(std::count(layer.weights.begin(), layer.weights.end(), 0.0), 2);
+	}
+
+	SparsityCrossover crossover = pruner.find_crossover(64, 32);
+	EXPECT_EQ(crossover.samples.size(), 9u);
+	EXPECT_GE(crossover.crossover_density, 0.0);
+	EXPECT_LE(crossover.crossover_density, 0.9);
+}
+
+TEST(Backend, TrainsThroughTheInterface) {
+	TestNetwork n;
+	n.learn_rate = 0.5;
+	n.build();
+	n.load_data();
+	BackendOptions options;
+	options.force = BackendKind::CPU;
+	auto backend = select_backend(n, options);
+	EXPECT_EQ(backend->kind(), BackendKind::CPU);
+
+	double before = backend->accuracy(n.training_data);
+	for (int epoch = 0; epoch < 20; epoch++) {
+		backend->train_epoch(n.learn_rate);
+	}
+	backend->sync_weights();
+	EXPECT_GE(backend->accuracy(n.training_data), before);
+	EXPECT_EQ(backend->metrics().snapshot().epochs, 20u);
+
+	std::vector<double> output;
+	backend->predict(n.training_data[0].get_input(), output);
+	EXPECT_EQ(output, n.calculate(n.training_data[0].get_input()));
+}
+
+TEST(Backend, SelectionIsBenchmarkedOnceAndCached) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+	std::vector<Layer> layers = n.layers;
+	size_t training_size = n.training_data.size();
+
+	auto dir = std::filesystem::temp_directory_path() / "ml_backend_cache_test";
+	std::filesystem::remove_all(dir);
+	BackendOptions options;
+	options.benchmark_samples = 64;
+	options.cache_path = (dir / "backends.txt").string();
+	auto backend = select_backend(n, options);
+
+	//the benchmark leaves the network as it found it
+	EXPECT_EQ(n.training_data.size(), training_size);
+	for (size_t l = 0; l < layers.size(); l++) {
+		EXPECT_EQ(n.layers[l].weights, layers[l].weights);
+		EXPECT_EQ(n.layers[l].biases, layers[l].biases);
+	}
+
+	std::string key = backend_cache_key(n);
+	auto cached = read_cached_backend(options.cache_path, key);
+	ASSERT_TRUE(cached.has_value());
+	EXPECT_EQ(cached->kind, backend->kind());
+	EXPECT_GT(cached->samples_per_second, 0.0);
+
+	//a recorded choice is used as is, and other shapes get their own line
+	BackendCandidate recorded;
+	recorded.kind = BackendKind::CPU;
+	recorded.description = "cpu from the cache";
+	write_cached_backend(options.cache_path, key, recorded);
+	EXPECT_EQ(select_backend(n, options)->kind(), BackendKind::CPU);
+	EXPECT_EQ(read_cached_backend(options.cache_path, key)->description, "cpu from the cache");
+	n.batch_size *= 2;
+	EXPECT_NE(backend_cache_key(n), key);
+	EXPECT_FALSE(read_cached_backend(options.cache_path, backend_cache_key(n)).has_value());
+	std::filesystem::remove_all(dir);
+}
+
+TEST(Timer, ThreadSafeHistograms) {
+	Timer::clear();
+	ThreadPool pool(4);
+	batch_function task = [&](size_t thread_index, size_t start_index, size_t count) {
+		for (size_t i = start_index; i < start_index + count; i++) {
+			Timer t("test_scope");
+			volatile double x = 0.0;
+			for (size_t k = 0; k < (i % 10) * 100; k++) {
+				x = x + k;
+			}
+		}
+	};
+	pool.batch_jobs(task, 10000);
+
+	auto report = Timer::usage_report();
+	auto it = std::find_if(report.begin(), report.end(), [](const TimerStats& s) { return s.name == "test_scope"; });
+#ifdef DISABLE_TIMERS
+	EXPECT_EQ(it, report.end());
+#else
+	ASSERT_NE(it, report.end());
+	EXPECT_EQ(it->calls, 10000u);
+	EXPECT_GT(it->total_ns, 0u);
+	EXPECT_LE(it->p50_ns, it->p99_ns);
+	EXPECT_LE(it->p99_ns, it->max_ns);
+	EXPECT_LE(it->max_ns, it->total_ns);
+#endif
+}
+
+TEST(Timer, SampledKernelScopes) {
+	Timer::clear();
+	//a fresh thread, so its first call is the one timed
+	std::thread kernel_thread([]() {
+		for (uint32_t i = 0; i < 2 * KERNEL_TIMER_PERIOD; i++) {
+			KernelTimer t("kernel_scope");
+		}
+	});
+	kernel_thread.join();
+
+	auto report = Timer::usage_report();
+	auto it = std::find_if(report.begin(), report.end(), [](const TimerStats& s) { return s.name == "kernel_scope"; });
+#ifdef DISABLE_TIMERS
+	EXPECT_EQ(it, report.end());
+#else
+	ASSERT_NE(it, report.end());
+	//two timed calls, each standing in for a period
+	EXPECT_EQ(it->calls, 2 * KERNEL_TIMER_PERIOD);
+	EXPECT_EQ(it->samples, it->calls);
+	EXPECT_LE(it->p50_ns, it->max_ns);
+#endif
+}
+
+TEST(Timer, PerfCounters) {
+	Timer::clear();
+	if (!PerfCounters::start()) {
+		GTEST_SKIP() << "no perf_event_open access on this host";
+	}
+	for (int i = 0; i < 10; i++) {
+		Timer t("counted_scope");
+		t.add_samples(100);
+		volatile double x = 0.0;
+		for (int k = 0; k < 10000; k++) {
+			x = x + k;
+		}
+	}
+	PerfCounters::stop();
+	PerfSample after_stop;
+	EXPECT_FALSE(PerfCounters::read(after_stop));
+	{
+		//not counted, so it must not dilute the per sample figures
+		Timer t("counted_scope");
+		t.add_samples(100);
+	}
+
+	auto report = Timer::usage_report();
+	auto it = std::find_if(report.begin(), report.end(), [](const TimerStats& s) { return s.name == "counted_scope"; });
+#ifdef DISABLE_TIMERS
+	EXPECT_EQ(it, report.end());
+#else
+	ASSERT_NE(it, report.end());
+	EXPECT_EQ(it->samples, 1100u);
+	EXPECT_EQ(it->counted_calls, 10u);
+	EXPECT_EQ(it->counted_samples, 1000u);
+	EXPECT_DOUBLE_EQ(it->misses_per_sample(), (double)it->counters.llc_misses / 1000);
+	//the loop alone is several instructions per iteration
+	EXPECT_GT(it->counters.instructions, 100000u);
+	EXPECT_GT(it->counters.ipc(), 0.0);
+#endif
+}
+
+TEST(Timer, PerfCountersCountWorkers) {
+	Timer::clear();
+	ThreadPool pool(2);
+	if (!PerfCounters::start()) {
+		GTEST_SKIP() << "no perf_event_open access on this host";
+	}
+	batch_function task = [&](size_t thread_index, size_t start_index, size_t count) {
+		volatile double x = 0.0;
+		for (int k = 0; k < 100000; k++) {
+			x = x + k;
+		}
+	};
+	{
+		//the calling thread only waits, the loops run on the workers
+		Timer t("pool_scope");
+		pool.batch_jobs(task, 2);
+	}
+	PerfCounters::stop();
+
+	auto report = Timer::usage_report();
+	auto it = std::find_if(report.begin(), report.end(), [](const TimerStats& s) { return s.name == "pool_scope"; });
+#ifndef DISABLE_TIMERS
+	ASSERT_NE(it, report.end());
+	EXPECT_EQ(it->counted_calls, 1u);
+	EXPECT_GT(it->counters.instructions, 200000u);
+#endif
+}
+
+TEST(Logging, AsyncLinesInOrder) {
+	ThreadPool pool(4);
+	std::ostringstream output;
+	Logs::set_output(output);
+	batch_function task = [&](size_t thread_index, size_t start_index, size_t count) {
+		for (size_t i = start_index; i < start_index + count; i++) {
+			//the logger has to copy this before it goes out of scope
+			std::string name = "line" + std::to_string(i % 7);
+			LOG_DEBUG("{} {} {}", name.c_str(), thread_index, i);
+		}
+	};
+	pool.batch_jobs(task, 10000);
+
+	int evaluated = 0;
+	Logs::set_level(LogLevel::Off);
+	LOG_DEBUG("{}", evaluated++);
+	Logs::set_level(LogLevel::Trace);
+	EXPECT_EQ(evaluated, 0);
+
+	Logs::flush();
+	Logs::set_output(std::cout);
+
+	std::istringstream lines(output.str());
+	std::string line;
+	size_t count = 0;
+	std::vector<size_t> last(4, 0);
+	std::vector<bool> seen(4, false);
+	while (std::getline(lines, line)) {
+		//ENABLE_TRACE builds log the pool's jobs too
+		if (line.rfind("[TRACE]", 0) == 0) {
+			continue;
+		}
+		std::istringstream fields(line);
+		std::string prefix, name;
+		size_t thread_index, i;
+		ASSERT_TRUE(fields >> prefix >> name >> thread_index >> i);
+		EXPECT_EQ(prefix, "[DEBUG]");
+		EXPECT_EQ(name, "line" + std::to_string(i % 7));
+		ASSERT_LT(thread_index, 4u);
+		//each thread's lines keep their order
+		EXPECT_TRUE(!seen[thread_index] || i > last[thread_index]);
+		seen[thread_index] = true;
+		last[thread_index] = i;
+		count++;
+	}
+	EXPECT_EQ(count, 10000u);
+}
+
+TEST(Logging, StringArguments) {
+	std::ostringstream output;
+	Logs::set_output(output);
+	std::string long_name(300, 'x');
+	{
+		std::string name = "copied";
+		//strings go into the ring slot, not into a new std::string
+		AllocationCounts before = Allocations::thread_counts();
+		LOG_DEBUG("{} {} {}", name, std::string_view("view"), "literal");
+		if (Allocations::hooked()) {
+			EXPECT_EQ((Allocations::thread_counts() - before).allocations, 0u);
+		}
+	}
+	//too big for a slot, formatted on this thread
+	LOG_DEBUG("{}", long_name);
+	Logs::flush();
+	Logs::set_output(std::cout);
+	EXPECT_EQ(output.str(), "[DEBUG] copied view literal\n[DEBUG] " + long_name + "\n");
+}
+
+TEST(Metrics, PrometheusExport) {
+	TestNetwork n;
+	n.build();
+	n.load_data();
+	n.learn_rate = 0.5;
+	//2 -> 2 -> 2 dense, one sample is 2*(4+4) forward and 2*2*4 + 3*2*4 for training
+	EXPECT_EQ(forward_flops_per_sample(n), 16u);
+	EXPECT_EQ(training_flops_per_sample(n), 40u);
+
+	StopCriteria criteria;
+	criteria.max_epochs = 2;
+	CPUTrainer trainer(n, 2);
+	trainer.set_stop_criteria(criteria);
+
+	auto path = std::filesystem::temp_directory_path() / "ml_metrics_test.prom";
+	MetricsExporterOptions options;
+	options.file_path = path.string();
+	options.interval = std::chrono::milliseconds(10);
+	MetricsExporter exporter(options);
+	exporter.add(trainer.metrics());
+	exporter.start();
+	trainer.train();
+	exporter.stop();
+
+	MetricsSnapshot snapshot = trainer.metrics().snapshot();
+	EXPECT_EQ(snapshot.samples, 2 * n.training_data.size());
+	EXPECT_EQ(snapshot.epochs, 2u);
+	EXPECT_EQ(snapshot.flops, snapshot.samples * 40);
+	EXPECT_GT(snapshot.phase_ns[(int)TrainingPhase::Forward], 0u);
+	EXPECT_GT(snapshot.phase_ns[(int)TrainingPhase::Backward], 0u);
+	EXPECT_GT(snapshot.phase_ns[(int)TrainingPhase::Update], 0u);
+	EXPECT_GT(snapshot.phase_ns[(int)TrainingPhase::Evaluation], 0u);
+	EXPECT_GT(peak_rss_bytes(), 0u);
+
+	std::ifstream file(path);
+	std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	EXPECT_NE(text.find("# TYPE ml_training_samples_total counter"), std::string::npos);
+	EXPECT_NE(text.find("ml_training_samples_total{backend=\"cpu\"} " + std::to_string(snapshot.samples) + "\n"), std::string::npos);
+	EXPECT_NE(text.find("ml_training_phase_seconds_total{backend=\"cpu\",phase=\"reduction\"}"), std::string::npos);
+	EXPECT_NE(text.find("ml_process_peak_rss_bytes "), std::string::npos);
+	file.close();
+	std::filesystem::remove(path);
+}
+
+TEST(Metrics, StopWithIdleHttpClient) {
+	MetricsExporterOptions options;
+	options.http_port = 19464;
+	options.client_timeout = std::chrono::milliseconds(100);
+	MetricsExporter exporter(options);
+	try {
+		exporter.start();
+	}
+	catch (const std::runtime_error& e) {
+		GTEST_SKIP() << e.what();
+	}
+
+	//connects and never sends a request
+	int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	ASSERT_GE(fd, 0);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)options.http_port);
+	::inet_pton(AF_INET, options.bind_address.c_str(), &addr.sin_addr);
+	ASSERT_EQ(::connect(fd, (sockaddr*)&addr, sizeof(addr)), 0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	auto started = std::chrono::steady_clock::now();
+	exporter.stop();
+	EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::seconds(2));
+	::close(fd);
+}
+
+TEST(Allocations, TimerScopes) {
+	if (!Allocations::hooked()) {
+		GTEST_SKIP() << "built without ENABLE_ALLOCATION_HOOKS";
+	}
+	Timer::clear();
+	Allocations::set_timer_tracking(true);
+	for (int i = 0; i < 10; i++) {
+		Timer t("allocating_scope");
+		std::vector<double> values(100);
+		values[i] = 1.0;
+	}
+	Allocations::set_timer_tracking(false);
+
+	auto report = Timer::usage_report();
+	auto it = std::find_if(report.begin(), report.end(), [](const TimerStats& s) { return s.name == "allocating_scope"; });
+#ifndef DISABLE_TIMERS
+	ASSERT_NE(it, report.end());
+	EXPECT_EQ(it->allocations, 10u);
+	EXPECT_EQ(it->allocated_bytes, 10 * 100 * sizeof(double));
+#endif
+	EXPECT_GT(Allocations::thread_counts().allocations, 0u);
+}
+
+//warms a step up, then checks the same step again inside a NoAllocRegion
+template<class Step>
+void expect_steady_state_allocation_free(Step step)
+{
+	step();
+	step();
+	Logs::flush();
+	NoAllocRegion region;
+	step();
+	EXPECT_EQ(region.allocations(), 0u);
+}
+
+TEST(Allocations, SteadyStateIsAllocationFree) {
+	if (!Allocations::hooked()) {
+		GTEST_SKIP() << "built without ENABLE_ALLOCATION_HOOKS";
+	}
+	TestNetwork n;
+	n.build();
+	n.load_data();
+	n.training_data.resize(32, n.training_data[0]);
+	n.batch_size = 32;
+	CPUTrainer trainer(n, 4);
+	Gradients gradients(n.layers);
+	auto training_step = [&]() {
+		gradients.reset();
+		trainer.process_batch(0, n.batch_size, &gradients);
+		trainer.apply_gradients(gradients, n.batch_size, n.learn_rate);
+	};
+	expect_steady_state_allocation_free(training_step);
+
+	trainer.set_execution_plan(true);
+	expect_steady_state_allocation_free(training_step);
+
+	std::vector<double> output;
+	expect_steady_state_allocation_free([&]() {
+		for (const auto& point : n.training_data) {
+			n.calculate(point.get_input(), output);
+		}
+	});
+}
+
+TEST(Tracer, ChromeJson) {
+	ThreadPool pool(2);
+	Tracer::start(1024);
+	batch_function task = [&](size_t thread_index, size_t start_index, size_t count) {
+		for (size_t i = start_index; i < start_index + count; i++) {
+			TraceScope trace("trace_test_scope", "test");
+		}
+	};
+	pool.batch_jobs(task, 20);
+	Tracer::instant("trace_test_mark", "test");
+	Tracer::stop();
+	//nothing is recorded once stopped
+	pool.batch_jobs(task, 20);
+
+	std::string path = (std::filesystem::temp_directory_path() / "ml_trace_test.json").string();
+	Tracer::write(path);
+	std::ifstream file(path);
+	std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	auto count = [&](const std::string& needle) {
+		size_t n = 0;
+		for (size_t pos = json.find(needle); pos != std::string::npos; pos = json.find(needle, pos + 1)) {
+			n++;
+		}
+		return n;
+	};
+	EXPECT_EQ(count("\"name\":\"trace_test_scope\",\"cat\":\"test\",\"ph\":\"B\""), 20u);
+	EXPECT_EQ(count("\"name\":\"trace_test_scope\",\"cat\":\"test\",\"ph\":\"E\""), 20u);
+	EXPECT_EQ(count("\"name\":\"task\",\"cat\":\"threadpool\",\"ph\":\"B\""), 2u);
+	EXPECT_EQ(count("trace_test_mark"), 1u);
+	EXPECT_EQ(count("\"args\":{\"name\":\"worker 0\"}"), 1u);
+	EXPECT_EQ(Tracer::dropped_events(), 0u);
+	std::filesystem::remove(path);
+
+	Tracer::start(4);
+	pool.batch_jobs(task, 20);
+	Tracer::stop();
+	EXPECT_GT(Tracer::dropped_events(), 0u);
+}
+
+TEST(Tracer, ScopeOpenAcrossRestart) {
+	Tracer::start(1024);
+	{
+		TraceScope scope("trace_stale_scope", "test");
+		//smaller than the buffer the scope began in, which has to stay valid
+		Tracer::stop();
+		Tracer::start(8);
+	}
+	Tracer::stop();
+
+	std::string path = (std::filesystem::temp_directory_path() / "ml_trace_restart_test.json").string();
+	Tracer::write(path);
+	std::ifstream file(path);
+	std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	//the begin went with the first trace, the end is not written into the second
+	EXPECT_EQ(json.find("trace_stale_scope"), std::string::npos);
+	file.close();
+	std::filesystem::remove(path);
+}
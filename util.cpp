@@ -6,8 +6,10 @@
 #include <functional>
 #include <algorithm>
 #include <filesystem>
+#include <cstdlib>
 #include "util.h"
 #include "ThreadPool.h"
+#include "Activation.h"
 #include <memory>
 
 double random01()
@@ -19,17 +21,16 @@ double random01()
 
 double relu(double x)
 {
-	return x > 0.0 ? x : 0.0;
+	return ReLUPolicy::activate(x);
 }
 
 double sigmoid(double x)
 {
-	return 1 / (1 + exp(-x));
+	return SigmoidPolicy::activate(x);
 }
 
 double sigmoid_derivative(double x) {
-	double fx = sigmoid(x);
-	return fx * (1 - fx);
+	return SigmoidPolicy::derivative(x);
 }
 
 double cost(const std::vector<double>& output, const std::vector<double>& expected)
@@ -47,7 +48,6 @@ double cost_derivative(double output, double expected) {
 	return output - expected;
 }
 
-
 void read_file(const std::string& path, std::vector<uint8_t>& buffer)
 {
 	std::ifstream file(path, std::ios::binary);
@@ -77,6 +77,26 @@ std::vector<char> read_file(const std::string& path) {
 	return buffer;
 }
 
+bool write_file_atomically(const std::string& path, const char* data, size_t size)
+{
+	std::string temp_path = path + ".tmp";
+	{
+		std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+		if (file.fail()) {
+			return false;
+		}
+		file.write(data, size);
+		if (file.fail()) {
+			return false;
+		}
+	}
+#ifdef _WIN32
+	//rename does not replace an existing file here
+	std::remove(path.c_str());
+#endif
+	return std::rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
 uint32_t from_big_endian(uint8_t* data) {
 	return (data[3] << 0) | (data[2] << 8) | (data[1] << 16) | ((unsigned)data[0] << 24);
 }
@@ -107,3 +127,20 @@ void double_vector_to_float(const std::vector<double>& a, std::vector<float>& b)
 		b.push_back(static_cast<float_t>(val));
 	}
 }
+
+std::string cache_directory()
+{
+#ifdef _WIN32
+	if (const char* local = std::getenv("LOCALAPPDATA")) {
+		return (std::filesystem::path(local) / "neural-net").string();
+	}
+#else
+	if (const char* cache = std::getenv("XDG_CACHE_HOME")) {
+		return (std::filesystem::path(cache) / "neural-net").string();
+	}
+	if (const char* home = std::getenv("HOME")) {
+		return (std::filesystem::path(home) / ".cache" / "neural-net").string();
+	}
+#endif
+	return "";
+}
@@ -3,6 +3,8 @@
 #include <vector>
 #include <thread>
 #include <functional>
+#include <memory>
+#include <type_traits>
 
 double get_random();
 
@@ -22,9 +24,36 @@ void read_file(const std::string& path, std::vector<uint8_t>& buffer);
 
 std::vector<char> read_file(const std::string& path);
 
+//writes a temporary file next to path and renames it over path, so a reader sees the old
+//contents or the new ones and never half a file. false if either step failed
+bool write_file_atomically(const std::string& path, const char* data, size_t size);
+
 uint32_t from_big_endian(uint8_t* data);
 
+//neural-net in the user's cache directory, empty when the environment names none
+std::string cache_directory();
+
 using batch_function = std::function<void(size_t, size_t, size_t)>;
+
+//non-owning reference to a callable, never allocates. The callable has to outlive it
+template<class Signature> class function_ref;
+template<class R, class... Args>
+class function_ref<R(Args...)> {
+private:
+	void* _object;
+	R (*_call)(void* object, Args... args);
+public:
+	template<class F> requires (!std::is_same_v<std::remove_cv_t<F>, function_ref>)
+	function_ref(F& f) :
+		_object(const_cast<void*>(static_cast<const void*>(std::addressof(f)))),
+		_call([](void* object, Args... args) -> R { return (*static_cast<F*>(object))(std::forward<Args>(args)...); }) {}
+
+	R operator()(Args... args) const { return _call(_object, std::forward<Args>(args)...); }
+};
+
+//what ThreadPool::batch_jobs takes, so a plain lambda can be passed without wrapping it in a
+//std::function, which allocates once the captures outgrow its small buffer
+using batch_function_ref = function_ref<void(size_t, size_t, size_t)>;
 void batch_jobs(batch_function& task, int nthreads, size_t data_len);
 
 void double_vector_to_float(const std::vector<double>& a, std::vector<float>& b);
\ No newline at end of file